@@ -0,0 +1,36 @@
+#ifndef CPP_PERSONAL_CLOUD_CLOUD_CHANGE_H
+#define CPP_PERSONAL_CLOUD_CLOUD_CHANGE_H
+
+#include <string>
+#include <nlohmann/json.hpp>
+using json = nlohmann::json;
+
+// One entry of a user's change journal. "put" creates or replaces the entry at `path`, "delete"
+// removes it (a directory together with everything below it).
+struct CloudChange {
+    unsigned long long version = 0;
+    std::string op;
+    std::string path;
+    bool is_dir = false;
+    unsigned long long size = 0;
+};
+
+inline void to_json(json &j, const CloudChange &p) {
+    j = json{
+        {"version", p.version},
+        {"op", p.op},
+        {"path", p.path},
+        {"is_dir", p.is_dir},
+        {"size", p.size},
+    };
+}
+
+inline void from_json(const json &j, CloudChange &p) {
+    j.at("version").get_to(p.version);
+    j.at("op").get_to(p.op);
+    j.at("path").get_to(p.path);
+    j.at("is_dir").get_to(p.is_dir);
+    j.at("size").get_to(p.size);
+}
+
+#endif //CPP_PERSONAL_CLOUD_CLOUD_CHANGE_H
@@ -27,5 +27,26 @@ inline void from_json(const json &j, CloudDir &p) {
     j.at("subdirs").get_to(p.subdirs);
 }
 
+// A subdirectory as it appears in a single-level listing: its contents are not included, only how
+// many entries it has.
+struct CloudDirSummary {
+    std::string name;
+    std::string path;
+    unsigned long long entries = 0;
+};
+
+inline void to_json(json &j, const CloudDirSummary &p) {
+    j = json{
+        {"name", p.name},
+        {"path", p.path},
+        {"entries", p.entries},
+    };
+}
+
+inline void from_json(const json &j, CloudDirSummary &p) {
+    j.at("name").get_to(p.name);
+    j.at("path").get_to(p.path);
+    j.at("entries").get_to(p.entries);
+}
 
 #endif
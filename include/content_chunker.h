@@ -0,0 +1,121 @@
+#ifndef CPP_PERSONAL_CLOUD_CONTENT_CHUNKER_H
+#define CPP_PERSONAL_CLOUD_CONTENT_CHUNKER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Chunk sizes of the content-defined chunking. Client and server must agree on all of them (and
+// on the gear table) for their chunks of the same file to line up.
+#define CDC_MIN_SIZE (256 * 1024)
+#define CDC_AVG_BITS 20
+#define CDC_MAX_SIZE (4 * 1024 * 1024)
+
+// FastCDC: a Gear rolling hash (one shift and one add per byte) looks for cut points, so a
+// boundary depends only on the bytes right before it. Inserting or removing data in a file moves
+// the boundaries around the edit and leaves every other chunk as it was.
+//
+// Boundaries are never placed in the first CDC_MIN_SIZE bytes of a chunk. Up to the average size a
+// stricter mask is used, past it a looser one (normalized chunking), which keeps chunk sizes close
+// to 1 << CDC_AVG_BITS; a chunk is cut at CDC_MAX_SIZE regardless.
+//
+// Data is fed in pieces of any size; every finished chunk is passed to the sink as
+// sink(const char *data, size_t length) and returns false to stop.
+class ContentChunker {
+private:
+    std::string pending;
+    size_t start = 0;
+
+    static const uint64_t *gearTable() {
+        static const struct Table {
+            uint64_t values[256];
+
+            Table() : values() {
+                // splitmix64 from a fixed seed: the same table on every build and platform.
+                uint64_t seed = 0x5ca1ab1ec0ffee42ULL;
+                for (uint64_t &value: values) {
+                    seed += 0x9e3779b97f4a7c15ULL;
+                    uint64_t z = seed;
+                    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+                    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+                    value = z ^ (z >> 31);
+                }
+            }
+        } table;
+        return table.values;
+    }
+
+    // The hash's high bits depend on the most recent bytes, so the masks test those.
+    static uint64_t highBits(int bits) {
+        return ~0ULL << (64 - bits);
+    }
+
+public:
+    // Length of the chunk starting at data[0], given `length` bytes of which the chunk must end
+    // within (the caller only cuts with less than CDC_MAX_SIZE bytes left at the end of input).
+    static size_t cut(const uint8_t *data, size_t length) {
+        if (length <= CDC_MIN_SIZE) {
+            return length;
+        }
+
+        static const uint64_t strict_mask = highBits(CDC_AVG_BITS + 1);
+        static const uint64_t loose_mask = highBits(CDC_AVG_BITS - 1);
+        const uint64_t *gear = gearTable();
+
+        size_t limit = length < CDC_MAX_SIZE ? length : CDC_MAX_SIZE;
+        size_t normal = limit < (1u << CDC_AVG_BITS) ? limit : (1u << CDC_AVG_BITS);
+        uint64_t hash = 0;
+        size_t i = CDC_MIN_SIZE;
+
+        for (; i < normal; i++) {
+            hash = (hash << 1) + gear[data[i]];
+            if ((hash & strict_mask) == 0) {
+                return i + 1;
+            }
+        }
+        for (; i < limit; i++) {
+            hash = (hash << 1) + gear[data[i]];
+            if ((hash & loose_mask) == 0) {
+                return i + 1;
+            }
+        }
+        return limit;
+    }
+
+    template<typename Sink>
+    bool feed(const char *data, size_t length, Sink &&sink) {
+        pending.append(data, length);
+
+        // A cut is only final once a whole CDC_MAX_SIZE window is buffered.
+        while (pending.size() - start >= CDC_MAX_SIZE) {
+            size_t size = cut(reinterpret_cast<const uint8_t *>(pending.data() + start), pending.size() - start);
+            if (!sink(pending.data() + start, size)) {
+                return false;
+            }
+            start += size;
+        }
+
+        if (start > 0) {
+            pending.erase(0, start);
+            start = 0;
+        }
+        return true;
+    }
+
+    // Emits whatever is still buffered; the chunker can then be reused for the next file.
+    template<typename Sink>
+    bool finish(Sink &&sink) {
+        bool ok = true;
+        while (ok && start < pending.size()) {
+            size_t size = cut(reinterpret_cast<const uint8_t *>(pending.data() + start), pending.size() - start);
+            ok = sink(pending.data() + start, size);
+            start += size;
+        }
+
+        pending.clear();
+        start = 0;
+        return ok;
+    }
+};
+
+#endif //CPP_PERSONAL_CLOUD_CONTENT_CHUNKER_H
@@ -0,0 +1,492 @@
+#ifndef CPP_PERSONAL_CLOUD_SHA256_ENGINE_H
+#define CPP_PERSONAL_CLOUD_SHA256_ENGINE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SHA256_ENGINE_X86 1
+#endif
+
+#define SHA256_BLOCK 64
+#define SHA256_DIGEST 32
+#define SHA256_LANES 8
+
+// Streaming SHA-256 with the same output as picosha2, used for file hashes and chunk checksums.
+//
+// Single messages are compressed with SHA-NI when the CPU has it and with the portable code
+// otherwise. hashMany() hashes several independent buffers (blocks of one file, several files)
+// in one call; without SHA-NI it runs eight of them side by side in the lanes of AVX2 registers.
+class Sha256 {
+public:
+    // Compresses `blocks` consecutive 64-byte blocks into `state`.
+    using Kernel = void (*)(uint32_t state[8], const uint8_t *data, size_t blocks);
+
+    struct Input {
+        const void *data;
+        size_t length;
+    };
+
+private:
+    Kernel compress;
+    uint32_t state[8];
+    uint8_t buffer[SHA256_BLOCK];
+    size_t buffered;
+    uint64_t total;
+
+    static constexpr uint32_t initial_state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    alignas(16) static constexpr uint32_t round_constants[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+    };
+
+    static uint32_t loadBigEndian32(const uint8_t *p) {
+        return static_cast<uint32_t>(p[0]) << 24 | static_cast<uint32_t>(p[1]) << 16 |
+               static_cast<uint32_t>(p[2]) << 8 | p[3];
+    }
+
+    static void storeBigEndian32(uint8_t *p, uint32_t v) {
+        p[0] = static_cast<uint8_t>(v >> 24);
+        p[1] = static_cast<uint8_t>(v >> 16);
+        p[2] = static_cast<uint8_t>(v >> 8);
+        p[3] = static_cast<uint8_t>(v);
+    }
+
+    static uint32_t rotr(uint32_t x, int n) {
+        return (x >> n) | (x << (32 - n));
+    }
+
+    static void compressPortable(uint32_t state[8], const uint8_t *data, size_t blocks) {
+        uint32_t w[64];
+
+        while (blocks--) {
+            for (int i = 0; i < 16; i++) {
+                w[i] = loadBigEndian32(data + i * 4);
+            }
+            for (int i = 16; i < 64; i++) {
+                uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+                uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+                w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+            }
+
+            uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+            uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+            for (int i = 0; i < 64; i++) {
+                uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) +
+                              round_constants[i] + w[i];
+                uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+                h = g;
+                g = f;
+                f = e;
+                e = d + t1;
+                d = c;
+                c = b;
+                b = a;
+                a = t1 + t2;
+            }
+
+            state[0] += a;
+            state[1] += b;
+            state[2] += c;
+            state[3] += d;
+            state[4] += e;
+            state[5] += f;
+            state[6] += g;
+            state[7] += h;
+
+            data += SHA256_BLOCK;
+        }
+    }
+
+#ifdef SHA256_ENGINE_X86
+    // The SHA-NI instructions keep the state as ABEF / CDGH and do two rounds per sha256rnds2;
+    // each group of four rounds also advances the message schedule for a later group.
+    __attribute__((target("sha,sse4.1")))
+    static void compressShaNi(uint32_t state[8], const uint8_t *data, size_t blocks) {
+        const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+        __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(state)), 0xB1);
+        __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(state + 4)), 0x1B);
+        __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+        state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+        while (blocks--) {
+            __m128i abef_save = state0;
+            __m128i cdgh_save = state1;
+            __m128i msg[4];
+
+#pragma GCC unroll 16
+            for (int group = 0; group < 16; group++) {
+                __m128i &current = msg[group % 4];
+                if (group < 4) {
+                    current = _mm_shuffle_epi8(
+                        _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + group * 16)), byte_swap);
+                }
+
+                __m128i words = _mm_add_epi32(
+                    current, _mm_load_si128(reinterpret_cast<const __m128i *>(round_constants + group * 4)));
+                state1 = _mm_sha256rnds2_epu32(state1, state0, words);
+
+                if (group >= 3 && group < 15) {
+                    __m128i &next = msg[(group + 1) % 4];
+                    next = _mm_add_epi32(next, _mm_alignr_epi8(current, msg[(group + 3) % 4], 4));
+                    next = _mm_sha256msg2_epu32(next, current);
+                }
+
+                state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(words, 0x0E));
+
+                if (group >= 1 && group < 13) {
+                    __m128i &previous = msg[(group + 3) % 4];
+                    previous = _mm_sha256msg1_epu32(previous, current);
+                }
+            }
+
+            state0 = _mm_add_epi32(state0, abef_save);
+            state1 = _mm_add_epi32(state1, cdgh_save);
+            data += SHA256_BLOCK;
+        }
+
+        tmp = _mm_shuffle_epi32(state0, 0x1B);
+        state1 = _mm_shuffle_epi32(state1, 0xB1);
+        state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+        state1 = _mm_alignr_epi8(state1, tmp, 8);
+
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(state), state0);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(state + 4), state1);
+    }
+
+    __attribute__((target("avx2")))
+    static __m256i rotr8(__m256i x, int n) {
+        return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n));
+    }
+
+    // One block for each of eight messages; lane i of every register belongs to message i.
+    // Lanes whose bit is set in `done` keep their state unchanged.
+    __attribute__((target("avx2")))
+    static void compressLanes(__m256i lanes[8], const uint8_t *const blocks[SHA256_LANES], int done) {
+        const __m256i byte_swap = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+                                                  12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+        __m256i w[64];
+
+        for (int i = 0; i < 16; i++) {
+            uint32_t word[SHA256_LANES];
+            for (int lane = 0; lane < SHA256_LANES; lane++) {
+                std::memcpy(&word[lane], blocks[lane] + i * 4, 4);
+            }
+            w[i] = _mm256_shuffle_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(word)), byte_swap);
+        }
+        for (int i = 16; i < 64; i++) {
+            __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(rotr8(w[i - 15], 7), rotr8(w[i - 15], 18)),
+                                          _mm256_srli_epi32(w[i - 15], 3));
+            __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(rotr8(w[i - 2], 17), rotr8(w[i - 2], 19)),
+                                          _mm256_srli_epi32(w[i - 2], 10));
+            w[i] = _mm256_add_epi32(_mm256_add_epi32(w[i - 16], s0), _mm256_add_epi32(w[i - 7], s1));
+        }
+
+        __m256i a = lanes[0], b = lanes[1], c = lanes[2], d = lanes[3];
+        __m256i e = lanes[4], f = lanes[5], g = lanes[6], h = lanes[7];
+
+        for (int i = 0; i < 64; i++) {
+            __m256i sigma1 = _mm256_xor_si256(_mm256_xor_si256(rotr8(e, 6), rotr8(e, 11)), rotr8(e, 25));
+            __m256i choose = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+            __m256i t1 = _mm256_add_epi32(_mm256_add_epi32(h, sigma1),
+                                          _mm256_add_epi32(_mm256_add_epi32(choose, w[i]),
+                                                           _mm256_set1_epi32(static_cast<int>(round_constants[i]))));
+            __m256i sigma0 = _mm256_xor_si256(_mm256_xor_si256(rotr8(a, 2), rotr8(a, 13)), rotr8(a, 22));
+            __m256i majority = _mm256_xor_si256(_mm256_xor_si256(_mm256_and_si256(a, b), _mm256_and_si256(a, c)),
+                                                _mm256_and_si256(b, c));
+            __m256i t2 = _mm256_add_epi32(sigma0, majority);
+            h = g;
+            g = f;
+            f = e;
+            e = _mm256_add_epi32(d, t1);
+            d = c;
+            c = b;
+            b = a;
+            a = _mm256_add_epi32(t1, t2);
+        }
+
+        const __m256i keep = _mm256_set_epi32(done & 0x80 ? -1 : 0, done & 0x40 ? -1 : 0, done & 0x20 ? -1 : 0,
+                                              done & 0x10 ? -1 : 0, done & 0x08 ? -1 : 0, done & 0x04 ? -1 : 0,
+                                              done & 0x02 ? -1 : 0, done & 0x01 ? -1 : 0);
+        __m256i updated[8] = {a, b, c, d, e, f, g, h};
+        for (int i = 0; i < 8; i++) {
+            lanes[i] = _mm256_blendv_epi8(_mm256_add_epi32(lanes[i], updated[i]), lanes[i], keep);
+        }
+    }
+
+    // Hashes up to eight messages at once. Every lane walks its whole blocks followed by its own
+    // padded tail; lanes that run out early are masked until the longest message is done.
+    __attribute__((target("avx2")))
+    static void hashLanes(const Input *inputs, size_t count, uint8_t (*digests)[SHA256_DIGEST]) {
+        static const uint8_t idle_block[SHA256_BLOCK] = {0};
+        uint8_t tails[SHA256_LANES][SHA256_BLOCK * 2];
+        size_t whole_blocks[SHA256_LANES] = {0};
+        size_t total_blocks[SHA256_LANES] = {0};
+        size_t longest = 0;
+
+        for (size_t lane = 0; lane < count; lane++) {
+            whole_blocks[lane] = inputs[lane].length / SHA256_BLOCK;
+            total_blocks[lane] = whole_blocks[lane] +
+                                 padTail(static_cast<const uint8_t *>(inputs[lane].data), inputs[lane].length,
+                                         inputs[lane].length, tails[lane]);
+            longest = total_blocks[lane] > longest ? total_blocks[lane] : longest;
+        }
+
+        __m256i lanes[8];
+        for (int i = 0; i < 8; i++) {
+            lanes[i] = _mm256_set1_epi32(static_cast<int>(initial_state[i]));
+        }
+
+        for (size_t block = 0; block < longest; block++) {
+            const uint8_t *blocks[SHA256_LANES];
+            int done = 0;
+
+            for (size_t lane = 0; lane < SHA256_LANES; lane++) {
+                if (lane >= count || block >= total_blocks[lane]) {
+                    blocks[lane] = idle_block;
+                    done |= 1 << lane;
+                } else if (block < whole_blocks[lane]) {
+                    blocks[lane] = static_cast<const uint8_t *>(inputs[lane].data) + block * SHA256_BLOCK;
+                } else {
+                    blocks[lane] = tails[lane] + (block - whole_blocks[lane]) * SHA256_BLOCK;
+                }
+            }
+
+            compressLanes(lanes, blocks, done);
+        }
+
+        alignas(32) uint32_t words[8][SHA256_LANES];
+        for (int i = 0; i < 8; i++) {
+            _mm256_store_si256(reinterpret_cast<__m256i *>(words[i]), lanes[i]);
+        }
+        for (size_t lane = 0; lane < count; lane++) {
+            for (int i = 0; i < 8; i++) {
+                storeBigEndian32(digests[lane] + i * 4, words[i][lane]);
+            }
+        }
+    }
+#endif
+
+    // Copies the bytes after the last whole block of a `length`-byte message into `out` and
+    // appends the padding; returns the number of blocks written (1 or 2).
+    static size_t padTail(const uint8_t *data, size_t length, uint64_t total_length, uint8_t *out) {
+        size_t rest = length % SHA256_BLOCK;
+        std::memcpy(out, data + length - rest, rest);
+        out[rest] = 0x80;
+
+        size_t blocks = rest + 9 > SHA256_BLOCK ? 2 : 1;
+        std::memset(out + rest + 1, 0, blocks * SHA256_BLOCK - rest - 1);
+
+        uint64_t bits = total_length * 8;
+        for (int i = 0; i < 8; i++) {
+            out[blocks * SHA256_BLOCK - 1 - i] = static_cast<uint8_t>(bits >> (i * 8));
+        }
+        return blocks;
+    }
+
+    static Kernel selectKernel() {
+        return availableKernels().front().second;
+    }
+
+    static bool hasLanes() {
+#ifdef SHA256_ENGINE_X86
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#else
+        return false;
+#endif
+    }
+
+    static bool useLanes() {
+        static const bool lanes = kernel() == &compressPortable && hasLanes();
+        return lanes;
+    }
+
+public:
+    Sha256() : compress(kernel()) {
+        reset();
+    }
+
+    // Compresses with `compress` instead of kernel(), so each kernel can be checked on its own.
+    explicit Sha256(Kernel compress) : compress(compress) {
+        reset();
+    }
+
+    void reset() {
+        std::memcpy(state, initial_state, sizeof(state));
+        buffered = 0;
+        total = 0;
+    }
+
+    void update(const void *data, size_t length) {
+        const uint8_t *bytes = static_cast<const uint8_t *>(data);
+        total += length;
+
+        if (buffered > 0) {
+            size_t take = SHA256_BLOCK - buffered < length ? SHA256_BLOCK - buffered : length;
+            std::memcpy(buffer + buffered, bytes, take);
+            buffered += take;
+            bytes += take;
+            length -= take;
+
+            if (buffered < SHA256_BLOCK) {
+                return;
+            }
+            compress(state, buffer, 1);
+            buffered = 0;
+        }
+
+        size_t whole = length / SHA256_BLOCK;
+        if (whole > 0) {
+            compress(state, bytes, whole);
+            bytes += whole * SHA256_BLOCK;
+            length -= whole * SHA256_BLOCK;
+        }
+
+        std::memcpy(buffer, bytes, length);
+        buffered = length;
+    }
+
+    // Writes the digest of everything passed to update(). The hasher itself is left untouched,
+    // so more data can still be appended afterwards.
+    void digest(uint8_t out[SHA256_DIGEST]) const {
+        uint32_t final_state[8];
+        std::memcpy(final_state, state, sizeof(final_state));
+
+        uint8_t tail[SHA256_BLOCK * 2];
+        size_t blocks = padTail(buffer, buffered, total, tail);
+        compress(final_state, tail, blocks);
+
+        for (int i = 0; i < 8; i++) {
+            storeBigEndian32(out + i * 4, final_state[i]);
+        }
+    }
+
+    std::string hexDigest() const {
+        uint8_t out[SHA256_DIGEST];
+        digest(out);
+        return toHex(out);
+    }
+
+    static std::string toHex(const uint8_t digest[SHA256_DIGEST]) {
+        static const char digits[] = "0123456789abcdef";
+
+        std::string hex(SHA256_DIGEST * 2, '0');
+        for (int i = 0; i < SHA256_DIGEST; i++) {
+            hex[i * 2] = digits[digest[i] >> 4];
+            hex[i * 2 + 1] = digits[digest[i] & 0x0f];
+        }
+        return hex;
+    }
+
+    static std::string hashHex(const void *data, size_t length) {
+        Sha256 hasher;
+        hasher.update(data, length);
+        return hasher.hexDigest();
+    }
+
+    // HMAC-SHA256 (RFC 2104) of `data` under `key`.
+    static void hmac(const void *key, size_t key_length, const void *data, size_t length,
+                     uint8_t out[SHA256_DIGEST]) {
+        uint8_t block[SHA256_BLOCK] = {0};
+        if (key_length > SHA256_BLOCK) {
+            Sha256 key_hasher;
+            key_hasher.update(key, key_length);
+            key_hasher.digest(block);
+        } else {
+            std::memcpy(block, key, key_length);
+        }
+
+        uint8_t pad[SHA256_BLOCK];
+        for (int i = 0; i < SHA256_BLOCK; i++) {
+            pad[i] = block[i] ^ 0x36;
+        }
+        uint8_t inner_digest[SHA256_DIGEST];
+        Sha256 inner;
+        inner.update(pad, sizeof(pad));
+        inner.update(data, length);
+        inner.digest(inner_digest);
+
+        for (int i = 0; i < SHA256_BLOCK; i++) {
+            pad[i] = block[i] ^ 0x5c;
+        }
+        Sha256 outer;
+        outer.update(pad, sizeof(pad));
+        outer.update(inner_digest, sizeof(inner_digest));
+        outer.digest(out);
+    }
+
+    // Digests of `count` independent buffers, written to digests[0..count).
+    static void hashMany(const Input *inputs, size_t count, uint8_t (*digests)[SHA256_DIGEST]) {
+        if (useLanes() && hashManyLanes(inputs, count, digests)) {
+            return;
+        }
+        for (size_t i = 0; i < count; i++) {
+            Sha256 hasher;
+            hasher.update(inputs[i].data, inputs[i].length);
+            hasher.digest(digests[i]);
+        }
+    }
+
+    // hashMany() in the AVX2 lanes whatever kernel() is; false, with nothing written, without AVX2.
+    static bool hashManyLanes(const Input *inputs, size_t count, uint8_t (*digests)[SHA256_DIGEST]) {
+#ifdef SHA256_ENGINE_X86
+        if (hasLanes()) {
+            for (size_t first = 0; first < count; first += SHA256_LANES) {
+                size_t group = count - first < SHA256_LANES ? count - first : SHA256_LANES;
+                hashLanes(inputs + first, group, digests + first);
+            }
+            return true;
+        }
+#endif
+        return false;
+    }
+
+    // Every compression kernel this CPU can run with its name, fastest first; kernel() is the first.
+    static std::vector<std::pair<const char *, Kernel> > availableKernels() {
+        std::vector<std::pair<const char *, Kernel> > kernels;
+#ifdef SHA256_ENGINE_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1")) {
+            kernels.emplace_back("SHA-NI", &compressShaNi);
+        }
+#endif
+        kernels.emplace_back("portable", &compressPortable);
+        return kernels;
+    }
+
+    static Kernel kernel() {
+        static const Kernel selected = selectKernel();
+        return selected;
+    }
+
+    static const char *kernelName() {
+#ifdef SHA256_ENGINE_X86
+        if (kernel() == &compressShaNi) {
+            return "SHA-NI";
+        }
+        if (useLanes()) {
+            return "portable, AVX2 x8 for batches";
+        }
+#endif
+        return "portable";
+    }
+};
+
+#endif //CPP_PERSONAL_CLOUD_SHA256_ENGINE_H
@@ -0,0 +1,175 @@
+#ifndef CPP_PERSONAL_CLOUD_WIRE_PROTOCOL_H
+#define CPP_PERSONAL_CLOUD_WIRE_PROTOCOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <nlohmann/json.hpp>
+using json = nlohmann::json;
+
+#include "server_response.h"
+
+#define WIRE_PROTOCOL_VERSION 2
+#define WIRE_HEADER_SIZE 12
+#define WIRE_MAX_PAYLOAD (1024 * 1024)
+
+// Set on every frame sent by the server.
+#define WIRE_RESPONSE 0x8000
+
+// Frame exchanged in the middle of a command (GET metadata, READY) rather than its final status.
+#define WIRE_FLAG_PARTIAL 0x0001
+
+// Frame of file data (GET). Unlike other frames its payload is the raw bytes, not fields.
+#define WIRE_FLAG_DATA 0x0002
+
+// Binary framing, switched on per connection by the text command "PROTO <version>". Every frame is
+// a fixed header followed by `length` bytes of payload:
+//
+//     uint16 opcode | uint16 flags | uint32 request id | uint32 length
+//
+// in host byte order, like the length prefix of the text frames. A request payload is the command's
+// arguments, each as a length-prefixed field, so arguments may contain spaces. A final response is
+// a uint32 status code, the status message and the response data as fields; the data is passed as
+// it is instead of being escaped into another JSON document.
+//
+// Several requests may be in flight on one connection; the server answers them as they finish, so
+// replies are matched to requests by id. A download arrives as the metadata frame, data frames and
+// the final status. Upload data still travels unframed after READY, and the server reads nothing
+// else from the connection until that upload command is done.
+//
+// CANCEL, with the id of an earlier request as its argument, asks the server to stop that
+// request's data frames. It gets no reply of its own; the cancelled request still ends with a
+// status, which the client may ignore.
+struct WireHeader {
+    uint16_t opcode = 0;
+    uint16_t flags = 0;
+    uint32_t request_id = 0;
+    uint32_t length = 0;
+};
+
+static_assert(sizeof(WireHeader) == WIRE_HEADER_SIZE, "WireHeader must match the wire layout");
+
+// Opcode n is the command wireCommands()[n]; 0 is unused.
+inline const std::vector<std::string> &wireCommands() {
+    static const std::vector<std::string> commands = {
+        "", "LOGIN", "LOGOUT", "REGISTER", "GET", "POST", "POST_BEGIN", "POST_STATUS", "POST_CHUNK",
+        "POST_COMMIT", "LIST", "LIST_SINCE", "DELETE", "CREATEDIR", "POST_BATCH", "POST_DEDUP", "CANCEL",
+    };
+    return commands;
+}
+
+// 0 when the command has no opcode.
+inline uint16_t wireOpcode(const std::string &name) {
+    const auto &commands = wireCommands();
+    for (size_t i = 1; i < commands.size(); i++) {
+        if (commands[i] == name) {
+            return static_cast<uint16_t>(i);
+        }
+    }
+    return 0;
+}
+
+// Empty for an unknown opcode.
+inline std::string wireCommandName(uint16_t opcode) {
+    const auto &commands = wireCommands();
+    opcode &= ~WIRE_RESPONSE;
+    return opcode < commands.size() ? commands[opcode] : "";
+}
+
+inline WireHeader decodeWireHeader(const char *data) {
+    WireHeader header;
+    std::memcpy(&header, data, WIRE_HEADER_SIZE);
+    return header;
+}
+
+// Builds one frame; the header's length is filled in by finish().
+class WireWriter {
+private:
+    std::string buffer;
+
+public:
+    WireWriter(uint16_t opcode, uint16_t flags, uint32_t request_id) : buffer(WIRE_HEADER_SIZE, '\0') {
+        WireHeader header{opcode, flags, request_id, 0};
+        std::memcpy(buffer.data(), &header, WIRE_HEADER_SIZE);
+    }
+
+    WireWriter &putU32(uint32_t value) {
+        buffer.append(reinterpret_cast<const char *>(&value), sizeof(value));
+        return *this;
+    }
+
+    WireWriter &putField(const std::string &field) {
+        putU32(static_cast<uint32_t>(field.size()));
+        buffer += field;
+        return *this;
+    }
+
+    std::string finish() {
+        uint32_t length = static_cast<uint32_t>(buffer.size() - WIRE_HEADER_SIZE);
+        std::memcpy(buffer.data() + offsetof(WireHeader, length), &length, sizeof(length));
+        return std::move(buffer);
+    }
+};
+
+// Reads the fields of one payload; every getter fails instead of reading past the end.
+class WireReader {
+private:
+    const std::string &payload;
+    size_t position = 0;
+
+public:
+    explicit WireReader(const std::string &payload) : payload(payload) {
+    }
+
+    bool done() const {
+        return position == payload.size();
+    }
+
+    bool getU32(uint32_t &value) {
+        if (payload.size() - position < sizeof(value)) {
+            return false;
+        }
+        std::memcpy(&value, payload.data() + position, sizeof(value));
+        position += sizeof(value);
+        return true;
+    }
+
+    bool getField(std::string &field) {
+        uint32_t size = 0;
+        if (!getU32(size) || payload.size() - position < size) {
+            return false;
+        }
+        field.assign(payload, position, size);
+        position += size;
+        return true;
+    }
+};
+
+inline std::string encodeWireResponse(uint16_t opcode, uint32_t request_id, const ServerResponse &response) {
+    return WireWriter(opcode | WIRE_RESPONSE, 0, request_id)
+            .putU32(static_cast<uint32_t>(response.status_code))
+            .putField(response.status_message)
+            .putField(response.response_data_json)
+            .finish();
+}
+
+// Whether the response fits in one frame; a client drops the connection on a longer one.
+inline bool fitsWireResponse(const ServerResponse &response) {
+    return 3 * sizeof(uint32_t) + response.status_message.size() + response.response_data_json.size() <=
+           WIRE_MAX_PAYLOAD;
+}
+
+inline bool decodeWireResponse(const std::string &payload, ServerResponse &response) {
+    WireReader reader(payload);
+    uint32_t status_code = 0;
+    if (!reader.getU32(status_code) || !reader.getField(response.status_message) ||
+        !reader.getField(response.response_data_json)) {
+        return false;
+    }
+    response.status_code = static_cast<int>(status_code);
+    return true;
+}
+
+#endif //CPP_PERSONAL_CLOUD_WIRE_PROTOCOL_H
@@ -1,8 +1,13 @@
 #ifndef CPP_PERSONAL_CLOUD_FILE_EXPLORER_MANAGER_H
 #define CPP_PERSONAL_CLOUD_FILE_EXPLORER_MANAGER_H
+#include <algorithm>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
+#include <vector>
 
+#include "cloud_change.h"
 #include "cloud_dir.h"
 
 struct SimpleDirEntry {
@@ -16,6 +21,15 @@ private:
     CloudDir root;
     std::vector<std::string> path_stack;
     CloudDir *curr_dir;
+    unsigned long long version;
+    bool synced;
+
+    // In lazy mode the tree starts as the root alone and directories are filled in one level at a
+    // time by load_dir. Directories not loaded yet are empty stubs; for those the entry count
+    // from their parent's listing is shown.
+    bool lazy;
+    std::unordered_set<std::string> loaded_dirs;
+    std::unordered_map<std::string, unsigned long long> entry_counts;
 
     CloudDir *find_dir_by_path(CloudDir &dir, const std::string &target_path) {
         if (dir.path == target_path) {
@@ -30,6 +44,14 @@ private:
     }
 
     int count_files(const CloudDir &dir) {
+        if (this->lazy) {
+            if (!is_loaded(dir.path)) {
+                auto found = entry_counts.find(dir.path);
+                return found == entry_counts.end() ? 0 : static_cast<int>(found->second);
+            }
+            return static_cast<int>(dir.files.size() + dir.subdirs.size());
+        }
+
         int count = dir.files.size();
         count += dir.subdirs.size();
 
@@ -41,8 +63,187 @@ private:
         return count;
     }
 
+    static std::string parent_path(const std::string &path) {
+        size_t slash = path.find_last_of('/');
+        return slash == 0 || slash == std::string::npos ? "/" : path.substr(0, slash);
+    }
+
+    static std::string base_name(const std::string &path) {
+        return path.substr(path.find_last_of('/') + 1);
+    }
+
+    // Walks down from the root one component at a time, adding directories that are missing.
+    CloudDir *ensure_dir(const std::string &path) {
+        CloudDir *dir = &this->root;
+        size_t start = 1;
+
+        while (start < path.size()) {
+            size_t end = path.find('/', start);
+            if (end == std::string::npos) {
+                end = path.size();
+            }
+
+            std::string sub_path = path.substr(0, end);
+            CloudDir *next = nullptr;
+            for (auto &subdir: dir->subdirs) {
+                if (subdir.path == sub_path) {
+                    next = &subdir;
+                    break;
+                }
+            }
+
+            if (!next) {
+                dir->subdirs.push_back(CloudDir{path.substr(start, end - start), sub_path, {}, {}});
+                next = &dir->subdirs.back();
+            }
+
+            dir = next;
+            start = end + 1;
+        }
+
+        return dir;
+    }
+
+    void apply_change(const CloudChange &change) {
+        // Changes inside a directory that was never opened are picked up when it is loaded.
+        if (this->lazy && !is_loaded(parent_path(change.path))) {
+            return;
+        }
+
+        if (change.op == "put" && change.is_dir) {
+            ensure_dir(change.path);
+        } else if (change.op == "put") {
+            CloudDir *dir = ensure_dir(parent_path(change.path));
+            std::string name = base_name(change.path);
+
+            for (auto &file: dir->files) {
+                if (file.name == name) {
+                    file.size = change.size;
+                    return;
+                }
+            }
+            dir->files.push_back(CloudFile{change.size, name});
+        } else if (change.op == "delete") {
+            CloudDir *dir = find_dir_by_path(this->root, parent_path(change.path));
+            if (!dir) {
+                return;
+            }
+
+            std::string name = base_name(change.path);
+            std::erase_if(dir->files, [&name](const CloudFile &file) { return file.name == name; });
+            std::erase_if(dir->subdirs, [&change](const CloudDir &subdir) { return subdir.path == change.path; });
+            forget_loaded(change.path);
+        }
+    }
+
+    // Marks a removed directory and everything below it as not loaded.
+    void forget_loaded(const std::string &dir_path) {
+        std::string prefix = dir_path + "/";
+        std::erase_if(loaded_dirs, [&dir_path, &prefix](const std::string &path) {
+            return path == dir_path || path.rfind(prefix, 0) == 0;
+        });
+    }
+
+    // Points curr_dir (and the back stack) at the same paths again after the tree was replaced or
+    // edited, falling back to the root for directories that are gone.
+    void restore_position(const std::string &saved_path, const std::vector<std::string> &saved_stack) {
+        this->curr_dir = &this->root;
+        this->path_stack.clear();
+
+        if (saved_path != "/" && saved_path != this->root.path) {
+            CloudDir *target = find_dir_by_path(this->root, saved_path);
+            if (target) {
+                this->curr_dir = target;
+
+                for (const auto &stack_path: saved_stack) {
+                    if (find_dir_by_path(this->root, stack_path)) {
+                        this->path_stack.push_back(stack_path);
+                    } else {
+                        break;
+                    }
+                }
+
+                std::cout << "Restored path to: " << saved_path << std::endl;
+            } else {
+                std::cout << "Path no longer exists: " << saved_path << ", returning to root" << std::endl;
+            }
+        }
+    }
+
 public:
-    FileExplorerManager(CloudDir root) : root(std::move(root)), curr_dir(&this->root) {
+    FileExplorerManager(CloudDir root) : root(std::move(root)), curr_dir(&this->root), version(0), synced(false),
+                                         lazy(false) {
+    }
+
+    // Drops the tree and switches to on-demand loading; the root has to be loaded next.
+    void reset_lazy() {
+        this->root = CloudDir{"root", "/", {}, {}};
+        this->curr_dir = &this->root;
+        this->path_stack.clear();
+        this->version = 0;
+        this->synced = false;
+        this->lazy = true;
+        this->loaded_dirs.clear();
+        this->entry_counts.clear();
+    }
+
+    bool is_loaded(const std::string &path) const {
+        return !this->lazy || loaded_dirs.count(path) > 0;
+    }
+
+    // Fills one directory level from a (complete, all pages) LIST <dir>. Subdirectories that
+    // were already loaded keep their contents. The first listing after reset_lazy() also sets the
+    // version LIST_SINCE continues from; later ones are at least as new, and replaying the
+    // journal from the older version over them ends in the same state.
+    void load_dir(const std::string &path, std::vector<CloudFile> files, const std::vector<CloudDirSummary> &subdirs,
+                  unsigned long long listed_version) {
+        std::string saved_path = this->curr_dir->path;
+        std::vector<std::string> saved_stack = this->path_stack;
+
+        CloudDir *dir = ensure_dir(path);
+        std::unordered_map<std::string, size_t> existing;
+        for (size_t i = 0; i < dir->subdirs.size(); i++) {
+            existing.emplace(dir->subdirs[i].path, i);
+        }
+
+        std::vector<CloudDir> merged;
+        merged.reserve(subdirs.size());
+        for (const auto &summary: subdirs) {
+            auto found = existing.find(summary.path);
+            if (found != existing.end() && is_loaded(summary.path)) {
+                merged.push_back(std::move(dir->subdirs[found->second]));
+            } else {
+                merged.push_back(CloudDir{summary.name, summary.path, {}, {}});
+            }
+            if (found != existing.end()) {
+                existing.erase(found);
+            }
+            entry_counts[summary.path] = summary.entries;
+        }
+
+        // Whatever is left in `existing` is gone on the server.
+        for (const auto &gone: existing) {
+            forget_loaded(gone.first);
+        }
+
+        dir->files = std::move(files);
+        dir->subdirs = std::move(merged);
+        loaded_dirs.insert(path);
+
+        if (!this->synced) {
+            this->version = listed_version;
+            this->synced = true;
+        }
+        restore_position(saved_path, saved_stack);
+    }
+
+    // True once a full tree has been loaded, i.e. get_version() can be passed to LIST_SINCE.
+    bool is_synced() const {
+        return synced;
+    }
+
+    unsigned long long get_version() const {
+        return version;
     }
 
     std::vector<SimpleDirEntry> get_subdirs() {
@@ -97,34 +298,35 @@ public:
         return this->curr_dir->path;
     }
 
-    void update_root(CloudDir new_root) {
+    void update_root(CloudDir new_root, unsigned long long new_version) {
         std::string saved_path = this->curr_dir->path;
         std::vector<std::string> saved_stack = this->path_stack;
 
         this->root = std::move(new_root);
-        this->curr_dir = &this->root;
-        this->path_stack.clear();
+        this->version = new_version;
+        this->synced = true;
+        this->lazy = false;
+        restore_position(saved_path, saved_stack);
 
-        if (saved_path != "/" && saved_path != this->root.path) {
-            CloudDir *target = find_dir_by_path(this->root, saved_path);
-            if (target) {
-                this->curr_dir = target;
+        std::cout << "Root updated; Current path: " << this->curr_dir->path << std::endl;
+    }
 
-                for (const auto &stack_path: saved_stack) {
-                    if (find_dir_by_path(this->root, stack_path)) {
-                        this->path_stack.push_back(stack_path);
-                    } else {
-                        break;
-                    }
-                }
+    // Applies LIST_SINCE results in place. Entries at or below the current version were already
+    // applied (two refreshes can race), so this is safe to call with overlapping batches.
+    void apply_changes(const std::vector<CloudChange> &changes, unsigned long long new_version) {
+        std::string saved_path = this->curr_dir->path;
+        std::vector<std::string> saved_stack = this->path_stack;
 
-                std::cout << "Restored path to: " << saved_path << std::endl;
-            } else {
-                std::cout << "Path no longer exists: " << saved_path << ", returning to root" << std::endl;
+        for (const auto &change: changes) {
+            if (change.version > this->version) {
+                apply_change(change);
             }
         }
 
-        std::cout << "Root updated; Current path: " << this->curr_dir->path << std::endl;
+        if (new_version > this->version) {
+            this->version = new_version;
+        }
+        restore_position(saved_path, saved_stack);
     }
 };
 
@@ -1,20 +1,47 @@
 #ifndef CPP_PERSONAL_CLOUD_COMMAND_HANDLER_H
 #define CPP_PERSONAL_CLOUD_COMMAND_HANDLER_H
+#include <cstring>
 #include <iostream>
 #include <string>
 #include <arpa/inet.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <thread>
+#include <unordered_map>
 
 #include "cloud_file.h"
+#include "content_chunker.h"
+#include "sha256_engine.h"
 #include "server_response.h"
 #include "utility_functions.h"
+#include "wire_protocol.h"
 
 #define BUFFER_SIZE 8192
+#define UPLOAD_STREAMS 4
+#define LIST_PAGE_SIZE 1000
+#define BATCH_FILE_MAX (4 * 1024 * 1024)
+#define BATCH_MAX_FILES 1000
+#define BATCH_MAX_BYTES (64 * 1024 * 1024)
+#define BATCH_SEND_BUFFER (256 * 1024)
+#define DEDUP_READ_BUFFER (4 * 1024 * 1024)
 #define PORT 8005
 // #define IP "10.100.0.30"
 #define IP "192.168.1.10"
 
+// One file of a batch upload: where it is read from and its path under the target directory
+// ("photos/2020/a.jpg").
+struct UploadItem {
+    std::string local_path;
+    std::string remote_path;
+};
+
 class ServerConnection {
 private:
     int sock;
@@ -23,25 +50,345 @@ private:
     std::string pass;
     std::filesystem::path user_dir;
 
-    ServerConnection() : sock(-1), isConnected(false) {
+    // Binary framing (wire_protocol.h) once the server accepted PROTO. The reader thread then takes
+    // every frame off the socket and hands it to the Exchange waiting for that request id.
+    bool binary;
+    std::atomic<uint32_t> next_request_id;
+    std::thread reader;
+    std::mutex send_mutex;
+    std::mutex text_mutex;
+
+    struct PendingReply {
+        std::mutex mutex;
+        std::condition_variable arrived;
+        std::deque<std::pair<WireHeader, std::string> > frames;
+        bool lost = false;
+    };
+
+    std::mutex pending_mutex;
+    std::unordered_map<uint32_t, std::shared_ptr<PendingReply> > pending;
+    bool replies_lost;
+
+    // Set once the server said it doesn't deduplicate; files are then not chunked locally.
+    std::atomic<bool> dedup_off;
+
+    // A chunk of a local file (content_chunker.h) and where it is in the file.
+    struct LocalChunk {
+        std::string hash;
+        unsigned long long offset = 0;
+        unsigned long long length = 0;
+    };
+
+    ServerConnection() : sock(-1), isConnected(false), binary(false), next_request_id(0), replies_lost(false),
+                         dedup_off(false) {
     }
 
     ServerConnection(const ServerConnection &) = delete;
 
     ServerConnection &operator=(const ServerConnection &) = delete;
 
+    // One command, from sending it to its final status. On a binary connection it is registered under
+    // its request id, so any number of exchanges (from any thread) can be in flight on the socket. A
+    // text connection has no ids: an exchange has the socket to itself until it ends.
+    class Exchange {
+    public:
+        enum class Frame {
+            PARTIAL,
+            DATA,
+            STATUS,
+        };
+
+    private:
+        ServerConnection &connection;
+        std::unique_lock<std::mutex> text_lock;
+        std::unique_lock<std::mutex> send_lock;
+        uint32_t id = 0;
+        std::shared_ptr<PendingReply> reply;
+        bool sent = false;
+
+    public:
+        // With `hold_send` nothing else is sent on the connection until the exchange ends, so raw
+        // upload data can follow the command (see sendRaw).
+        Exchange(ServerConnection &connection, const std::string &name, const std::vector<std::string> &arguments,
+                 bool hold_send = false) : connection(connection) {
+            if (!connection.binary) {
+                text_lock = std::unique_lock<std::mutex>(connection.text_mutex);
+
+                std::string cmd = name;
+                for (const auto &argument: arguments) {
+                    cmd += " " + argument;
+                }
+                sent = connection.sendToServer(cmd).status_code == 1;
+                return;
+            }
+
+            id = ++connection.next_request_id;
+            reply = std::make_shared<PendingReply>();
+            {
+                std::lock_guard<std::mutex> lock(connection.pending_mutex);
+                reply->lost = connection.replies_lost;
+                connection.pending.emplace(id, reply);
+            }
+
+            WireWriter writer(wireOpcode(name), 0, id);
+            for (const auto &argument: arguments) {
+                writer.putField(argument);
+            }
+            std::string frame = writer.finish();
+
+            send_lock = std::unique_lock<std::mutex>(connection.send_mutex);
+            sent = connection.sendAll(frame.data(), frame.size());
+            if (!hold_send) {
+                send_lock.unlock();
+            }
+            std::cout << "Sent to server: " << name << " (id " << id << ")\n";
+        }
+
+        Exchange(const Exchange &) = delete;
+
+        Exchange &operator=(const Exchange &) = delete;
+
+        ~Exchange() {
+            if (reply) {
+                std::lock_guard<std::mutex> lock(connection.pending_mutex);
+                connection.pending.erase(id);
+            }
+        }
+
+        bool binary() const {
+            return reply != nullptr;
+        }
+
+        // Next frame of this command: a frame sent in the middle of it (GET metadata, READY) into
+        // `payload`, file data into `payload`, or the final status into `status`.
+        Frame receive(std::string &payload, ServerResponse &status) {
+            if (!sent) {
+                status = {0, "Failed to send\n", ""};
+                return Frame::STATUS;
+            }
+
+            if (!reply) {
+                if (!connection.receiveFrame(payload)) {
+                    status = {0, "Error getting payload!\n", ""};
+                    return Frame::STATUS;
+                }
+
+                try {
+                    json j = json::parse(payload);
+                    if (j.is_object() && j.contains("status_code")) {
+                        status = j.get<ServerResponse>();
+                        return Frame::STATUS;
+                    }
+                } catch (const std::exception &) {
+                }
+                return Frame::PARTIAL;
+            }
+
+            std::unique_lock<std::mutex> lock(reply->mutex);
+            reply->arrived.wait(lock, [this]() {
+                return !reply->frames.empty() || reply->lost;
+            });
+            if (reply->frames.empty()) {
+                status = {0, "Connection lost\n", ""};
+                return Frame::STATUS;
+            }
+
+            std::pair<WireHeader, std::string> frame = std::move(reply->frames.front());
+            reply->frames.pop_front();
+            lock.unlock();
+
+            if (frame.first.flags & WIRE_FLAG_DATA) {
+                payload = std::move(frame.second);
+                return Frame::DATA;
+            }
+
+            if (frame.first.flags & WIRE_FLAG_PARTIAL) {
+                WireReader reader(frame.second);
+                if (reader.getField(payload)) {
+                    return Frame::PARTIAL;
+                }
+                status = {0, "Malformed frame from server\n", ""};
+            } else if (!decodeWireResponse(frame.second, status)) {
+                status = {0, "Malformed status from server\n", ""};
+            }
+            return Frame::STATUS;
+        }
+
+        ServerResponse status() {
+            std::string payload;
+            ServerResponse response;
+            while (receive(payload, response) != Frame::STATUS) {
+            }
+            return response;
+        }
+
+        // Up to `max` bytes of a download: the next data frame, or whatever the socket has on a text
+        // connection.
+        bool receiveData(std::string &data, size_t max) {
+            if (!reply) {
+                data.resize(max < 64 * 1024 ? max : 64 * 1024);
+                ssize_t received = recv(connection.sock, data.data(), data.size(), 0);
+                if (received <= 0) {
+                    return false;
+                }
+                data.resize(received);
+                return true;
+            }
+
+            ServerResponse status;
+            return receive(data, status) == Frame::DATA && data.size() <= max;
+        }
+
+        // Binary connections only: asks the server to stop sending this command's data (CANCEL). Frames
+        // already on their way are dropped by the reader once the exchange ends.
+        void cancel() {
+            if (!reply) {
+                return;
+            }
+
+            std::string frame = WireWriter(wireOpcode("CANCEL"), 0, ++connection.next_request_id)
+                    .putField(std::to_string(id))
+                    .finish();
+            std::unique_lock<std::mutex> lock(connection.send_mutex, std::defer_lock);
+            if (!send_lock.owns_lock()) {
+                lock.lock();
+            }
+            connection.sendAll(frame.data(), frame.size());
+        }
+
+        // Text connections only; a binary download starts without waiting for it.
+        void sendReady() {
+            connection.sendToServer("READY");
+        }
+
+        // Turns down the data announced by a GET's metadata; the command then ends with an error
+        // status, read with status().
+        void decline() {
+            if (reply) {
+                cancel();
+            } else {
+                connection.sendToServer("CANCEL");
+            }
+        }
+
+        bool sendRaw(const char *data, size_t length) {
+            return connection.sendAll(data, length);
+        }
+    };
+
+    // Length and command go out in one write so the command is not held back by Nagle.
     ServerResponse sendToServer(std::string msg) {
         int len = msg.length();
-        ssize_t sent = send(sock, &len, sizeof(int), 0);
+        std::string frame(sizeof(int), '\0');
+        std::memcpy(frame.data(), &len, sizeof(int));
+        frame += msg;
+
+        ssize_t sent = send(sock, frame.data(), frame.size(), 0);
         if (sent < 0) {
             std::cout << "Error sending\n";
         }
-        sent = send(sock, msg.c_str(), msg.length(), 0);
         std::cout << "Sent to server: " << msg << '\n';
 
-        return {sent == msg.length() ? 1 : 0, sent == msg.length() ? "Sent successfully\n" : "Failed to send\n", ""};
+        return {sent == frame.size() ? 1 : 0, sent == frame.size() ? "Sent successfully\n" : "Failed to send\n", ""};
+    }
+
+    bool sendAll(const char *data, size_t length) {
+        size_t total_sent = 0;
+        while (total_sent < length) {
+            ssize_t sent = send(sock, data + total_sent, length - total_sent, MSG_NOSIGNAL);
+            if (sent <= 0) {
+                return false;
+            }
+            total_sent += sent;
+        }
+        return true;
+    }
+
+    ServerResponse request(const std::string &name, const std::vector<std::string> &arguments = {}) {
+        return Exchange(*this, name, arguments).status();
+    }
+
+    // Switches the connection to binary framing; an older server rejects PROTO and it stays on text.
+    void negotiate() {
+        sendToServer("PROTO " + std::to_string(WIRE_PROTOCOL_VERSION));
+        binary = receiveStatus().status_code == 1;
+        if (binary) {
+            replies_lost = false;
+            reader = std::thread(&ServerConnection::readReplies, this);
+        }
+    }
+
+    void readReplies() {
+        WireHeader header;
+        std::string payload;
+        while (receiveWireFrame(header, payload)) {
+            std::shared_ptr<PendingReply> reply;
+            {
+                std::lock_guard<std::mutex> lock(pending_mutex);
+                auto found = pending.find(header.request_id);
+                if (found != pending.end()) {
+                    reply = found->second;
+                }
+            }
+            if (!reply) {
+                continue;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(reply->mutex);
+                reply->frames.emplace_back(header, std::move(payload));
+            }
+            reply->arrived.notify_one();
+        }
+
+        std::lock_guard<std::mutex> lock(pending_mutex);
+        replies_lost = true;
+        for (auto &entry: pending) {
+            {
+                std::lock_guard<std::mutex> reply_lock(entry.second->mutex);
+                entry.second->lost = true;
+            }
+            entry.second->arrived.notify_one();
+        }
+    }
+
+    bool recvAll(void *data, size_t length) {
+        size_t total_received = 0;
+        while (total_received < length) {
+            ssize_t received = recv(sock, static_cast<char *>(data) + total_received, length - total_received, 0);
+            if (received <= 0) {
+                return false;
+            }
+            total_received += received;
+        }
+        return true;
+    }
+
+    bool receiveFrame(std::string &payload) {
+        int size = 0;
+        if (!recvAll(&size, sizeof(int)) || size <= 0) {
+            return false;
+        }
+
+        payload.resize(size);
+        return recvAll(payload.data(), size);
+    }
+
+    bool receiveWireFrame(WireHeader &header, std::string &payload) {
+        char header_bytes[WIRE_HEADER_SIZE];
+        if (!recvAll(header_bytes, WIRE_HEADER_SIZE)) {
+            return false;
+        }
+
+        header = decodeWireHeader(header_bytes);
+        if (header.length > WIRE_MAX_PAYLOAD) {
+            return false;
+        }
+        payload.resize(header.length);
+        return recvAll(payload.data(), payload.size());
     }
 
+    // Status reply on a text connection.
     ServerResponse receiveStatus() {
         try {
             int size;
@@ -78,12 +425,579 @@ private:
         }
     }
 
+    static std::vector<std::pair<unsigned long long, unsigned long long> > missingChunks(
+        unsigned long long size, unsigned long long chunk_size,
+        const std::vector<std::pair<unsigned long long, unsigned long long> > &received) {
+        std::vector<std::pair<unsigned long long, unsigned long long> > missing;
+        if (chunk_size == 0) {
+            chunk_size = size;
+        }
+
+        for (unsigned long long offset = 0; offset < size; offset += chunk_size) {
+            unsigned long long length = size - offset < chunk_size ? size - offset : chunk_size;
+
+            bool covered = false;
+            for (const auto &range: received) {
+                if (range.first <= offset && offset + length <= range.first + range.second) {
+                    covered = true;
+                    break;
+                }
+            }
+
+            if (!covered) {
+                missing.emplace_back(offset, length);
+            }
+        }
+
+        return missing;
+    }
+
+    // Ranges of an upload session the server already holds. The chunks it lists with their hashes
+    // are checked against the local file first: one that differs (the file changed since the
+    // interrupted attempt) is left out, so it is sent again.
+    static std::vector<std::pair<unsigned long long, unsigned long long> > heldRanges(const std::string &file_path,
+                                                                                   const json &status) {
+        std::vector<std::pair<unsigned long long, unsigned long long> > held;
+        if (!status.contains("chunks")) {
+            return status.at("ranges").get<std::vector<std::pair<unsigned long long, unsigned long long> > >();
+        }
+
+        std::ifstream file(file_path, std::ios::binary);
+        std::vector<char> data;
+        for (const auto &chunk: status.at("chunks")) {
+            unsigned long long offset = chunk.at(0).get<unsigned long long>();
+            unsigned long long length = chunk.at(1).get<unsigned long long>();
+            data.resize(length);
+            file.clear();
+            file.seekg(static_cast<std::streamoff>(offset));
+            if (file.read(data.data(), static_cast<std::streamsize>(length)) &&
+                Sha256::hashHex(data.data(), data.size()) == chunk.at(2).get<std::string>()) {
+                held.emplace_back(offset, length);
+            }
+        }
+        return held;
+    }
+
+    // Chunks are handed out one at a time to this connection and up to UPLOAD_STREAMS - 1 others:
+    // the given `streams`, or siblings opened for this upload when there are none. The server writes
+    // each chunk at its own offset, so the order they land in does not matter.
+    ServerResponse postChunks(const std::string &file_path, const std::string &upload_id,
+                              const std::vector<std::pair<unsigned long long, unsigned long long> > &chunks,
+                              const std::vector<ServerConnection *> &streams, const std::atomic<bool> *cancelled) {
+        size_t wanted = chunks.size() < UPLOAD_STREAMS ? chunks.size() : UPLOAD_STREAMS;
+        std::vector<ServerConnection *> connections = {this};
+        for (ServerConnection *stream: streams) {
+            if (connections.size() < wanted && stream != this) {
+                connections.push_back(stream);
+            }
+        }
+
+        std::vector<std::unique_ptr<ServerConnection> > siblings;
+        while (streams.empty() && connections.size() < wanted) {
+            auto sibling = openSibling();
+            if (!sibling) {
+                break;
+            }
+            connections.push_back(sibling.get());
+            siblings.push_back(std::move(sibling));
+        }
+
+        std::atomic<size_t> next_chunk{0};
+        std::atomic<bool> failed{false};
+        std::mutex result_mutex;
+        ServerResponse result{1, "Chunks sent", ""};
+
+        auto sendLoop = [&](ServerConnection &connection) {
+            std::ifstream file(file_path, std::ios::binary);
+            if (!file.is_open()) {
+                std::lock_guard<std::mutex> lock(result_mutex);
+                result = {0, "Can't open file for reading\n", ""};
+                failed = true;
+                return;
+            }
+
+            while (!failed) {
+                if (cancelled && *cancelled) {
+                    std::lock_guard<std::mutex> lock(result_mutex);
+                    result = {0, "Upload cancelled", ""};
+                    failed = true;
+                    return;
+                }
+
+                size_t index = next_chunk++;
+                if (index >= chunks.size()) {
+                    return;
+                }
+
+                ServerResponse sent = connection.postChunk(file, upload_id, chunks[index].first, chunks[index].second);
+                if (!sent.status_code) {
+                    std::lock_guard<std::mutex> lock(result_mutex);
+                    result = sent;
+                    failed = true;
+                    return;
+                }
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < connections.size(); i++) {
+            threads.emplace_back(sendLoop, std::ref(*connections[i]));
+        }
+        sendLoop(*this);
+
+        for (auto &thread: threads) {
+            thread.join();
+        }
+
+        return result;
+    }
+
+    ServerResponse postChunk(std::ifstream &file, const std::string &upload_id, unsigned long long offset,
+                             unsigned long long length) {
+        std::vector<char> data(length);
+        file.clear();
+        file.seekg(static_cast<std::streamoff>(offset));
+        if (!file.read(data.data(), static_cast<std::streamsize>(length))) {
+            return {0, "Can't read file chunk\n", ""};
+        }
+
+        std::string hash = Sha256::hashHex(data.data(), data.size());
+        Exchange exchange(*this, "POST_CHUNK", {upload_id, std::to_string(offset), std::to_string(length), hash},
+                          true);
+
+        std::string response;
+        ServerResponse status;
+        if (exchange.receive(response, status) == Exchange::Frame::STATUS) {
+            return status;
+        }
+        if (response != "READY") {
+            return {0, "Server not ready to get file: " + response + "\n", ""};
+        }
+
+        if (!exchange.sendRaw(data.data(), length)) {
+            return {0, "Error sending file data to server\n", ""};
+        }
+
+        return exchange.status();
+    }
+
+    // Cuts a local file into the chunks the server stores it as, hashing each one and the whole file.
+    static bool chunkFile(const std::string &file_path, const std::atomic<bool> *cancelled,
+                          std::vector<LocalChunk> &chunks, std::string &file_hash) {
+        std::ifstream file(file_path, std::ios::binary);
+        if (!file.is_open()) {
+            return false;
+        }
+
+        ContentChunker chunker;
+        Sha256 hasher;
+        unsigned long long offset = 0;
+        auto sink = [&](const char *data, size_t length) {
+            chunks.push_back(LocalChunk{Sha256::hashHex(data, length), offset, length});
+            offset += length;
+            return !(cancelled && *cancelled);
+        };
+
+        std::vector<char> buffer(DEDUP_READ_BUFFER);
+        while (file) {
+            file.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+            std::streamsize got = file.gcount();
+            if (got <= 0) {
+                break;
+            }
+            hasher.update(buffer.data(), got);
+            if (!chunker.feed(buffer.data(), got, sink)) {
+                return false;
+            }
+        }
+        if (file.bad() || !chunker.finish(sink)) {
+            return false;
+        }
+
+        file_hash = hasher.hexDigest();
+        return true;
+    }
+
+    // POST_DEDUP: the server gets the file's chunk list first and only the chunks it doesn't
+    // already hold are sent. Returns false when the server doesn't take the file as chunks; the
+    // caller then uploads it through POST_BEGIN.
+    bool postDedup(const std::string &file_path, const CloudFile &fileToSend, const std::string &target_dir,
+                   const std::atomic<bool> *cancelled, ServerResponse &result) {
+        std::vector<LocalChunk> chunks;
+        std::string file_hash;
+        if (!chunkFile(file_path, cancelled, chunks, file_hash)) {
+            result = cancelled && *cancelled ? ServerResponse{0, "Upload cancelled", ""}
+                                             : ServerResponse{0, "Can't read file\n", ""};
+            return true;
+        }
+
+        json metadata = fileToSend;
+        metadata["hash"] = file_hash;
+        Exchange exchange(*this, "POST_DEDUP", {metadata.dump(), target_dir}, true);
+
+        std::string response;
+        ServerResponse status;
+        if (exchange.receive(response, status) == Exchange::Frame::STATUS) {
+            result = status;
+            try {
+                json refusal = json::parse(status.response_data_json);
+                dedup_off = refusal.at("dedup").get<std::string>() == "off";
+                return false;
+            } catch (const std::exception &) {
+            }
+            return true;
+        }
+        if (response != "READY") {
+            result = {0, "Server not ready to get file: " + response + "\n", ""};
+            return true;
+        }
+
+        json recipe = json::array();
+        for (const auto &chunk: chunks) {
+            recipe.push_back({chunk.hash, chunk.length});
+        }
+        std::string frame = recipe.dump();
+        int size = frame.length();
+        if (!exchange.sendRaw(reinterpret_cast<const char *>(&size), sizeof(int)) ||
+            !exchange.sendRaw(frame.data(), frame.size())) {
+            result = {0, "Error sending chunk list to server\n", ""};
+            return true;
+        }
+
+        if (exchange.receive(response, status) == Exchange::Frame::STATUS) {
+            result = status;
+            return true;
+        }
+
+        std::vector<std::string> missing;
+        try {
+            missing = json::parse(response).at("missing").get<std::vector<std::string> >();
+        } catch (const std::exception &e) {
+            result = {0, "Invalid reply from server: " + std::string(e.what()) + "\n", ""};
+            return true;
+        }
+
+        std::unordered_map<std::string, const LocalChunk *> by_hash;
+        for (const auto &chunk: chunks) {
+            by_hash.emplace(chunk.hash, &chunk);
+        }
+
+        std::ifstream file(file_path, std::ios::binary);
+        std::vector<char> data;
+        for (const auto &hash: missing) {
+            auto chunk = by_hash.find(hash);
+            int length = 0;
+            bool readable = chunk != by_hash.end() && file.is_open();
+            if (readable && !(cancelled && *cancelled)) {
+                length = static_cast<int>(chunk->second->length);
+                data.resize(length);
+                file.seekg(static_cast<std::streamoff>(chunk->second->offset));
+                readable = static_cast<bool>(file.read(data.data(), length));
+            }
+
+            // A length of 0 tells the server the upload stops here.
+            if (!readable || length == 0) {
+                int stop = 0;
+                exchange.sendRaw(reinterpret_cast<const char *>(&stop), sizeof(int));
+                status = exchange.status();
+                result = readable ? status : ServerResponse{0, "Can't read file chunk\n", ""};
+                return true;
+            }
+
+            if (!exchange.sendRaw(reinterpret_cast<const char *>(&length), sizeof(int)) ||
+                !exchange.sendRaw(data.data(), data.size())) {
+                result = {0, "Error sending file data to server\n", ""};
+                return true;
+            }
+        }
+
+        result = exchange.status();
+        return true;
+    }
+
+    // Remote directory `relative` (may be empty) under `target_dir`, as POST_BEGIN expects it.
+    static std::string joinRemote(std::string target_dir, const std::string &relative) {
+        if (relative.empty()) {
+            return target_dir;
+        }
+        if (target_dir.empty() || target_dir.back() != '/') {
+            target_dir += '/';
+        }
+        return target_dir + relative;
+    }
+
+    // One POST_BATCH: the directories, then every file as its entry frame and bytes, coalesced into
+    // BATCH_SEND_BUFFER writes. A file that can't be read is left out and reported in `failed`;
+    // `cancelled` ends the stream early and the files already sent are kept.
+    ServerResponse postBatch(const std::vector<std::string> &dirs, const std::vector<UploadItem> &files,
+                             const std::string &target_dir, const std::atomic<bool> *cancelled,
+                             size_t &uploaded, json &failed) {
+        Exchange exchange(*this, "POST_BATCH", {target_dir}, true);
+
+        std::string response;
+        ServerResponse status;
+        if (exchange.receive(response, status) == Exchange::Frame::STATUS) {
+            return status;
+        }
+        if (response != "READY") {
+            return {0, "Server not ready to get files: " + response + "\n", ""};
+        }
+
+        std::string buffer;
+        auto appendFrame = [&buffer](const std::string &payload) {
+            int size = payload.length();
+            buffer.append(reinterpret_cast<const char *>(&size), sizeof(int));
+            buffer += payload;
+        };
+        auto flush = [&buffer, &exchange](size_t threshold) {
+            if (buffer.size() < threshold) {
+                return true;
+            }
+            bool sent = exchange.sendRaw(buffer.data(), buffer.size());
+            buffer.clear();
+            return sent;
+        };
+
+        for (const auto &dir: dirs) {
+            appendFrame(json{{"path", dir}, {"dir", true}}.dump());
+        }
+
+        std::vector<char> data;
+        for (const auto &file: files) {
+            if (cancelled && *cancelled) {
+                break;
+            }
+
+            std::ifstream stream(file.local_path, std::ios::binary);
+            std::error_code ec;
+            unsigned long long size = std::filesystem::file_size(file.local_path, ec);
+            data.resize(ec ? 0 : size);
+            if (ec || !stream.is_open() || !stream.read(data.data(), static_cast<std::streamsize>(size))) {
+                failed.push_back({{"path", file.remote_path}, {"reason", "Can't read file"}});
+                continue;
+            }
+
+            appendFrame(json{{"path", file.remote_path}, {"size", size}}.dump());
+            buffer.append(data.data(), data.size());
+            if (!flush(BATCH_SEND_BUFFER)) {
+                return {0, "Error sending file data to server\n", ""};
+            }
+        }
+
+        appendFrame("END");
+        if (!flush(0)) {
+            return {0, "Error sending file data to server\n", ""};
+        }
+
+        status = exchange.status();
+        try {
+            json result = json::parse(status.response_data_json);
+            uploaded += result.at("uploaded").get<size_t>();
+            for (const auto &entry: result.at("failed")) {
+                failed.push_back(entry);
+            }
+        } catch (const std::exception &) {
+        }
+        return status;
+    }
+
+    // A download in progress is kept in "<name>.<path key>.part", next to a ".meta" file holding the
+    // server path, size and hash it was started for; the key keeps files of the same name in
+    // different directories apart.
+    struct PartialDownload {
+        std::string path;
+        std::filesystem::path data;
+        std::filesystem::path meta;
+
+        PartialDownload(const std::filesystem::path &user_dir, const std::string &remote_path)
+            : path(std::filesystem::path(remote_path).lexically_normal().relative_path().generic_string()) {
+            std::string name = std::filesystem::path(path).filename().string();
+            data = user_dir / (name + "." + Sha256::hashHex(path.data(), path.size()).substr(0, 16) + ".part");
+            meta = data.string() + ".meta";
+        }
+
+        // Bytes already downloaded; a ".part" whose metadata is missing or for another path is
+        // dropped first.
+        unsigned long long resumeOffset() {
+            if (!std::filesystem::exists(data)) {
+                return 0;
+            }
+            try {
+                std::ifstream stream(meta);
+                json j = json::parse(stream);
+                if (j.at("path").get<std::string>() == path) {
+                    return std::filesystem::file_size(data);
+                }
+            } catch (const std::exception &) {
+            }
+            discard();
+            return 0;
+        }
+
+        // Whether the bytes downloaded so far belong to the file the server is about to send.
+        bool matches(unsigned long long size, const std::string &hash) {
+            try {
+                std::ifstream stream(meta);
+                json j = json::parse(stream);
+                return j.at("size").get<unsigned long long>() == size && j.at("hash").get<std::string>() == hash;
+            } catch (const std::exception &) {
+                return false;
+            }
+        }
+
+        bool start(unsigned long long size, const std::string &hash) {
+            std::ofstream stream(meta, std::ios::trunc);
+            stream << json{{"path", path}, {"size", size}, {"hash", hash}}.dump();
+            return stream.good();
+        }
+
+        void discard() {
+            std::error_code ec;
+            std::filesystem::remove(data, ec);
+            std::filesystem::remove(meta, ec);
+        }
+    };
+
+    // One GET. `restart` is set when a ".part" turned out to be stale and was dropped, so the
+    // caller can start again from the first byte.
+    ServerResponse download(const std::string &path, const std::atomic<bool> *cancelled, bool &restart) {
+        restart = false;
+        PartialDownload part(this->user_dir, path);
+        unsigned long long offset = part.resumeOffset();
+
+        std::vector<std::string> arguments = {path};
+        if (offset > 0) {
+            arguments.push_back(std::to_string(offset));
+        }
+        Exchange exchange(*this, "GET", arguments);
+
+        std::string obj_json;
+        ServerResponse response;
+        if (exchange.receive(obj_json, response) != Exchange::Frame::PARTIAL) {
+            if (offset > 0 && response.status_message == "Offset past end of file") {
+                part.discard();
+                restart = true;
+            }
+            return response;
+        }
+
+        try {
+            json j = json::parse(obj_json);
+            CloudFile received_file = j.get<CloudFile>();
+            std::string hash = j.value("hash", "");
+            unsigned long long to_receive_total = received_file.size - offset;
+            if (j.contains("length")) {
+                to_receive_total = j.at("length").get<unsigned long long>();
+            }
+
+            // The file changed on the server since the ".part" was started.
+            if (offset > 0 && !part.matches(received_file.size, hash)) {
+                exchange.decline();
+                exchange.status();
+                part.discard();
+                restart = true;
+                return ServerResponse{0, "File changed on the server, download restarted", ""};
+            }
+            if (offset == 0 && !part.start(received_file.size, hash)) {
+                exchange.decline();
+                exchange.status();
+                return ServerResponse{0, "Failed to create file", ""};
+            }
+
+            std::ofstream primary_stream(part.data, std::ios::binary | (offset > 0 ? std::ios::app : std::ios::trunc));
+
+            if (!primary_stream.is_open()) {
+                exchange.decline();
+                exchange.status();
+                return ServerResponse{0, "Failed to create file", ""};
+            }
+
+            if (!exchange.binary()) {
+                exchange.sendReady();
+            }
+
+            if (offset > 0) {
+                std::cout << "Resuming download from byte " << offset << "... \n";
+            } else {
+                std::cout << "Downloading file from cloud... \n";
+            }
+
+            std::string data;
+            size_t total_received = 0;
+
+            while (total_received < to_receive_total) {
+                if (cancelled && *cancelled && exchange.binary()) {
+                    exchange.cancel();
+                    primary_stream.close();
+                    return ServerResponse{0, "Download cancelled", ""};
+                }
+
+                if (!exchange.receiveData(data, to_receive_total - total_received)) {
+                    primary_stream.close();
+                    return ServerResponse{0, "Transfer interrupted, download will resume", ""};
+                }
+
+                primary_stream.write(data.data(), data.size());
+
+                total_received += data.size();
+            }
+            primary_stream.close();
+
+            // A failure reported after the data (e.g. the server's integrity check) means the bytes
+            // can't be trusted, so they are not kept for a resume.
+            ServerResponse status = exchange.status();
+            if (!status.status_code) {
+                part.discard();
+                return status;
+            }
+
+            std::filesystem::path file_path = this->user_dir / received_file.name;
+
+            if (std::filesystem::exists(file_path)) {
+                std::string base_name = file_path.stem().string();
+                std::string extension = file_path.extension().string();
+                int counter = 1;
+
+                while (std::filesystem::exists(file_path)) {
+                    counter++;
+                    std::string new_name = base_name + "(" + std::to_string(counter) + ")";
+                    new_name += extension;
+                    file_path = this->user_dir / new_name;
+                }
+            }
+
+            std::filesystem::rename(part.data, file_path);
+            std::filesystem::remove(part.meta);
+
+            std::cout << "File downloaded: " << received_file.name
+                    << " (" << offset + total_received << " bytes)\n";
+
+            return status;
+        } catch (const json::exception &e) {
+            std::cerr << e.what() << '\n';
+            return {0, "Invalid download metadata", ""};
+        } catch (const std::exception &e) {
+            std::cerr << e.what() << '\n';
+
+            return exchange.status();
+        }
+    }
+
 public:
     static ServerConnection &getInstance() {
         static ServerConnection instance;
         return instance;
     }
 
+    // Extra connection logged in with the same account (parallel upload streams, TransferManager).
+    std::unique_ptr<ServerConnection> openSibling() {
+        std::unique_ptr<ServerConnection> sibling(new ServerConnection());
+        if (!sibling->connect().status_code || !sibling->login(user, pass).status_code) {
+            return nullptr;
+        }
+        return sibling;
+    }
+
     ~ServerConnection() {
         disconnect();
     }
@@ -116,15 +1030,21 @@ public:
         }
         std::string status = "Client connected!\n";
         isConnected = true;
+        negotiate();
 
         return {1, status, ""};
     }
 
     void disconnect() {
         if (sock >= 0) {
+            shutdown(sock, SHUT_RDWR);
+            if (reader.joinable()) {
+                reader.join();
+            }
             close(sock);
             sock = -1;
             isConnected = false;
+            binary = false;
             std::cout << "Disconnected from server\n";
         }
     }
@@ -134,10 +1054,7 @@ public:
     }
 
     ServerResponse register_cmd(std::string user, std::string passwd) {
-        std::string cmd = "REGISTER " + user + " " + passwd;
-        sendToServer(cmd);
-
-        return receiveStatus();
+        return request("REGISTER", {user, passwd});
     }
 
     ServerResponse login(std::string user, std::string passwd) {
@@ -159,10 +1076,7 @@ public:
             return {0, err, ""};
         }
 
-        std::string cmd = "LOGIN " + user + " " + passwd;
-        sendToServer(cmd);
-
-        auto response = receiveStatus();
+        auto response = request("LOGIN", {user, passwd});
         if (response.status_code) {
             if (!std::filesystem::exists("./cloud_downloads")) {
                 if (std::filesystem::create_directory("./cloud_downloads")) {
@@ -186,100 +1100,36 @@ public:
     }
 
     ServerResponse logout() {
-        std::string cmd = "LOGOUT";
-        sendToServer(cmd);
-        return receiveStatus();
+        return request("LOGOUT");
     }
 
-    ServerResponse get(std::string path) {
-        std::string cmd = "GET " + path;
-        sendToServer(cmd);
-
-        int size = 0;
-        if (recv(sock, &size, sizeof(int), 0) < 0) {
-            std::cout << "Error getting payload size\n";
-            return {0, "fail", ""};
+    // Downloads into a ".part" file (see PartialDownload) and renames it when complete. If one is
+    // already there from an interrupted download of the same file, only the missing tail is
+    // requested; when the file has changed on the server since, it is downloaded again from the
+    // start. Setting `cancelled` stops a binary download between two data frames and keeps the
+    // ".part" for a later resume.
+    ServerResponse get(std::string path, const std::atomic<bool> *cancelled = nullptr) {
+        if (sock < 0 || !isConnected) {
+            std::string err = "You're not connected...\n";
+            return {0, err, ""};
         }
 
-        char buffer[BUFFER_SIZE];
-        memset(buffer, 0, BUFFER_SIZE);
-        if (recv(sock, buffer, size, 0) < 0) {
-            std::cout << "Error getting payload\n";
-            return {0, "fail", ""};
-        }
-
-        std::string obj_json(buffer);
-
-        try {
-            json j = json::parse(obj_json);
-            CloudFile received_file = j.get<CloudFile>();
-
-            std::filesystem::path down_dir = this->user_dir;
-
-            std::filesystem::path file_path = this->user_dir / received_file.name;
-
-            if (std::filesystem::exists(file_path)) {
-                std::string base_name = file_path.stem().string();
-                std::string extension = file_path.extension().string();
-                int counter = 1;
-
-                while (std::filesystem::exists(file_path)) {
-                    counter++;
-                    std::string new_name = base_name + "(" + std::to_string(counter) + ")";
-                    new_name += extension;
-                    file_path = this->user_dir / new_name;
-                }
-            }
-
-            std::ofstream primary_stream(file_path, std::ios::binary);
-
-            if (!primary_stream.is_open()) {
-                return ServerResponse{0, "Failed to create file", ""};
-            }
-
-            std::string ack = "READY";
-            size_t ack_size = ack.length();
-            send(sock, &ack_size, sizeof(int), 0);
-            send(sock, ack.c_str(), ack_size, 0);
-
-            std::cout << "Downloading file from cloud... \n";
-
-            char buffer[8192];
-            size_t total_received = 0;
-            size_t file_size = received_file.size;
-
-            while (total_received < file_size) {
-                size_t remaining = file_size - total_received;
-                size_t to_receive = (sizeof(buffer) < remaining) ? sizeof(buffer) : remaining;
-                ssize_t bytes_received = recv(sock, buffer, to_receive, 0);
-
-                if (bytes_received <= 0) {
-                    primary_stream.close();
-                    std::filesystem::remove(file_path);
-                    return ServerResponse{0, "Transfer interrupted", ""};
-                }
-
-                primary_stream.write(buffer, bytes_received);
-
-                total_received += bytes_received;
-            }
-            primary_stream.close();
-
-            std::cout << "File downloaded: " << received_file.name
-                    << " (" << total_received << " bytes)\n";
-
-            return receiveStatus();
-        } catch (const json::parse_error &e) {
-            std::cerr << e.what() << '\n';
-            return receiveStatus();
-        } catch (const std::exception &e) {
-            std::cerr << e.what() << '\n';
-
-            return receiveStatus();
+        bool restart = false;
+        ServerResponse response = download(path, cancelled, restart);
+        if (restart) {
+            response = download(path, cancelled, restart);
         }
+        return response;
     }
 
-    ServerResponse post(std::string file_path, std::string target_dir) {
+    // When the server deduplicates, a file bigger than one chunk goes through postDedup() and only
+    // content the account doesn't already have is sent. Otherwise it is uploaded through a
+    // server-side upload session: POST_BEGIN reports which chunks the server already holds (from an
+    // earlier, interrupted attempt), only the missing or changed ones are sent, then POST_COMMIT
+    // moves the file into place. `streams` are connections to send chunks on next to this one;
+    // `cancelled` stops the upload between chunks, and the session stays resumable.
+    ServerResponse post(std::string file_path, std::string target_dir, const std::atomic<bool> *cancelled = nullptr,
+                        const std::vector<ServerConnection *> &streams = {}) {
         if (sock < 0 || !isConnected) {
             std::string err = "You're not connected...\n";
             return {0, err, ""};
@@ -298,74 +1148,113 @@ public:
                 path.filename().string(),
             };
 
+            ServerResponse deduplicated;
+            if (fileToSend.size > CDC_MIN_SIZE && !dedup_off &&
+                postDedup(file_path, fileToSend, target_dir, cancelled, deduplicated)) {
+                return deduplicated;
+            }
+
             json j = fileToSend;
             std::string metadata_json = j.dump();
 
-            std::string cmd = "POST " + metadata_json + " " + target_dir;
-            sendToServer(cmd);
-
-            char buffer[BUFFER_SIZE];
-            memset(buffer, 0, BUFFER_SIZE);
-
-            int size = 0;
-            ssize_t received = recv(sock, &size, sizeof(int), 0);
-            if (received < 0) {
-                std::string err = "Error getting payload size!\n";
-                return {0, err, ""};
+            ServerResponse begin = request("POST_BEGIN", {metadata_json, target_dir});
+            if (!begin.status_code) {
+                return begin;
             }
 
-            memset(buffer, 0, BUFFER_SIZE);
-            received = recv(sock, buffer, size, 0);
-            if (received != size) {
-                std::string err = "Error getting payload!\n";
-                return {0, err, ""};
+            json status = json::parse(begin.response_data_json);
+            std::string upload_id = status.at("upload_id").get<std::string>();
+            unsigned long long chunk_size = status.at("chunk_size").get<unsigned long long>();
+            auto missing = missingChunks(fileToSend.size, chunk_size, heldRanges(file_path, status));
+            ServerResponse sent = postChunks(file_path, upload_id, missing, streams, cancelled);
+            if (!sent.status_code) {
+                return sent;
             }
 
-            std::string response(buffer);
-            if (response != "READY") {
-                std::string err = "Server not ready to get file: " + response;
-                err += '\n';
-                return {0, err, ""};
-            }
+            return request("POST_COMMIT", {upload_id});
+        } catch (const std::exception &e) {
+            std::string err = "Error: ";
+            err += e.what();
+            err += '\n';
+            return {0, err, ""};
+        }
+    }
 
-            std::ifstream file(file_path, std::ios::binary);
-            if (!file.is_open()) {
-                std::string err = "Can't open file for reading\n";
-                return {0, err, ""};
+    // Uploads many files (a multi-selection or a folder) into `target_dir`. `dirs` are created first
+    // (a folder's empty subdirectories included). Files up to BATCH_FILE_MAX travel in POST_BATCH
+    // commands of at most BATCH_MAX_FILES files / BATCH_MAX_BYTES each, so thousands of small files
+    // cost a handful of round trips and transactions; bigger ones go through post() as usual.
+    ServerResponse post_batch(const std::vector<std::string> &dirs, const std::vector<UploadItem> &files,
+                              const std::string &target_dir, const std::atomic<bool> *cancelled = nullptr,
+                              const std::vector<ServerConnection *> &streams = {}) {
+        if (sock < 0 || !isConnected) {
+            std::string err = "You're not connected...\n";
+            return {0, err, ""};
+        }
+
+        std::vector<std::vector<UploadItem> > batches(1);
+        std::vector<UploadItem> large_files;
+        unsigned long long batch_bytes = 0;
+        for (const auto &file: files) {
+            std::error_code ec;
+            unsigned long long size = std::filesystem::file_size(file.local_path, ec);
+            if (!ec && size > BATCH_FILE_MAX) {
+                large_files.push_back(file);
+                continue;
             }
 
-            char file_buffer[BUFFER_SIZE];
-            size_t total_sent = 0;
+            if (batches.back().size() >= BATCH_MAX_FILES || batch_bytes + size > BATCH_MAX_BYTES) {
+                batches.emplace_back();
+                batch_bytes = 0;
+            }
+            batches.back().push_back(file);
+            batch_bytes += size;
+        }
 
-            while (file.read(file_buffer, sizeof(file_buffer)) || file.gcount() > 0) {
-                size_t bytes_to_send = file.gcount();
-                ssize_t sent = send(sock, file_buffer, bytes_to_send, 0);
+        size_t uploaded = 0;
+        json failed = json::array();
 
-                if (sent < 0) {
-                    std::string err = "Error sending file data to server\n";
-                    file.close();
-                    return {0, err, ""};
-                }
+        // A reply without the result JSON means the command itself failed (not connected, no
+        // target directory, connection lost), so there is no point in sending more.
+        ServerResponse error{1, "", ""};
+        for (size_t i = 0; i < batches.size() && error.status_code; i++) {
+            if (batches[i].empty() && (i > 0 || dirs.empty())) {
+                continue;
+            }
 
-                total_sent += sent;
+            ServerResponse sent = postBatch(i == 0 ? dirs : std::vector<std::string>{}, batches[i], target_dir,
+                                            cancelled, uploaded, failed);
+            if (!sent.status_code && sent.response_data_json.empty()) {
+                error = sent;
             }
+        }
 
-            file.close();
+        for (size_t i = 0; i < large_files.size() && error.status_code && !(cancelled && *cancelled); i++) {
+            std::string parent = std::filesystem::path(large_files[i].remote_path).parent_path().generic_string();
+            ServerResponse sent = post(large_files[i].local_path, joinRemote(target_dir, parent), cancelled, streams);
+            if (sent.status_code) {
+                uploaded++;
+            } else {
+                failed.push_back({{"path", large_files[i].remote_path}, {"reason", sent.status_message}});
+            }
+        }
 
-            return receiveStatus();
-        } catch (const std::exception &e) {
-            std::string err = "Error: ";
-            err += e.what();
-            err += '\n';
-            return {0, err, ""};
+        json result{{"uploaded", uploaded}, {"failed", failed}};
+        if (!error.status_code) {
+            return {0, error.status_message, result.dump()};
         }
+        if (cancelled && *cancelled) {
+            return {0, "Upload cancelled after " + std::to_string(uploaded) + " files", result.dump()};
+        }
+        if (!failed.empty()) {
+            return {0, "Uploaded " + std::to_string(uploaded) + " files, " + std::to_string(failed.size()) +
+                       " failed", result.dump()};
+        }
+        return {1, "Successfully uploaded " + std::to_string(uploaded) + " files", result.dump()};
     }
 
     ServerResponse delete_file(std::string path) {
-        std::string cmd = "DELETE " + path;
-        sendToServer(cmd);
-
-        auto status = receiveStatus();
+        auto status = request("DELETE", {path});
         if (!status.status_code) {
             std::string err = "DELETE command failed\n";
             return {0, err, ""};
@@ -375,10 +1264,7 @@ public:
     }
 
     ServerResponse list() {
-        std::string cmd = "LIST";
-        sendToServer(cmd);
-
-        auto status = receiveStatus();
+        auto status = request("LIST");
 
         if (!status.status_code) {
             std::string err = "LIST command failed\n";
@@ -391,6 +1277,27 @@ public:
         return {1, "Updated file tree successfully", json_str};
     }
 
+    // One page of a single directory level; pass the returned "cursor" back for the next page.
+    ServerResponse list_dir(const std::string &path, const std::string &cursor = "",
+                            unsigned long long limit = LIST_PAGE_SIZE) {
+        auto status = request("LIST", {path, cursor.empty() ? "-" : cursor, std::to_string(limit)});
+        if (!status.status_code) {
+            return {0, "LIST command failed\n", ""};
+        }
+
+        return {1, "Listed directory successfully", status.response_data_json};
+    }
+
+    // Changes made since `version` of an earlier LIST / LIST_SINCE (see ListSinceCommand).
+    ServerResponse list_since(unsigned long long version) {
+        auto status = request("LIST_SINCE", {std::to_string(version)});
+        if (!status.status_code) {
+            return {0, "LIST_SINCE command failed\n", ""};
+        }
+
+        return {1, "Fetched file tree changes", status.response_data_json};
+    }
+
     ServerResponse create_dir(std::string name, std::string target_dir) {
         if (trimString(name).empty()) {
             std::string err = "Invalid name\n";
@@ -402,10 +1309,7 @@ public:
             return {0, err, ""};
         }
 
-        std::string cmd = "CREATEDIR " + name + " " + target_dir;
-        sendToServer(cmd);
-
-        return receiveStatus();
+        return request("CREATEDIR", {name, target_dir});
     }
 };
 
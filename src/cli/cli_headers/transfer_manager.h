@@ -0,0 +1,269 @@
+#ifndef CPP_PERSONAL_CLOUD_TRANSFER_MANAGER_H
+#define CPP_PERSONAL_CLOUD_TRANSFER_MANAGER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "server_connection.h"
+
+#define TRANSFER_WORKERS 4
+#define TRANSFER_CONNECTIONS 3
+
+enum class TransferPriority {
+    METADATA,
+    BULK,
+};
+
+// What a job gets to work with: the connection it was given, the connections transfers run on (an
+// upload spreads its chunks over them) and its cancellation flag.
+struct TransferContext {
+    ServerConnection &connection;
+    std::vector<ServerConnection *> pool;
+    const std::atomic<bool> &cancelled;
+};
+
+// Runs the client's network work off the UI thread: a fixed set of TRANSFER_WORKERS threads and
+// a pool of connections logged in with the user's account, the ServerConnection singleton plus
+// TRANSFER_CONNECTIONS - 1 siblings opened at login.
+//
+// Metadata jobs (listings, delete, create dir, logout) always run on the singleton and are taken
+// off the queue before any transfer. Transfers get the siblings in turn, never the singleton
+// unless no sibling could be opened, and never occupy more than TRANSFER_WORKERS - 1 workers, so
+// a listing waits neither for a worker nor behind a transfer's frames.
+//
+// A queued job can be cancelled before it starts; a running one sees its flag set and stops at its
+// next checkpoint (between download frames or upload chunks).
+class TransferManager {
+public:
+    using Job = std::function<void(const TransferContext &)>;
+    using Listener = std::function<void(size_t)>;
+
+private:
+    struct Entry {
+        unsigned long long id;
+        Job run;
+        std::shared_ptr<std::atomic<bool> > cancelled;
+    };
+
+    struct Running {
+        std::shared_ptr<std::atomic<bool> > cancelled;
+        bool bulk;
+    };
+
+    ServerConnection &primary;
+    std::vector<std::unique_ptr<ServerConnection> > siblings;
+    size_t next_connection = 0;
+
+    std::deque<Entry> metadata_jobs;
+    std::deque<Entry> bulk_jobs;
+    std::unordered_map<unsigned long long, Running> running;
+    size_t bulk_running = 0;
+    unsigned long long next_id = 0;
+    Listener listener;
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::condition_variable bulk_done;
+    bool stopping = false;
+
+    TransferManager() : primary(ServerConnection::getInstance()) {
+        for (int i = 0; i < TRANSFER_WORKERS; i++) {
+            workers.emplace_back(&TransferManager::work, this);
+        }
+    }
+
+    // Connections for transfers: the siblings, or the singleton when there are none.
+    std::vector<ServerConnection *> poolLocked() {
+        std::vector<ServerConnection *> pool;
+        for (auto &sibling: siblings) {
+            pool.push_back(sibling.get());
+        }
+        if (pool.empty()) {
+            pool.push_back(&primary);
+        }
+        return pool;
+    }
+
+    // Transfers queued or running, reported to the listener whenever it changes. Called with the
+    // mutex held; the listener must not call back into the manager.
+    void notifyLocked() {
+        if (listener) {
+            listener(bulk_jobs.size() + bulk_running);
+        }
+    }
+
+    void cancelTransfersLocked() {
+        bulk_jobs.clear();
+        for (auto &entry: running) {
+            if (entry.second.bulk) {
+                *entry.second.cancelled = true;
+            }
+        }
+        notifyLocked();
+    }
+
+    void work() {
+        while (true) {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this]() {
+                return stopping || !metadata_jobs.empty() ||
+                       (!bulk_jobs.empty() && bulk_running < TRANSFER_WORKERS - 1);
+            });
+            if (stopping) {
+                return;
+            }
+
+            bool bulk = metadata_jobs.empty();
+            std::deque<Entry> &queue = bulk ? bulk_jobs : metadata_jobs;
+            Entry entry = std::move(queue.front());
+            queue.pop_front();
+
+            std::vector<ServerConnection *> pool = poolLocked();
+            ServerConnection *connection = &primary;
+            if (bulk) {
+                connection = pool[next_connection++ % pool.size()];
+                bulk_running++;
+            }
+            running.emplace(entry.id, Running{entry.cancelled, bulk});
+            lock.unlock();
+
+            TransferContext context{*connection, pool, *entry.cancelled};
+            try {
+                entry.run(context);
+            } catch (const std::exception &e) {
+                std::cerr << "Transfer failed: " << e.what() << '\n';
+            }
+
+            lock.lock();
+            running.erase(entry.id);
+            if (bulk) {
+                bulk_running--;
+                notifyLocked();
+                bulk_done.notify_all();
+                cv.notify_one();
+            }
+        }
+    }
+
+public:
+    static TransferManager &getInstance() {
+        static TransferManager instance;
+        return instance;
+    }
+
+    TransferManager(const TransferManager &) = delete;
+
+    TransferManager &operator=(const TransferManager &) = delete;
+
+    ~TransferManager() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            for (auto &entry: running) {
+                *entry.second.cancelled = true;
+            }
+        }
+        cv.notify_all();
+
+        // Workers blocked on the network return once their sockets are shut down.
+        primary.disconnect();
+        for (auto &sibling: siblings) {
+            sibling->disconnect();
+        }
+        for (auto &worker: workers) {
+            worker.join();
+        }
+    }
+
+    void setListener(Listener callback) {
+        std::lock_guard<std::mutex> lock(mutex);
+        listener = std::move(callback);
+    }
+
+    // Opens the sibling connections after the singleton logged in. Fewer siblings than asked for
+    // only means fewer parallel transfers.
+    void openPool() {
+        std::vector<std::unique_ptr<ServerConnection> > opened;
+        for (int i = 1; i < TRANSFER_CONNECTIONS; i++) {
+            auto sibling = primary.openSibling();
+            if (!sibling) {
+                break;
+            }
+            opened.push_back(std::move(sibling));
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto &sibling: opened) {
+            siblings.push_back(std::move(sibling));
+        }
+    }
+
+    // Cancels every transfer and closes the siblings once the running ones have stopped. Metadata
+    // jobs are left alone, so this can be called from one (logout).
+    void closePool() {
+        std::vector<std::unique_ptr<ServerConnection> > closing;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cancelTransfersLocked();
+            bulk_done.wait(lock, [this]() {
+                return bulk_running == 0;
+            });
+            closing.swap(siblings);
+        }
+    }
+
+    unsigned long long submit(TransferPriority priority, Job job) {
+        unsigned long long id;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            id = ++next_id;
+            Entry entry{id, std::move(job), std::make_shared<std::atomic<bool> >(false)};
+            if (priority == TransferPriority::BULK) {
+                bulk_jobs.push_back(std::move(entry));
+                notifyLocked();
+            } else {
+                metadata_jobs.push_back(std::move(entry));
+            }
+        }
+        cv.notify_one();
+        return id;
+    }
+
+    // False when the job already finished.
+    bool cancel(unsigned long long id) {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        for (auto *queue: {&metadata_jobs, &bulk_jobs}) {
+            for (auto it = queue->begin(); it != queue->end(); ++it) {
+                if (it->id == id) {
+                    queue->erase(it);
+                    notifyLocked();
+                    return true;
+                }
+            }
+        }
+
+        auto found = running.find(id);
+        if (found == running.end()) {
+            return false;
+        }
+        *found->second.cancelled = true;
+        return true;
+    }
+
+    // Drops the queued transfers and stops the running ones.
+    void cancelTransfers() {
+        std::lock_guard<std::mutex> lock(mutex);
+        cancelTransfersLocked();
+    }
+};
+
+#endif //CPP_PERSONAL_CLOUD_TRANSFER_MANAGER_H
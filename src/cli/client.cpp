@@ -6,11 +6,13 @@
 #include <nlohmann/json.hpp>
 #include <chrono>
 
+#include "cloud_change.h"
 #include "cloud_dir.h"
 #include "main_window.h"
 #include "portable-file-dialogs.h"
 #include "cli_headers/file_explorer_manager.h"
 #include "cli_headers/server_connection.h"
+#include "cli_headers/transfer_manager.h"
 
 #define BUFFER_SIZE 8192
 
@@ -70,25 +72,128 @@ void refresh_explorer(slint::ComponentHandle<MainWindow> ui_handle, std::shared_
     });
 }
 
-void refresh_file_list(slint::ComponentHandle<MainWindow> ui_handle, std::shared_ptr<FileExplorerManager> manager) {
-    std::thread network_thread([ui_handle, manager]() {
-        ServerResponse response = ServerConnection::getInstance().list();
+// Fetches every page of one directory level as a metadata job and hands it to the explorer on
+// the UI thread. With `enter` set the explorer then moves into the directory; `reset` starts a new
+// lazy tree first (login, or when the change journal can't bring the old one up to date).
+void load_dir(slint::ComponentHandle<MainWindow> ui_handle, std::shared_ptr<FileExplorerManager> manager,
+              std::string path, bool enter, bool reset = false) {
+    TransferManager::getInstance().submit(TransferPriority::METADATA, [ui_handle, manager, path, enter, reset](
+                                          const TransferContext &context) {
+        auto &server = context.connection;
+        std::vector<CloudFile> files;
+        std::vector<CloudDirSummary> subdirs;
+        unsigned long long version = 0;
+        std::string cursor;
 
-        if (response.status_code != 1)
+        try {
+            do {
+                ServerResponse response = server.list_dir(path, cursor);
+                if (response.status_code != 1)
+                    return;
+
+                json j = json::parse(response.response_data_json);
+                auto page_files = j.at("files").get<std::vector<CloudFile> >();
+                auto page_subdirs = j.at("subdirs").get<std::vector<CloudDirSummary> >();
+                files.insert(files.end(), page_files.begin(), page_files.end());
+                subdirs.insert(subdirs.end(), page_subdirs.begin(), page_subdirs.end());
+
+                if (cursor.empty()) {
+                    version = j.at("version").get<unsigned long long>();
+                }
+                cursor = j.at("cursor").get<std::string>();
+            } while (!cursor.empty());
+        } catch (...) {
             return;
+        }
+
+        slint::invoke_from_event_loop([ui_handle, manager, path, enter, reset, files, subdirs, version]() {
+            if (reset) {
+                manager->reset_lazy();
+            }
+            manager->load_dir(path, files, subdirs, version);
+            if (enter) {
+                manager->navigate_to(path);
+            }
+            refresh_explorer(ui_handle, manager);
+        });
+    });
+}
 
+// Brings the explorer up to date with the changes since its version, applied in place. The tree
+// is only touched on the UI thread, which also reads it.
+void refresh_file_list(slint::ComponentHandle<MainWindow> ui_handle, std::shared_ptr<FileExplorerManager> manager) {
+    if (!manager->is_synced()) {
+        load_dir(ui_handle, manager, "/", false, true);
+        return;
+    }
+
+    unsigned long long since = manager->get_version();
+
+    TransferManager::getInstance().submit(TransferPriority::METADATA, [ui_handle, manager, since](
+                                          const TransferContext &context) {
         try {
+            ServerResponse response = context.connection.list_since(since);
+            if (response.status_code != 1)
+                return;
+
             json j = json::parse(response.response_data_json);
-            CloudDir root = j.get<CloudDir>();
+            if (j.at("reset").get<bool>()) {
+                slint::invoke_from_event_loop([ui_handle, manager]() {
+                    load_dir(ui_handle, manager, "/", false, true);
+                });
+                return;
+            }
 
-            manager->update_root(root);
-            refresh_explorer(ui_handle, manager);
+            auto changes = j.at("changes").get<std::vector<CloudChange> >();
+            unsigned long long version = j.at("version").get<unsigned long long>();
+
+            slint::invoke_from_event_loop([ui_handle, manager, changes, version]() {
+                manager->apply_changes(changes, version);
+                refresh_explorer(ui_handle, manager);
+            });
         } catch (...) {
             return;
         }
     });
+}
+
+void show_toast(bool succ, const std::string &msg, slint::ComponentHandle<MainWindow> ui_handle);
+
+// Uploads `files` (or everything under the local `folder`, which keeps its name on the server) into
+// curr_dir as one transfer, with a single refresh of the listing at the end.
+void upload_batch(slint::ComponentHandle<MainWindow> ui_handle, std::shared_ptr<FileExplorerManager> manager,
+                  std::string curr_dir, std::string folder, std::vector<UploadItem> files) {
+    TransferManager::getInstance().submit(TransferPriority::BULK, [ui_handle, manager, curr_dir, folder, files](
+                                          const TransferContext &context) mutable {
+        std::vector<std::string> dirs;
+        if (!folder.empty()) {
+            std::filesystem::path root(folder);
+            std::string root_name = root.filename().string();
+            if (root_name.empty()) {
+                root_name = root.parent_path().filename().string();
+            }
+            dirs.push_back(root_name);
+
+            std::error_code ec;
+            for (auto it = std::filesystem::recursive_directory_iterator(root, ec);
+                 !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+                std::string remote = root_name + "/" + it->path().lexically_relative(root).generic_string();
+                if (it->is_directory()) {
+                    dirs.push_back(remote);
+                } else if (it->is_regular_file()) {
+                    files.push_back({it->path().string(), remote});
+                }
+            }
+        }
 
-    network_thread.detach();
+        ServerResponse response = context.connection.post_batch(dirs, files, curr_dir, &context.cancelled,
+                                                                context.pool);
+
+        slint::invoke_from_event_loop([ui_handle, response, manager]() {
+            show_toast(response.status_code == 1, response.status_message, ui_handle);
+            refresh_file_list(ui_handle, manager);
+        });
+    });
 }
 
 void show_toast(bool succ, const std::string &msg, slint::ComponentHandle<MainWindow> ui_handle) {
@@ -122,13 +227,26 @@ int main(int argc, char *argv[]) {
         CloudDir{"root", "/", {}, {}}
     );
 
+    auto &transfers = TransferManager::getInstance();
+    transfers.setListener([ui_handle](size_t active) {
+        slint::invoke_from_event_loop([ui_handle, active]() {
+            if (auto *ui = ui_handle.operator->()) {
+                ui->set_active_transfers(static_cast<int>(active));
+            }
+        });
+    });
+
+    ui->on_cancel_transfers([]() {
+        TransferManager::getInstance().cancelTransfers();
+    });
+
     ui->on_get([ui_handle](slint::SharedString path) {
-        std::thread network_thread([path, ui_handle]() {
+        TransferManager::getInstance().submit(TransferPriority::BULK, [path, ui_handle](
+                                              const TransferContext &context) {
             std::string process_path = path.data();
             process_path.erase(0, 1);
 
-            ServerResponse response =
-                    ServerConnection::getInstance().get(process_path);
+            ServerResponse response = context.connection.get(process_path, &context.cancelled);
 
             slint::invoke_from_event_loop([ui_handle, response] {
                 if (response.status_code == 1) {
@@ -138,24 +256,32 @@ int main(int argc, char *argv[]) {
                 }
             });
         });
-
-        network_thread.detach();
     });
 
     ui->on_post([ui_handle, explorer_manager]() {
-        auto selection = pfd::open_file("Select file to upload").result();
+        auto selection = pfd::open_file("Select files to upload", "", {"All Files", "*"},
+                                        pfd::opt::multiselect).result();
 
         if (selection.empty())
             return;
 
-        std::filesystem::path path = selection[0];
         std::string curr_dir = explorer_manager->get_curr_path();
 
+        if (selection.size() > 1) {
+            std::vector<UploadItem> files;
+            for (const auto &selected: selection) {
+                files.push_back({selected, std::filesystem::path(selected).filename().string()});
+            }
+            upload_batch(ui_handle, explorer_manager, curr_dir, "", std::move(files));
+            return;
+        }
 
-        std::thread network_thread([path, curr_dir, ui_handle, explorer_manager]() {
-            ServerResponse response =
-                    ServerConnection::getInstance().post(path.string(), curr_dir);
+        std::filesystem::path path = selection[0];
 
+        TransferManager::getInstance().submit(TransferPriority::BULK, [path, curr_dir, ui_handle, explorer_manager](
+                                              const TransferContext &context) {
+            ServerResponse response =
+                    context.connection.post(path.string(), curr_dir, &context.cancelled, context.pool);
 
             slint::invoke_from_event_loop([ui_handle, response, explorer_manager]() {
                 if (response.status_code == 1) {
@@ -166,25 +292,41 @@ int main(int argc, char *argv[]) {
                 }
             });
         });
+    });
+
+    ui->on_post_folder([ui_handle, explorer_manager]() {
+        std::string folder = pfd::select_folder("Select folder to upload").result();
+
+        if (folder.empty())
+            return;
 
-        network_thread.detach();
+        upload_batch(ui_handle, explorer_manager, explorer_manager->get_curr_path(), folder, {});
     });
 
     ui->on_navigate_back([ui_handle, explorer_manager]() {
         if (explorer_manager->navigate_back()) {
-            refresh_explorer(ui_handle, explorer_manager);
+            std::string path = explorer_manager->get_curr_path();
+            if (explorer_manager->is_loaded(path)) {
+                refresh_explorer(ui_handle, explorer_manager);
+            } else {
+                load_dir(ui_handle, explorer_manager, path, false);
+            }
         }
     });
 
     ui->on_navigate_to_dir([ui_handle, explorer_manager](slint::SharedString path) {
-        if (explorer_manager->navigate_to(path.data())) {
+        if (!explorer_manager->is_loaded(path.data())) {
+            load_dir(ui_handle, explorer_manager, path.data(), true);
+        } else if (explorer_manager->navigate_to(path.data())) {
             refresh_explorer(ui_handle, explorer_manager);
         }
     });
 
     ui->on_logout([ui_handle]() {
-        std::thread network_thread([ui_handle]() {
-            ServerResponse response = ServerConnection::getInstance().logout();
+        TransferManager::getInstance().submit(TransferPriority::METADATA, [ui_handle](
+                                              const TransferContext &context) {
+            TransferManager::getInstance().closePool();
+            ServerResponse response = context.connection.logout();
 
             slint::invoke_from_event_loop([ui_handle, response]() {
                 if (auto *ui = ui_handle.operator->()) {
@@ -192,13 +334,15 @@ int main(int argc, char *argv[]) {
                 }
             });
         });
-
-        network_thread.detach();
     });
 
     ui->on_try_login([ui_handle, explorer_manager](slint::SharedString name, slint::SharedString passwd) {
-        std::thread network_thread([ui_handle, name, passwd, explorer_manager]() {
-            ServerResponse response = ServerConnection::getInstance().login(name.data(), passwd.data());
+        TransferManager::getInstance().submit(TransferPriority::METADATA, [ui_handle, name, passwd, explorer_manager](
+                                              const TransferContext &context) {
+            ServerResponse response = context.connection.login(name.data(), passwd.data());
+            if (response.status_code) {
+                TransferManager::getInstance().openPool();
+            }
 
             slint::invoke_from_event_loop([ui_handle, response, explorer_manager]() {
                 auto *ui = ui_handle.operator->();
@@ -207,20 +351,19 @@ int main(int argc, char *argv[]) {
                 if (response.status_code) {
                     show_toast(true, response.status_message, ui_handle);
                     ui->set_is_logged(true);
-                    refresh_file_list(ui_handle, explorer_manager);
+                    load_dir(ui_handle, explorer_manager, "/", false, true);
                 } else {
                     ui->set_is_logged(false);
                     show_toast(false, response.status_message, ui_handle);
                 }
             });
         });
-
-        network_thread.detach();
     });
 
     ui->on_register([ui_handle, explorer_manager](slint::SharedString name, slint::SharedString passwd) {
-        std::thread network_thread([ui_handle, name, passwd, explorer_manager]() {
-            ServerResponse response = ServerConnection::getInstance().register_cmd(name.data(), passwd.data());
+        TransferManager::getInstance().submit(TransferPriority::METADATA, [ui_handle, name, passwd, explorer_manager](
+                                              const TransferContext &context) {
+            ServerResponse response = context.connection.register_cmd(name.data(), passwd.data());
 
 
             slint::invoke_from_event_loop([ui_handle, response, explorer_manager]() {
@@ -234,17 +377,15 @@ int main(int argc, char *argv[]) {
                 }
             });
         });
-
-        network_thread.detach();
     });
 
     ui->on_delete([ui_handle, explorer_manager](slint::SharedString path) {
-        std::thread network_thread([path, ui_handle, explorer_manager]() {
+        TransferManager::getInstance().submit(TransferPriority::METADATA, [path, ui_handle, explorer_manager](
+                                              const TransferContext &context) {
             std::string process_path = path.data();
             process_path.erase(0, 1);
 
-            ServerResponse response =
-                    ServerConnection::getInstance().delete_file(process_path);
+            ServerResponse response = context.connection.delete_file(process_path);
 
             slint::invoke_from_event_loop([ui_handle, response, explorer_manager]() {
                 if (response.status_code == 1) {
@@ -252,20 +393,23 @@ int main(int argc, char *argv[]) {
                 }
             });
         });
-
-        network_thread.detach();
     });
 
     ui->on_create_dir([ui_handle, explorer_manager](slint::SharedString name) {
-        auto response = ServerConnection::getInstance().create_dir(name.data(), explorer_manager->get_curr_path());
+        std::string curr_dir = explorer_manager->get_curr_path();
 
-        slint::invoke_from_event_loop([ui_handle, explorer_manager, response] {
-            if (response.status_code == 1) {
-                show_toast(true, response.status_message, ui_handle);
-                refresh_file_list(ui_handle, explorer_manager);
-            } else {
-                show_toast(false, response.status_message, ui_handle);
-            }
+        TransferManager::getInstance().submit(TransferPriority::METADATA, [name, curr_dir, ui_handle, explorer_manager](
+                                              const TransferContext &context) {
+            auto response = context.connection.create_dir(name.data(), curr_dir);
+
+            slint::invoke_from_event_loop([ui_handle, explorer_manager, response] {
+                if (response.status_code == 1) {
+                    show_toast(true, response.status_message, ui_handle);
+                    refresh_file_list(ui_handle, explorer_manager);
+                } else {
+                    show_toast(false, response.status_message, ui_handle);
+                }
+            });
         });
     });
 
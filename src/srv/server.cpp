@@ -2,18 +2,28 @@
 #include <unistd.h>
 #include <iostream>
 #include <arpa/inet.h>
+#include <csignal>
 #include <thread>
 
-#include "sv_headers/client_worker.h"
+#include "sv_headers/chunk_store.h"
+#include "sv_headers/event_loop.h"
+#include "sv_headers/integrity_scrubber.h"
+#include "sv_headers/metadata_index.h"
+#include "sv_headers/pack_store.h"
 #include "sv_headers/redundancy_manager.h"
+#include "sv_headers/server_config.h"
+#include "sv_headers/upload_manager.h"
+#include "sv_headers/worker_pool.h"
 
 #define PORT 8005
-#define BACKLOG 30
+#define BACKLOG 512
 
 int main() {
-    const int serverFd = socket(AF_INET, SOCK_STREAM, 0);
+    signal(SIGPIPE, SIG_IGN);
 
-    if (serverFd == 0) {
+    const int serverFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (serverFd < 0) {
         std::cout << "Error creating socket\n";
         return -1;
     }
@@ -28,8 +38,6 @@ int main() {
     serverAddr.sin_addr.s_addr = INADDR_ANY;
     serverAddr.sin_port = htons(PORT);
 
-    socklen_t serverLen = sizeof(serverAddr);
-
     if (bind(serverFd, reinterpret_cast<sockaddr *>(&serverAddr), sizeof(serverAddr))) {
         std::cerr << "Error binding\n";
 
@@ -49,24 +57,36 @@ int main() {
 
     std::filesystem::create_directory("./storage");
     RedundancyManager::initDatabase();
+    UploadManager::initDatabase();
+    MetadataIndex::initDatabase();
+    PackStore::initDatabase();
+    ChunkStore::initDatabase();
     DBManager::initUsers();
 
-    while (true) {
-        int new_sock = accept(serverFd, reinterpret_cast<sockaddr *>(&serverAddr), &serverLen);
-        if (new_sock < 0) {
-            std::cout << "Error connecting\n";
+    const ServerConfig &config = ServerConfig::instance();
+    WorkerPool pool(config.worker_threads, config.worker_queue_depth, config.user_queue_depth);
 
-            close(serverFd);
-            return -1;
-        }
+    unsigned int loop_count = std::thread::hardware_concurrency();
+    if (loop_count == 0) {
+        loop_count = 1;
+    }
 
-        std::cout << "Client connected\n";
+    std::vector<std::unique_ptr<EventLoop> > loops;
+    for (unsigned int i = 0; i < loop_count; i++) {
+        loops.push_back(std::make_unique<EventLoop>(serverFd, pool));
+        loops.back()->start();
+    }
 
-        ClientWorker worker(new_sock);
+    std::cout << "Started " << loop_count << " event loops, " << config.worker_threads << " workers\n";
+    IntegrityScrubber scrubber(pool);
+    if (config.scrub_enabled) {
+        scrubber.start();
+    }
 
-        std::thread client_thread(&ClientWorker::run, std::move(worker));
+    std::cout << "AES kernel: " << AesEngine::kernelName() << ", SHA-256 kernel: " << Sha256::kernelName() << "\n";
 
-        client_thread.detach();
+    for (auto &loop: loops) {
+        loop->join();
     }
 
     close(serverFd);
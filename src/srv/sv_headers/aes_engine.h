@@ -0,0 +1,364 @@
+#ifndef CPP_PERSONAL_CLOUD_AES_ENGINE_H
+#define CPP_PERSONAL_CLOUD_AES_ENGINE_H
+
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define AES_ENGINE_X86 1
+#endif
+
+#define AES_ENGINE_BLOCK 16
+#define AES_ENGINE_ROUNDS 10
+
+// AES-128 in CTR mode, byte-for-byte compatible with tiny-AES (AES_CTR_xcrypt_buffer built with
+// AES128): the counter is the 16-byte IV read as one big-endian 128-bit number.
+//
+// Three kernels, picked once at runtime from the CPU flags:
+//   - VAES + AVX2: 16 blocks per iteration, two blocks per 256-bit register;
+//   - AES-NI: 8 blocks per iteration, interleaved to hide the aesenc latency;
+//   - portable T-table fallback for other CPUs.
+class AesEngine {
+public:
+    struct Schedule {
+        alignas(16) uint8_t round_keys[AES_ENGINE_BLOCK * (AES_ENGINE_ROUNDS + 1)];
+    };
+
+    // XORs `blocks` whole blocks with the keystream for counters (hi:lo), (hi:lo)+1, ...
+    using Kernel = void (*)(const Schedule &schedule, uint64_t hi, uint64_t lo, uint8_t *data, size_t blocks);
+
+private:
+    struct Tables {
+        uint8_t sbox[256];
+        uint32_t te[4][256];
+
+        Tables() {
+            uint8_t exp[256];
+            uint8_t log[256] = {0};
+            uint8_t x = 1;
+            for (int i = 0; i < 255; i++) {
+                exp[i] = x;
+                log[x] = static_cast<uint8_t>(i);
+                x = static_cast<uint8_t>(x ^ xtime(x));
+            }
+            exp[255] = exp[0];
+
+            for (int i = 0; i < 256; i++) {
+                uint8_t inverse = i == 0 ? 0 : exp[(255 - log[i]) % 255];
+                uint8_t s = inverse;
+                for (int shift = 1; shift <= 4; shift++) {
+                    s ^= static_cast<uint8_t>((inverse << shift) | (inverse >> (8 - shift)));
+                }
+                sbox[i] = static_cast<uint8_t>(s ^ 0x63);
+            }
+
+            for (int i = 0; i < 256; i++) {
+                uint8_t s = sbox[i];
+                uint8_t s2 = xtime(s);
+                uint8_t s3 = static_cast<uint8_t>(s2 ^ s);
+                uint32_t word = (static_cast<uint32_t>(s2) << 24) | (static_cast<uint32_t>(s) << 16) |
+                                (static_cast<uint32_t>(s) << 8) | s3;
+                for (int t = 0; t < 4; t++) {
+                    te[t][i] = word;
+                    word = (word >> 8) | (word << 24);
+                }
+            }
+        }
+    };
+
+    static uint8_t xtime(uint8_t x) {
+        return static_cast<uint8_t>((x << 1) ^ ((x >> 7) * 0x1b));
+    }
+
+    static const Tables &tables() {
+        static const Tables instance;
+        return instance;
+    }
+
+    static uint32_t loadBigEndian32(const uint8_t *p) {
+        return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) |
+               (static_cast<uint32_t>(p[2]) << 8) | p[3];
+    }
+
+    static uint64_t loadBigEndian64(const uint8_t *p) {
+        return (static_cast<uint64_t>(loadBigEndian32(p)) << 32) | loadBigEndian32(p + 4);
+    }
+
+    static void storeBigEndian32(uint8_t *p, uint32_t v) {
+        p[0] = static_cast<uint8_t>(v >> 24);
+        p[1] = static_cast<uint8_t>(v >> 16);
+        p[2] = static_cast<uint8_t>(v >> 8);
+        p[3] = static_cast<uint8_t>(v);
+    }
+
+    static void encryptBlockPortable(const Schedule &schedule, const uint8_t in[16], uint8_t out[16]) {
+        const Tables &t = tables();
+        const uint8_t *rk = schedule.round_keys;
+
+        uint32_t s0 = loadBigEndian32(in) ^ loadBigEndian32(rk);
+        uint32_t s1 = loadBigEndian32(in + 4) ^ loadBigEndian32(rk + 4);
+        uint32_t s2 = loadBigEndian32(in + 8) ^ loadBigEndian32(rk + 8);
+        uint32_t s3 = loadBigEndian32(in + 12) ^ loadBigEndian32(rk + 12);
+
+        for (int round = 1; round < AES_ENGINE_ROUNDS; round++) {
+            rk += AES_ENGINE_BLOCK;
+            uint32_t t0 = t.te[0][s0 >> 24] ^ t.te[1][(s1 >> 16) & 0xff] ^ t.te[2][(s2 >> 8) & 0xff] ^
+                          t.te[3][s3 & 0xff] ^ loadBigEndian32(rk);
+            uint32_t t1 = t.te[0][s1 >> 24] ^ t.te[1][(s2 >> 16) & 0xff] ^ t.te[2][(s3 >> 8) & 0xff] ^
+                          t.te[3][s0 & 0xff] ^ loadBigEndian32(rk + 4);
+            uint32_t t2 = t.te[0][s2 >> 24] ^ t.te[1][(s3 >> 16) & 0xff] ^ t.te[2][(s0 >> 8) & 0xff] ^
+                          t.te[3][s1 & 0xff] ^ loadBigEndian32(rk + 8);
+            uint32_t t3 = t.te[0][s3 >> 24] ^ t.te[1][(s0 >> 16) & 0xff] ^ t.te[2][(s1 >> 8) & 0xff] ^
+                          t.te[3][s2 & 0xff] ^ loadBigEndian32(rk + 12);
+            s0 = t0;
+            s1 = t1;
+            s2 = t2;
+            s3 = t3;
+        }
+
+        rk += AES_ENGINE_BLOCK;
+        const uint8_t *s = t.sbox;
+        storeBigEndian32(out, ((uint32_t) s[s0 >> 24] << 24 | (uint32_t) s[(s1 >> 16) & 0xff] << 16 |
+                               (uint32_t) s[(s2 >> 8) & 0xff] << 8 | s[s3 & 0xff]) ^ loadBigEndian32(rk));
+        storeBigEndian32(out + 4, ((uint32_t) s[s1 >> 24] << 24 | (uint32_t) s[(s2 >> 16) & 0xff] << 16 |
+                                   (uint32_t) s[(s3 >> 8) & 0xff] << 8 | s[s0 & 0xff]) ^ loadBigEndian32(rk + 4));
+        storeBigEndian32(out + 8, ((uint32_t) s[s2 >> 24] << 24 | (uint32_t) s[(s3 >> 16) & 0xff] << 16 |
+                                   (uint32_t) s[(s0 >> 8) & 0xff] << 8 | s[s1 & 0xff]) ^ loadBigEndian32(rk + 8));
+        storeBigEndian32(out + 12, ((uint32_t) s[s3 >> 24] << 24 | (uint32_t) s[(s0 >> 16) & 0xff] << 16 |
+                                    (uint32_t) s[(s1 >> 8) & 0xff] << 8 | s[s2 & 0xff]) ^ loadBigEndian32(rk + 12));
+    }
+
+#ifdef AES_ENGINE_X86
+    __attribute__((target("aes,sse4.1")))
+    static __m128i counterBlock(uint64_t hi, uint64_t lo) {
+        const __m128i byte_swap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+        return _mm_shuffle_epi8(_mm_set_epi64x(static_cast<long long>(hi), static_cast<long long>(lo)),
+                                byte_swap);
+    }
+#endif
+
+    static Kernel selectKernel() {
+        return availableKernels().front().second;
+    }
+
+public:
+    static void expandKey(const uint8_t key[16], Schedule &schedule) {
+        const uint8_t *sbox = tables().sbox;
+        uint8_t *rk = schedule.round_keys;
+        std::memcpy(rk, key, 16);
+
+        uint8_t rcon = 0x01;
+        for (int i = 16; i < AES_ENGINE_BLOCK * (AES_ENGINE_ROUNDS + 1); i += 4) {
+            uint8_t temp[4] = {rk[i - 4], rk[i - 3], rk[i - 2], rk[i - 1]};
+
+            if (i % 16 == 0) {
+                uint8_t first = temp[0];
+                temp[0] = static_cast<uint8_t>(sbox[temp[1]] ^ rcon);
+                temp[1] = sbox[temp[2]];
+                temp[2] = sbox[temp[3]];
+                temp[3] = sbox[first];
+                rcon = xtime(rcon);
+            }
+
+            for (int j = 0; j < 4; j++) {
+                rk[i + j] = static_cast<uint8_t>(rk[i - 16 + j] ^ temp[j]);
+            }
+        }
+    }
+
+    static void ctrPortable(const Schedule &schedule, uint64_t hi, uint64_t lo, uint8_t *data, size_t blocks) {
+        uint8_t counter[16];
+        uint8_t keystream[16];
+
+        for (size_t b = 0; b < blocks; b++) {
+            storeBigEndian32(counter, static_cast<uint32_t>(hi >> 32));
+            storeBigEndian32(counter + 4, static_cast<uint32_t>(hi));
+            storeBigEndian32(counter + 8, static_cast<uint32_t>(lo >> 32));
+            storeBigEndian32(counter + 12, static_cast<uint32_t>(lo));
+
+            encryptBlockPortable(schedule, counter, keystream);
+            for (int i = 0; i < 16; i++) {
+                data[b * 16 + i] ^= keystream[i];
+            }
+
+            if (++lo == 0) {
+                hi++;
+            }
+        }
+    }
+
+#ifdef AES_ENGINE_X86
+    __attribute__((target("aes,sse4.1")))
+    static void ctrAesNi(const Schedule &schedule, uint64_t hi, uint64_t lo, uint8_t *data, size_t blocks) {
+        __m128i rk[AES_ENGINE_ROUNDS + 1];
+        for (int r = 0; r <= AES_ENGINE_ROUNDS; r++) {
+            rk[r] = _mm_load_si128(reinterpret_cast<const __m128i *>(schedule.round_keys + r * 16));
+        }
+
+        size_t b = 0;
+        for (; b + 8 <= blocks; b += 8) {
+            __m128i s[8];
+            for (int i = 0; i < 8; i++) {
+                s[i] = _mm_xor_si128(counterBlock(hi, lo), rk[0]);
+                if (++lo == 0) {
+                    hi++;
+                }
+            }
+            for (int r = 1; r < AES_ENGINE_ROUNDS; r++) {
+                for (int i = 0; i < 8; i++) {
+                    s[i] = _mm_aesenc_si128(s[i], rk[r]);
+                }
+            }
+            for (int i = 0; i < 8; i++) {
+                s[i] = _mm_aesenclast_si128(s[i], rk[AES_ENGINE_ROUNDS]);
+                __m128i *p = reinterpret_cast<__m128i *>(data + (b + i) * 16);
+                _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), s[i]));
+            }
+        }
+
+        for (; b < blocks; b++) {
+            __m128i s = _mm_xor_si128(counterBlock(hi, lo), rk[0]);
+            if (++lo == 0) {
+                hi++;
+            }
+            for (int r = 1; r < AES_ENGINE_ROUNDS; r++) {
+                s = _mm_aesenc_si128(s, rk[r]);
+            }
+            s = _mm_aesenclast_si128(s, rk[AES_ENGINE_ROUNDS]);
+            __m128i *p = reinterpret_cast<__m128i *>(data + b * 16);
+            _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), s));
+        }
+    }
+
+    __attribute__((target("vaes,avx2,aes,sse4.1")))
+    static void ctrVaes(const Schedule &schedule, uint64_t hi, uint64_t lo, uint8_t *data, size_t blocks) {
+        __m256i rk[AES_ENGINE_ROUNDS + 1];
+        for (int r = 0; r <= AES_ENGINE_ROUNDS; r++) {
+            rk[r] = _mm256_broadcastsi128_si256(
+                _mm_load_si128(reinterpret_cast<const __m128i *>(schedule.round_keys + r * 16)));
+        }
+
+        size_t b = 0;
+        for (; b + 16 <= blocks; b += 16) {
+            __m256i s[8];
+            for (int i = 0; i < 8; i++) {
+                __m128i first = counterBlock(hi, lo);
+                if (++lo == 0) {
+                    hi++;
+                }
+                __m128i second = counterBlock(hi, lo);
+                if (++lo == 0) {
+                    hi++;
+                }
+                s[i] = _mm256_xor_si256(_mm256_set_m128i(second, first), rk[0]);
+            }
+            for (int r = 1; r < AES_ENGINE_ROUNDS; r++) {
+                for (int i = 0; i < 8; i++) {
+                    s[i] = _mm256_aesenc_epi128(s[i], rk[r]);
+                }
+            }
+            for (int i = 0; i < 8; i++) {
+                s[i] = _mm256_aesenclast_epi128(s[i], rk[AES_ENGINE_ROUNDS]);
+                __m256i *p = reinterpret_cast<__m256i *>(data + (b + 2 * i) * 16);
+                _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), s[i]));
+            }
+        }
+
+        if (b < blocks) {
+            ctrAesNi(schedule, hi, lo, data + b * 16, blocks - b);
+        }
+    }
+#endif
+
+    // Every kernel this CPU can run with its name, fastest first; kernel() is the first one.
+    static std::vector<std::pair<const char *, Kernel> > availableKernels() {
+        std::vector<std::pair<const char *, Kernel> > kernels;
+#ifdef AES_ENGINE_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("vaes") && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("aes")) {
+            kernels.emplace_back("VAES", &ctrVaes);
+        }
+        if (__builtin_cpu_supports("aes") && __builtin_cpu_supports("sse4.1")) {
+            kernels.emplace_back("AES-NI", &ctrAesNi);
+        }
+#endif
+        kernels.emplace_back("portable", &ctrPortable);
+        return kernels;
+    }
+
+    static Kernel kernel() {
+        static const Kernel selected = selectKernel();
+        return selected;
+    }
+
+    static const char *kernelName() {
+#ifdef AES_ENGINE_X86
+        if (kernel() == &ctrVaes) {
+            return "VAES";
+        }
+        if (kernel() == &ctrAesNi) {
+            return "AES-NI";
+        }
+#endif
+        return "portable";
+    }
+
+    // XORs `length` bytes with the keystream starting `offset` bytes after the start of the IV's
+    // stream. Calling it with offset 0 matches one AES_CTR_xcrypt_buffer call on a fresh context.
+    static void ctrXcrypt(const Schedule &schedule, const uint8_t iv[16], uint64_t offset, uint8_t *data,
+                          size_t length) {
+        ctrXcrypt(kernel(), schedule, iv, offset, data, length);
+    }
+
+    // The same with a given kernel, so each one can be checked against tiny-AES.
+    static void ctrXcrypt(Kernel run, const Schedule &schedule, const uint8_t iv[16], uint64_t offset,
+                          uint8_t *data, size_t length) {
+        uint64_t hi = loadBigEndian64(iv);
+        uint64_t lo = loadBigEndian64(iv + 8);
+
+        uint64_t start_lo = lo;
+        lo += offset / AES_ENGINE_BLOCK;
+        if (lo < start_lo) {
+            hi++;
+        }
+
+        size_t skip = offset % AES_ENGINE_BLOCK;
+        if (skip != 0 && length > 0) {
+            uint8_t block[16] = {0};
+            size_t take = AES_ENGINE_BLOCK - skip < length ? AES_ENGINE_BLOCK - skip : length;
+            std::memcpy(block + skip, data, take);
+            run(schedule, hi, lo, block, 1);
+            std::memcpy(data, block + skip, take);
+
+            data += take;
+            length -= take;
+            if (++lo == 0) {
+                hi++;
+            }
+        }
+
+        size_t whole = length / AES_ENGINE_BLOCK;
+        if (whole > 0) {
+            run(schedule, hi, lo, data, whole);
+            data += whole * AES_ENGINE_BLOCK;
+            length -= whole * AES_ENGINE_BLOCK;
+            uint64_t before = lo;
+            lo += whole;
+            if (lo < before) {
+                hi++;
+            }
+        }
+
+        if (length > 0) {
+            uint8_t block[16] = {0};
+            std::memcpy(block, data, length);
+            run(schedule, hi, lo, block, 1);
+            std::memcpy(data, block, length);
+        }
+    }
+};
+
+#endif //CPP_PERSONAL_CLOUD_AES_ENGINE_H
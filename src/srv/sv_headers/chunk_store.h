@@ -0,0 +1,669 @@
+#ifndef CPP_PERSONAL_CLOUD_CHUNK_STORE_H
+#define CPP_PERSONAL_CLOUD_CHUNK_STORE_H
+
+#include <algorithm>
+#include <cerrno>
+#include <ctime>
+#include <fcntl.h>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sqlite3.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "content_chunker.h"
+#include "db_connection.h"
+#include "encryption_manager.h"
+#include "redundancy_manager.h"
+#include "server_config.h"
+#include "sha256_engine.h"
+
+// One chunk of a deduplicated file: its id (ChunkStore::chunkId()) and its length.
+struct ChunkRef {
+    std::string hash;
+    unsigned long long length = 0;
+};
+
+// Optional deduplicating storage (ServerConfig::dedup). A file is cut into content-defined chunks
+// (content_chunker.h) and each chunk is stored once per user, whichever files and paths it
+// appears in, at ./storage/<user>/chunks/{primary,backup}/<id[0:2]>/<id>. file_chunks holds
+// every file's recipe under its primary path (the same key as file_hashes.filepath) and chunks
+// counts how many recipe entries point at each chunk.
+//
+// A chunk's id is an HMAC of its plaintext's SHA-256 under a secret derived from the owner's key,
+// and its IV comes from the id. Neither file names nor the database tell someone without the key
+// whether a known piece of content is stored, and identical content is only shared within one
+// account. stored_hash covers the bytes on disk and is what reads and the scrubber check, without
+// needing the key; it is only the plaintext's hash for chunks kept in plaintext.
+//
+// A reference is taken as soon as a chunk is stored (put()), before the file's recipe is
+// recorded, and given back with release() if the upload fails. References are only added and
+// dropped under the user's lock and a chunk file is removed together with its last reference, so
+// an upload never counts on a chunk that a delete is about to remove.
+class ChunkStore {
+private:
+    struct ChunkRow {
+        unsigned long long length = 0;
+        std::string stored_hash;
+        int encryption = STORAGE_PLAINTEXT;
+    };
+
+    static std::shared_ptr<std::mutex> userLock(int user_id) {
+        static std::mutex mutex;
+        static std::unordered_map<int, std::shared_ptr<std::mutex> > locks;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto &entry = locks[user_id];
+        if (!entry) {
+            entry = std::make_shared<std::mutex>();
+        }
+        return entry;
+    }
+
+    static std::filesystem::path chunkPath(const std::filesystem::path &user_dir, const std::string &id,
+                                           bool backup) {
+        return user_dir / "chunks" / (backup ? "backup" : "primary") / id.substr(0, 2) / id;
+    }
+
+    static void chunkIv(const std::string &id, uint8_t iv[16]) {
+        for (int i = 0; i < 16; i++) {
+            iv[i] = static_cast<uint8_t>(std::stoi(id.substr(i * 2, 2), nullptr, 16));
+        }
+    }
+
+    static bool readChunk(const std::filesystem::path &path, unsigned long long length, std::string &data) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+        data.resize(length);
+        size_t filled = 0;
+        while (filled < data.size()) {
+            ssize_t got = read(fd, data.data() + filled, data.size() - filled);
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                break;
+            }
+            filled += got;
+        }
+        close(fd);
+        return filled == data.size();
+    }
+
+    // Written next to the target and renamed over it, so a reader never sees half a chunk.
+    static bool writeChunk(const std::filesystem::path &path, const std::string &data) {
+        std::error_code ec;
+        std::filesystem::create_directories(path.parent_path(), ec);
+
+        std::filesystem::path temp = path;
+        temp += ".tmp";
+        int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        size_t written = 0;
+        while (written < data.size()) {
+            ssize_t result = write(fd, data.data() + written, data.size() - written);
+            if (result < 0 && errno == EINTR) {
+                continue;
+            }
+            if (result <= 0) {
+                break;
+            }
+            written += result;
+        }
+        close(fd);
+
+        if (written != data.size()) {
+            std::filesystem::remove(temp, ec);
+            return false;
+        }
+        std::filesystem::rename(temp, path, ec);
+        return !ec;
+    }
+
+    static bool lookupChunk(int user_id, const std::string &hash, ChunkRow &row) {
+        std::string sql = "SELECT length, stored_hash, encryption FROM chunks WHERE user_id = ? AND hash = ?;";
+        DBStatement stmt = DBConnection::local().prepare(sql);
+
+        sqlite3_bind_int(stmt, 1, user_id);
+        sqlite3_bind_text(stmt, 2, hash.c_str(), -1, SQLITE_TRANSIENT);
+
+        if (sqlite3_step(stmt) != SQLITE_ROW) {
+            return false;
+        }
+        row.length = static_cast<unsigned long long>(sqlite3_column_int64(stmt, 0));
+        row.stored_hash = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1));
+        row.encryption = sqlite3_column_int(stmt, 2);
+        return true;
+    }
+
+    // Part of the caller's transaction, under the user's lock. The chunks left without references
+    // are dropped from the table and returned, for their files to be removed once it commits.
+    static bool dropRefs(int user_id, const std::vector<ChunkRef> &recipe, std::vector<std::string> &unreferenced) {
+        std::string sql = "UPDATE chunks SET refs = refs - 1 WHERE user_id = ? AND hash = ? RETURNING refs;";
+        std::string delete_sql = "DELETE FROM chunks WHERE user_id = ? AND hash = ?;";
+
+        for (const auto &chunk: recipe) {
+            long long refs = 1;
+            {
+                DBStatement stmt = DBConnection::local().prepare(sql);
+                sqlite3_bind_int(stmt, 1, user_id);
+                sqlite3_bind_text(stmt, 2, chunk.hash.c_str(), -1, SQLITE_TRANSIENT);
+                int rc = sqlite3_step(stmt);
+                if (rc == SQLITE_ROW) {
+                    refs = sqlite3_column_int64(stmt, 0);
+                    rc = sqlite3_step(stmt);
+                }
+                if (rc != SQLITE_DONE) {
+                    return false;
+                }
+            }
+            if (refs > 0) {
+                continue;
+            }
+
+            DBStatement stmt = DBConnection::local().prepare(delete_sql);
+            sqlite3_bind_int(stmt, 1, user_id);
+            sqlite3_bind_text(stmt, 2, chunk.hash.c_str(), -1, SQLITE_TRANSIENT);
+            if (sqlite3_step(stmt) != SQLITE_DONE) {
+                return false;
+            }
+            unreferenced.push_back(chunk.hash);
+        }
+        return true;
+    }
+
+public:
+    static bool initDatabase() {
+        std::string sql =
+                "CREATE TABLE IF NOT EXISTS chunks ("
+                "user_id INTEGER NOT NULL, "
+                "hash TEXT NOT NULL, "
+                "length INTEGER NOT NULL, "
+                "stored_hash TEXT NOT NULL, "
+                "encryption INTEGER NOT NULL, "
+                "refs INTEGER NOT NULL, "
+                "PRIMARY KEY (user_id, hash)"
+                ") WITHOUT ROWID;"
+                "CREATE TABLE IF NOT EXISTS file_chunks ("
+                "user_id INTEGER NOT NULL, "
+                "path TEXT NOT NULL, "
+                "seq INTEGER NOT NULL, "
+                "hash TEXT NOT NULL, "
+                "length INTEGER NOT NULL, "
+                "PRIMARY KEY (user_id, path, seq)"
+                ") WITHOUT ROWID;"
+                "CREATE INDEX IF NOT EXISTS file_chunks_hash ON file_chunks (user_id, hash);"
+                // References taken by uploads that never committed (the server stopped midway) are
+                // recounted from the recipes; collect() removes what is left unreferenced.
+                "UPDATE chunks SET refs = (SELECT COUNT(*) FROM file_chunks f "
+                "WHERE f.user_id = chunks.user_id AND f.hash = chunks.hash);";
+
+        return DBConnection::local().exec(sql);
+    }
+
+    // Whether a new file of `size` bytes is stored as chunks.
+    static bool accepts(unsigned long long size) {
+        return ServerConfig::instance().dedup && size > 0;
+    }
+
+    // Stat fields the metadata index keeps for a chunked file.
+    static struct stat fileStat(unsigned long long size) {
+        struct stat st{};
+        st.st_size = static_cast<off_t>(size);
+        clock_gettime(CLOCK_REALTIME, &st.st_mtim);
+        return st;
+    }
+
+    // Id of the chunk whose plaintext has the SHA-256 `content_hash` (hex); empty without a key.
+    // The hash rather than the plaintext is keyed so a POST_DEDUP chunk list can be looked up.
+    static std::string chunkId(const CipherKey &key, const std::string &content_hash) {
+        uint8_t secret[SHA256_DIGEST];
+        if (!EncryptionManager::chunkSecret(key, secret)) {
+            return "";
+        }
+        uint8_t id[SHA256_DIGEST];
+        Sha256::hmac(secret, sizeof(secret), content_hash.data(), content_hash.size(), id);
+        return Sha256::toHex(id);
+    }
+
+    // Whether `hash` is a well-formed SHA-256 hex digest, as chunk ids and content hashes are.
+    static bool validHash(const std::string &hash) {
+        return hash.size() == SHA256_DIGEST * 2 &&
+               std::all_of(hash.begin(), hash.end(), [](char c) {
+                   return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+               });
+    }
+
+    // Takes `count` references on a chunk the user already has. False, with nothing taken, when
+    // the chunk is unknown, of another length or its primary copy went missing.
+    static bool acquire(int user_id, const std::filesystem::path &user_dir, const ChunkRef &chunk, size_t count) {
+        auto lock = userLock(user_id);
+        std::lock_guard<std::mutex> guard(*lock);
+
+        ChunkRow row;
+        std::error_code ec;
+        if (!lookupChunk(user_id, chunk.hash, row) || row.length != chunk.length ||
+            !std::filesystem::exists(chunkPath(user_dir, chunk.hash, false), ec)) {
+            return false;
+        }
+
+        std::string sql = "UPDATE chunks SET refs = refs + ? WHERE user_id = ? AND hash = ?;";
+        DBStatement stmt = DBConnection::local().prepare(sql);
+        sqlite3_bind_int64(stmt, 1, static_cast<sqlite3_int64>(count));
+        sqlite3_bind_int(stmt, 2, user_id);
+        sqlite3_bind_text(stmt, 3, chunk.hash.c_str(), -1, SQLITE_TRANSIENT);
+        return sqlite3_step(stmt) == SQLITE_DONE;
+    }
+
+    // Takes a reference on the chunk holding `data`, storing it first when the user doesn't have
+    // it yet (or its primary copy went missing).
+    static bool put(int user_id, const std::filesystem::path &user_dir, const CipherKey &key, bool encrypt,
+                    const char *data, size_t length, ChunkRef &ref) {
+        return put(user_id, user_dir, key, encrypt, Sha256::hashHex(data, length), data, length, ref);
+    }
+
+    // put() for a chunk whose plaintext hash the caller already computed.
+    static bool put(int user_id, const std::filesystem::path &user_dir, const CipherKey &key, bool encrypt,
+                    const std::string &content_hash, const char *data, size_t length, ChunkRef &ref) {
+        ref.hash = chunkId(key, content_hash);
+        ref.length = length;
+        if (ref.hash.empty()) {
+            return false;
+        }
+
+        auto lock = userLock(user_id);
+        std::lock_guard<std::mutex> guard(*lock);
+
+        ChunkRow row;
+        std::error_code ec;
+        if (lookupChunk(user_id, ref.hash, row) && std::filesystem::exists(chunkPath(user_dir, ref.hash, false), ec)) {
+            std::string sql = "UPDATE chunks SET refs = refs + 1 WHERE user_id = ? AND hash = ?;";
+            DBStatement stmt = DBConnection::local().prepare(sql);
+            sqlite3_bind_int(stmt, 1, user_id);
+            sqlite3_bind_text(stmt, 2, ref.hash.c_str(), -1, SQLITE_TRANSIENT);
+            return sqlite3_step(stmt) == SQLITE_DONE;
+        }
+
+        std::string stored(data, length);
+        std::string stored_hash = content_hash;
+        int encryption = STORAGE_PLAINTEXT;
+        if (encrypt) {
+            uint8_t iv[16];
+            chunkIv(ref.hash, iv);
+            CipherStream cipher = EncryptionManager::chunkStream(key, iv);
+            if (!cipher.valid()) {
+                return false;
+            }
+            cipher.xcrypt(reinterpret_cast<uint8_t *>(stored.data()), stored.size());
+            stored_hash = Sha256::hashHex(stored.data(), stored.size());
+            encryption = STORAGE_AES_CTR_STREAM;
+        }
+
+        if (!writeChunk(chunkPath(user_dir, ref.hash, false), stored) ||
+            !writeChunk(chunkPath(user_dir, ref.hash, true), stored)) {
+            return false;
+        }
+
+        std::string sql = "INSERT INTO chunks (user_id, hash, length, stored_hash, encryption, refs) "
+                "VALUES (?,?,?,?,?,1) ON CONFLICT (user_id, hash) DO UPDATE SET "
+                "stored_hash = excluded.stored_hash, encryption = excluded.encryption, refs = refs + 1;";
+        DBStatement stmt = DBConnection::local().prepare(sql);
+        sqlite3_bind_int(stmt, 1, user_id);
+        sqlite3_bind_text(stmt, 2, ref.hash.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(stmt, 3, static_cast<sqlite3_int64>(length));
+        sqlite3_bind_text(stmt, 4, stored_hash.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(stmt, 5, encryption);
+        return sqlite3_step(stmt) == SQLITE_DONE;
+    }
+
+    // Gives back the references put() took for an upload that is not going to be recorded.
+    static void release(int user_id, const std::filesystem::path &user_dir, const std::vector<ChunkRef> &recipe) {
+        if (recipe.empty()) {
+            return;
+        }
+
+        auto lock = userLock(user_id);
+        std::lock_guard<std::mutex> guard(*lock);
+
+        std::vector<std::string> unreferenced;
+        DBTransaction transaction;
+        if (!dropRefs(user_id, recipe, unreferenced) || !transaction.commit()) {
+            std::cerr << "Failed to release " << recipe.size() << " chunks\n";
+            return;
+        }
+        removeChunkFiles(user_dir, unreferenced);
+    }
+
+    // Part of the caller's transaction, next to the file_hashes and file_index rows. Fails when the
+    // path already has a recipe (two uploads of one path raced); the caller then gives back the
+    // references it took, and the recipe recorded first stays whole.
+    static bool record(int user_id, const std::string &path, const std::vector<ChunkRef> &recipe) {
+        std::string sql = "INSERT INTO file_chunks (user_id, path, seq, hash, length) VALUES (?,?,?,?,?);";
+
+        for (size_t seq = 0; seq < recipe.size(); seq++) {
+            DBStatement stmt = DBConnection::local().prepare(sql);
+            sqlite3_bind_int(stmt, 1, user_id);
+            sqlite3_bind_text(stmt, 2, path.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int64(stmt, 3, static_cast<sqlite3_int64>(seq));
+            sqlite3_bind_text(stmt, 4, recipe[seq].hash.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int64(stmt, 5, static_cast<sqlite3_int64>(recipe[seq].length));
+            if (sqlite3_step(stmt) != SQLITE_DONE) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // The chunks of a file in order; false when the file is not chunked.
+    static bool recipe(int user_id, const std::string &path, std::vector<ChunkRef> &chunks) {
+        std::string sql = "SELECT hash, length FROM file_chunks WHERE user_id = ? AND path = ? ORDER BY seq;";
+        DBStatement stmt = DBConnection::local().prepare(sql);
+
+        sqlite3_bind_int(stmt, 1, user_id);
+        sqlite3_bind_text(stmt, 2, path.c_str(), -1, SQLITE_TRANSIENT);
+
+        chunks.clear();
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            chunks.push_back(ChunkRef{
+                reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)),
+                static_cast<unsigned long long>(sqlite3_column_int64(stmt, 1)),
+            });
+        }
+        return !chunks.empty();
+    }
+
+    static bool contains(int user_id, const std::string &path) {
+        std::string sql = "SELECT 1 FROM file_chunks WHERE user_id = ? AND path = ? LIMIT 1;";
+        DBStatement stmt = DBConnection::local().prepare(sql);
+
+        sqlite3_bind_int(stmt, 1, user_id);
+        sqlite3_bind_text(stmt, 2, path.c_str(), -1, SQLITE_TRANSIENT);
+
+        return sqlite3_step(stmt) == SQLITE_ROW;
+    }
+
+    // Whether a directory still holds chunked files (it has nothing on disk to show for them).
+    static bool containsUnder(int user_id, const std::string &dir_path) {
+        std::string sql = "SELECT 1 FROM file_chunks WHERE user_id = ? AND path > ? AND path < ? LIMIT 1;";
+        DBStatement stmt = DBConnection::local().prepare(sql);
+
+        std::string prefix = dir_path + "/";
+        std::string end = dir_path + "0";
+        sqlite3_bind_int(stmt, 1, user_id);
+        sqlite3_bind_text(stmt, 2, prefix.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 3, end.c_str(), -1, SQLITE_TRANSIENT);
+
+        return sqlite3_step(stmt) == SQLITE_ROW;
+    }
+
+    // The user's lock, for a caller that drops a recipe in its own transaction: taken before the
+    // transaction starts and held until the chunks it left unreferenced are removed, so no upload
+    // takes a reference on them in between.
+    static std::unique_lock<std::mutex> lock(int user_id) {
+        return std::unique_lock<std::mutex>(*userLock(user_id));
+    }
+
+    // Part of the caller's transaction, under lock(): drops a file's recipe and its references.
+    // The chunks no other file uses are returned, for removeChunkFiles() once it commits.
+    static bool dropFile(int user_id, const std::string &path, std::vector<std::string> &unreferenced) {
+        std::vector<ChunkRef> chunks;
+        if (!recipe(user_id, path, chunks)) {
+            return false;
+        }
+
+        std::string sql = "DELETE FROM file_chunks WHERE user_id = ? AND path = ?;";
+        DBStatement stmt = DBConnection::local().prepare(sql);
+        sqlite3_bind_int(stmt, 1, user_id);
+        sqlite3_bind_text(stmt, 2, path.c_str(), -1, SQLITE_TRANSIENT);
+        return sqlite3_step(stmt) == SQLITE_DONE && dropRefs(user_id, chunks, unreferenced);
+    }
+
+    static void removeChunkFiles(const std::filesystem::path &user_dir, const std::vector<std::string> &hashes) {
+        std::error_code ec;
+        for (const auto &hash: hashes) {
+            std::filesystem::remove(chunkPath(user_dir, hash, false), ec);
+            std::filesystem::remove(chunkPath(user_dir, hash, true), ec);
+        }
+    }
+
+    // Plaintext of the chunk `hash` (its id). A damaged primary copy is rewritten from the backup.
+    static bool load(int user_id, const std::filesystem::path &user_dir, const CipherKey &key, const std::string &hash,
+                     std::string &data) {
+        ChunkRow row;
+        if (!lookupChunk(user_id, hash, row)) {
+            return false;
+        }
+
+        if (!readChunk(chunkPath(user_dir, hash, false), row.length, data) ||
+            Sha256::hashHex(data.data(), data.size()) != row.stored_hash) {
+            std::cout << "Hash mismatch in chunk " << hash << ", reading backup\n";
+            if (!readChunk(chunkPath(user_dir, hash, true), row.length, data) ||
+                Sha256::hashHex(data.data(), data.size()) != row.stored_hash) {
+                std::cerr << "Both copies of chunk " << hash << " are damaged\n";
+                return false;
+            }
+
+            auto lock = userLock(user_id);
+            std::lock_guard<std::mutex> guard(*lock);
+            if (lookupChunk(user_id, hash, row)) {
+                writeChunk(chunkPath(user_dir, hash, false), data);
+            }
+        }
+
+        if (row.encryption != STORAGE_PLAINTEXT) {
+            uint8_t iv[16];
+            chunkIv(hash, iv);
+            CipherStream cipher = EncryptionManager::chunkStream(key, iv);
+            if (!cipher.valid()) {
+                return false;
+            }
+            cipher.xcrypt(reinterpret_cast<uint8_t *>(data.data()), data.size());
+        }
+        return true;
+    }
+
+    // Scrubber check of both copies of one chunk, each rewritten from the other when it is damaged.
+    // Returns false when neither copy is intact and the chunk is still referenced.
+    static bool verify(int user_id, const std::filesystem::path &user_dir, const std::string &hash,
+                       bool &primary_repaired, bool &backup_repaired) {
+        primary_repaired = false;
+        backup_repaired = false;
+
+        ChunkRow row;
+        if (!lookupChunk(user_id, hash, row)) {
+            return true;
+        }
+
+        std::string primary;
+        std::string backup;
+        bool primary_ok = readChunk(chunkPath(user_dir, hash, false), row.length, primary) &&
+                          Sha256::hashHex(primary.data(), primary.size()) == row.stored_hash;
+        bool backup_ok = readChunk(chunkPath(user_dir, hash, true), row.length, backup) &&
+                         Sha256::hashHex(backup.data(), backup.size()) == row.stored_hash;
+        if (primary_ok && backup_ok) {
+            return true;
+        }
+
+        // Repairs must not bring back a chunk whose last reference was dropped meanwhile.
+        auto lock = userLock(user_id);
+        std::lock_guard<std::mutex> guard(*lock);
+        if (!lookupChunk(user_id, hash, row)) {
+            return true;
+        }
+        if (primary_ok) {
+            backup_repaired = writeChunk(chunkPath(user_dir, hash, true), primary);
+        } else if (backup_ok) {
+            primary_repaired = writeChunk(chunkPath(user_dir, hash, false), backup);
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    // One page of a user's chunks in hash order, for the scrubber.
+    static std::vector<ChunkRef> chunks(int user_id, const std::string &after, size_t limit) {
+        std::string sql = "SELECT hash, length FROM chunks WHERE user_id = ? AND hash > ? ORDER BY hash LIMIT ?;";
+        DBStatement stmt = DBConnection::local().prepare(sql);
+
+        sqlite3_bind_int(stmt, 1, user_id);
+        sqlite3_bind_text(stmt, 2, after.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(stmt, 3, static_cast<sqlite3_int64>(limit));
+
+        std::vector<ChunkRef> page;
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            page.push_back(ChunkRef{
+                reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)),
+                static_cast<unsigned long long>(sqlite3_column_int64(stmt, 1)),
+            });
+        }
+        return page;
+    }
+
+    // Removes the chunks left unreferenced by the startup recount.
+    static void collect(int user_id, const std::filesystem::path &user_dir) {
+        auto lock = userLock(user_id);
+        std::lock_guard<std::mutex> guard(*lock);
+
+        std::vector<std::string> unreferenced;
+        {
+            std::string sql = "SELECT hash FROM chunks WHERE user_id = ? AND refs <= 0;";
+            DBStatement stmt = DBConnection::local().prepare(sql);
+            sqlite3_bind_int(stmt, 1, user_id);
+            while (sqlite3_step(stmt) == SQLITE_ROW) {
+                unreferenced.emplace_back(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)));
+            }
+        }
+        if (unreferenced.empty()) {
+            return;
+        }
+
+        std::string sql = "DELETE FROM chunks WHERE user_id = ? AND refs <= 0;";
+        DBStatement stmt = DBConnection::local().prepare(sql);
+        sqlite3_bind_int(stmt, 1, user_id);
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+            return;
+        }
+        removeChunkFiles(user_dir, unreferenced);
+        std::cout << "Removed " << unreferenced.size() << " unreferenced chunks\n";
+    }
+};
+
+// Cuts the plaintext of one file into chunks as it arrives and stores each through ChunkStore.
+// The file's recipe and hash are ready after finish(); an upload that is given up calls abort().
+class ChunkWriter {
+private:
+    int user_id;
+    std::filesystem::path user_dir;
+    CipherKey key;
+    bool encrypt;
+    ContentChunker chunker;
+    Sha256 file_hasher;
+    std::vector<ChunkRef> chunks;
+    unsigned long long total = 0;
+
+    bool store(const char *data, size_t length) {
+        ChunkRef ref;
+        if (!ChunkStore::put(user_id, user_dir, key, encrypt, data, length, ref)) {
+            return false;
+        }
+        chunks.push_back(std::move(ref));
+        return true;
+    }
+
+public:
+    ChunkWriter(int user_id, std::filesystem::path user_dir, CipherKey key, bool encrypt)
+        : user_id(user_id), user_dir(std::move(user_dir)), key(std::move(key)), encrypt(encrypt) {
+    }
+
+    bool feed(const char *data, size_t length) {
+        file_hasher.update(data, length);
+        total += length;
+        return chunker.feed(data, length, [this](const char *chunk, size_t size) { return store(chunk, size); });
+    }
+
+    bool finish() {
+        return chunker.finish([this](const char *chunk, size_t size) { return store(chunk, size); });
+    }
+
+    void abort() {
+        ChunkStore::release(user_id, user_dir, chunks);
+        chunks.clear();
+    }
+
+    const std::vector<ChunkRef> &recipe() const {
+        return chunks;
+    }
+
+    // SHA-256 of the whole plaintext.
+    std::string fileHash() const {
+        return file_hasher.hexDigest();
+    }
+
+    unsigned long long size() const {
+        return total;
+    }
+};
+
+// Serves byte ranges of a chunked file, loading (and checking) one chunk at a time.
+class ChunkReader {
+private:
+    int user_id;
+    std::filesystem::path user_dir;
+    CipherKey key;
+    std::vector<ChunkRef> chunks;
+    std::vector<unsigned long long> starts;
+    size_t loaded = SIZE_MAX;
+    std::string data;
+
+public:
+    ChunkReader(int user_id, std::filesystem::path user_dir, CipherKey key, std::vector<ChunkRef> recipe)
+        : user_id(user_id), user_dir(std::move(user_dir)), key(std::move(key)), chunks(std::move(recipe)) {
+        unsigned long long offset = 0;
+        for (const auto &chunk: chunks) {
+            starts.push_back(offset);
+            offset += chunk.length;
+        }
+        starts.push_back(offset);
+    }
+
+    unsigned long long size() const {
+        return starts.back();
+    }
+
+    // Passes [from, from + count) to sink(const char *data, size_t length) piece by piece.
+    template<typename Sink>
+    bool read(unsigned long long from, unsigned long long count, Sink &&sink) {
+        size_t index = std::upper_bound(starts.begin(), starts.end(), from) - starts.begin() - 1;
+        while (count > 0 && index < chunks.size()) {
+            if (loaded != index) {
+                if (!ChunkStore::load(user_id, user_dir, key, chunks[index].hash, data)) {
+                    loaded = SIZE_MAX;
+                    return false;
+                }
+                loaded = index;
+            }
+
+            unsigned long long within = from - starts[index];
+            unsigned long long take = std::min<unsigned long long>(count, data.size() - within);
+            if (!sink(data.data() + within, static_cast<size_t>(take))) {
+                return false;
+            }
+            from += take;
+            count -= take;
+            index++;
+        }
+        return count == 0;
+    }
+};
+
+#endif //CPP_PERSONAL_CLOUD_CHUNK_STORE_H
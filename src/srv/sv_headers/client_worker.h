@@ -1,7 +1,13 @@
 #ifndef CPP_PERSONAL_CLOUD_CLIENT_WORKER_H
 #define CPP_PERSONAL_CLOUD_CLIENT_WORKER_H
 
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <thread>
+#include <unordered_map>
 #include <iostream>
 #include <unistd.h>
 #include <sys/socket.h>
@@ -11,87 +17,319 @@
 #include "user_session.h"
 
 
-class ClientWorker {
+// Per-connection state owned by an EventLoop. The loop reads the command frames without blocking;
+// once a frame is complete the command is parsed on the loop thread and executed on a pool thread.
+//
+// A connection starts with text frames ([int length][command line]) and switches to the binary
+// framing of wire_protocol.h after a successful "PROTO <version>". A text connection runs one
+// command at a time. A binary one keeps being read while its commands run, so several of them can
+// be in flight; their frames are serialized by send_mutex, and session_mutex keeps LOGIN / LOGOUT
+// from running next to anything else. A CANCEL frame flags one of them through `cancellable`.
+//
+// Owned by the EventLoop's connection map and by the pool tasks of its running commands; the socket
+// is closed when the last of them lets go.
+class ClientWorker : public std::enable_shared_from_this<ClientWorker> {
+public:
+    enum class ReadResult {
+        INCOMPLETE,
+        COMMAND_READY,
+        INVALID_SIZE,
+        CLOSED,
+    };
+
 private:
     int fd;
     UserSession session;
+    bool binary = false;
+    std::mutex send_mutex;
+    std::shared_mutex session_mutex;
 
-    void processClientCommands() {
-        ServerResponse response;
-
-        while (true) {
-            char buffer[BUFFER_SIZE] = {0};
-            int size;
-            int received = recv(fd, &size, sizeof(int), 0);
-
-            if (received == sizeof(int)) {
-                if (size <= 0 || size >= BUFFER_SIZE) {
-                    std::cerr << "Dimensiune invalida primita: " << size << "\n";
-                    std::string msgBack = "FAIL";
-
-                    int msgSize = msgBack.length();
-                    send(fd, &msgSize, sizeof(int), 0);
-                    send(fd, msgBack.c_str(), msgBack.length(), 0);
-                } else {
-                    received = recv(fd, buffer, size, 0);
-                    if (received == size) {
-                        buffer[size] = '\0';
-                        std::string cmd = buffer;
-
-                        cmd = trimString(cmd);
-                        std::cout << "Received command: " << cmd << "\n";
-
-                        try {
-                            std::unique_ptr<Command> command = CommandFactory::createCommand(cmd, this->fd, session);
-                            response = command->execute();
-
-                            if (response.status_code) {
-                                std::cout << "SUCCESS: " << response.status_message << '\n';
-                            } else {
-                                std::cout << "FAILED: " << response.status_message << '\n';
-                            }
-                        } catch (const char *err) {
-                            std::cerr << "COMANDA EROARE: " << err << "\n";
-                        } catch (const std::exception &e) {
-                            std::cerr << "EROARE SISTEM: " << e.what() << "\n";
-                        } catch (...) {
-                            std::cerr << "EROARE NECUNOSCUTĂ! Curatare si Oprire.\n";
-                        }
-
-                        nlohmann::json response_j = response;
-                        std::string response_str = response_j.dump();
-
-                        int msgSize = response_str.length();
-                        send(fd, &msgSize, sizeof(int), 0);
-                        send(fd, response_str.c_str(), msgSize, 0);
-
-                        std::cout << "Sent " << response_str << "\n";
-                    } else {
-                        std::cerr << "Eroare la primire mesaj: asteptat " << size << ", primit " << received << "\n";
-                    }
-                }
-            } else if (received == 0) {
-                std::cout << "Client deconectat\n";
-                break;
-            } else {
-                std::cerr << "Eroare la primire dimensiune\n";
-                break;
+    std::mutex cancel_mutex;
+    std::unordered_map<uint32_t, std::shared_ptr<std::atomic<bool> > > cancellable;
+
+    // Framing of the frame being read; only touched by the event loop thread.
+    RequestContext request;
+
+    char header[WIRE_HEADER_SIZE];
+    size_t header_received = 0;
+    size_t frame_size = 0;
+    std::string frame;
+    size_t frame_received = 0;
+
+    void resetFrame() {
+        header_received = 0;
+        frame_size = 0;
+        frame.clear();
+        frame_received = 0;
+    }
+
+    size_t headerSize() const {
+        return binary ? WIRE_HEADER_SIZE : sizeof(int);
+    }
+
+    // Validates a complete header and sizes the frame; false when the announced length is refused.
+    bool startFrame() {
+        if (binary) {
+            WireHeader wire_header = decodeWireHeader(header);
+            if (wire_header.length > WIRE_MAX_PAYLOAD) {
+                std::cerr << "Dimensiune invalida primita: " << wire_header.length << "\n";
+                return false;
+            }
+            request = RequestContext{true, wire_header.opcode, wire_header.request_id, &send_mutex,
+                                     std::make_shared<std::atomic<bool> >(false)};
+            frame_size = wire_header.length;
+        } else {
+            int size = 0;
+            std::memcpy(&size, header, sizeof(int));
+            if (size <= 0 || size >= BUFFER_SIZE) {
+                std::cerr << "Dimensiune invalida primita: " << size << "\n";
+                return false;
             }
+            request = RequestContext{false, 0, 0, &send_mutex};
+            frame_size = size;
         }
+
+        frame.resize(frame_size);
+        return true;
     }
 
 public:
     explicit ClientWorker(int socketFd) : fd(socketFd) {
     };
 
-    void run() {
-        std::cout << "Thread [" << std::this_thread::get_id() << "] a preluat clientul FD: " << fd << '\n';
+    ~ClientWorker() {
+        close(fd);
+    }
 
-        processClientCommands();
+    // Framing of the last complete frame; a command answers with the same.
+    RequestContext currentRequest() const {
+        return request;
+    }
 
-        std::cout << "Sesiune incheiata pentru clientul FD: " << fd << std::endl;
+    // A reply longer than a frame may carry is replaced by an error, on either framing; the
+    // commands with large replies keep theirs below the limit themselves.
+    void sendResponse(const ServerResponse &full_response, const RequestContext &request) {
+        std::lock_guard<std::mutex> lock(send_mutex);
 
-        close(fd);
+        ServerResponse response = full_response;
+        if (!fitsWireResponse(response)) {
+            std::cerr << "Reply of " << response.response_data_json.size() << " bytes refused\n";
+            response = ServerResponse{0, "Reply too large", ""};
+        }
+
+        if (request.binary) {
+            std::string message = encodeWireResponse(request.opcode, request.request_id, response);
+            send(fd, message.data(), message.size(), MSG_NOSIGNAL);
+
+            std::cout << "Sent " << response.status_code << " " << response.status_message << "\n";
+            return;
+        }
+
+        nlohmann::json response_j = response;
+        std::string response_str = response_j.dump();
+
+        // Header and body go out in one write: a separate 4-byte send leaves the body waiting on the
+        // client's delayed ACK (Nagle), which costs ~40 ms per reply.
+        int msgSize = response_str.length();
+        std::string message(sizeof(int), '\0');
+        std::memcpy(message.data(), &msgSize, sizeof(int));
+        message += response_str;
+        send(fd, message.data(), message.size(), MSG_NOSIGNAL);
+
+        std::cout << "Sent " << response_str << "\n";
+    }
+
+    int getFd() const {
+        return fd;
+    }
+
+    // Reads at most up to the end of the current frame so bytes that belong to a command's own
+    // transfer (file data, READY acks) are never consumed by the loop. The socket itself stays in
+    // blocking mode for the commands; the loop's reads don't wait.
+    ReadResult readFrame(std::string &command) {
+        while (header_received < headerSize()) {
+            ssize_t received = recv(fd, header + header_received, headerSize() - header_received, MSG_DONTWAIT);
+            if (received == 0) {
+                return ReadResult::CLOSED;
+            }
+            if (received < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                    return ReadResult::INCOMPLETE;
+                }
+                std::cerr << "Eroare la primire dimensiune\n";
+                return ReadResult::CLOSED;
+            }
+
+            header_received += received;
+
+            if (header_received == headerSize() && !startFrame()) {
+                resetFrame();
+                return ReadResult::INVALID_SIZE;
+            }
+        }
+
+        while (frame_received < frame_size) {
+            ssize_t received = recv(fd, frame.data() + frame_received, frame_size - frame_received, MSG_DONTWAIT);
+            if (received == 0) {
+                return ReadResult::CLOSED;
+            }
+            if (received < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                    return ReadResult::INCOMPLETE;
+                }
+                std::cerr << "Eroare la primire mesaj: asteptat " << frame_size << ", primit " << frame_received
+                        << "\n";
+                return ReadResult::CLOSED;
+            }
+
+            frame_received += received;
+        }
+
+        command = std::move(frame);
+        resetFrame();
+        return ReadResult::COMMAND_READY;
+    }
+
+    // False when the connection can't continue: a refused binary frame leaves its payload unread.
+    bool rejectFrame() {
+        if (binary) {
+            return false;
+        }
+
+        std::string msgBack = "FAIL";
+
+        int msgSize = msgBack.length();
+        send(fd, &msgSize, sizeof(int), 0);
+        send(fd, msgBack.c_str(), msgBack.length(), 0);
+        return true;
+    }
+
+    // Handles "PROTO <version>" on a text connection; false for any other command. Runs on the event
+    // loop thread, so the switch takes effect before the next frame is read.
+    bool negotiate(const std::string &cmd) {
+        if (binary || cmd.compare(0, 6, "PROTO ") != 0) {
+            return false;
+        }
+
+        json versions = {{"version", WIRE_PROTOCOL_VERSION}};
+        if (trimString(cmd.substr(6)) != std::to_string(WIRE_PROTOCOL_VERSION)) {
+            sendResponse(ServerResponse{0, "Unsupported protocol version", versions.dump()}, request);
+            return true;
+        }
+
+        sendResponse(ServerResponse{1, "Binary protocol enabled", versions.dump()}, request);
+        binary = true;
+        return true;
+    }
+
+    // Handles "CANCEL <request id>" on a binary connection; false for any other command. Runs on the
+    // event loop thread. A request that already finished (or never existed) is ignored.
+    bool cancel(const std::string &cmd) {
+        if (!binary || wireCommandName(request.opcode) != "CANCEL") {
+            return false;
+        }
+
+        std::string argument;
+        WireReader reader(cmd);
+        if (!reader.getField(argument)) {
+            return true;
+        }
+        uint32_t request_id = static_cast<uint32_t>(std::strtoul(argument.c_str(), nullptr, 10));
+
+        std::lock_guard<std::mutex> lock(cancel_mutex);
+        auto found = cancellable.find(request_id);
+        if (found != cancellable.end()) {
+            *found->second = true;
+            std::cout << "FD " << fd << " cancelled request " << request_id << "\n";
+        }
+        return true;
+    }
+
+    // A binary request can be cancelled from when it is dispatched until its reply is sent.
+    void track(const RequestContext &request) {
+        if (request.cancelled) {
+            std::lock_guard<std::mutex> lock(cancel_mutex);
+            cancellable[request.request_id] = request.cancelled;
+        }
+    }
+
+    void untrack(const RequestContext &request) {
+        if (request.cancelled) {
+            std::lock_guard<std::mutex> lock(cancel_mutex);
+            auto found = cancellable.find(request.request_id);
+            if (found != cancellable.end() && found->second == request.cancelled) {
+                cancellable.erase(found);
+            }
+        }
+    }
+
+    // Queue key for the WorkerPool: all connections of one user share a fair-share queue.
+    std::string schedulingKey() const {
+        if (session.isAuthenticated()) {
+            return session.getSchedulingKey();
+        }
+        return "fd:" + std::to_string(fd);
+    }
+
+    // Called on the event loop thread; the connection is not armed, so the session is not in use.
+    std::unique_ptr<Command> parseCommand(std::string cmd) {
+        if (binary) {
+            std::string name = wireCommandName(request.opcode);
+            std::vector<std::string> arguments;
+            std::string argument;
+            WireReader reader(cmd);
+            while (!reader.done()) {
+                if (!reader.getField(argument)) {
+                    throw std::runtime_error("Cerere malformata");
+                }
+                arguments.push_back(std::move(argument));
+            }
+
+            std::cout << "FD " << fd << " command: " << name << " (" << arguments.size() << " arguments, id "
+                    << request.request_id << ")\n";
+            if (name.empty()) {
+                throw std::runtime_error("Comanda Invalida");
+            }
+            return CommandFactory::create(name, arguments, this->fd, session, request);
+        }
+
+        cmd = trimString(cmd);
+        std::cout << "FD " << fd << " command: " << cmd << "\n";
+
+        return CommandFactory::createCommand(cmd, this->fd, session);
+    }
+
+    // Runs on a pool thread; commands talk to the client directly.
+    void executeCommand(Command &command, const RequestContext &request) {
+        ServerResponse response{0, "Command failed", ""};
+
+        std::unique_lock<std::shared_mutex> exclusive(session_mutex, std::defer_lock);
+        std::shared_lock<std::shared_mutex> shared(session_mutex, std::defer_lock);
+        if (command.changesSession()) {
+            exclusive.lock();
+        } else {
+            shared.lock();
+        }
+
+        try {
+            response = command.execute();
+
+            if (response.status_code) {
+                std::cout << "SUCCESS: " << response.status_message << '\n';
+            } else {
+                std::cout << "FAILED: " << response.status_message << '\n';
+            }
+        } catch (const char *err) {
+            std::cerr << "COMANDA EROARE: " << err << "\n";
+            response = ServerResponse{0, err, ""};
+        } catch (const std::exception &e) {
+            std::cerr << "EROARE SISTEM: " << e.what() << "\n";
+            response = ServerResponse{0, e.what(), ""};
+        } catch (...) {
+            std::cerr << "EROARE NECUNOSCUTĂ!\n";
+        }
+
+        sendResponse(response, request);
     }
 };
 
@@ -1,30 +1,209 @@
 #ifndef CPP_PERSONAL_CLOUD_COMMAND_HANDLERS_H
 #define CPP_PERSONAL_CLOUD_COMMAND_HANDLERS_H
 
+#include <atomic>
 #include <memory>
 #include <string>
 #include <nlohmann/json.hpp>
 #include <filesystem>
 #include <fstream>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
+#include <fcntl.h>
+#include <sys/stat.h>
 
-#include "picosha2.h"
+#include "sha256_engine.h"
+#include "chunk_store.h"
+#include "cloud_change.h"
 #include "cloud_dir.h"
 #include "cloud_file.h"
 #include "db_manager.h"
 #include "encryption_manager.h"
+#include "file_sender.h"
+#include "metadata_index.h"
+#include "pack_store.h"
 #include "redundancy_manager.h"
+#include "server_config.h"
 #include "server_response.h"
+#include "upload_manager.h"
 #include "user_session.h"
+#include "wire_protocol.h"
 
 #define BUFFER_SIZE 8192
+#define LIST_PAGE_SIZE 1000
+#define LIST_PAGE_MAX 10000
+#define BATCH_ENTRY_MAX 4096
+#define DEDUP_RECIPE_MAX (16 * 1024 * 1024)
 
 using json = nlohmann::json;
 
+inline std::string cleanFileName(std::string name) {
+    name.erase(std::remove(name.begin(), name.end(), '/'), name.end());
+    return name;
+}
+
+inline std::string relativeTarget(std::string target_dir) {
+    if (!target_dir.empty() && target_dir[0] == '/') {
+        target_dir.erase(0, 1);
+    }
+    return target_dir;
+}
+
+// A file is stored either on its own under primary/, in a pack when small (pack_store.h) or as
+// deduplicated chunks (chunk_store.h).
+inline bool storedFileExists(const UserSession &session, const std::filesystem::path &primary_file) {
+    return std::filesystem::exists(primary_file) || PackStore::contains(session.getUserId(), primary_file.string()) ||
+           ChunkStore::contains(session.getUserId(), primary_file.string());
+}
+
+// Rows of a file stored as chunks, part of the caller's transaction. `hash` is that of the
+// plaintext; the chunks carry their own checks. When encrypted, the hash recorded is keyed like a
+// chunk id, so the database doesn't tell which known file is stored.
+inline bool recordChunkedFile(const UserSession &session, const std::filesystem::path &primary_file,
+                              const std::vector<ChunkRef> &recipe, const std::string &hash, unsigned long long size,
+                              bool encrypt) {
+    int user_id = session.getUserId();
+    std::string recorded_hash = encrypt ? ChunkStore::chunkId(session.getCipherKey(), hash) : hash;
+    return !recorded_hash.empty() &&
+           RedundancyManager::saveFileHash(user_id, primary_file.string(), recorded_hash,
+                                           encrypt ? STORAGE_AES_CTR_STREAM : STORAGE_PLAINTEXT) &&
+           ChunkStore::record(user_id, primary_file.string(), recipe) &&
+           MetadataIndex::putFile(user_id, MetadataIndex::indexPath(session.getPrimaryDirectory(), primary_file),
+                                  ChunkStore::fileStat(size), recorded_hash);
+}
+
+// Records a chunked file on its own; the references on its chunks are given back if that fails.
+inline bool commitChunkedFile(const UserSession &session, const std::filesystem::path &primary_file,
+                              const std::vector<ChunkRef> &recipe, const std::string &hash, unsigned long long size,
+                              bool encrypt) {
+    {
+        DBTransaction transaction;
+        if (recordChunkedFile(session, primary_file, recipe, hash, size, encrypt) && transaction.commit()) {
+            return true;
+        }
+    }
+    std::cerr << "Failed to record metadata for " << primary_file << '\n';
+    ChunkStore::release(session.getUserId(), session.getUserDirectory(), recipe);
+    return false;
+}
+
+#define WIRE_DATA_FRAME (256 * 1024)
+
+// How the command being executed was framed. Frames it sends before its final status (GET
+// metadata and data, READY) use the same framing and, in binary mode, the same request id. Binary
+// commands on one connection run concurrently, so every frame is written whole under send_mutex.
+// `cancelled` is set by a CANCEL for the request (binary mode only).
+struct RequestContext {
+    bool binary = false;
+    uint16_t opcode = 0;
+    uint32_t request_id = 0;
+    std::mutex *send_mutex = nullptr;
+    std::shared_ptr<std::atomic<bool> > cancelled{};
+};
+
+inline std::unique_lock<std::mutex> lockSend(const RequestContext &request) {
+    return request.send_mutex ? std::unique_lock<std::mutex>(*request.send_mutex) : std::unique_lock<std::mutex>();
+}
+
+inline bool recvAll(int sock, void *data, size_t length) {
+    size_t total_received = 0;
+    while (total_received < length) {
+        ssize_t received = recv(sock, static_cast<char *>(data) + total_received, length - total_received, 0);
+        if (received <= 0) {
+            return false;
+        }
+        total_received += received;
+    }
+    return true;
+}
+
+inline bool sendFrame(int sock, const RequestContext &request, const std::string &payload) {
+    std::string message;
+    if (request.binary) {
+        message = WireWriter(request.opcode | WIRE_RESPONSE, WIRE_FLAG_PARTIAL, request.request_id)
+                .putField(payload)
+                .finish();
+    } else {
+        int size = payload.length();
+        message.assign(sizeof(int), '\0');
+        std::memcpy(message.data(), &size, sizeof(int));
+        message += payload;
+    }
+
+    auto lock = lockSend(request);
+    return FileSender::sendAll(sock, message.data(), message.size());
+}
+
+// Binary protocol only: sends [offset, offset + length) as WIRE_FLAG_DATA frames whose payload is
+// the raw bytes. `send_range(offset, length)` writes one frame's bytes; replies to other requests on
+// the connection can go out between two frames. Stops, returning false, once the request is
+// cancelled.
+template<typename SendRange>
+bool sendDataFrames(int sock, const RequestContext &request, unsigned long long offset, unsigned long long length,
+                    SendRange send_range) {
+    while (length > 0) {
+        if (request.cancelled && *request.cancelled) {
+            return false;
+        }
+
+        uint32_t frame_length = length < WIRE_DATA_FRAME ? static_cast<uint32_t>(length) : WIRE_DATA_FRAME;
+        WireHeader header{static_cast<uint16_t>(request.opcode | WIRE_RESPONSE), WIRE_FLAG_DATA, request.request_id,
+                          frame_length};
+
+        auto lock = lockSend(request);
+        if (!FileSender::sendAll(sock, reinterpret_cast<const char *>(&header), WIRE_HEADER_SIZE) ||
+            !send_range(offset, frame_length)) {
+            return false;
+        }
+
+        offset += frame_length;
+        length -= frame_length;
+    }
+    return true;
+}
+
+// Reads one text frame of at most `max_size` bytes sent by the client in the middle of a command.
+inline bool receiveFrame(int sock, std::string &payload, size_t max_size) {
+    int size = 0;
+    if (!recvAll(sock, &size, sizeof(int)) || size <= 0 || static_cast<size_t>(size) > max_size) {
+        return false;
+    }
+    payload.resize(size);
+    return recvAll(sock, payload.data(), size);
+}
+
+inline void sendReady(int sock, const RequestContext &request) {
+    sendFrame(sock, request, "READY");
+}
+
 class Command {
 public:
     virtual ServerResponse execute() = 0;
 
+    // Bulk commands stream file contents and are scheduled separately from metadata commands.
+    virtual bool isBulk() const {
+        return false;
+    }
+
+    // Binary protocol: the connection is not read again until the command is done, because it reads
+    // the socket itself (upload data) or changes the session later commands run in.
+    virtual bool holdsConnection() const {
+        return false;
+    }
+
+    // Waits for the other commands in flight on the connection and runs alone.
+    virtual bool changesSession() const {
+        return false;
+    }
+
+    // Asked once the command is done. True when it stopped in the middle of the client's data (a
+    // refused size, a malformed frame): the rest can't be told apart from the next command, so the
+    // connection is closed after the reply instead of being read again.
+    virtual bool desynced() const {
+        return false;
+    }
+
     virtual ~Command() {
     }
 };
@@ -40,6 +219,14 @@ public:
         : username(std::move(username)), passwd(std::move(passwd)), session(session) {
     }
 
+    bool holdsConnection() const override {
+        return true;
+    }
+
+    bool changesSession() const override {
+        return true;
+    }
+
     ServerResponse execute() override {
         if (session.login(username, passwd)) {
             return ServerResponse{1, "Login Successful", ""};
@@ -56,21 +243,175 @@ public:
     LogOutCommand(UserSession &session) : session(session) {
     }
 
+    bool holdsConnection() const override {
+        return true;
+    }
+
+    bool changesSession() const override {
+        return true;
+    }
+
     ServerResponse execute() override {
         session.logout();
         return ServerResponse{1, "Logout Successful", ""};
     }
 };
 
+// GET <path> [offset] [length] - without a range the whole file is sent. For a ranged request the
+// metadata also carries "offset" and "length" (the bytes that will actually follow). "hash" is the
+// stored hash of the file when it has one. A text client answers the metadata with READY, or with
+// anything else to get an error status instead of the data.
 class GetCommand : public Command {
 private:
     UserSession &session;
     std::string file_path;
     int sock;
+    RequestContext request;
+    unsigned long long offset;
+    unsigned long long length;
+    bool ranged;
 
 public:
-    GetCommand(std::string file_path, UserSession &session, int sock)
-        : file_path(std::move(file_path)), session(session), sock(sock) {
+    GetCommand(std::string file_path, UserSession &session, int sock, const RequestContext &request)
+        : session(session), file_path(std::move(file_path)), sock(sock), request(request), offset(0), length(0),
+          ranged(false) {
+    }
+
+    GetCommand(std::string file_path, UserSession &session, int sock, const RequestContext &request,
+               unsigned long long offset, unsigned long long length)
+        : session(session), file_path(std::move(file_path)), sock(sock), request(request), offset(offset),
+          length(length), ranged(true) {
+    }
+
+    bool isBulk() const override {
+        return true;
+    }
+
+    // Reply when the data could not be sent: the client went away or cancelled the download.
+    ServerResponse sendFailure() const {
+        if (request.cancelled && *request.cancelled) {
+            return {0, "Download cancelled", ""};
+        }
+        return {0, "Error sending file data to client", ""};
+    }
+
+    // Download metadata: the file, the range being sent and the stored hash, which a client resuming
+    // into a partial download compares with the one it started from.
+    json describe(const CloudFile &fileToSend, unsigned long long to_send, const std::string &hash) const {
+        json j = fileToSend;
+        if (ranged) {
+            j["offset"] = offset;
+            j["length"] = to_send;
+        }
+        if (!hash.empty()) {
+            j["hash"] = hash;
+        }
+        return j;
+    }
+
+    // Sends the metadata of a file that is not read from a file of its own and waits for a text
+    // client's READY. On failure `error` holds the reply.
+    bool announce(const CloudFile &fileToSend, const std::string &hash, unsigned long long &to_send,
+                  ServerResponse &error) {
+        if (offset > fileToSend.size) {
+            error = {0, "Offset past end of file", ""};
+            return false;
+        }
+
+        unsigned long long available = fileToSend.size - offset;
+        to_send = (length == 0 || length > available) ? available : length;
+
+        if (!sendFrame(sock, request, describe(fileToSend, to_send, hash).dump())) {
+            error = {0, "Client disconnected", ""};
+            return false;
+        }
+
+        if (!request.binary) {
+            std::string response;
+            if (!receiveFrame(sock, response, 100)) {
+                error = {0, "Client disconnected", ""};
+                return false;
+            }
+            if (response != "READY") {
+                error = {0, "Sync error. Expected READY, got: " + response, ""};
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Keystream the stored bytes of a loose or packed file were encrypted with.
+    CipherStream storedCipher(const IntegrityRecord &record) const {
+        return record.encryption == STORAGE_AES_CTR_LEGACY
+                   ? EncryptionManager::legacyStream(session.getCipherKey())
+                   : EncryptionManager::stream(session.getCipherKey(), record.nonce);
+    }
+
+    // A packed file is small: it is read, checked (and repaired from the backup pack) and decrypted
+    // in memory, then sent like any other.
+    ServerResponse sendPacked(const std::filesystem::path &primary_path, const IntegrityRecord &record) {
+        CipherStream cipher = storedCipher(record);
+        if (record.encryption != STORAGE_PLAINTEXT && !cipher.valid()) {
+            return {0, "No encryption key for " + primary_path.filename().string(), ""};
+        }
+
+        std::string data;
+        if (!PackStore::load(session.getUserId(), session.getUserDirectory(), primary_path.string(), record, data)) {
+            return {0, "Can't read packed file " + primary_path.filename().string(), ""};
+        }
+
+        CloudFile fileToSend = {data.size(), primary_path.filename().string()};
+        unsigned long long to_send = 0;
+        ServerResponse error;
+        if (!announce(fileToSend, record.hash, to_send, error)) {
+            return error;
+        }
+
+        if (record.encryption != STORAGE_PLAINTEXT) {
+            cipher.seek(offset);
+            cipher.xcrypt(reinterpret_cast<uint8_t *>(data.data() + offset), to_send);
+        }
+
+        auto sendRange = [&](unsigned long long from, unsigned long long count) {
+            return FileSender::sendAll(sock, data.data() + from, count);
+        };
+        bool sent = request.binary
+                        ? sendDataFrames(sock, request, offset, to_send, sendRange)
+                        : sendRange(offset, to_send);
+        if (!sent) {
+            return sendFailure();
+        }
+
+        return ServerResponse{1, "Successfully downloaded " + fileToSend.name, ""};
+    }
+
+    // A chunked file is put back together as it is sent; every chunk is checked (and repaired from
+    // its backup copy) when it is loaded.
+    ServerResponse sendChunked(const std::filesystem::path &primary_path, const IntegrityRecord &record,
+                               std::vector<ChunkRef> recipe) {
+        ChunkReader reader(session.getUserId(), session.getUserDirectory(), session.getCipherKey(),
+                           std::move(recipe));
+
+        CloudFile fileToSend = {reader.size(), primary_path.filename().string()};
+        unsigned long long to_send = 0;
+        ServerResponse error;
+        if (!announce(fileToSend, record.hash, to_send, error)) {
+            return error;
+        }
+
+        auto sendRange = [&](unsigned long long from, unsigned long long count) {
+            return reader.read(from, count, [&](const char *data, size_t size) {
+                return FileSender::sendAll(sock, data, size);
+            });
+        };
+        bool sent = request.binary
+                        ? sendDataFrames(sock, request, offset, to_send, sendRange)
+                        : sendRange(offset, to_send);
+        if (!sent) {
+            return sendFailure();
+        }
+
+        return ServerResponse{1, "Successfully downloaded " + fileToSend.name, ""};
     }
 
     ServerResponse execute() override {
@@ -78,88 +419,153 @@ public:
             return ServerResponse{0, "Not authenticated", ""};
         }
 
-        std::filesystem::path primary_path = session.getUserDirectory() / "primary" / file_path;
-        int user_id = DBManager::get_user_id(session.getUsername());
-        std::string db_hash = RedundancyManager::getStoredHash(user_id,
-                                                               primary_path.string());
+        std::filesystem::path primary_path = session.getPrimaryDirectory() / file_path;
+        std::filesystem::path backup_path = session.getBackupDirectory() / file_path;
+        int user_id = session.getUserId();
+        IntegrityRecord record = RedundancyManager::getIntegrityRecord(user_id, primary_path.string());
+        long long max_age = static_cast<long long>(ServerConfig::instance().verify_max_age_sec);
+
+        // Every stored file gets its row in the transaction that stores it. Without one there is no
+        // telling how the bytes are encrypted and nothing to check them against, so nothing is sent.
+        if (!record.found) {
+            bool stored = std::filesystem::exists(primary_path) || std::filesystem::exists(backup_path) ||
+                          PackStore::contains(user_id, primary_path.string()) ||
+                          ChunkStore::contains(user_id, primary_path.string());
+            if (stored) {
+                std::cerr << "No integrity record for " << primary_path << '\n';
+                return {0, "No integrity record for " + file_path, ""};
+            }
+            return {0, "File doesn't exist " + primary_path.string() + "\n", ""};
+        }
 
-        std::cout << "Looking for hash of: " << primary_path.filename() << "\n";
-        std::cout << "Found hash: " << db_hash << "\n";
+        // Files unchanged since their last check are sent right away. Otherwise a whole-file
+        // download is verified while it streams, and a partial read checks (and patches) only the
+        // blocks it covers. Files without block hashes, and a missing primary, go through the
+        // whole-file check up front, which restores the primary from the backup.
+        struct stat path_stat{};
+        bool exists = stat(primary_path.c_str(), &path_stat) == 0;
+        if (!exists && PackStore::contains(user_id, primary_path.string())) {
+            return sendPacked(primary_path, record);
+        }
+        std::vector<ChunkRef> recipe;
+        if (!exists && ChunkStore::recipe(user_id, primary_path.string(), recipe)) {
+            return sendChunked(primary_path, record, std::move(recipe));
+        }
+        bool needs_check = !record.hash.empty() && !(exists && record.isVerified(path_stat, max_age));
+        unsigned long long file_size = exists ? static_cast<unsigned long long>(path_stat.st_size) : 0;
+        bool whole_file = exists && offset == 0 && (length == 0 || length >= file_size);
+
+        if (needs_check && !whole_file && exists && !record.block_hashes.empty() && offset < file_size) {
+            unsigned long long range = (length == 0 || length > file_size - offset) ? file_size - offset : length;
+            if (RedundancyManager::verifyRange(primary_path.string(), backup_path.string(), record.block_hashes,
+                                               offset, range)) {
+                needs_check = false;
+            }
+        }
 
-        if (!db_hash.empty()) {
-            if (!RedundancyManager::verifyFileIntegrity(primary_path.string(), db_hash)) {
+        if (needs_check && !whole_file) {
+            if (!RedundancyManager::verifyFileIntegrity(primary_path.string(), record.hash)) {
                 std::cout << "Hash mismatch! Repairing...\n";
-                std::filesystem::path backup_path = session.getUserDirectory() / "backup" / file_path;
                 RedundancyManager::repairFromBackup(primary_path.string(), backup_path.string());
+            } else {
+                RedundancyManager::markVerified(user_id, primary_path.string(), path_stat);
             }
-        } else {
-            std::cout << "Warning: No hash found in DB for " << file_path << "\n";
+            needs_check = false;
         }
 
         file_path = primary_path;
+        int encryption = record.encryption;
+        CipherStream cipher = storedCipher(record);
+        if (encryption != STORAGE_PLAINTEXT && !cipher.valid()) {
+            return {0, "No encryption key for " + primary_path.filename().string(), ""};
+        }
+
         try {
-            if (!std::filesystem::exists(file_path)) {
+            int file_fd = open(file_path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (file_fd < 0) {
                 std::string err = "File doesn't exist " + file_path;
                 err += '\n';
                 return {0, err, ""};
             }
+
+            struct stat file_stat{};
+            if (fstat(file_fd, &file_stat) < 0 || !S_ISREG(file_stat.st_mode)) {
+                close(file_fd);
+                return {0, "Can't open file for reading", ""};
+            }
+
             std::filesystem::path path(file_path);
             CloudFile fileToSend = {
-                std::filesystem::file_size(path),
+                static_cast<unsigned long long>(file_stat.st_size),
                 path.filename().string(),
             };
 
-            json j = fileToSend;
-            std::string metadata_json = j.dump();
-
-            int json_size = metadata_json.length();
-            send(sock, &json_size, sizeof(int), 0);
-            send(sock, metadata_json.c_str(), json_size, 0);
-
-            int size = 0;
-            if (recv(sock, &size, sizeof(int), 0) <= 0) {
-                return {0, "Client disconnected", ""};
+            if (offset > fileToSend.size) {
+                close(file_fd);
+                return {0, "Offset past end of file", ""};
             }
 
-            if (size <= 0 || size > 100) {
-                return {0, "Protocol error: invalid READY size", ""};
-            }
+            unsigned long long available = fileToSend.size - offset;
+            unsigned long long to_send = (length == 0 || length > available) ? available : length;
 
-            char buffer[100];
-            memset(buffer, 0, 100);
-            int bytes_rec = recv(sock, buffer, size, 0);
+            std::string metadata_json = describe(fileToSend, to_send, record.hash).dump();
 
-            std::string response(buffer, bytes_rec);
-            if (response != "READY") {
-                return {0, "Sync error. Expected READY, got: " + response, ""};
+            if (!sendFrame(sock, request, metadata_json)) {
+                close(file_fd);
+                return {0, "Client disconnected", ""};
             }
 
-            std::ifstream file(file_path, std::ios::binary);
-            if (!file.is_open()) {
-                std::string err = "Can't open file for reading";
-                return {0, err, ""};
+            // In binary mode the data follows as frames right away; a text client confirms first.
+            if (!request.binary) {
+                std::string response;
+                if (!receiveFrame(sock, response, 100)) {
+                    close(file_fd);
+                    return {0, "Client disconnected", ""};
+                }
+
+                if (response != "READY") {
+                    close(file_fd);
+                    return {0, "Sync error. Expected READY, got: " + response, ""};
+                }
             }
 
-            char file_buffer[BUFFER_SIZE];
-            size_t total_sent = 0;
+            FileDigest hasher(record.block_hashes.empty());
+            auto sendRange = [&](unsigned long long from, unsigned long long count) {
+                if (encryption == STORAGE_PLAINTEXT && !needs_check) {
+                    return FileSender::sendPlain(sock, file_fd, from, count);
+                }
+                if (encryption == STORAGE_PLAINTEXT) {
+                    return FileSender::sendBuffered(sock, file_fd, from, count, nullptr, &hasher);
+                }
+                return FileSender::sendBuffered(sock, file_fd, from, count, &cipher, needs_check ? &hasher : nullptr);
+            };
 
-            while (file.read(file_buffer, sizeof(file_buffer)) || file.gcount() > 0) {
-                size_t bytes_to_send = file.gcount();
+            bool sent = request.binary
+                            ? sendDataFrames(sock, request, offset, to_send, sendRange)
+                            : sendRange(offset, to_send);
+            close(file_fd);
 
-                std::string hash = session.getPasswordHash();
-                EncryptionManager::decrypt((uint8_t *) file_buffer, bytes_to_send, hash);
+            if (!sent) {
+                return sendFailure();
+            }
 
-                ssize_t sent = send(sock, file_buffer, bytes_to_send, 0);
-                if (sent < 0) {
-                    std::string err = "Error sending file data to client";
-                    file.close();
-                    return {0, err, ""};
+            if (needs_check) {
+                if (!record.matches(hasher)) {
+                    std::cout << "Hash mismatch! Repairing...\n";
+                    if (record.block_hashes.empty()) {
+                        RedundancyManager::repairFromBackup(file_path, backup_path.string());
+                    } else {
+                        RedundancyManager::repairBlocks(file_path, backup_path.string(), record.block_hashes,
+                                                        hasher.blockHashes());
+                    }
+                    return {0, "Integrity check failed, the file was restored from backup. Download it again", ""};
                 }
-
-                total_sent += sent;
+                if (record.block_hashes.empty()) {
+                    RedundancyManager::saveBlockHashes(user_id, file_path, hasher.blockHashes());
+                }
+                RedundancyManager::markVerified(user_id, file_path, file_stat);
             }
 
-            file.close();
             return ServerResponse{
                 1, "Successfully downloaded " + std::filesystem::path(file_path).filename().string(), ""
             };
@@ -176,12 +582,114 @@ class PostCommand : public Command {
 private:
     std::string ObjJson;
     int client_sock;
+    RequestContext request;
     UserSession &session;
     std::string target_dir;
 
 public:
-    PostCommand(std::string ObjJson, std::string target_dir, int client_sock, UserSession &session)
-        : ObjJson(std::move(ObjJson)), target_dir(std::move(target_dir)), client_sock(client_sock), session(session) {
+    PostCommand(std::string ObjJson, std::string target_dir, int client_sock, const RequestContext &request,
+                UserSession &session)
+        : ObjJson(std::move(ObjJson)), client_sock(client_sock), request(request), session(session),
+          target_dir(std::move(target_dir)) {
+    }
+
+    bool isBulk() const override {
+        return true;
+    }
+
+    bool holdsConnection() const override {
+        return true;
+    }
+
+    // A small file is received whole and appended to the user's pack, like in POST_BATCH.
+    ServerResponse receivePacked(const CloudFile &received_file, const std::filesystem::path &primary_file) {
+        bool encrypt = ServerConfig::instance().encrypt_at_rest;
+        std::string nonce = encrypt ? EncryptionManager::newNonce() : "";
+        CipherStream cipher = EncryptionManager::stream(session.getCipherKey(), nonce);
+        if (encrypt && !cipher.valid()) {
+            return ServerResponse{0, "No encryption key for this session", ""};
+        }
+
+        sendReady(client_sock, request);
+
+        std::string data(received_file.size, '\0');
+        if (!recvAll(client_sock, data.data(), data.size())) {
+            return ServerResponse{0, "Transfer interrupted", ""};
+        }
+        if (encrypt) {
+            cipher.xcrypt(reinterpret_cast<uint8_t *>(data.data()), data.size());
+        }
+
+        FileDigest hasher;
+        hasher.update(data.data(), data.size());
+        std::string hash = hasher.fileHash();
+
+        int user_id = session.getUserId();
+        PackEntry entry;
+        if (!PackStore::append(user_id, session.getUserDirectory(), data, entry)) {
+            return ServerResponse{0, "Failed to store file", ""};
+        }
+
+        bool recorded;
+        {
+            DBTransaction transaction;
+            recorded = RedundancyManager::saveFileHash(user_id, primary_file.string(), hash,
+                                                       encrypt ? STORAGE_AES_CTR_STREAM : STORAGE_PLAINTEXT,
+                                                       hasher.blockHashes(), nonce) &&
+                       PackStore::record(user_id, primary_file.string(), entry) &&
+                       MetadataIndex::putFile(user_id,
+                                              MetadataIndex::indexPath(session.getPrimaryDirectory(), primary_file),
+                                              PackStore::entryStat(entry), hash) &&
+                       transaction.commit();
+        }
+        PackStore::settle(user_id, entry);
+
+        if (!recorded) {
+            std::cerr << "Failed to record metadata for " << primary_file << '\n';
+            return ServerResponse{0, "Failed to record file", ""};
+        }
+
+        return ServerResponse{1, "Successfully uploaded file " + received_file.name, ""};
+    }
+
+    // The file is cut into chunks as it arrives; only chunks the user doesn't have yet are written.
+    ServerResponse receiveChunked(const CloudFile &received_file, const std::filesystem::path &primary_file) {
+        bool encrypt = ServerConfig::instance().encrypt_at_rest;
+        if (encrypt && !session.getCipherKey()) {
+            return ServerResponse{0, "No encryption key for this session", ""};
+        }
+
+        sendReady(client_sock, request);
+
+        ChunkWriter writer(session.getUserId(), session.getUserDirectory(), session.getCipherKey(), encrypt);
+        thread_local std::vector<char> buffer(64 * 1024);
+        unsigned long long total_received = 0;
+        bool stored = true;
+
+        while (total_received < received_file.size) {
+            size_t remaining = received_file.size - total_received;
+            size_t to_receive = buffer.size() < remaining ? buffer.size() : remaining;
+            ssize_t bytes_received = recv(client_sock, buffer.data(), to_receive, 0);
+
+            if (bytes_received <= 0) {
+                writer.abort();
+                return ServerResponse{0, "Transfer interrupted", ""};
+            }
+
+            // After a failed write the rest is still read, so the connection stays in step.
+            stored = stored && writer.feed(buffer.data(), bytes_received);
+            total_received += bytes_received;
+        }
+
+        if (!stored || !writer.finish()) {
+            writer.abort();
+            return ServerResponse{0, "Failed to store file", ""};
+        }
+        if (!commitChunkedFile(session, primary_file, writer.recipe(), writer.fileHash(), writer.size(), encrypt)) {
+            return ServerResponse{0, "Failed to record file", ""};
+        }
+
+        return ServerResponse{1, "Successfully uploaded file " + received_file.name, ""};
     }
 
     ServerResponse execute() override {
@@ -193,36 +701,55 @@ public:
             json j = json::parse(this->ObjJson);
             CloudFile received_file = j.get<CloudFile>();
 
-            std::string clean_name = received_file.name;
-            clean_name.erase(std::remove(clean_name.begin(), clean_name.end(), '/'), clean_name.end());
+            std::string clean_name = cleanFileName(received_file.name);
 
-            std::filesystem::path primary_dir = session.getUserDirectory() / "primary";
-            std::filesystem::path backup_dir = session.getUserDirectory() / "backup";
+            std::filesystem::path primary_dir = session.getPrimaryDirectory();
+            std::filesystem::path backup_dir = session.getBackupDirectory();
 
-            std::string relative_target = this->target_dir;
-            if (!relative_target.empty() && relative_target[0] == '/') {
-                relative_target.erase(0, 1);
-            }
+            std::string relative_target = relativeTarget(this->target_dir);
 
             std::filesystem::path primary_file = primary_dir / relative_target / clean_name;
             std::filesystem::path backup_file = backup_dir / relative_target / clean_name;
 
-            if (std::filesystem::exists(primary_file)) {
+            if (storedFileExists(session, primary_file)) {
                 return ServerResponse{0, "File already exists", ""};
             }
+            if (!std::filesystem::is_directory(primary_file.parent_path())) {
+                return ServerResponse{0, "Target directory doesn't exist", ""};
+            }
+            if (PackStore::accepts(received_file.size)) {
+                return receivePacked(received_file, primary_file);
+            }
+            if (ChunkStore::accepts(received_file.size)) {
+                return receiveChunked(received_file, primary_file);
+            }
+
+            // Refused before READY and before anything is created, so the client sends no data and
+            // no empty file is left behind.
+            bool encrypt = ServerConfig::instance().encrypt_at_rest;
+            std::string nonce = encrypt ? EncryptionManager::newNonce() : "";
+            CipherStream cipher = EncryptionManager::stream(session.getCipherKey(), nonce);
+            if (encrypt && !cipher.valid()) {
+                return ServerResponse{0, "No encryption key for this session", ""};
+            }
 
             std::ofstream primary_stream(primary_file, std::ios::binary);
             std::ofstream backup_stream(backup_file, std::ios::binary);
 
             if (!primary_stream.is_open() || !backup_stream.is_open()) {
+                primary_stream.close();
+                backup_stream.close();
+                std::error_code ec;
+                std::filesystem::remove(primary_file, ec);
+                std::filesystem::remove(backup_file, ec);
                 return ServerResponse{0, "Failed to create file", ""};
             }
 
-            std::string ack = "READY";
-            size_t ack_size = ack.length();
-            send(client_sock, &ack_size, sizeof(int), 0);
-            send(client_sock, ack.c_str(), ack_size, 0);
+            sendReady(client_sock, request);
 
+            // The stored hash covers the bytes as written to disk, the same thing verifyFileIntegrity
+            // reads back, so it is computed here instead of re-reading the file afterwards.
+            FileDigest hasher;
             char buffer[8192];
             size_t total_received = 0;
             size_t file_size = received_file.size;
@@ -240,9 +767,11 @@ public:
                     return ServerResponse{0, "Transfer interrupted", ""};
                 }
 
-                std::string hash = session.getPasswordHash();
-                EncryptionManager::encrypt((uint8_t *) buffer, bytes_received, hash);
+                if (encrypt) {
+                    cipher.xcrypt(reinterpret_cast<uint8_t *>(buffer), bytes_received);
+                }
 
+                hasher.update(buffer, bytes_received);
                 primary_stream.write(buffer, bytes_received);
                 backup_stream.write(buffer, bytes_received);
 
@@ -252,9 +781,24 @@ public:
             primary_stream.close();
             backup_stream.close();
 
-            std::string hash = RedundancyManager::calculateHash(primary_file.string());
-            int user_id = DBManager::get_user_id(session.getUsername());
-            RedundancyManager::saveFileHash(user_id, primary_file.string(), hash);
+            int user_id = session.getUserId();
+            std::string hash = hasher.fileHash();
+            struct stat file_stat{};
+            stat(primary_file.c_str(), &file_stat);
+
+            DBTransaction transaction;
+            if (!RedundancyManager::saveFileHash(user_id, primary_file.string(), hash,
+                                                 encrypt ? STORAGE_AES_CTR_STREAM : STORAGE_PLAINTEXT,
+                                                 hasher.blockHashes(), nonce) ||
+                !MetadataIndex::putFile(user_id, MetadataIndex::indexPath(primary_dir, primary_file), file_stat,
+                                        hash) ||
+                !transaction.commit()) {
+                // A file without its rows would be served unchecked and missing from listings.
+                std::cerr << "Failed to record metadata for " << primary_file << '\n';
+                std::filesystem::remove(primary_file);
+                std::filesystem::remove(backup_file);
+                return ServerResponse{0, "Failed to record file", ""};
+            }
 
             return ServerResponse{1, "Successfully uploaded file " + received_file.name, ""};
         } catch (const json::parse_error &e) {
@@ -265,50 +809,40 @@ public:
     }
 };
 
-class ListCommand : public Command {
+// "ranges" are the merged byte ranges the server holds; "chunks" lists them as received,
+// [offset, length, sha256], so a client resuming from a file that has changed since can tell which
+// ones to send again.
+inline json uploadStatusJson(const UploadSession &upload) {
+    json ranges = json::array();
+    for (const auto &range: UploadManager::getRanges(upload.id)) {
+        ranges.push_back({range.first, range.second});
+    }
+    json chunks = json::array();
+    for (const auto &chunk: UploadManager::getChunks(upload.id)) {
+        chunks.push_back({chunk.offset, chunk.length, chunk.hash});
+    }
+
+    return json{
+        {"upload_id", upload.id},
+        {"size", upload.size},
+        {"chunk_size", UPLOAD_CHUNK_SIZE},
+        {"ranges", ranges},
+        {"chunks", chunks},
+    };
+}
+
+// POST_BEGIN <file json> <target dir> - opens (or resumes) an upload session. The reply lists the
+// byte ranges the server already holds so the client only sends what is missing. Sessions left
+// idle past their time to live are swept here, at most once an hour.
+class PostBeginCommand : public Command {
 private:
+    std::string ObjJson;
+    std::string target_dir;
     UserSession &session;
 
-    CloudDir buildDir(const std::filesystem::path &dir_path, const std::filesystem::path &base_path) {
-        CloudDir cloud_dir;
-        cloud_dir.name = dir_path.filename().string();
-
-        std::filesystem::path rel_path = std::filesystem::relative(dir_path, base_path);
-
-        if (rel_path == ".") {
-            cloud_dir.path = "/";
-        } else {
-            std::string path_str = rel_path.string();
-            std::replace(path_str.begin(), path_str.end(), '\\', '/');
-
-            if (path_str[0] != '/') {
-                cloud_dir.path = "/" + path_str;
-            } else {
-                cloud_dir.path = path_str;
-            }
-        }
-
-        try {
-            for (const auto &entry: std::filesystem::directory_iterator(dir_path)) {
-                if (entry.is_regular_file()) {
-                    CloudFile file;
-                    file.name = entry.path().filename().string();
-                    file.size = std::filesystem::file_size(entry.path());
-                    cloud_dir.files.push_back(file);
-                } else if (entry.is_directory()) {
-                    CloudDir subdir = buildDir(entry.path(), base_path);
-                    cloud_dir.subdirs.push_back(subdir);
-                }
-            }
-        } catch (const std::filesystem::filesystem_error &e) {
-            std::cerr << "Error reading directory: " << e.what() << '\n';
-        }
-
-        return cloud_dir;
-    }
-
 public:
-    ListCommand(UserSession &session) : session(session) {
+    PostBeginCommand(std::string ObjJson, std::string target_dir, UserSession &session)
+        : ObjJson(std::move(ObjJson)), target_dir(std::move(target_dir)), session(session) {
     }
 
     ServerResponse execute() override {
@@ -317,126 +851,1380 @@ public:
         }
 
         try {
-            std::filesystem::path primary_dir = session.getUserDirectory() / "primary";
+            CloudFile received_file = json::parse(this->ObjJson).get<CloudFile>();
+            std::string clean_name = cleanFileName(received_file.name);
 
-            if (!std::filesystem::exists(primary_dir)) {
-                return ServerResponse{0, "User directory not found", ""};
+            std::filesystem::path primary_file =
+                    session.getPrimaryDirectory() / relativeTarget(target_dir) / clean_name;
+            if (storedFileExists(session, primary_file)) {
+                return ServerResponse{0, "File already exists", ""};
+            }
+            if (!std::filesystem::is_directory(primary_file.parent_path())) {
+                return ServerResponse{0, "Target directory doesn't exist", ""};
             }
 
-            CloudDir root = buildDir(primary_dir, primary_dir);
+            UploadManager::sweepExpired(ServerConfig::instance().upload_ttl_sec);
 
-            json j = root;
-            std::string json_str = j.dump();
+            int encryption = ServerConfig::instance().encrypt_at_rest ? STORAGE_AES_CTR_STREAM : STORAGE_PLAINTEXT;
+            std::string nonce = encryption == STORAGE_AES_CTR_STREAM ? EncryptionManager::newNonce() : "";
+            UploadSession upload = UploadManager::beginSession(session.getUserId(), target_dir, clean_name,
+                                                               received_file.size, encryption, nonce);
+            if (upload.id.empty()) {
+                return ServerResponse{0, "Failed to create upload session", ""};
+            }
 
-            std::cout << json_str << '\n';
+            std::filesystem::path staging_file = session.getStagingDirectory() / upload.id;
+            std::filesystem::create_directories(staging_file.parent_path());
+
+            int fd = open(staging_file.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+            if (fd < 0) {
+                return ServerResponse{0, "Failed to create staging file", ""};
+            }
+            int truncated = ftruncate(fd, static_cast<off_t>(upload.size));
+            close(fd);
+            if (truncated < 0) {
+                return ServerResponse{0, "Not enough space for upload", ""};
+            }
 
-            return ServerResponse{1, "List Successful", json_str};
+            return ServerResponse{1, "Upload session ready", uploadStatusJson(upload).dump()};
+        } catch (const json::exception &e) {
+            return ServerResponse{0, "JSON parse error", e.what()};
         } catch (const std::exception &e) {
-            return ServerResponse{0, "Error listing files", e.what()};
+            return ServerResponse{0, "Error starting upload", e.what()};
         }
     }
 };
 
-class DeleteCommand : public Command {
+class PostStatusCommand : public Command {
 private:
-    std::string path;
+    std::string upload_id;
     UserSession &session;
 
 public:
-    DeleteCommand(const std::string &path, UserSession &session) : path(path), session(session) {
+    PostStatusCommand(std::string upload_id, UserSession &session)
+        : upload_id(std::move(upload_id)), session(session) {
     }
 
     ServerResponse execute() override {
-        try {
-            std::filesystem::path primary_p = session.getUserDirectory() / "primary" / path;
-            std::filesystem::path backup_p = session.getUserDirectory() / "backup" / path;
-
-            bool deleted_primary = std::filesystem::remove(primary_p);
-            std::filesystem::remove(backup_p);
-            DBManager::removeFile(session.getUsername(), primary_p.filename());
+        if (!session.isAuthenticated()) {
+            return ServerResponse{0, "Not authenticated", ""};
+        }
 
-            if (deleted_primary) {
-                return ServerResponse{1, "Deleted successfully", ""};
-            } else {
-                return ServerResponse{0, "File not found in primary storage", ""};
-            }
-        } catch (const std::filesystem::filesystem_error &e) {
-            return ServerResponse{0, e.what(), ""};
+        UploadSession upload;
+        if (!UploadManager::getSession(upload_id, session.getUserId(), upload)) {
+            return ServerResponse{0, "Unknown upload", ""};
         }
+
+        return ServerResponse{1, "Upload status", uploadStatusJson(upload).dump()};
     }
 };
 
-class CreateDirCommand : public Command {
+// POST_CHUNK <upload id> <offset> <length> <sha256 of the plaintext chunk>. After READY the client
+// streams `length` bytes; once their checksum matches they are encrypted at their own offset and
+// written into the staging file, and the range is recorded.
+class PostChunkCommand : public Command {
 private:
-    std::string name;
-    std::string target_dir;
+    std::string upload_id;
+    unsigned long long offset;
+    unsigned long long length;
+    std::string expected_hash;
+    int client_sock;
+    RequestContext request;
     UserSession &session;
 
 public:
-    CreateDirCommand(const std::string &name, const std::string &target_dir, UserSession &session) : name(name),
-        target_dir(target_dir), session(session) {
+    PostChunkCommand(std::string upload_id, unsigned long long offset, unsigned long long length,
+                     std::string expected_hash, int client_sock, const RequestContext &request,
+                     UserSession &session)
+        : upload_id(std::move(upload_id)), offset(offset), length(length), expected_hash(std::move(expected_hash)),
+          client_sock(client_sock), request(request), session(session) {
+    }
+
+    bool isBulk() const override {
+        return true;
+    }
+
+    bool holdsConnection() const override {
+        return true;
     }
 
     ServerResponse execute() override {
-        std::filesystem::path primary_path =
-                session.getUserDirectory().string() + "/" + "primary" + "/" + target_dir + "/" + name;
-        std::filesystem::path backup_path = session.getUserDirectory().string() + "/" + "backup" + "/" + target_dir
-                                            + "/" + name;
+        if (!session.isAuthenticated()) {
+            return ServerResponse{0, "Not authenticated", ""};
+        }
 
-        try {
-            if (std::filesystem::exists(primary_path)) {
-                return {0, "Directory already exists", ""};
+        UploadSession upload;
+        if (!UploadManager::getSession(upload_id, session.getUserId(), upload)) {
+            return ServerResponse{0, "Unknown upload", ""};
+        }
+
+        if (length == 0 || length > MAX_UPLOAD_CHUNK || offset > upload.size || length > upload.size - offset) {
+            return ServerResponse{0, "Invalid chunk range", ""};
+        }
+
+        CipherStream cipher = EncryptionManager::stream(session.getCipherKey(), upload.nonce);
+        bool encrypt = upload.encryption != STORAGE_PLAINTEXT;
+        if (encrypt && !cipher.valid()) {
+            return ServerResponse{0, "No encryption key for this upload", ""};
+        }
+        cipher.seek(offset);
+
+        std::filesystem::path staging_file = session.getStagingDirectory() / upload.id;
+        int fd = open(staging_file.c_str(), O_RDWR | O_CLOEXEC);
+        if (fd < 0) {
+            return ServerResponse{0, "Staging file missing", ""};
+        }
+
+        // A chunk that continues the hashed prefix is folded into a copy of the upload digest, which
+        // is only published once the chunk is stored and if the digest hasn't moved meanwhile. A
+        // chunk sent again (the client's file changed since it was first sent) replaces bytes the
+        // digest may cover, now or by the time they are written: it starts over both times.
+        auto digest = UploadManager::getDigest(upload.id);
+        bool rewrite = UploadManager::overlapsChunk(upload.id, offset, length);
+        bool hash_inline = false;
+        unsigned long long generation = 0;
+        FileDigest stored_hasher;
+        {
+            std::lock_guard<std::mutex> digest_lock(digest->mutex);
+            if (offset < digest->hashed) {
+                rewrite = true;
+                digest->rewind();
+            }
+            if (digest->hashed == offset) {
+                hash_inline = true;
+                generation = digest->generation;
+                stored_hasher = digest->hasher;
             }
-            std::filesystem::create_directory(primary_path);
-            std::filesystem::create_directory(backup_path);
-            return {1, "Successfully Created Directory", ""};
-        } catch (std::exception e) {
-            return {0, e.what(), ""};
         }
-    }
-};
 
-class RegisterCommand : public Command {
-private:
-    std::string user;
-    std::string pass;
+        sendReady(client_sock, request);
 
-public:
-    RegisterCommand(const std::string &name, const std::string &pass)
-        : user(name), pass(pass) {
-    }
+        // The whole chunk is received and checked before any of it reaches the staging file, so a
+        // corrupt chunk never overwrites bytes that are already there.
+        thread_local std::vector<char> buffer;
+        buffer.resize(length);
+        Sha256 hasher;
+        unsigned long long received_total = 0;
 
-    ServerResponse execute() override {
-        if (DBManager::try_register(user, pass)) {
-            return {1, "Registered Successfully", ""};
-        } else {
-            return {0, "Username Taken", ""};
+        while (received_total < length) {
+            ssize_t bytes_received = recv(client_sock, buffer.data() + received_total, length - received_total, 0);
+
+            if (bytes_received <= 0) {
+                close(fd);
+                return ServerResponse{0, "Transfer interrupted", ""};
+            }
+
+            hasher.update(buffer.data() + received_total, bytes_received);
+            received_total += bytes_received;
         }
-    }
-};
 
-class CommandFactory {
-public:
-    static std::unique_ptr<Command> createCommand(
-        const std::string &command, int client_sock,
-        UserSession &session) {
-        std::vector<std::string> arguments = getArguments(command);
+        std::string actual_hash = hasher.hexDigest();
 
-        if (command.find("LOGIN") == 0) {
-            return std::make_unique<LogInCommand>(arguments[0], arguments[1], session);
-        } else if (command.find("LOGOUT") == 0) {
-            return std::make_unique<LogOutCommand>(session);
-        } else if (command.find("GET") == 0) {
-            return std::make_unique<GetCommand>(arguments[0], session, client_sock);
-        } else if (command.find("POST") == 0) {
-            return std::make_unique<PostCommand>(arguments[0], arguments[1], client_sock, session);
-        } else if (command.find("LIST") == 0) {
+        if (actual_hash != expected_hash) {
+            close(fd);
+            return ServerResponse{0, "Chunk checksum mismatch", ""};
+        }
+
+        if (encrypt) {
+            cipher.xcrypt(reinterpret_cast<uint8_t *>(buffer.data()), length);
+        }
+        if (hash_inline) {
+            stored_hasher.update(buffer.data(), length);
+        }
+
+        unsigned long long written_total = 0;
+        while (written_total < length) {
+            ssize_t result = pwrite(fd, buffer.data() + written_total, length - written_total,
+                                    static_cast<off_t>(offset + written_total));
+            if (result < 0 && errno == EINTR) {
+                continue;
+            }
+            if (result <= 0) {
+                break;
+            }
+            written_total += result;
+        }
+        bool written = written_total == length;
+        if (buffer.size() > UPLOAD_CHUNK_SIZE) {
+            std::vector<char>().swap(buffer);
+        }
+        if (!written) {
+            close(fd);
+            return ServerResponse{0, "Failed to write chunk", ""};
+        }
+
+        if (!UploadManager::recordChunk(upload.id, offset, length, actual_hash)) {
+            close(fd);
+            return ServerResponse{0, "Failed to record chunk", ""};
+        }
+
+        std::unique_lock<std::mutex> digest_lock(digest->mutex, std::defer_lock);
+        if (hash_inline || rewrite) {
+            digest_lock.lock();
+        } else {
+            digest_lock.try_lock();
+        }
+        if (hash_inline && digest->generation == generation && digest->hashed == offset) {
+            digest->hasher = stored_hasher;
+            digest->hashed += length;
+        } else if (rewrite && offset < digest->hashed) {
+            digest->rewind();
+        }
+
+        // Chunks sent in parallel land behind a gap; once the prefix reaches them they are hashed
+        // from the staging file while they are still in the page cache.
+        if (digest_lock.owns_lock()) {
+            UploadManager::extendDigest(*digest, fd, UploadManager::contiguousEnd(upload.id));
+        }
+        close(fd);
+
+        return ServerResponse{1, "Chunk stored", ""};
+    }
+};
+
+// POST_COMMIT <upload id> - moves a complete staging file into primary storage and writes the backup.
+class PostCommitCommand : public Command {
+private:
+    std::string upload_id;
+    UserSession &session;
+
+    // The staged upload is decrypted and cut into chunks; only chunks the user doesn't have yet
+    // are written, and the staging file is dropped.
+    ServerResponse commitChunked(const UploadSession &upload, const std::filesystem::path &staging_file,
+                                 const std::filesystem::path &primary_file) {
+        bool encrypt = upload.encryption != STORAGE_PLAINTEXT;
+        CipherStream cipher = upload.encryption == STORAGE_AES_CTR_LEGACY
+                                  ? EncryptionManager::legacyStream(session.getCipherKey())
+                                  : EncryptionManager::stream(session.getCipherKey(), upload.nonce);
+        if (encrypt && !cipher.valid()) {
+            return ServerResponse{0, "No encryption key for this upload", ""};
+        }
+
+        int fd = open(staging_file.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return ServerResponse{0, "Failed to read staged upload", ""};
+        }
+
+        ChunkWriter writer(session.getUserId(), session.getUserDirectory(), session.getCipherKey(), encrypt);
+        std::vector<char> buffer(CDC_MAX_SIZE);
+        unsigned long long done = 0;
+        bool stored = true;
+
+        while (stored && done < upload.size) {
+            size_t to_read = upload.size - done < buffer.size() ? upload.size - done : buffer.size();
+            ssize_t got = read(fd, buffer.data(), to_read);
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                stored = false;
+                break;
+            }
+
+            if (encrypt) {
+                cipher.xcrypt(reinterpret_cast<uint8_t *>(buffer.data()), got);
+            }
+            stored = writer.feed(buffer.data(), got);
+            done += got;
+        }
+        close(fd);
+
+        if (!stored || !writer.finish()) {
+            writer.abort();
+            return ServerResponse{0, "Failed to store upload", ""};
+        }
+        if (!commitChunkedFile(session, primary_file, writer.recipe(), writer.fileHash(), writer.size(), encrypt)) {
+            return ServerResponse{0, "Failed to record upload", ""};
+        }
+
+        std::filesystem::remove(staging_file);
+        UploadManager::removeSession(upload.id);
+        return ServerResponse{1, "Successfully uploaded file " + upload.name, ""};
+    }
+
+public:
+    PostCommitCommand(std::string upload_id, UserSession &session)
+        : upload_id(std::move(upload_id)), session(session) {
+    }
+
+    bool isBulk() const override {
+        return true;
+    }
+
+    ServerResponse execute() override {
+        if (!session.isAuthenticated()) {
+            return ServerResponse{0, "Not authenticated", ""};
+        }
+
+        UploadSession upload;
+        if (!UploadManager::getSession(upload_id, session.getUserId(), upload)) {
+            return ServerResponse{0, "Unknown upload", ""};
+        }
+
+        if (!UploadManager::isComplete(upload)) {
+            return ServerResponse{0, "Upload incomplete", uploadStatusJson(upload).dump()};
+        }
+
+        try {
+            std::string relative_target = relativeTarget(upload.target_dir);
+            std::filesystem::path staging_file = session.getStagingDirectory() / upload.id;
+            std::filesystem::path primary_file = session.getPrimaryDirectory() / relative_target / upload.name;
+            std::filesystem::path backup_file = session.getBackupDirectory() / relative_target / upload.name;
+
+            if (storedFileExists(session, primary_file)) {
+                return ServerResponse{0, "File already exists", ""};
+            }
+            if (ChunkStore::accepts(upload.size) && !PackStore::accepts(upload.size)) {
+                return commitChunked(upload, staging_file, primary_file);
+            }
+
+            // Only whatever the chunks did not already cover (e.g. after a restart) is read here.
+            auto digest = UploadManager::getDigest(upload.id);
+            std::string hash;
+            std::string block_hashes;
+            {
+                std::lock_guard<std::mutex> digest_lock(digest->mutex);
+                int fd = open(staging_file.c_str(), O_RDONLY | O_CLOEXEC);
+                bool hashed = fd >= 0 && UploadManager::extendDigest(*digest, fd, upload.size);
+                if (fd >= 0) {
+                    close(fd);
+                }
+                if (!hashed) {
+                    return ServerResponse{0, "Failed to read staged upload", ""};
+                }
+
+                hash = digest->hasher.fileHash();
+                block_hashes = digest->hasher.blockHashes();
+            }
+
+            // A small upload goes into a pack instead of becoming two files of its own.
+            bool pack = PackStore::accepts(upload.size);
+            PackEntry packed;
+            struct stat file_stat{};
+            if (pack) {
+                std::string data(upload.size, '\0');
+                std::ifstream staged(staging_file, std::ios::binary);
+                if (!staged.read(data.data(), static_cast<std::streamsize>(data.size())) ||
+                    !PackStore::append(session.getUserId(), session.getUserDirectory(), data, packed)) {
+                    return ServerResponse{0, "Failed to store upload", ""};
+                }
+                file_stat = PackStore::entryStat(packed);
+            } else {
+                std::filesystem::rename(staging_file, primary_file);
+                std::filesystem::copy_file(primary_file, backup_file,
+                                           std::filesystem::copy_options::overwrite_existing);
+                stat(primary_file.c_str(), &file_stat);
+            }
+
+            DBTransaction transaction;
+            bool metadata_saved =
+                    RedundancyManager::saveFileHash(session.getUserId(), primary_file.string(), hash, upload.encryption,
+                                                    block_hashes, upload.nonce) &&
+                    (!pack || PackStore::record(session.getUserId(), primary_file.string(), packed)) &&
+                    MetadataIndex::putFile(session.getUserId(),
+                                        MetadataIndex::indexPath(session.getPrimaryDirectory(), primary_file),
+                                        file_stat, hash);
+            bool recorded = metadata_saved && transaction.commit();
+            if (pack) {
+                PackStore::settle(session.getUserId(), packed);
+            }
+
+            // The staged upload is put back, so the commit can be retried.
+            if (!recorded) {
+                std::cerr << "Failed to record metadata for " << primary_file << '\n';
+                if (!pack) {
+                    std::error_code ec;
+                    std::filesystem::rename(primary_file, staging_file, ec);
+                    std::filesystem::remove(backup_file, ec);
+                }
+                return ServerResponse{0, "Failed to record upload", ""};
+            }
+            if (pack) {
+                std::filesystem::remove(staging_file);
+            }
+            UploadManager::removeSession(upload.id);
+
+            return ServerResponse{1, "Successfully uploaded file " + upload.name, ""};
+        } catch (const std::exception &e) {
+            return ServerResponse{0, "Error committing upload", e.what()};
+        }
+    }
+};
+
+// POST_DEDUP <file json> <target dir> - upload of a file the client has already cut into chunks
+// (content_chunker.h); the file JSON also carries the SHA-256 of the whole file as "hash". After
+// READY the client sends its recipe as a frame, [["<chunk hash>", length], ...] in file order. The
+// server takes references on the chunks the user already has and answers with a frame listing
+// the others, {"missing": ["<chunk hash>", ...]}; the client then sends each missing chunk in that
+// order as [int length][bytes], and the file is recorded from its recipe. A length of 0 instead
+// of the next chunk cancels the upload. A file whose chunks are all known costs no data at all.
+//
+// Refused before READY, with {"dedup": "off"} or {"dedup": "not_chunked"} as data, when the file
+// would not be stored as chunks (deduplication off, a file small enough for a pack); the client
+// then uploads it through POST_BEGIN.
+class PostDedupCommand : public Command {
+private:
+    std::string ObjJson;
+    std::string target_dir;
+    int client_sock;
+    RequestContext request;
+    UserSession &session;
+    bool out_of_step = false;
+
+    // The recipe must cover exactly `size` bytes, and a chunk listed twice has one length.
+    static bool parseRecipe(const std::string &recipe_json, unsigned long long size, std::vector<ChunkRef> &recipe,
+                            std::unordered_map<std::string, size_t> &counts) {
+        json entries = json::parse(recipe_json);
+        std::unordered_map<std::string, unsigned long long> lengths;
+        unsigned long long total = 0;
+
+        for (const auto &entry: entries) {
+            ChunkRef chunk{entry.at(0).get<std::string>(), entry.at(1).get<unsigned long long>()};
+            if (!ChunkStore::validHash(chunk.hash) || chunk.length == 0 || chunk.length > CDC_MAX_SIZE) {
+                return false;
+            }
+            auto known = lengths.emplace(chunk.hash, chunk.length);
+            if (known.first->second != chunk.length) {
+                return false;
+            }
+
+            total += chunk.length;
+            counts[chunk.hash]++;
+            recipe.push_back(std::move(chunk));
+        }
+        return total == size;
+    }
+
+public:
+    PostDedupCommand(std::string ObjJson, std::string target_dir, int client_sock, const RequestContext &request,
+                     UserSession &session)
+        : ObjJson(std::move(ObjJson)), target_dir(std::move(target_dir)), client_sock(client_sock), request(request),
+          session(session) {
+    }
+
+    bool isBulk() const override {
+        return true;
+    }
+
+    bool holdsConnection() const override {
+        return true;
+    }
+
+    bool desynced() const override {
+        return out_of_step;
+    }
+
+    ServerResponse execute() override {
+        if (!session.isAuthenticated()) {
+            return ServerResponse{0, "Not authenticated", ""};
+        }
+
+        try {
+            json j = json::parse(ObjJson);
+            CloudFile received_file = j.get<CloudFile>();
+            std::string hash = j.value("hash", "");
+            std::filesystem::path primary_file =
+                    session.getPrimaryDirectory() / relativeTarget(target_dir) / cleanFileName(received_file.name);
+
+            if (!ServerConfig::instance().dedup) {
+                return ServerResponse{0, "Deduplication is off", json{{"dedup", "off"}}.dump()};
+            }
+            if (!ChunkStore::accepts(received_file.size) || PackStore::accepts(received_file.size)) {
+                return ServerResponse{0, "File is not stored as chunks", json{{"dedup", "not_chunked"}}.dump()};
+            }
+            if (!ChunkStore::validHash(hash)) {
+                return ServerResponse{0, "Missing file hash", ""};
+            }
+            if (storedFileExists(session, primary_file)) {
+                return ServerResponse{0, "File already exists", ""};
+            }
+            if (!std::filesystem::is_directory(primary_file.parent_path())) {
+                return ServerResponse{0, "Target directory doesn't exist", ""};
+            }
+
+            bool encrypt = ServerConfig::instance().encrypt_at_rest;
+            if (encrypt && !session.getCipherKey()) {
+                return ServerResponse{0, "No encryption key for this session", ""};
+            }
+
+            sendReady(client_sock, request);
+
+            // Giving up while the client's frames are still being read leaves them half read.
+            out_of_step = true;
+            std::string recipe_json;
+            if (!receiveFrame(client_sock, recipe_json, DEDUP_RECIPE_MAX)) {
+                return ServerResponse{0, "Client disconnected", ""};
+            }
+            out_of_step = false;
+
+            std::vector<ChunkRef> recipe;
+            std::unordered_map<std::string, size_t> counts;
+            bool valid = false;
+            try {
+                valid = parseRecipe(recipe_json, received_file.size, recipe, counts);
+            } catch (const json::exception &) {
+            }
+            if (!valid) {
+                return ServerResponse{0, "Invalid chunk list", ""};
+            }
+
+            // The client names chunks by the SHA-256 of their plaintext, the store by keyed ids.
+            std::vector<ChunkRef> stored_recipe;
+            std::unordered_map<std::string, std::string> ids;
+            for (const auto &chunk: recipe) {
+                auto id = ids.emplace(chunk.hash, "");
+                if (id.second) {
+                    id.first->second = ChunkStore::chunkId(session.getCipherKey(), chunk.hash);
+                }
+                if (id.first->second.empty()) {
+                    return ServerResponse{0, "No encryption key for this session", ""};
+                }
+                stored_recipe.push_back(ChunkRef{id.first->second, chunk.length});
+            }
+
+            // References on the chunks already stored are taken now, so they can't go away before
+            // the file is recorded; every one taken is given back if the upload fails.
+            int user_id = session.getUserId();
+            const std::filesystem::path &user_dir = session.getUserDirectory();
+            std::vector<ChunkRef> held;
+            std::vector<const ChunkRef *> wanted;
+            std::unordered_set<std::string> seen;
+            json missing = json::array();
+
+            for (size_t i = 0; i < recipe.size(); i++) {
+                const ChunkRef &chunk = recipe[i];
+                if (!seen.insert(chunk.hash).second) {
+                    continue;
+                }
+                size_t count = counts[chunk.hash];
+                if (ChunkStore::acquire(user_id, user_dir, stored_recipe[i], count)) {
+                    held.insert(held.end(), count, stored_recipe[i]);
+                } else {
+                    wanted.push_back(&chunk);
+                    missing.push_back(chunk.hash);
+                }
+            }
+
+            // The client sends the missing chunks right after this frame. After a chunk fails the
+            // rest are still read, so the connection stays in step.
+            out_of_step = true;
+            if (!sendFrame(client_sock, request, json{{"missing", missing}}.dump())) {
+                ChunkStore::release(user_id, user_dir, held);
+                return ServerResponse{0, "Client disconnected", ""};
+            }
+
+            std::string data;
+            std::string failure;
+            for (const ChunkRef *chunk: wanted) {
+                int length = 0;
+                if (!recvAll(client_sock, &length, sizeof(int)) ||
+                    (length != 0 && static_cast<unsigned long long>(length) != chunk->length)) {
+                    ChunkStore::release(user_id, user_dir, held);
+                    return ServerResponse{0, "Transfer interrupted", ""};
+                }
+                if (length == 0) {
+                    ChunkStore::release(user_id, user_dir, held);
+                    out_of_step = false;
+                    return ServerResponse{0, "Upload cancelled", ""};
+                }
+
+                data.resize(chunk->length);
+                if (!recvAll(client_sock, data.data(), data.size())) {
+                    ChunkStore::release(user_id, user_dir, held);
+                    return ServerResponse{0, "Transfer interrupted", ""};
+                }
+                if (!failure.empty()) {
+                    continue;
+                }
+                if (Sha256::hashHex(data.data(), data.size()) != chunk->hash) {
+                    failure = "Chunk checksum mismatch";
+                    continue;
+                }
+
+                ChunkRef stored;
+                if (!ChunkStore::put(user_id, user_dir, session.getCipherKey(), encrypt, chunk->hash, data.data(),
+                                     data.size(), stored)) {
+                    failure = "Failed to store chunk";
+                    continue;
+                }
+                held.push_back(stored);
+
+                size_t extra = counts[chunk->hash] - 1;
+                if (extra > 0) {
+                    if (!ChunkStore::acquire(user_id, user_dir, stored, extra)) {
+                        failure = "Failed to store chunk";
+                        continue;
+                    }
+                    held.insert(held.end(), extra, stored);
+                }
+            }
+            out_of_step = false;
+
+            if (!failure.empty()) {
+                ChunkStore::release(user_id, user_dir, held);
+                return ServerResponse{0, failure, ""};
+            }
+
+            // The file hash is only the client's word; it is recomputed from the chunks in order.
+            Sha256 file_hasher;
+            ChunkReader reader(user_id, user_dir, session.getCipherKey(), stored_recipe);
+            bool readable = reader.read(0, reader.size(), [&file_hasher](const char *data, size_t length) {
+                file_hasher.update(data, length);
+                return true;
+            });
+            if (!readable || file_hasher.hexDigest() != hash) {
+                ChunkStore::release(user_id, user_dir, held);
+                return ServerResponse{0, readable ? "File checksum mismatch" : "Failed to read stored chunks", ""};
+            }
+
+            if (!commitChunkedFile(session, primary_file, stored_recipe, hash, received_file.size, encrypt)) {
+                return ServerResponse{0, "Failed to record file", ""};
+            }
+
+            json result{{"chunks", recipe.size()}, {"sent", wanted.size()}};
+            return ServerResponse{1, "Successfully uploaded file " + received_file.name, result.dump()};
+        } catch (const json::exception &e) {
+            return ServerResponse{0, "JSON parse error", e.what()};
+        } catch (const std::exception &e) {
+            return ServerResponse{0, "Error uploading file", e.what()};
+        }
+    }
+};
+
+// Relative path of a batch entry ("photos/2020/a.jpg") split into its components, or empty when
+// it is absolute or leaves the target directory.
+inline std::vector<std::string> batchPathComponents(const std::string &path) {
+    std::vector<std::string> components;
+    if (path.empty() || path[0] == '/') {
+        return components;
+    }
+
+    size_t start = 0;
+    while (start <= path.size()) {
+        size_t slash = path.find('/', start);
+        if (slash == std::string::npos) {
+            slash = path.size();
+        }
+        std::string component = path.substr(start, slash - start);
+        if (component.empty() || component == "." || component == "..") {
+            return {};
+        }
+        components.push_back(component);
+        start = slash + 1;
+    }
+    return components;
+}
+
+// POST_BATCH <target dir> - many small files (and the directories of an uploaded folder) in one
+// command. After READY the client streams entries until the frame "END". Every entry is a text
+// frame with its JSON, {"path": "a/b.txt", "size": n} followed by n raw bytes, or
+// {"path": "a", "dir": true}; paths are relative to the target directory and missing parent
+// directories are created. A file that can't be stored is skipped (its bytes are still read) and
+// reported in the reply, {"uploaded": n, "failed": [{"path": ..., "reason": ...}]}.
+//
+// The rows of every stored file go into the database in one transaction once the stream ends,
+// so the write lock is never held while waiting on the network.
+class PostBatchCommand : public Command {
+private:
+    struct StoredFile {
+        std::filesystem::path primary_file{};
+        std::string hash{};
+        std::string block_hashes{};
+        bool packed = false;
+        PackEntry entry{};
+        bool chunked = false;
+        std::vector<ChunkRef> recipe{};
+        unsigned long long size = 0;
+        std::string nonce{};
+    };
+
+    std::string target_dir;
+    int client_sock;
+    RequestContext request;
+    UserSession &session;
+    bool out_of_step = false;
+
+    // Creates the directory (and its parents) in primary and backup storage.
+    bool makeDirs(const std::filesystem::path &relative, std::vector<std::filesystem::path> &created) {
+        std::error_code ec;
+        std::filesystem::path primary_path = session.getPrimaryDirectory() / relative;
+        if (std::filesystem::is_directory(primary_path)) {
+            return true;
+        }
+        if (!std::filesystem::create_directories(primary_path, ec)) {
+            return false;
+        }
+        std::filesystem::create_directories(session.getBackupDirectory() / relative, ec);
+        if (ec) {
+            return false;
+        }
+        created.push_back(primary_path);
+        return true;
+    }
+
+    // Reads and drops the bytes of a file that is not stored.
+    bool skip(unsigned long long length) {
+        char buffer[BUFFER_SIZE];
+        while (length > 0) {
+            size_t to_receive = length < sizeof(buffer) ? length : sizeof(buffer);
+            if (!recvAll(client_sock, buffer, to_receive)) {
+                return false;
+            }
+            length -= to_receive;
+        }
+        return true;
+    }
+
+    // A small file is received whole and appended to the user's pack.
+    bool receivePacked(const std::filesystem::path &primary_file, unsigned long long size, bool encrypt,
+                       std::vector<StoredFile> &stored, std::string &reason) {
+        std::string data(size, '\0');
+        if (!recvAll(client_sock, data.data(), data.size())) {
+            return false;
+        }
+
+        std::string nonce = encrypt ? EncryptionManager::newNonce() : "";
+        if (encrypt) {
+            CipherStream cipher = EncryptionManager::stream(session.getCipherKey(), nonce);
+            if (!cipher.valid()) {
+                reason = "Failed to encrypt file";
+                return true;
+            }
+            cipher.xcrypt(reinterpret_cast<uint8_t *>(data.data()), data.size());
+        }
+
+        FileDigest hasher;
+        hasher.update(data.data(), data.size());
+
+        PackEntry entry;
+        if (!PackStore::append(session.getUserId(), session.getUserDirectory(), data, entry)) {
+            reason = "Failed to store file";
+            return true;
+        }
+        StoredFile file{primary_file, hasher.fileHash(), hasher.blockHashes(), true, entry};
+        file.nonce = nonce;
+        stored.push_back(std::move(file));
+        return true;
+    }
+
+    // With deduplication a file is received whole and cut into chunks; only chunks the user doesn't
+    // have yet are written.
+    bool receiveChunked(const std::filesystem::path &primary_file, unsigned long long size, bool encrypt,
+                        std::vector<StoredFile> &stored, std::string &reason) {
+        std::string data(size, '\0');
+        if (!recvAll(client_sock, data.data(), data.size())) {
+            return false;
+        }
+
+        ChunkWriter writer(session.getUserId(), session.getUserDirectory(), session.getCipherKey(), encrypt);
+        if (!writer.feed(data.data(), data.size()) || !writer.finish()) {
+            writer.abort();
+            reason = "Failed to store file";
+            return true;
+        }
+
+        StoredFile file{primary_file, writer.fileHash()};
+        file.chunked = true;
+        file.recipe = writer.recipe();
+        file.size = size;
+        stored.push_back(std::move(file));
+        return true;
+    }
+
+    // False only when the connection broke; a file that can't be written is reported in `reason`.
+    bool receiveFile(const std::filesystem::path &relative, unsigned long long size, bool encrypt,
+                     std::vector<StoredFile> &stored, std::vector<std::filesystem::path> &created_dirs,
+                     std::string &reason) {
+        std::filesystem::path primary_file = session.getPrimaryDirectory() / relative;
+        std::filesystem::path backup_file = session.getBackupDirectory() / relative;
+
+        if (storedFileExists(session, primary_file)) {
+            reason = "File already exists";
+            return skip(size);
+        }
+        if (!makeDirs(relative.parent_path(), created_dirs)) {
+            reason = "Failed to create directory";
+            return skip(size);
+        }
+        if (PackStore::accepts(size)) {
+            return receivePacked(primary_file, size, encrypt, stored, reason);
+        }
+        if (ChunkStore::accepts(size)) {
+            return receiveChunked(primary_file, size, encrypt, stored, reason);
+        }
+
+        std::string nonce = encrypt ? EncryptionManager::newNonce() : "";
+        CipherStream cipher = EncryptionManager::stream(session.getCipherKey(), nonce);
+        if (encrypt && !cipher.valid()) {
+            reason = "Failed to encrypt file";
+            return skip(size);
+        }
+
+        std::ofstream primary_stream(primary_file, std::ios::binary);
+        std::ofstream backup_stream(backup_file, std::ios::binary);
+        if (!primary_stream.is_open() || !backup_stream.is_open()) {
+            reason = "Failed to create file";
+            return skip(size);
+        }
+
+        FileDigest hasher;
+        char buffer[BUFFER_SIZE];
+        unsigned long long total_received = 0;
+
+        while (total_received < size) {
+            size_t remaining = size - total_received;
+            size_t to_receive = sizeof(buffer) < remaining ? sizeof(buffer) : remaining;
+            ssize_t bytes_received = recv(client_sock, buffer, to_receive, 0);
+
+            if (bytes_received <= 0) {
+                primary_stream.close();
+                backup_stream.close();
+                std::filesystem::remove(primary_file);
+                std::filesystem::remove(backup_file);
+                return false;
+            }
+
+            if (encrypt) {
+                cipher.xcrypt(reinterpret_cast<uint8_t *>(buffer), bytes_received);
+            }
+
+            hasher.update(buffer, bytes_received);
+            primary_stream.write(buffer, bytes_received);
+            backup_stream.write(buffer, bytes_received);
+
+            total_received += bytes_received;
+        }
+
+        StoredFile file{primary_file, hasher.fileHash(), hasher.blockHashes()};
+        file.nonce = nonce;
+        stored.push_back(std::move(file));
+        return true;
+    }
+
+    bool recordRows(const std::vector<StoredFile> &stored, const std::vector<std::filesystem::path> &created_dirs,
+                    bool encrypt) {
+        int user_id = session.getUserId();
+        std::filesystem::path primary_dir = session.getPrimaryDirectory();
+        bool recorded = true;
+
+        DBTransaction transaction;
+        for (const auto &dir: created_dirs) {
+            recorded = recorded && MetadataIndex::putDir(user_id, MetadataIndex::indexPath(primary_dir, dir));
+        }
+        for (const auto &file: stored) {
+            if (file.chunked) {
+                recorded = recorded && recordChunkedFile(session, file.primary_file, file.recipe, file.hash, file.size,
+                                                         encrypt);
+                continue;
+            }
+
+            struct stat file_stat{};
+            if (file.packed) {
+                file_stat = PackStore::entryStat(file.entry);
+            } else {
+                stat(file.primary_file.c_str(), &file_stat);
+            }
+
+            recorded = recorded &&
+                       RedundancyManager::saveFileHash(user_id, file.primary_file.string(), file.hash,
+                                                       encrypt ? STORAGE_AES_CTR_STREAM : STORAGE_PLAINTEXT,
+                                                       file.block_hashes, file.nonce) &&
+                       (!file.packed || PackStore::record(user_id, file.primary_file.string(), file.entry)) &&
+                       MetadataIndex::putFile(user_id, MetadataIndex::indexPath(primary_dir, file.primary_file),
+                                              file_stat, file.hash);
+        }
+        return recorded && transaction.commit();
+    }
+
+    // Chunks of files that could not be recorded are given back; pack appends are settled either way.
+    void recordMetadata(const std::vector<StoredFile> &stored, const std::vector<std::filesystem::path> &created_dirs,
+                        bool encrypt) {
+        if (stored.empty() && created_dirs.empty()) {
+            return;
+        }
+
+        int user_id = session.getUserId();
+        bool recorded = recordRows(stored, created_dirs, encrypt);
+        for (const auto &file: stored) {
+            if (file.packed) {
+                PackStore::settle(user_id, file.entry);
+            }
+        }
+        if (recorded) {
+            return;
+        }
+
+        std::cerr << "Failed to record metadata for a batch of " << stored.size() << " files\n";
+        for (const auto &file: stored) {
+            ChunkStore::release(user_id, session.getUserDirectory(), file.recipe);
+        }
+    }
+
+public:
+    PostBatchCommand(std::string target_dir, int client_sock, const RequestContext &request, UserSession &session)
+        : target_dir(std::move(target_dir)), client_sock(client_sock), request(request), session(session) {
+    }
+
+    bool isBulk() const override {
+        return true;
+    }
+
+    bool holdsConnection() const override {
+        return true;
+    }
+
+    bool desynced() const override {
+        return out_of_step;
+    }
+
+    ServerResponse execute() override {
+        if (!session.isAuthenticated()) {
+            return ServerResponse{0, "Not authenticated", ""};
+        }
+
+        std::filesystem::path relative_target = relativeTarget(target_dir);
+        if (!std::filesystem::is_directory(session.getPrimaryDirectory() / relative_target)) {
+            return ServerResponse{0, "Target directory doesn't exist", ""};
+        }
+
+        bool encrypt = ServerConfig::instance().encrypt_at_rest;
+        if (encrypt && !session.getCipherKey()) {
+            return ServerResponse{0, "No encryption key for this session", ""};
+        }
+
+        sendReady(client_sock, request);
+
+        std::vector<StoredFile> stored;
+        std::vector<std::filesystem::path> created_dirs;
+        json failed = json::array();
+        bool complete = false;
+        std::string entry_json;
+
+        try {
+            while (receiveFrame(client_sock, entry_json, BATCH_ENTRY_MAX)) {
+                if (entry_json == "END") {
+                    complete = true;
+                    break;
+                }
+
+                json entry = json::parse(entry_json);
+                std::string path = entry.at("path").get<std::string>();
+                bool is_dir = entry.value("dir", false);
+                unsigned long long size = is_dir ? 0 : entry.at("size").get<unsigned long long>();
+
+                if (size > MAX_UPLOAD_CHUNK) {
+                    // The bytes can't be skipped safely either; the stream is out of step.
+                    failed.push_back({{"path", path}, {"reason", "File too large for a batch"}});
+                    break;
+                }
+
+                std::vector<std::string> components = batchPathComponents(path);
+                std::filesystem::path relative = relative_target;
+                for (const auto &component: components) {
+                    relative /= component;
+                }
+
+                std::string reason;
+                bool connected = true;
+                if (components.empty()) {
+                    reason = "Invalid path";
+                    connected = skip(size);
+                } else if (is_dir) {
+                    if (!makeDirs(relative, created_dirs)) {
+                        reason = "Failed to create directory";
+                    }
+                } else {
+                    connected = receiveFile(relative, size, encrypt, stored, created_dirs, reason);
+                }
+
+                if (!reason.empty()) {
+                    failed.push_back({{"path", path}, {"reason", reason}});
+                }
+                if (!connected) {
+                    break;
+                }
+            }
+        } catch (const json::exception &e) {
+            std::cerr << "Invalid batch entry: " << e.what() << '\n';
+        } catch (const std::exception &e) {
+            std::cerr << "Batch upload failed: " << e.what() << '\n';
+        }
+
+        // Whatever arrived whole is kept even if the stream broke off. Without END the position in
+        // the client's stream is unknown.
+        out_of_step = !complete;
+        recordMetadata(stored, created_dirs, encrypt);
+
+        json result{{"uploaded", stored.size()}, {"failed", failed}};
+        if (!complete) {
+            return ServerResponse{0, "Batch upload interrupted", result.dump()};
+        }
+        if (!failed.empty()) {
+            return ServerResponse{0, "Uploaded " + std::to_string(stored.size()) + " files, " +
+                                     std::to_string(failed.size()) + " failed", result.dump()};
+        }
+        return ServerResponse{1, "Successfully uploaded " + std::to_string(stored.size()) + " files", result.dump()};
+    }
+};
+
+// LIST - the whole tree as one CloudDir.
+// LIST <dir> [cursor] [limit] - one level of <dir>, at most `limit` entries (LIST_PAGE_SIZE by
+// default) ordered by name. A non-empty "cursor" in the reply is passed back to get the next page;
+// "-" stands for the first page when a limit is given.
+class ListCommand : public Command {
+private:
+    UserSession &session;
+    bool single_level;
+    std::string dir;
+    std::string cursor;
+    size_t limit;
+
+    static std::string normalizeDir(const std::string &dir) {
+        std::string normalized = dir.empty() || dir[0] != '/' ? "/" + dir : dir;
+        while (normalized.size() > 1 && normalized.back() == '/') {
+            normalized.pop_back();
+        }
+        return normalized;
+    }
+
+    static int hexValue(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    // Cursors are hex-encoded names, so names with spaces survive the whitespace-split arguments.
+    static std::string encodeCursor(const std::string &name) {
+        static const char digits[] = "0123456789abcdef";
+        std::string hex;
+        hex.reserve(name.size() * 2);
+        for (unsigned char c: name) {
+            hex += digits[c >> 4];
+            hex += digits[c & 15];
+        }
+        return hex;
+    }
+
+    static bool decodeCursor(const std::string &hex, std::string &name) {
+        name.clear();
+        if (hex == "-") {
+            return true;
+        }
+        if (hex.size() % 2 != 0) {
+            return false;
+        }
+
+        for (size_t i = 0; i < hex.size(); i += 2) {
+            int high = hexValue(hex[i]);
+            int low = hexValue(hex[i + 1]);
+            if (high < 0 || low < 0) {
+                return false;
+            }
+            name += static_cast<char>(high << 4 | low);
+        }
+        return true;
+    }
+
+public:
+    ListCommand(UserSession &session) : session(session), single_level(false), limit(0) {
+    }
+
+    ListCommand(UserSession &session, std::string dir, std::string cursor, size_t limit)
+        : session(session), single_level(true), dir(normalizeDir(dir)), cursor(std::move(cursor)),
+          limit(limit == 0 || limit > LIST_PAGE_MAX ? LIST_PAGE_MAX : limit) {
+    }
+
+    ServerResponse execute() override {
+        if (!session.isAuthenticated()) {
+            return ServerResponse{0, "Not authenticated", ""};
+        }
+
+        try {
+            if (single_level) {
+                std::string after;
+                if (!decodeCursor(cursor, after)) {
+                    return ServerResponse{0, "Invalid cursor", ""};
+                }
+                if (!MetadataIndex::isDirectory(session.getUserId(), dir)) {
+                    return ServerResponse{0, "Directory not found", ""};
+                }
+
+                DirListing listing = MetadataIndex::listDir(session.getUserId(), dir, after, limit);
+
+                json j;
+                j["name"] = dir == "/" ? session.getPrimaryDirectory().filename().string()
+                                       : dir.substr(dir.find_last_of('/') + 1);
+                j["path"] = dir;
+                j["files"] = listing.files;
+                j["subdirs"] = listing.subdirs;
+                j["cursor"] = listing.next.empty() ? "" : encodeCursor(listing.next);
+                j["version"] = listing.version;
+                return ServerResponse{1, "List Successful", j.dump()};
+            }
+
+            unsigned long long version = 0;
+            CloudDir root = MetadataIndex::listTree(session.getUserId(),
+                                                    session.getPrimaryDirectory().filename().string(), version);
+
+            json j = root;
+            j["version"] = version;
+            ServerResponse response{1, "List Successful", j.dump()};
+            if (!fitsWireResponse(response)) {
+                return ServerResponse{0, "Tree too large for one reply, use LIST <dir> <cursor> <limit>", ""};
+            }
+            return response;
+        } catch (const std::exception &e) {
+            return ServerResponse{0, "Error listing files", e.what()};
+        }
+    }
+};
+
+// LIST_SINCE <version> - the changes made after `version` (the "version" of an earlier LIST or
+// LIST_SINCE reply), oldest first. "reset" means the journal no longer covers that range, or the
+// changes don't fit in one reply, and the client has to LIST again.
+class ListSinceCommand : public Command {
+private:
+    unsigned long long since;
+    UserSession &session;
+
+public:
+    ListSinceCommand(unsigned long long since, UserSession &session) : since(since), session(session) {
+    }
+
+    ServerResponse execute() override {
+        if (!session.isAuthenticated()) {
+            return ServerResponse{0, "Not authenticated", ""};
+        }
+
+        std::vector<CloudChange> changes;
+        unsigned long long version = 0;
+        bool complete = MetadataIndex::changesSince(session.getUserId(), since, changes, version);
+
+        json j;
+        j["version"] = version;
+        j["reset"] = !complete;
+        j["changes"] = complete ? json(changes) : json::array();
+        ServerResponse response{1, "List Successful", j.dump()};
+        if (!fitsWireResponse(response)) {
+            j["reset"] = true;
+            j["changes"] = json::array();
+            response.response_data_json = j.dump();
+        }
+        return response;
+    }
+};
+
+class DeleteCommand : public Command {
+private:
+    std::string path;
+    UserSession &session;
+
+public:
+    DeleteCommand(const std::string &path, UserSession &session) : path(path), session(session) {
+    }
+
+    ServerResponse execute() override {
+        try {
+            std::filesystem::path primary_p = session.getPrimaryDirectory() / path;
+            std::filesystem::path backup_p = session.getBackupDirectory() / path;
+            int user_id = session.getUserId();
+
+            // Packed and chunked files leave nothing on disk, so their directory would look empty.
+            if (std::filesystem::is_directory(primary_p) &&
+                (PackStore::containsUnder(user_id, primary_p.string()) ||
+                 ChunkStore::containsUnder(user_id, primary_p.string()))) {
+                return ServerResponse{0, "Directory not empty", ""};
+            }
+
+            bool on_disk = std::filesystem::exists(primary_p);
+            PackEntry packed;
+            bool in_pack = !on_disk && PackStore::lookup(user_id, primary_p.string(), packed);
+            bool chunked = !on_disk && !in_pack && ChunkStore::contains(user_id, primary_p.string());
+            bool deleted_primary = in_pack || chunked || std::filesystem::remove(primary_p);
+            std::filesystem::remove(backup_p);
+
+            // A chunked file's recipe goes in the same transaction as its other rows; its chunks are
+            // only unlinked once that commits.
+            std::unique_lock<std::mutex> chunk_lock;
+            if (chunked) {
+                chunk_lock = ChunkStore::lock(user_id);
+            }
+            std::vector<std::string> unreferenced;
+
+            DBTransaction transaction;
+            if (!DBManager::removeFile(user_id, primary_p.string()) ||
+                !MetadataIndex::remove(user_id, MetadataIndex::indexPath(session.getPrimaryDirectory(), primary_p)) ||
+                (in_pack && !PackStore::remove(user_id, primary_p.string())) ||
+                (chunked && !ChunkStore::dropFile(user_id, primary_p.string(), unreferenced)) ||
+                !transaction.commit()) {
+                std::cerr << "Failed to remove metadata for " << primary_p << '\n';
+                if (chunked) {
+                    return ServerResponse{0, "Failed to delete file", ""};
+                }
+            } else if (in_pack) {
+                PackStore::compact(user_id, session.getUserDirectory(), packed.pack_id);
+            } else if (chunked) {
+                ChunkStore::removeChunkFiles(session.getUserDirectory(), unreferenced);
+            }
+
+            if (deleted_primary) {
+                return ServerResponse{1, "Deleted successfully", ""};
+            } else {
+                return ServerResponse{0, "File not found in primary storage", ""};
+            }
+        } catch (const std::filesystem::filesystem_error &e) {
+            return ServerResponse{0, e.what(), ""};
+        }
+    }
+};
+
+class CreateDirCommand : public Command {
+private:
+    std::string name;
+    std::string target_dir;
+    UserSession &session;
+
+public:
+    CreateDirCommand(const std::string &name, const std::string &target_dir, UserSession &session) : name(name),
+        target_dir(target_dir), session(session) {
+    }
+
+    ServerResponse execute() override {
+        std::filesystem::path primary_path = session.getPrimaryDirectory().string() + "/" + target_dir + "/" + name;
+        std::filesystem::path backup_path = session.getBackupDirectory().string() + "/" + target_dir + "/" + name;
+
+        try {
+            if (std::filesystem::exists(primary_path)) {
+                return {0, "Directory already exists", ""};
+            }
+            std::filesystem::create_directory(primary_path);
+            std::filesystem::create_directory(backup_path);
+
+            DBTransaction transaction;
+            if (!MetadataIndex::putDir(session.getUserId(),
+                                       MetadataIndex::indexPath(session.getPrimaryDirectory(), primary_path)) ||
+                !transaction.commit()) {
+                std::cerr << "Failed to record metadata for " << primary_path << '\n';
+                std::error_code ec;
+                std::filesystem::remove(primary_path, ec);
+                std::filesystem::remove(backup_path, ec);
+                return {0, "Failed to record directory", ""};
+            }
+            return {1, "Successfully Created Directory", ""};
+        } catch (std::exception e) {
+            return {0, e.what(), ""};
+        }
+    }
+};
+
+class RegisterCommand : public Command {
+private:
+    std::string user;
+    std::string pass;
+
+public:
+    RegisterCommand(const std::string &name, const std::string &pass)
+        : user(name), pass(pass) {
+    }
+
+    ServerResponse execute() override {
+        if (DBManager::try_register(user, pass)) {
+            return {1, "Registered Successfully", ""};
+        } else {
+            return {0, "Username Taken", ""};
+        }
+    }
+};
+
+class CommandFactory {
+private:
+    static void requireArguments(const std::vector<std::string> &arguments, size_t count) {
+        if (arguments.size() < count) {
+            throw std::runtime_error("Argumente lipsa");
+        }
+    }
+
+    static unsigned long long parseNumber(const std::string &argument) {
+        size_t parsed = 0;
+        unsigned long long value = 0;
+        try {
+            value = std::stoull(argument, &parsed);
+        } catch (const std::exception &) {
+            parsed = 0;
+        }
+
+        if (argument.empty() || parsed != argument.length() || argument[0] == '-') {
+            throw std::runtime_error("Argument numeric invalid: " + argument);
+        }
+        return value;
+    }
+
+public:
+    // Text protocol: "<NAME> <arg> <arg> ...".
+    static std::unique_ptr<Command> createCommand(
+        const std::string &command, int client_sock,
+        UserSession &session) {
+        return create(command.substr(0, command.find(' ')), getArguments(command), client_sock, session,
+                      RequestContext{});
+    }
+
+    static std::unique_ptr<Command> create(const std::string &name, const std::vector<std::string> &arguments,
+                                           int client_sock, UserSession &session, const RequestContext &request) {
+        if (name == "LOGIN") {
+            requireArguments(arguments, 2);
+            return std::make_unique<LogInCommand>(arguments[0], arguments[1], session);
+        } else if (name == "LOGOUT") {
+            return std::make_unique<LogOutCommand>(session);
+        } else if (name == "GET") {
+            requireArguments(arguments, 1);
+            if (arguments.size() >= 2) {
+                unsigned long long offset = parseNumber(arguments[1]);
+                unsigned long long length = arguments.size() >= 3 ? parseNumber(arguments[2]) : 0;
+                return std::make_unique<GetCommand>(arguments[0], session, client_sock, request, offset, length);
+            }
+            return std::make_unique<GetCommand>(arguments[0], session, client_sock, request);
+        } else if (name == "POST") {
+            requireArguments(arguments, 2);
+            return std::make_unique<PostCommand>(arguments[0], arguments[1], client_sock, request, session);
+        } else if (name == "POST_BEGIN") {
+            requireArguments(arguments, 2);
+            return std::make_unique<PostBeginCommand>(arguments[0], arguments[1], session);
+        } else if (name == "POST_STATUS") {
+            requireArguments(arguments, 1);
+            return std::make_unique<PostStatusCommand>(arguments[0], session);
+        } else if (name == "POST_CHUNK") {
+            requireArguments(arguments, 4);
+            return std::make_unique<PostChunkCommand>(arguments[0], parseNumber(arguments[1]),
+                                                      parseNumber(arguments[2]), arguments[3], client_sock,
+                                                      request, session);
+        } else if (name == "POST_COMMIT") {
+            requireArguments(arguments, 1);
+            return std::make_unique<PostCommitCommand>(arguments[0], session);
+        } else if (name == "POST_DEDUP") {
+            requireArguments(arguments, 2);
+            return std::make_unique<PostDedupCommand>(arguments[0], arguments[1], client_sock, request, session);
+        } else if (name == "POST_BATCH") {
+            requireArguments(arguments, 1);
+            return std::make_unique<PostBatchCommand>(arguments[0], client_sock, request, session);
+        } else if (name == "LIST") {
+            if (!arguments.empty()) {
+                std::string cursor = arguments.size() >= 2 ? arguments[1] : "-";
+                size_t limit = arguments.size() >= 3 ? parseNumber(arguments[2]) : LIST_PAGE_SIZE;
+                return std::make_unique<ListCommand>(session, arguments[0], cursor, limit);
+            }
             return std::make_unique<ListCommand>(session);
-        } else if (command.find("DELETE") == 0) {
+        } else if (name == "LIST_SINCE") {
+            requireArguments(arguments, 1);
+            return std::make_unique<ListSinceCommand>(parseNumber(arguments[0]), session);
+        } else if (name == "DELETE") {
+            requireArguments(arguments, 1);
             return std::make_unique<DeleteCommand>(arguments[0], session);
-        } else if (command.find("CREATEDIR") == 0) {
+        } else if (name == "CREATEDIR") {
+            requireArguments(arguments, 2);
             return std::make_unique<CreateDirCommand>(arguments[0], arguments[1], session);
-        } else if (command.find("REGISTER") == 0) {
+        } else if (name == "REGISTER") {
+            requireArguments(arguments, 2);
             return std::make_unique<RegisterCommand>(arguments[0], arguments[1]);
         } else {
             throw std::runtime_error("Comanda Invalida");
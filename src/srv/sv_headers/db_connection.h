@@ -0,0 +1,155 @@
+#ifndef CPP_PERSONAL_CLOUD_DB_CONNECTION_H
+#define CPP_PERSONAL_CLOUD_DB_CONNECTION_H
+
+#include <iostream>
+#include <sqlite3.h>
+#include <string>
+#include <unordered_map>
+
+#define DATABASE_PATH "./storage/cloud.db"
+#define DB_BUSY_TIMEOUT_MS 5000
+
+// A cached prepared statement on loan to one query. Going out of scope resets it and clears its
+// bindings, which also ends the read transaction of a SELECT that stopped before its last row.
+// Converts to sqlite3_stmt* so the usual sqlite3_bind_* / sqlite3_column_* calls apply directly.
+class DBStatement {
+private:
+    sqlite3_stmt *stmt;
+
+public:
+    explicit DBStatement(sqlite3_stmt *stmt) : stmt(stmt) {
+    }
+
+    DBStatement(DBStatement &&other) noexcept : stmt(other.stmt) {
+        other.stmt = nullptr;
+    }
+
+    DBStatement(const DBStatement &) = delete;
+
+    DBStatement &operator=(const DBStatement &) = delete;
+
+    ~DBStatement() {
+        if (stmt) {
+            sqlite3_reset(stmt);
+            sqlite3_clear_bindings(stmt);
+        }
+    }
+
+    operator sqlite3_stmt *() const {
+        return stmt;
+    }
+};
+
+// Long-lived connection to ./storage/cloud.db, one per thread (worker threads, the scrubber, the
+// main thread), so no query pays for sqlite3_open or statement compilation. Statements are
+// prepared on first use and kept for the life of the thread.
+//
+// The database runs in WAL mode: readers don't block the writer and vice versa, and writers that
+// still collide wait up to DB_BUSY_TIMEOUT_MS instead of failing with SQLITE_BUSY.
+class DBConnection {
+private:
+    sqlite3 *db = nullptr;
+    std::unordered_map<std::string, sqlite3_stmt *> statements;
+
+    DBConnection() {
+        int rc = sqlite3_open_v2(DATABASE_PATH, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE |
+                                                     SQLITE_OPEN_NOMUTEX, nullptr);
+        if (rc != SQLITE_OK) {
+            std::cerr << "Can't open database: " << sqlite3_errmsg(db) << '\n';
+            return;
+        }
+
+        sqlite3_busy_timeout(db, DB_BUSY_TIMEOUT_MS);
+        exec("PRAGMA journal_mode=WAL;");
+        exec("PRAGMA synchronous=NORMAL;");
+    }
+
+public:
+    DBConnection(const DBConnection &) = delete;
+
+    DBConnection &operator=(const DBConnection &) = delete;
+
+    ~DBConnection() {
+        for (auto &entry: statements) {
+            sqlite3_finalize(entry.second);
+        }
+        sqlite3_close(db);
+    }
+
+    static DBConnection &local() {
+        thread_local DBConnection connection;
+        return connection;
+    }
+
+    sqlite3 *handle() const {
+        return db;
+    }
+
+    const char *error() const {
+        return sqlite3_errmsg(db);
+    }
+
+    DBStatement prepare(const std::string &sql) {
+        auto found = statements.find(sql);
+        if (found != statements.end()) {
+            return DBStatement(found->second);
+        }
+
+        sqlite3_stmt *stmt = nullptr;
+        if (sqlite3_prepare_v3(db, sql.c_str(), -1, SQLITE_PREPARE_PERSISTENT, &stmt, nullptr) != SQLITE_OK) {
+            std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(db) << '\n';
+            return DBStatement(nullptr);
+        }
+
+        statements.emplace(sql, stmt);
+        return DBStatement(stmt);
+    }
+
+    bool exec(const std::string &sql) {
+        char *err_msg = nullptr;
+        if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &err_msg) != SQLITE_OK) {
+            std::cerr << "SQL error: " << (err_msg ? err_msg : sqlite3_errmsg(db)) << '\n';
+            sqlite3_free(err_msg);
+            return false;
+        }
+        return true;
+    }
+};
+
+// Transaction on the calling thread's connection; rolls back unless commit() succeeded. A write
+// transaction takes the write lock up front (BEGIN IMMEDIATE), so it never has to upgrade a read
+// lock halfway through. A read transaction gives several queries one consistent snapshot.
+class DBTransaction {
+private:
+    DBConnection &db;
+    bool open;
+
+public:
+    explicit DBTransaction(bool write = true) : db(DBConnection::local()) {
+        open = db.exec(write ? "BEGIN IMMEDIATE;" : "BEGIN;");
+    }
+
+    DBTransaction(const DBTransaction &) = delete;
+
+    DBTransaction &operator=(const DBTransaction &) = delete;
+
+    ~DBTransaction() {
+        if (open) {
+            db.exec("ROLLBACK;");
+        }
+    }
+
+    bool active() const {
+        return open;
+    }
+
+    bool commit() {
+        if (!open || !db.exec("COMMIT;")) {
+            return false;
+        }
+        open = false;
+        return true;
+    }
+};
+
+#endif //CPP_PERSONAL_CLOUD_DB_CONNECTION_H
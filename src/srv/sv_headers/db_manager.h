@@ -5,6 +5,8 @@
 #include <string>
 #include <picosha2.h>
 
+#include "db_connection.h"
+
 class DBManager {
 private:
     static std::string generate_salt(size_t length = 16) {
@@ -31,39 +33,23 @@ private:
     }
 
 public:
-    static bool removeFile(std::string user, std::string filename) {
-        sqlite3 *db;
-        sqlite3_open("./storage/cloud.db", &db);
-
-        sqlite3_stmt *stmt;
+    static bool removeFile(int user_id, const std::string &filepath) {
+        std::string sql = "DELETE FROM file_hashes WHERE user_id = ? AND filepath = ?;";
+        DBStatement stmt = DBConnection::local().prepare(sql);
 
-        std::string sql = "DELETE FROM file_hashes WHERE username = ? AND filename = ?;";
-        sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr);
-
-        sqlite3_bind_text(stmt, 1, user.c_str(), -1, SQLITE_TRANSIENT);
-        sqlite3_bind_text(stmt, 2, filename.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(stmt, 1, user_id);
+        sqlite3_bind_text(stmt, 2, filepath.c_str(), -1, SQLITE_TRANSIENT);
 
         if (sqlite3_step(stmt) != SQLITE_DONE) {
-            std::cerr << "Error deleting " << filename << " from db\n";
+            std::cerr << "Error deleting " << filepath << " from db\n";
             return false;
         }
 
-        std::cout << "Deleted " << filename << " from db\n";
-
-        sqlite3_finalize(stmt);
-        sqlite3_close(db);
+        std::cout << "Deleted " << filepath << " from db\n";
         return true;
     }
 
     static bool initUsers() {
-        sqlite3 *db;
-
-        int rc = sqlite3_open("./storage/cloud.db", &db);
-        if (rc != SQLITE_OK) {
-            std::cerr << "Can't open database: " << sqlite3_errmsg(db) << '\n';
-            return false;
-        }
-
         std::string sql =
                 "CREATE TABLE IF NOT EXISTS users ("
                 "id INTEGER PRIMARY KEY AUTOINCREMENT, "
@@ -72,100 +58,56 @@ public:
                 "created_at TEXT DEFAULT (strftime('%d/%m/%Y', 'now')) "
                 ");";
 
-        char *err_msg = nullptr;
-        rc = sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &err_msg);
-
-        if (rc != SQLITE_OK) {
-            std::cerr << "SQL error: " << err_msg << '\n';
-            sqlite3_free(err_msg);
-            sqlite3_close(db);
-            return false;
-        }
-
-        sqlite3_close(db);
-        return true;
+        return DBConnection::local().exec(sql);
     }
 
     static bool try_register(std::string user, std::string pass) {
-        sqlite3 *db;
-
-        int rc = sqlite3_open("./storage/cloud.db", &db);
-        if (rc != SQLITE_OK) {
-            std::cerr << "Can't open database: " << sqlite3_errmsg(db) << '\n';
-            return false;
-        }
-
         std::string salt = generate_salt();
         std::string password_hash = hash_password(pass, salt);
 
-        sqlite3_stmt *stmt;
         std::string sql = "INSERT INTO users (username, password_hash) VALUES (?, ?);";
-
-        rc = sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr);
-        if (rc != SQLITE_OK) {
-            std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(db) << '\n';
-            sqlite3_close(db);
+        DBStatement stmt = DBConnection::local().prepare(sql);
+        if (!stmt) {
             return false;
         }
 
         sqlite3_bind_text(stmt, 1, user.c_str(), -1, SQLITE_TRANSIENT);
         sqlite3_bind_text(stmt, 2, password_hash.c_str(), -1, SQLITE_TRANSIENT);
 
-        rc = sqlite3_step(stmt);
+        int rc = sqlite3_step(stmt);
 
         if (rc != SQLITE_DONE) {
             if (rc == SQLITE_CONSTRAINT) {
                 std::cerr << "Username already exists!\n";
             } else {
-                std::cerr << "Error registering user: " << sqlite3_errmsg(db) << '\n';
+                std::cerr << "Error registering user: " << DBConnection::local().error() << '\n';
             }
-            sqlite3_finalize(stmt);
-            sqlite3_close(db);
             return false;
         }
 
-        sqlite3_finalize(stmt);
-        sqlite3_close(db);
         return true;
     }
 
-    static bool try_login(std::string user, std::string pass) {
-        sqlite3 *db;
-
-        int rc = sqlite3_open("./storage/cloud.db", &db);
-        if (rc != SQLITE_OK) {
-            std::cerr << "Can't open database: " << sqlite3_errmsg(db) << '\n';
-            return false;
-        }
-
-        sqlite3_stmt *stmt;
-        std::string sql = "SELECT password_hash FROM users WHERE username = ?;";
-
-        rc = sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr);
-        if (rc != SQLITE_OK) {
-            std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(db) << '\n';
-            sqlite3_close(db);
+    // On success fills in the user's id and the hex hash their file encryption key is derived from.
+    static bool try_login(const std::string &user, const std::string &pass, int &user_id, std::string &key_hash) {
+        std::string sql = "SELECT id, password_hash FROM users WHERE username = ?;";
+        DBStatement stmt = DBConnection::local().prepare(sql);
+        if (!stmt) {
             return false;
         }
 
         sqlite3_bind_text(stmt, 1, user.c_str(), -1, SQLITE_TRANSIENT);
 
-        rc = sqlite3_step(stmt);
-
-        if (rc != SQLITE_ROW) {
+        if (sqlite3_step(stmt) != SQLITE_ROW) {
             std::cerr << "User not found\n";
-            sqlite3_finalize(stmt);
-            sqlite3_close(db);
             return false;
         }
 
-        std::string stored_hash = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+        std::string stored_hash = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1));
 
         size_t delimiter_pos = stored_hash.find(':');
         if (delimiter_pos == std::string::npos) {
             std::cerr << "Invalid password hash format\n";
-            sqlite3_finalize(stmt);
-            sqlite3_close(db);
             return false;
         }
 
@@ -175,11 +117,10 @@ public:
         std::string input_hash = hash_password(pass, salt);
         input_hash = input_hash.substr(delimiter_pos + 1);
 
-        sqlite3_finalize(stmt);
-        sqlite3_close(db);
-
         if (input_hash == stored_password_hash) {
             std::cout << "Login successful\n";
+            user_id = sqlite3_column_int(stmt, 0);
+            key_hash = stored_password_hash;
             return true;
         } else {
             std::cerr << "Invalid password\n";
@@ -188,90 +129,20 @@ public:
     }
 
     static int get_user_id(const std::string &user) {
-        sqlite3 *db;
-
-        int rc = sqlite3_open("./storage/cloud.db", &db);
-        if (rc != SQLITE_OK) {
-            std::cerr << "Can't open database: " << sqlite3_errmsg(db) << '\n';
-            return false;
-        }
-
-        sqlite3_stmt *stmt;
         std::string sql = "SELECT id FROM users WHERE username = ?;";
-
-        rc = sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr);
-        if (rc != SQLITE_OK) {
-            std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(db) << '\n';
-            sqlite3_close(db);
+        DBStatement stmt = DBConnection::local().prepare(sql);
+        if (!stmt) {
             return false;
         }
 
         sqlite3_bind_text(stmt, 1, user.c_str(), -1, SQLITE_TRANSIENT);
 
-        rc = sqlite3_step(stmt);
-
-        if (rc != SQLITE_ROW) {
+        if (sqlite3_step(stmt) != SQLITE_ROW) {
             std::cerr << "User not found\n";
-            sqlite3_finalize(stmt);
-            sqlite3_close(db);
             return false;
         }
 
-        int id = sqlite3_column_int(stmt, 0);
-
-        sqlite3_finalize(stmt);
-        sqlite3_close(db);
-
-        return id;
-    }
-
-    static std::string get_user_hash(int user_id) {
-        sqlite3 *db;
-
-        int rc = sqlite3_open("./storage/cloud.db", &db);
-        if (rc != SQLITE_OK) {
-            std::cerr << "Can't open database: " << sqlite3_errmsg(db) << '\n';
-            return "";
-        }
-
-        sqlite3_stmt *stmt;
-        std::string sql = "SELECT password_hash FROM users WHERE id = ?;";
-
-        rc = sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr);
-        if (rc != SQLITE_OK) {
-            std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(db) << '\n';
-            sqlite3_close(db);
-            return "";
-        }
-
-        sqlite3_bind_int(stmt, 1, user_id);
-
-        rc = sqlite3_step(stmt);
-
-        if (rc != SQLITE_ROW) {
-            std::cerr << "User not found\n";
-            sqlite3_finalize(stmt);
-            sqlite3_close(db);
-            return "";
-        }
-
-        const char *hash_ch = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
-        std::string hash = hash_ch;
-
-        size_t delimiter_pos = hash.find(':');
-        if (delimiter_pos == std::string::npos) {
-            std::cerr << "Invalid password hash format\n";
-            sqlite3_finalize(stmt);
-            sqlite3_close(db);
-            return "";
-        }
-
-        hash = hash.substr(delimiter_pos + 1);
-
-        sqlite3_finalize(stmt);
-        sqlite3_close(db);
-
-        return hash;
+        return sqlite3_column_int(stmt, 0);
     }
 };
 
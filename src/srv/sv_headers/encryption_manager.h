@@ -5,53 +5,159 @@
 #include <vector>
 #include <cstring>
 #include <cstdlib>
+#include <cerrno>
+#include <iostream>
+#include <memory>
+#include <sys/random.h>
 
-extern "C" {
-#include "aes.h"
-}
+#include "aes_engine.h"
+
+// Files stored before streaming encryption restarted the keystream every 8 KB chunk.
+#define LEGACY_CIPHER_SEGMENT 8192
+// Per-file nonce of STORAGE_AES_CTR_STREAM objects: the high half of the initial counter block.
+#define CIPHER_NONCE_SIZE 8
+
+using CipherKey = std::shared_ptr<const AesEngine::Schedule>;
+
+// Keystream position for one transfer. The key schedule is shared (expanded once per login),
+// the counter advances with every call and can be moved to any byte offset of the object.
+class CipherStream {
+private:
+    CipherKey key;
+    uint8_t iv[16];
+    uint64_t position;
+    uint64_t segment_size;
+
+public:
+    CipherStream(CipherKey key, const uint8_t *initial_iv, uint64_t segment_size = 0)
+        : key(std::move(key)), iv(), position(0), segment_size(segment_size) {
+        std::memcpy(iv, initial_iv, sizeof(iv));
+    }
+
+    bool valid() const {
+        return key != nullptr;
+    }
+
+    void seek(uint64_t offset) {
+        position = offset;
+    }
+
+    uint64_t tell() const {
+        return position;
+    }
+
+    void xcrypt(uint8_t *data, size_t length) {
+        if (segment_size == 0) {
+            AesEngine::ctrXcrypt(*key, iv, position, data, length);
+            position += length;
+            return;
+        }
+
+        while (length > 0) {
+            uint64_t in_segment = position % segment_size;
+            size_t chunk = segment_size - in_segment < length ? segment_size - in_segment : length;
+
+            AesEngine::ctrXcrypt(*key, iv, in_segment, data, chunk);
+            data += chunk;
+            length -= chunk;
+            position += chunk;
+        }
+    }
+};
 
 class EncryptionManager {
 private:
-    static void prepare_iv(uint8_t *iv) {
-        uint8_t default_iv[16] = {
+    static const uint8_t *defaultIv() {
+        static const uint8_t default_iv[16] = {
             0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
             0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10
         };
-        std::memcpy(iv, default_iv, 16);
+        return default_iv;
+    }
+
+    static int hexValue(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
     }
 
 public:
-    static void encrypt(uint8_t *data, size_t length, const std::string &key_hash_hex) {
+    // Expands the user's key once; the result is kept in the UserSession for the whole login.
+    // Only the first 16 bytes of the 64-char hex key are used: the stored data is AES-128.
+    static CipherKey deriveKey(const std::string &key_hash_hex) {
         if (key_hash_hex.length() != 64) {
-            return;
+            return nullptr;
         }
 
-        if (key_hash_hex.length() != 64) return;
-
         uint8_t key[32];
         for (unsigned int i = 0; i < 32; i++) {
-            std::string byteString = key_hash_hex.substr(i * 2, 2);
-            key[i] = (uint8_t) std::strtol(byteString.c_str(), nullptr, 16);
+            int high = hexValue(key_hash_hex[i * 2]);
+            int low = hexValue(key_hash_hex[i * 2 + 1]);
+            if (high < 0 || low < 0) {
+                return nullptr;
+            }
+            key[i] = static_cast<uint8_t>(high << 4 | low);
         }
 
-        uint8_t iv[16];
-        uint8_t default_iv[16] = {
-            0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10
-        };
-        std::memcpy(iv, default_iv, 16);
+        auto schedule = std::make_shared<AesEngine::Schedule>();
+        AesEngine::expandKey(key, *schedule);
+        return schedule;
+    }
 
-        struct AES_ctx ctx;
-        AES_init_ctx_iv(&ctx, key, iv);
+    // Random nonce for a new STORAGE_AES_CTR_STREAM object, kept in its file_hashes row (or its
+    // upload session until it is committed). Empty if the system has no randomness to give.
+    static std::string newNonce() {
+        std::string nonce(CIPHER_NONCE_SIZE, '\0');
+        size_t filled = 0;
+        while (filled < nonce.size()) {
+            ssize_t got = getrandom(nonce.data() + filled, nonce.size() - filled, 0);
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                return "";
+            }
+            filled += got;
+        }
+        return nonce;
+    }
 
-        std::cout << "Encrypting file...\n";
+    // Stream for new objects: one keystream over the whole file, starting from the file's own
+    // nonce so no two files share keystream. Invalid without a key or a well-formed nonce.
+    static CipherStream stream(const CipherKey &key, const std::string &nonce) {
+        uint8_t iv[16] = {0};
+        if (nonce.size() != CIPHER_NONCE_SIZE) {
+            return CipherStream(nullptr, iv);
+        }
+        std::memcpy(iv, nonce.data(), CIPHER_NONCE_SIZE);
+        return CipherStream(key, iv);
+    }
 
-        AES_CTR_xcrypt_buffer(&ctx, data, (uint32_t) length);
+    // Stream for a deduplicated chunk (chunk_store.h). The IV is derived from the chunk's keyed id:
+    // a chunk always encrypts to the same bytes and no two chunks share a keystream.
+    static CipherStream chunkStream(const CipherKey &key, const uint8_t *iv) {
+        return CipherStream(key, iv);
     }
 
-    static void decrypt(uint8_t *data, size_t length, const std::string &key_hash_hex) {
-        std::cout << "Decrypting file...\n";
+    // Secret the ids of deduplicated chunks are keyed with: two keystream blocks under an IV no
+    // stored object uses, so it is as private as the key itself. False without a key.
+    static bool chunkSecret(const CipherKey &key, uint8_t secret[32]) {
+        static const uint8_t secret_iv[16] = {
+            0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+        };
+        if (!key) {
+            return false;
+        }
+        std::memset(secret, 0, 32);
+        AesEngine::ctrXcrypt(*key, secret_iv, 0, secret, 32);
+        return true;
+    }
 
-        encrypt(data, length, key_hash_hex);
+    // Stream for objects written before the keystream was continuous.
+    static CipherStream legacyStream(const CipherKey &key) {
+        return CipherStream(key, defaultIv(), LEGACY_CIPHER_SEGMENT);
     }
 };
 
@@ -0,0 +1,222 @@
+#ifndef CPP_PERSONAL_CLOUD_EVENT_LOOP_H
+#define CPP_PERSONAL_CLOUD_EVENT_LOOP_H
+
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "client_worker.h"
+#include "worker_pool.h"
+
+#define MAX_EPOLL_EVENTS 256
+#define CLIENT_IO_TIMEOUT_SEC 120
+
+// One reactor per core. All loops share the listening socket (EPOLLEXCLUSIVE wakes a single
+// loop per incoming connection) and each keeps the connections it accepted.
+//
+// Connections are registered with EPOLLONESHOT: an idle connection costs a ClientWorker and an
+// epoll entry, no thread. When a full command frame arrives the command is handed to the
+// WorkerPool, which runs it on the blocking socket (commands do their own READY handshakes and
+// streaming). A text connection goes back into the loop once the command is done; a binary one
+// right away, so the next requests are read and run while the first is still going, unless the
+// command holds the connection (see Command::holdsConnection). A command that left the client's
+// data half read (Command::desynced) ends the connection instead.
+class EventLoop {
+private:
+    int epoll_fd;
+    int listen_fd;
+    WorkerPool &pool;
+    std::thread thread;
+
+    std::mutex connections_mutex;
+    std::unordered_map<int, std::shared_ptr<ClientWorker> > connections;
+
+    void arm(ClientWorker *worker, int op) {
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+        ev.data.ptr = worker;
+
+        if (epoll_ctl(epoll_fd, op, worker->getFd(), &ev) < 0) {
+            std::cerr << "epoll_ctl failed for FD " << worker->getFd() << '\n';
+            closeConnection(worker);
+        }
+    }
+
+    // The socket itself is closed by ~ClientWorker, once commands still running on it are done.
+    void closeConnection(ClientWorker *worker) {
+        int fd = worker->getFd();
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+
+        std::lock_guard<std::mutex> lock(connections_mutex);
+        connections.erase(fd);
+
+        std::cout << "Sesiune incheiata pentru clientul FD: " << fd << std::endl;
+    }
+
+    void acceptClients() {
+        while (true) {
+            sockaddr_in clientAddr{};
+            socklen_t clientLen = sizeof(clientAddr);
+            int new_sock = accept4(listen_fd, reinterpret_cast<sockaddr *>(&clientAddr), &clientLen, SOCK_CLOEXEC);
+            if (new_sock < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    std::cerr << "Error accepting client\n";
+                }
+                return;
+            }
+
+            timeval timeout{CLIENT_IO_TIMEOUT_SEC, 0};
+            setsockopt(new_sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(new_sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+            std::cout << "Client connected FD: " << new_sock << '\n';
+
+            ClientWorker *worker;
+            {
+                std::lock_guard<std::mutex> lock(connections_mutex);
+                auto inserted = connections.emplace(new_sock, std::make_shared<ClientWorker>(new_sock));
+                worker = inserted.first->second.get();
+            }
+
+            arm(worker, EPOLL_CTL_ADD);
+        }
+    }
+
+    void onReadable(ClientWorker *worker) {
+        std::string cmd;
+
+        switch (worker->readFrame(cmd)) {
+            case ClientWorker::ReadResult::INCOMPLETE:
+                arm(worker, EPOLL_CTL_MOD);
+                break;
+            case ClientWorker::ReadResult::INVALID_SIZE:
+                if (worker->rejectFrame()) {
+                    arm(worker, EPOLL_CTL_MOD);
+                } else {
+                    closeConnection(worker);
+                }
+                break;
+            case ClientWorker::ReadResult::CLOSED:
+                std::cout << "Client deconectat\n";
+                closeConnection(worker);
+                break;
+            case ClientWorker::ReadResult::COMMAND_READY:
+                dispatch(worker, std::move(cmd));
+                break;
+        }
+    }
+
+    void dispatch(ClientWorker *worker, std::string cmd) {
+        if (worker->negotiate(cmd) || worker->cancel(cmd)) {
+            arm(worker, EPOLL_CTL_MOD);
+            return;
+        }
+
+        RequestContext request = worker->currentRequest();
+        std::shared_ptr<Command> command;
+        try {
+            command = worker->parseCommand(std::move(cmd));
+        } catch (const std::exception &e) {
+            std::cerr << "COMANDA EROARE: " << e.what() << "\n";
+            worker->sendResponse(ServerResponse{0, e.what(), ""}, request);
+            arm(worker, EPOLL_CTL_MOD);
+            return;
+        }
+
+        bool holds = !request.binary || command->holdsConnection();
+        std::shared_ptr<ClientWorker> owner = worker->shared_from_this();
+
+        worker->track(request);
+        bool accepted = pool.submit(worker->schedulingKey(), command->isBulk(), [this, owner, command, request, holds]() {
+            owner->executeCommand(*command, request);
+            owner->untrack(request);
+
+            if (holds && command->desynced()) {
+                shutdown(owner->getFd(), SHUT_RDWR);
+                closeConnection(owner.get());
+            } else if (holds) {
+                arm(owner.get(), EPOLL_CTL_MOD);
+            }
+        });
+
+        if (!accepted) {
+            worker->untrack(request);
+            worker->sendResponse(ServerResponse{0, "Server busy, try again later", ""}, request);
+            arm(worker, EPOLL_CTL_MOD);
+        } else if (!holds) {
+            arm(worker, EPOLL_CTL_MOD);
+        }
+    }
+
+    void loop() {
+        epoll_event events[MAX_EPOLL_EVENTS];
+
+        while (true) {
+            int count = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+            if (count < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                std::cerr << "epoll_wait failed\n";
+                return;
+            }
+
+            for (int i = 0; i < count; i++) {
+                if (events[i].data.ptr == nullptr) {
+                    acceptClients();
+                    continue;
+                }
+
+                auto *worker = static_cast<ClientWorker *>(events[i].data.ptr);
+                if ((events[i].events & EPOLLIN) == 0 && (events[i].events & (EPOLLERR | EPOLLHUP))) {
+                    closeConnection(worker);
+                    continue;
+                }
+
+                onReadable(worker);
+            }
+        }
+    }
+
+public:
+    EventLoop(int listen_fd, WorkerPool &pool) : epoll_fd(epoll_create1(EPOLL_CLOEXEC)), listen_fd(listen_fd),
+                                                 pool(pool) {
+        if (epoll_fd < 0) {
+            throw std::runtime_error("Error creating epoll instance");
+        }
+
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = nullptr;
+
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+            close(epoll_fd);
+            throw std::runtime_error("Error registering listening socket");
+        }
+    }
+
+    EventLoop(const EventLoop &) = delete;
+
+    EventLoop &operator=(const EventLoop &) = delete;
+
+    ~EventLoop() {
+        join();
+        close(epoll_fd);
+    }
+
+    void start() {
+        thread = std::thread(&EventLoop::loop, this);
+    }
+
+    void join() {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+};
+
+#endif //CPP_PERSONAL_CLOUD_EVENT_LOOP_H
@@ -0,0 +1,116 @@
+#ifndef CPP_PERSONAL_CLOUD_FILE_SENDER_H
+#define CPP_PERSONAL_CLOUD_FILE_SENDER_H
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "encryption_manager.h"
+#include "redundancy_manager.h"
+
+#define SEND_PIPELINE_BUFFER (1024 * 1024)
+
+// Streams a stored object to a client socket. Objects kept as plaintext are handed to the kernel
+// with sendfile() and never touch user space. Encrypted objects are read with pread() in 1 MB
+// blocks, decrypted in place and sent with one send() loop per block instead of one read,
+// decrypt and send per 8 KB.
+class FileSender {
+public:
+    static bool sendAll(int sock, const char *data, size_t length) {
+        size_t sent_total = 0;
+
+        while (sent_total < length) {
+            ssize_t sent = send(sock, data + sent_total, length - sent_total, MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            sent_total += sent;
+        }
+
+        return true;
+    }
+
+    static bool sendPlain(int sock, int file_fd, off_t offset, size_t length) {
+        size_t remaining = length;
+
+        while (remaining > 0) {
+            ssize_t sent = sendfile(sock, file_fd, &offset, remaining);
+            if (sent < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                std::cerr << "sendfile failed: " << std::strerror(errno) << '\n';
+                return false;
+            }
+            if (sent == 0) {
+                std::cerr << "sendfile: file shorter than expected\n";
+                return false;
+            }
+            remaining -= sent;
+        }
+
+        return true;
+    }
+
+    // Sends through the pread pipeline. `cipher` is null for plaintext objects; `hasher`, when set,
+    // is fed the stored bytes before they are decrypted so the object can be verified while it streams.
+    static bool sendBuffered(int sock, int file_fd, off_t offset, size_t length, CipherStream *cipher,
+                             FileDigest *hasher) {
+        thread_local std::vector<char> buffer(SEND_PIPELINE_BUFFER);
+
+        posix_fadvise(file_fd, offset, length, POSIX_FADV_SEQUENTIAL);
+        if (cipher) {
+            cipher->seek(offset);
+        }
+
+        size_t remaining = length;
+
+        while (remaining > 0) {
+            size_t to_read = remaining < buffer.size() ? remaining : buffer.size();
+            size_t filled = 0;
+
+            while (filled < to_read) {
+                ssize_t got = pread(file_fd, buffer.data() + filled, to_read - filled, offset + filled);
+                if (got < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    std::cerr << "pread failed: " << std::strerror(errno) << '\n';
+                    return false;
+                }
+                if (got == 0) {
+                    std::cerr << "pread: file shorter than expected\n";
+                    return false;
+                }
+                filled += got;
+            }
+
+            if (hasher) {
+                hasher->update(buffer.data(), filled);
+            }
+            if (cipher) {
+                cipher->xcrypt(reinterpret_cast<uint8_t *>(buffer.data()), filled);
+            }
+
+            if (!sendAll(sock, buffer.data(), filled)) {
+                return false;
+            }
+
+            offset += filled;
+            remaining -= filled;
+        }
+
+        return true;
+    }
+};
+
+#endif //CPP_PERSONAL_CLOUD_FILE_SENDER_H
@@ -0,0 +1,358 @@
+#ifndef CPP_PERSONAL_CLOUD_INTEGRITY_SCRUBBER_H
+#define CPP_PERSONAL_CLOUD_INTEGRITY_SCRUBBER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <fcntl.h>
+#include <filesystem>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "chunk_store.h"
+#include "db_manager.h"
+#include "pack_store.h"
+#include "redundancy_manager.h"
+#include "server_config.h"
+#include "worker_pool.h"
+
+#define SCRUB_READ_BLOCK (1024 * 1024)
+// Files written this recently may still be in the middle of an upload and are left for the next pass.
+#define SCRUB_SETTLE_SEC 60
+#define SCRUB_BUSY_POLL_MS 200
+#define SCRUB_PACK_PAGE 1000
+
+// Background thread that walks ./storage/<user>/primary, checks every file with a stored hash
+// and its copy under backup/, and repairs whichever side is damaged from the other one.
+//
+// Reads are paced to a byte rate and the scrubber waits while client commands are queued or
+// running, so it only uses disk time the foreground does not need. Scrub reads are dropped from
+// the page cache as they go so they don't evict files clients are actually reading.
+class IntegrityScrubber {
+private:
+    WorkerPool &pool;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping = false;
+
+    std::chrono::steady_clock::time_point window_start;
+    unsigned long long window_bytes = 0;
+
+    struct PassStats {
+        size_t files = 0;
+        size_t repaired_primary = 0;
+        size_t repaired_backup = 0;
+        size_t unrecoverable = 0;
+    };
+
+    // Sleeps up to `duration`; returns false if the scrubber is being stopped.
+    bool pause(std::chrono::milliseconds duration) {
+        std::unique_lock<std::mutex> lock(mutex);
+        return !cv.wait_for(lock, duration, [this] { return stopping; });
+    }
+
+    bool waitForIdle() {
+        while (pool.load() >= ServerConfig::instance().scrub_busy_tasks) {
+            if (!pause(std::chrono::milliseconds(SCRUB_BUSY_POLL_MS))) {
+                return false;
+            }
+            window_start = std::chrono::steady_clock::now();
+            window_bytes = 0;
+        }
+        return true;
+    }
+
+    bool throttle(size_t bytes) {
+        window_bytes += bytes;
+
+        auto allowed = std::chrono::duration<double>(
+            static_cast<double>(window_bytes) / ServerConfig::instance().scrub_rate);
+        auto due = window_start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(allowed);
+        auto now = std::chrono::steady_clock::now();
+
+        if (due > now) {
+            return pause(std::chrono::duration_cast<std::chrono::milliseconds>(due - now));
+        }
+        return true;
+    }
+
+    // Hashes a whole file at the scrub rate. Returns false only when the scrubber is stopping;
+    // `readable` is false for a missing or unreadable file.
+    bool hashFile(const std::filesystem::path &path, FileDigest &hasher, bool &readable) {
+        readable = false;
+
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return true;
+        }
+
+        thread_local std::vector<char> buffer(SCRUB_READ_BLOCK);
+        off_t offset = 0;
+
+        while (true) {
+            if (!waitForIdle()) {
+                close(fd);
+                return false;
+            }
+
+            ssize_t got = pread(fd, buffer.data(), buffer.size(), offset);
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got < 0) {
+                close(fd);
+                return true;
+            }
+            if (got == 0) {
+                break;
+            }
+
+            hasher.update(buffer.data(), got);
+            posix_fadvise(fd, offset, got, POSIX_FADV_DONTNEED);
+            offset += got;
+
+            if (!throttle(got)) {
+                close(fd);
+                return false;
+            }
+        }
+
+        close(fd);
+        readable = true;
+        return true;
+    }
+
+    static bool sameFile(const struct stat &a, const struct stat &b) {
+        return a.st_size == b.st_size && a.st_ino == b.st_ino &&
+               IntegrityRecord::mtimeNs(a) == IntegrityRecord::mtimeNs(b);
+    }
+
+    bool scrubFile(int user_id, const std::filesystem::path &primary, const std::filesystem::path &backup,
+                   PassStats &stats) {
+        IntegrityRecord record = RedundancyManager::getIntegrityRecord(user_id, primary.string());
+        if (record.hash.empty()) {
+            return true;
+        }
+
+        struct stat before{};
+        if (stat(primary.c_str(), &before) < 0 || std::time(nullptr) - before.st_mtim.tv_sec < SCRUB_SETTLE_SEC) {
+            return true;
+        }
+        stats.files++;
+
+        // A primary already fully hashed since the previous pass is trusted; the backup has no
+        // fingerprint of its own and is always read. Only damaged blocks are rewritten when the
+        // file has block hashes.
+        bool has_blocks = !record.block_hashes.empty();
+        FileDigest primary_digest(!has_blocks);
+        bool primary_ok = record.isVerified(before, ServerConfig::instance().scrub_interval_sec);
+        bool primary_read = false;
+        if (!primary_ok) {
+            if (!hashFile(primary, primary_digest, primary_read)) {
+                return false;
+            }
+
+            // The file changed while it was being read (a new upload or a GET repair): not a verdict.
+            struct stat after{};
+            if (stat(primary.c_str(), &after) < 0 || !sameFile(before, after) ||
+                RedundancyManager::getIntegrityRecord(user_id, primary.string()).hash != record.hash) {
+                return true;
+            }
+            primary_ok = primary_read && record.matches(primary_digest);
+
+            if (primary_ok && !has_blocks) {
+                record.block_hashes = primary_digest.blockHashes();
+                RedundancyManager::saveBlockHashes(user_id, primary.string(), record.block_hashes);
+            }
+        }
+
+        FileDigest backup_digest(!has_blocks);
+        bool backup_read = false;
+        if (!hashFile(backup, backup_digest, backup_read)) {
+            return false;
+        }
+        bool backup_ok = backup_read && record.matches(backup_digest);
+
+        if (primary_ok && !backup_ok) {
+            std::cout << "Scrubber: backup damaged or missing, rewriting " << backup << '\n';
+            bool repaired = has_blocks && backup_read
+                                ? RedundancyManager::repairBlocks(backup.string(), primary.string(),
+                                                                  record.block_hashes, backup_digest.blockHashes())
+                                : RedundancyManager::restoreBackup(primary.string(), backup.string());
+            if (repaired) {
+                stats.repaired_backup++;
+            }
+        } else if (!primary_ok && backup_ok) {
+            std::cout << "Scrubber: primary damaged, restoring " << primary << '\n';
+            bool repaired = has_blocks && primary_read
+                                ? RedundancyManager::repairBlocks(primary.string(), backup.string(),
+                                                                  record.block_hashes, primary_digest.blockHashes())
+                                : RedundancyManager::repairFromBackup(primary.string(), backup.string());
+            if (repaired && stat(primary.c_str(), &before) == 0) {
+                stats.repaired_primary++;
+                primary_ok = true;
+            }
+        } else if (!primary_ok) {
+            std::cerr << "Scrubber: both copies of " << primary << " are damaged\n";
+            stats.unrecoverable++;
+        }
+
+        if (primary_ok) {
+            RedundancyManager::markVerified(user_id, primary.string(), before);
+        }
+        return true;
+    }
+
+    // Both copies of every packed file (pack_store.h), each repaired from the other.
+    bool scrubPacks(const std::filesystem::path &user_dir, int user_id, PassStats &stats) {
+        std::string after;
+        while (true) {
+            auto page = PackStore::entries(user_id, after, SCRUB_PACK_PAGE);
+            if (page.empty()) {
+                return true;
+            }
+
+            for (const auto &entry: page) {
+                if (!waitForIdle()) {
+                    return false;
+                }
+
+                stats.files++;
+                bool primary_repaired = false;
+                bool backup_repaired = false;
+                if (!PackStore::verify(user_id, user_dir, entry.first, entry.second, primary_repaired,
+                                       backup_repaired)) {
+                    std::cerr << "Scrubber: both packed copies of " << entry.first << " are damaged\n";
+                    stats.unrecoverable++;
+                }
+                stats.repaired_primary += primary_repaired;
+                stats.repaired_backup += backup_repaired;
+
+                if (!throttle(2 * entry.second.length)) {
+                    return false;
+                }
+                after = entry.first;
+            }
+        }
+    }
+
+    // Both copies of every deduplicated chunk (chunk_store.h), after dropping unreferenced ones.
+    bool scrubChunks(const std::filesystem::path &user_dir, int user_id, PassStats &stats) {
+        ChunkStore::collect(user_id, user_dir);
+
+        std::string after;
+        while (true) {
+            auto page = ChunkStore::chunks(user_id, after, SCRUB_PACK_PAGE);
+            if (page.empty()) {
+                return true;
+            }
+
+            for (const auto &chunk: page) {
+                if (!waitForIdle()) {
+                    return false;
+                }
+
+                stats.files++;
+                bool primary_repaired = false;
+                bool backup_repaired = false;
+                if (!ChunkStore::verify(user_id, user_dir, chunk.hash, primary_repaired, backup_repaired)) {
+                    std::cerr << "Scrubber: both copies of chunk " << chunk.hash << " are damaged\n";
+                    stats.unrecoverable++;
+                }
+                stats.repaired_primary += primary_repaired;
+                stats.repaired_backup += backup_repaired;
+
+                if (!throttle(2 * chunk.length)) {
+                    return false;
+                }
+                after = chunk.hash;
+            }
+        }
+    }
+
+    bool scrubUser(const std::filesystem::path &user_dir, PassStats &stats) {
+        std::filesystem::path primary_root = user_dir / "primary";
+        std::filesystem::path backup_root = user_dir / "backup";
+        if (!std::filesystem::is_directory(primary_root)) {
+            return true;
+        }
+
+        int user_id = DBManager::get_user_id(user_dir.filename().string());
+        if (user_id <= 0) {
+            return true;
+        }
+
+        std::error_code ec;
+        for (auto it = std::filesystem::recursive_directory_iterator(primary_root, ec);
+             !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+            if (!it->is_regular_file(ec)) {
+                continue;
+            }
+
+            std::filesystem::path relative = std::filesystem::relative(it->path(), primary_root, ec);
+            if (!scrubFile(user_id, it->path(), backup_root / relative, stats)) {
+                return false;
+            }
+        }
+
+        return scrubPacks(user_dir, user_id, stats) && scrubChunks(user_dir, user_id, stats);
+    }
+
+    void run() {
+        while (true) {
+            PassStats stats;
+            window_start = std::chrono::steady_clock::now();
+            window_bytes = 0;
+
+            std::error_code ec;
+            for (const auto &entry: std::filesystem::directory_iterator("./storage", ec)) {
+                if (entry.is_directory() && !scrubUser(entry.path(), stats)) {
+                    return;
+                }
+            }
+
+            std::cout << "Scrub pass done: " << stats.files << " files checked, " << stats.repaired_primary
+                    << " primaries and " << stats.repaired_backup << " backups repaired, "
+                    << stats.unrecoverable << " unrecoverable\n";
+
+            if (!pause(std::chrono::seconds(ServerConfig::instance().scrub_interval_sec))) {
+                return;
+            }
+        }
+    }
+
+public:
+    explicit IntegrityScrubber(WorkerPool &pool) : pool(pool) {
+    }
+
+    IntegrityScrubber(const IntegrityScrubber &) = delete;
+
+    IntegrityScrubber &operator=(const IntegrityScrubber &) = delete;
+
+    ~IntegrityScrubber() {
+        stop();
+    }
+
+    void start() {
+        thread = std::thread(&IntegrityScrubber::run, this);
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+};
+
+#endif //CPP_PERSONAL_CLOUD_INTEGRITY_SCRUBBER_H
@@ -0,0 +1,465 @@
+#ifndef CPP_PERSONAL_CLOUD_METADATA_INDEX_H
+#define CPP_PERSONAL_CLOUD_METADATA_INDEX_H
+
+#include <filesystem>
+#include <iostream>
+#include <sqlite3.h>
+#include <string>
+#include <sys/stat.h>
+#include <unordered_map>
+#include <vector>
+
+#include "cloud_change.h"
+#include "cloud_dir.h"
+#include "db_connection.h"
+#include "redundancy_manager.h"
+
+// Journal entries kept per user. A client further behind than this, or with more pending changes
+// than JOURNAL_MAX_CHANGES, is told to reload the whole tree instead.
+#define JOURNAL_RETAIN 20000
+#define JOURNAL_MAX_CHANGES 5000
+#define JOURNAL_PRUNE_EVERY 1000
+
+// One page of a single directory level, ordered by name. `next` is the name to continue after, or
+// empty on the last page.
+struct DirListing {
+    std::vector<CloudFile> files;
+    std::vector<CloudDirSummary> subdirs;
+    std::string next;
+    unsigned long long version = 0;
+};
+
+// One row per file and directory under a user's primary storage, so LIST is a single indexed
+// query instead of a walk of the directory tree. Paths are relative to primary and always start
+// with '/' ("/photos/a.jpg"); the root itself is "/" and has no row.
+//
+// Commands that change primary storage update the index inside the same transaction as the rest
+// of their metadata. Users created before the index existed are indexed from disk at their first
+// login (see ensureIndexed).
+//
+// Every change is also appended to a per-user journal under a version number that only goes up,
+// so a client that already has the tree at version N can ask for what happened after N
+// (changesSince) instead of listing everything again.
+class MetadataIndex {
+private:
+    struct Entry {
+        std::string path;
+        std::string name;
+        bool is_dir;
+        unsigned long long size;
+    };
+
+    static std::string parentOf(const std::string &path) {
+        size_t slash = path.find_last_of('/');
+        return slash == 0 ? "/" : path.substr(0, slash);
+    }
+
+    // Directories are added on demand as well, so a file that shows up in a directory created
+    // outside MKDIR still has a complete chain of parents.
+    static bool putParents(int user_id, const std::string &path, bool journal) {
+        std::string parent = parentOf(path);
+        if (parent == "/") {
+            return true;
+        }
+        return putDir(user_id, parent, journal);
+    }
+
+    static bool bumpVersion(int user_id, unsigned long long &version) {
+        DBConnection &db = DBConnection::local();
+        {
+            std::string sql = "INSERT INTO file_versions (user_id, version) VALUES (?, 1) "
+                    "ON CONFLICT (user_id) DO UPDATE SET version = version + 1;";
+            DBStatement stmt = db.prepare(sql);
+            sqlite3_bind_int(stmt, 1, user_id);
+            if (sqlite3_step(stmt) != SQLITE_DONE) {
+                return false;
+            }
+        }
+
+        version = currentVersion(user_id);
+        return version > 0;
+    }
+
+    static bool record(int user_id, const char *op, const std::string &path, bool is_dir,
+                       unsigned long long size) {
+        unsigned long long version = 0;
+        if (!bumpVersion(user_id, version)) {
+            return false;
+        }
+
+        DBConnection &db = DBConnection::local();
+        {
+            std::string sql = "INSERT INTO file_journal (user_id, version, op, path, is_dir, size) "
+                    "VALUES (?,?,?,?,?,?);";
+            DBStatement stmt = db.prepare(sql);
+            sqlite3_bind_int(stmt, 1, user_id);
+            sqlite3_bind_int64(stmt, 2, static_cast<sqlite3_int64>(version));
+            sqlite3_bind_text(stmt, 3, op, -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 4, path.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int(stmt, 5, is_dir ? 1 : 0);
+            sqlite3_bind_int64(stmt, 6, static_cast<sqlite3_int64>(size));
+            if (sqlite3_step(stmt) != SQLITE_DONE) {
+                return false;
+            }
+        }
+
+        if (version % JOURNAL_PRUNE_EVERY == 0 && version > JOURNAL_RETAIN) {
+            std::string sql = "DELETE FROM file_journal WHERE user_id = ? AND version <= ?;";
+            DBStatement stmt = db.prepare(sql);
+            sqlite3_bind_int(stmt, 1, user_id);
+            sqlite3_bind_int64(stmt, 2, static_cast<sqlite3_int64>(version - JOURNAL_RETAIN));
+            sqlite3_step(stmt);
+        }
+        return true;
+    }
+
+    static void buildDir(CloudDir &dir, std::unordered_map<std::string, std::vector<Entry> > &children) {
+        auto found = children.find(dir.path);
+        if (found == children.end()) {
+            return;
+        }
+
+        for (Entry &entry: found->second) {
+            if (entry.is_dir) {
+                CloudDir subdir;
+                subdir.name = std::move(entry.name);
+                subdir.path = std::move(entry.path);
+                buildDir(subdir, children);
+                dir.subdirs.push_back(std::move(subdir));
+            } else {
+                dir.files.push_back(CloudFile{entry.size, std::move(entry.name)});
+            }
+        }
+    }
+
+public:
+    static bool initDatabase() {
+        std::string sql =
+                "CREATE TABLE IF NOT EXISTS file_index ("
+                "user_id INTEGER NOT NULL, "
+                "path TEXT NOT NULL, "
+                "parent TEXT NOT NULL, "
+                "name TEXT NOT NULL, "
+                "is_dir INTEGER NOT NULL, "
+                "size INTEGER NOT NULL DEFAULT 0, "
+                "mtime INTEGER NOT NULL DEFAULT 0, "
+                "hash TEXT, "
+                "PRIMARY KEY (user_id, path)"
+                ") WITHOUT ROWID;"
+                "DROP INDEX IF EXISTS file_index_parent;"
+                "CREATE INDEX IF NOT EXISTS file_index_children ON file_index (user_id, parent, name);"
+                "CREATE TABLE IF NOT EXISTS file_index_users ("
+                "user_id INTEGER PRIMARY KEY, "
+                "indexed_at INTEGER NOT NULL"
+                ");"
+                "CREATE TABLE IF NOT EXISTS file_versions ("
+                "user_id INTEGER PRIMARY KEY, "
+                "version INTEGER NOT NULL"
+                ");"
+                "CREATE TABLE IF NOT EXISTS file_journal ("
+                "user_id INTEGER NOT NULL, "
+                "version INTEGER NOT NULL, "
+                "op TEXT NOT NULL, "
+                "path TEXT NOT NULL, "
+                "is_dir INTEGER NOT NULL, "
+                "size INTEGER NOT NULL, "
+                "PRIMARY KEY (user_id, version)"
+                ") WITHOUT ROWID;";
+
+        return DBConnection::local().exec(sql);
+    }
+
+    // Index key of a file or directory under `primary_root`, or "" for anything outside it.
+    static std::string indexPath(const std::filesystem::path &primary_root, const std::filesystem::path &full_path) {
+        std::filesystem::path relative = full_path.lexically_normal().lexically_relative(
+            primary_root.lexically_normal());
+        std::string path = relative.generic_string();
+
+        if (path.empty() || path == "." || path.rfind("..", 0) == 0) {
+            return "";
+        }
+        if (path.back() == '/') {
+            path.pop_back();
+        }
+        return "/" + path;
+    }
+
+    // The put/remove calls also append to the journal, so they belong in the caller's transaction.
+    static bool putFile(int user_id, const std::string &path, const struct stat &st, const std::string &hash,
+                        bool journal = true) {
+        if (path.empty() || !putParents(user_id, path, journal)) {
+            return false;
+        }
+
+        std::string sql = "INSERT OR REPLACE INTO file_index (user_id, path, parent, name, is_dir, size, mtime, hash) "
+                "VALUES (?,?,?,?,0,?,?,?);";
+        DBStatement stmt = DBConnection::local().prepare(sql);
+
+        std::string parent = parentOf(path);
+        std::string name = path.substr(path.find_last_of('/') + 1);
+        sqlite3_bind_int(stmt, 1, user_id);
+        sqlite3_bind_text(stmt, 2, path.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 3, parent.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 4, name.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(stmt, 5, st.st_size);
+        sqlite3_bind_int64(stmt, 6, IntegrityRecord::mtimeNs(st));
+        if (!hash.empty()) {
+            sqlite3_bind_text(stmt, 7, hash.c_str(), -1, SQLITE_TRANSIENT);
+        }
+
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+            return false;
+        }
+        return !journal || record(user_id, "put", path, false, st.st_size);
+    }
+
+    static bool putDir(int user_id, const std::string &path, bool journal = true) {
+        if (path.empty() || !putParents(user_id, path, journal)) {
+            return false;
+        }
+
+        std::string sql = "INSERT OR IGNORE INTO file_index (user_id, path, parent, name, is_dir) VALUES (?,?,?,?,1);";
+        DBStatement stmt = DBConnection::local().prepare(sql);
+
+        std::string parent = parentOf(path);
+        std::string name = path.substr(path.find_last_of('/') + 1);
+        sqlite3_bind_int(stmt, 1, user_id);
+        sqlite3_bind_text(stmt, 2, path.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 3, parent.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 4, name.c_str(), -1, SQLITE_TRANSIENT);
+
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+            return false;
+        }
+        bool created = sqlite3_changes(DBConnection::local().handle()) > 0;
+        return !journal || !created || record(user_id, "put", path, true, 0);
+    }
+
+    // Removes a file, or a directory together with everything below it.
+    static bool remove(int user_id, const std::string &path) {
+        if (path.empty()) {
+            return false;
+        }
+
+        // Descendants of "/a" sort between "/a/" and "/a0" ('0' follows '/'), which keeps the
+        // delete on the primary key instead of a LIKE scan.
+        std::string sql = "DELETE FROM file_index WHERE user_id = ? AND (path = ? OR (path >= ? AND path < ?));";
+        DBStatement stmt = DBConnection::local().prepare(sql);
+
+        std::string lower = path + "/";
+        std::string upper = path + "0";
+        sqlite3_bind_int(stmt, 1, user_id);
+        sqlite3_bind_text(stmt, 2, path.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 3, lower.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 4, upper.c_str(), -1, SQLITE_TRANSIENT);
+
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+            return false;
+        }
+        bool removed = sqlite3_changes(DBConnection::local().handle()) > 0;
+        return !removed || record(user_id, "delete", path, false, 0);
+    }
+
+    static unsigned long long currentVersion(int user_id) {
+        std::string sql = "SELECT version FROM file_versions WHERE user_id = ?;";
+        DBStatement stmt = DBConnection::local().prepare(sql);
+        sqlite3_bind_int(stmt, 1, user_id);
+
+        if (sqlite3_step(stmt) != SQLITE_ROW) {
+            return 0;
+        }
+        return static_cast<unsigned long long>(sqlite3_column_int64(stmt, 0));
+    }
+
+    // Journal entries after `since`, oldest first, and the version they bring the client to.
+    // Returns false when the journal no longer reaches back to `since` (or `since` is from a
+    // different database), in which case the client has to reload the whole tree.
+    static bool changesSince(int user_id, unsigned long long since, std::vector<CloudChange> &changes,
+                             unsigned long long &version) {
+        DBTransaction snapshot(false);
+        version = currentVersion(user_id);
+        if (since > version) {
+            return false;
+        }
+        if (since == version) {
+            return true;
+        }
+        if (version - since > JOURNAL_MAX_CHANGES) {
+            return false;
+        }
+
+        std::string sql = "SELECT version, op, path, is_dir, size FROM file_journal "
+                "WHERE user_id = ? AND version > ? ORDER BY version;";
+        DBStatement stmt = DBConnection::local().prepare(sql);
+        sqlite3_bind_int(stmt, 1, user_id);
+        sqlite3_bind_int64(stmt, 2, static_cast<sqlite3_int64>(since));
+
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            changes.push_back(CloudChange{
+                static_cast<unsigned long long>(sqlite3_column_int64(stmt, 0)),
+                reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1)),
+                reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2)),
+                sqlite3_column_int(stmt, 3) != 0,
+                static_cast<unsigned long long>(sqlite3_column_int64(stmt, 4)),
+            });
+        }
+
+        // Versions are handed out inside the same transaction as their journal entry, so a gap at
+        // the front means the entries were pruned.
+        return !changes.empty() && changes.front().version == since + 1;
+    }
+
+    // The whole tree in the shape LIST has always returned, and the journal version it reflects.
+    static CloudDir listTree(int user_id, const std::string &root_name, unsigned long long &version) {
+        DBTransaction snapshot(false);
+        version = currentVersion(user_id);
+
+        std::string sql = "SELECT path, parent, name, is_dir, size FROM file_index WHERE user_id = ?;";
+        DBStatement stmt = DBConnection::local().prepare(sql);
+        sqlite3_bind_int(stmt, 1, user_id);
+
+        std::unordered_map<std::string, std::vector<Entry> > children;
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            std::string parent = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1));
+            children[parent].push_back(Entry{
+                reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)),
+                reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2)),
+                sqlite3_column_int(stmt, 3) != 0,
+                static_cast<unsigned long long>(sqlite3_column_int64(stmt, 4)),
+            });
+        }
+
+        CloudDir root;
+        root.name = root_name;
+        root.path = "/";
+        buildDir(root, children);
+        return root;
+    }
+
+    static bool isDirectory(int user_id, const std::string &path) {
+        if (path == "/") {
+            return true;
+        }
+
+        std::string sql = "SELECT is_dir FROM file_index WHERE user_id = ? AND path = ?;";
+        DBStatement stmt = DBConnection::local().prepare(sql);
+        sqlite3_bind_int(stmt, 1, user_id);
+        sqlite3_bind_text(stmt, 2, path.c_str(), -1, SQLITE_TRANSIENT);
+
+        return sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int(stmt, 0) != 0;
+    }
+
+    // Up to `limit` entries of `dir` whose names sort after `after`, walked on the
+    // (user_id, parent, name) index so every page costs the same however deep into the
+    // directory it is.
+    static DirListing listDir(int user_id, const std::string &dir, const std::string &after, size_t limit) {
+        DBTransaction snapshot(false);
+        DirListing listing;
+        listing.version = currentVersion(user_id);
+
+        std::string sql =
+                "SELECT f.path, f.name, f.is_dir, f.size, CASE WHEN f.is_dir THEN "
+                "(SELECT COUNT(*) FROM file_index c WHERE c.user_id = f.user_id AND c.parent = f.path) ELSE 0 END "
+                "FROM file_index f WHERE f.user_id = ? AND f.parent = ? AND f.name > ? ORDER BY f.name LIMIT ?;";
+        DBStatement stmt = DBConnection::local().prepare(sql);
+        sqlite3_bind_int(stmt, 1, user_id);
+        sqlite3_bind_text(stmt, 2, dir.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 3, after.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(stmt, 4, static_cast<sqlite3_int64>(limit));
+
+        size_t rows = 0;
+        std::string last;
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            last = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1));
+            if (sqlite3_column_int(stmt, 2) != 0) {
+                listing.subdirs.push_back(CloudDirSummary{
+                    last,
+                    reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)),
+                    static_cast<unsigned long long>(sqlite3_column_int64(stmt, 4)),
+                });
+            } else {
+                listing.files.push_back(CloudFile{static_cast<unsigned long long>(sqlite3_column_int64(stmt, 3)), last});
+            }
+            rows++;
+        }
+
+        if (rows == limit) {
+            listing.next = last;
+        }
+        return listing;
+    }
+
+    // Indexes a user's existing primary storage the first time they log in after the upgrade.
+    // The tree is walked (and its hashes looked up) before the write transaction is opened, so
+    // other users' writes only wait for the inserts. The marker is checked again inside the
+    // transaction: when two connections log in at once, only one of them writes the rows.
+    static bool ensureIndexed(int user_id, const std::filesystem::path &primary_root) {
+        DBConnection &db = DBConnection::local();
+        std::string sql = "SELECT 1 FROM file_index_users WHERE user_id = ?;";
+        {
+            DBStatement stmt = db.prepare(sql);
+            sqlite3_bind_int(stmt, 1, user_id);
+            if (sqlite3_step(stmt) == SQLITE_ROW) {
+                return true;
+            }
+        }
+
+        struct Entry {
+            std::string path;
+            bool is_dir = false;
+            struct stat st{};
+            std::string hash;
+        };
+        std::vector<Entry> entries;
+        std::error_code ec;
+        for (auto it = std::filesystem::recursive_directory_iterator(primary_root, ec);
+             !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+            Entry entry;
+            entry.path = indexPath(primary_root, it->path());
+            if (it->is_directory(ec)) {
+                entry.is_dir = true;
+            } else if (!it->is_regular_file(ec) || stat(it->path().c_str(), &entry.st) != 0) {
+                continue;
+            } else {
+                entry.hash = RedundancyManager::getStoredHash(user_id, it->path().string());
+            }
+            entries.push_back(std::move(entry));
+        }
+
+        DBTransaction transaction;
+        if (!transaction.active()) {
+            return false;
+        }
+
+        {
+            DBStatement stmt = db.prepare(sql);
+            sqlite3_bind_int(stmt, 1, user_id);
+            if (sqlite3_step(stmt) == SQLITE_ROW) {
+                return true;
+            }
+        }
+
+        for (const Entry &entry: entries) {
+            if (entry.is_dir) {
+                putDir(user_id, entry.path, false);
+            } else {
+                putFile(user_id, entry.path, entry.st, entry.hash, false);
+            }
+        }
+
+        sql = "INSERT INTO file_index_users (user_id, indexed_at) VALUES (?, strftime('%s', 'now'));";
+        DBStatement stmt = db.prepare(sql);
+        sqlite3_bind_int(stmt, 1, user_id);
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+            return false;
+        }
+
+        if (!transaction.commit()) {
+            return false;
+        }
+        std::cout << "Indexed " << entries.size() << " entries for user " << user_id << '\n';
+        return true;
+    }
+};
+
+#endif //CPP_PERSONAL_CLOUD_METADATA_INDEX_H
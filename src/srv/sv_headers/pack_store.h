@@ -0,0 +1,487 @@
+#ifndef CPP_PERSONAL_CLOUD_PACK_STORE_H
+#define CPP_PERSONAL_CLOUD_PACK_STORE_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <ctime>
+#include <fcntl.h>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sqlite3.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "db_connection.h"
+#include "redundancy_manager.h"
+#include "server_config.h"
+
+// A pack is closed for appends once it reaches this size.
+#define PACK_MAX_SIZE (64ULL * 1024 * 1024)
+// A pack is rewritten once less than 1 / PACK_COMPACT_RATIO of its bytes are still referenced.
+#define PACK_COMPACT_RATIO 2
+// The pack being appended to is only rotated out for compaction past this size.
+#define PACK_COMPACT_MIN (1024 * 1024)
+
+// Where the stored bytes of a packed file live.
+struct PackEntry {
+    long long pack_id = 0;
+    unsigned long long offset = 0;
+    unsigned long long length = 0;
+};
+
+// Optional storage for small files (ServerConfig::pack_small_files). Instead of a file of its own
+// under primary/ and backup/, a file of at most pack_threshold bytes is appended to the user's
+// current pack, ./storage/<user>/packs/{primary,backup}/<id>.pack, and pack_entries maps its
+// primary path (the same key as file_hashes.filepath) to its range. The two copies of a pack have
+// the same layout, so a damaged range is repaired by copying it from the other one.
+//
+// Packs are append-only; deleting a file only drops its row. A pack whose live bytes fall below
+// 1 / PACK_COMPACT_RATIO is compacted: the live entries are appended to the current pack and the
+// old one is removed. A pack with appends whose rows are not committed yet is left alone, since
+// their bytes would look dead.
+class PackStore {
+private:
+    // Appends and compactions of one user are serialized; the open pack's descriptors are kept
+    // so a batch of small files costs no open / close per file. `pending` counts, per pack, the
+    // appends not yet settle()d.
+    struct UserPacks {
+        std::mutex mutex;
+        long long current = 0;
+        int primary_fd = -1;
+        int backup_fd = -1;
+        std::unordered_map<long long, int> pending;
+    };
+
+    static std::shared_ptr<UserPacks> userPacks(int user_id) {
+        static std::mutex mutex;
+        static std::unordered_map<int, std::shared_ptr<UserPacks> > packs;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto &entry = packs[user_id];
+        if (!entry) {
+            entry = std::make_shared<UserPacks>();
+        }
+        return entry;
+    }
+
+    static std::filesystem::path packPath(const std::filesystem::path &user_dir, long long pack_id, bool backup) {
+        return user_dir / "packs" / (backup ? "backup" : "primary") / (std::to_string(pack_id) + ".pack");
+    }
+
+    static bool readRange(const std::filesystem::path &path, unsigned long long offset, std::string &data) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+        size_t filled = 0;
+        while (filled < data.size()) {
+            ssize_t got = pread(fd, data.data() + filled, data.size() - filled, static_cast<off_t>(offset + filled));
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                break;
+            }
+            filled += got;
+        }
+        close(fd);
+        return filled == data.size();
+    }
+
+    static bool writeRange(int fd, const std::string &data, unsigned long long offset) {
+        size_t written = 0;
+        while (written < data.size()) {
+            ssize_t result = pwrite(fd, data.data() + written, data.size() - written,
+                                    static_cast<off_t>(offset + written));
+            if (result < 0 && errno == EINTR) {
+                continue;
+            }
+            if (result <= 0) {
+                return false;
+            }
+            written += result;
+        }
+        return true;
+    }
+
+    static bool rewriteRange(const std::filesystem::path &path, const std::string &data, unsigned long long offset) {
+        int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+        bool written = writeRange(fd, data, offset);
+        close(fd);
+        return written;
+    }
+
+    static void closePack(UserPacks &packs) {
+        if (packs.primary_fd >= 0) close(packs.primary_fd);
+        if (packs.backup_fd >= 0) close(packs.backup_fd);
+        packs.primary_fd = -1;
+        packs.backup_fd = -1;
+    }
+
+    // Opens the pack to append to, starting after the highest pack on disk the first time.
+    static bool openCurrent(UserPacks &packs, const std::filesystem::path &user_dir) {
+        if (packs.primary_fd >= 0 && packs.backup_fd >= 0) {
+            return true;
+        }
+
+        std::error_code ec;
+        std::filesystem::create_directories(user_dir / "packs" / "primary", ec);
+        std::filesystem::create_directories(user_dir / "packs" / "backup", ec);
+
+        if (packs.current == 0) {
+            long long highest = 0;
+            for (const auto &entry: std::filesystem::directory_iterator(user_dir / "packs" / "primary", ec)) {
+                highest = std::max(highest, std::atoll(entry.path().stem().c_str()));
+            }
+            packs.current = highest + 1;
+        }
+
+        packs.primary_fd = open(packPath(user_dir, packs.current, false).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        packs.backup_fd = open(packPath(user_dir, packs.current, true).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (packs.primary_fd < 0 || packs.backup_fd < 0) {
+            closePack(packs);
+            return false;
+        }
+        return true;
+    }
+
+    static void rotate(UserPacks &packs) {
+        closePack(packs);
+        packs.current++;
+    }
+
+    static bool appendLocked(UserPacks &packs, const std::filesystem::path &user_dir, const std::string &data,
+                             PackEntry &entry) {
+        if (!openCurrent(packs, user_dir)) {
+            return false;
+        }
+
+        struct stat st{};
+        if (fstat(packs.primary_fd, &st) < 0) {
+            return false;
+        }
+        if (st.st_size > 0 && static_cast<unsigned long long>(st.st_size) + data.size() > PACK_MAX_SIZE) {
+            rotate(packs);
+            if (!openCurrent(packs, user_dir) || fstat(packs.primary_fd, &st) < 0) {
+                return false;
+            }
+        }
+
+        entry = PackEntry{packs.current, static_cast<unsigned long long>(st.st_size), data.size()};
+        return writeRange(packs.primary_fd, data, entry.offset) && writeRange(packs.backup_fd, data, entry.offset);
+    }
+
+    static bool checks(const IntegrityRecord &record, const std::string &data) {
+        if (record.hash.empty()) {
+            return true;
+        }
+        FileDigest digest(record.block_hashes.empty());
+        digest.update(data.data(), data.size());
+        return record.matches(digest);
+    }
+
+public:
+    static bool initDatabase() {
+        std::string sql =
+                "CREATE TABLE IF NOT EXISTS pack_entries ("
+                "user_id INTEGER NOT NULL, "
+                "path TEXT NOT NULL, "
+                "pack_id INTEGER NOT NULL, "
+                "offset INTEGER NOT NULL, "
+                "length INTEGER NOT NULL, "
+                "PRIMARY KEY (user_id, path)"
+                ") WITHOUT ROWID;"
+                "CREATE INDEX IF NOT EXISTS pack_entries_pack ON pack_entries (user_id, pack_id);";
+
+        return DBConnection::local().exec(sql);
+    }
+
+    // Whether a new file of `size` bytes goes into a pack.
+    static bool accepts(unsigned long long size) {
+        const ServerConfig &config = ServerConfig::instance();
+        return config.pack_small_files && size <= config.pack_threshold;
+    }
+
+    // Stat fields the metadata index keeps for a packed file.
+    static struct stat entryStat(const PackEntry &entry) {
+        struct stat st{};
+        st.st_size = static_cast<off_t>(entry.length);
+        clock_gettime(CLOCK_REALTIME, &st.st_mtim);
+        return st;
+    }
+
+    // Appends the stored bytes of a file to both copies of the user's current pack. The entry only
+    // becomes visible once record() is committed; bytes of an entry that never is are reclaimed by
+    // compaction. After a successful append the caller calls settle() once its transaction has
+    // committed or rolled back; until then the pack is not compacted.
+    static bool append(int user_id, const std::filesystem::path &user_dir, const std::string &data,
+                       PackEntry &entry) {
+        auto packs = userPacks(user_id);
+        std::lock_guard<std::mutex> lock(packs->mutex);
+        if (!appendLocked(*packs, user_dir, data, entry)) {
+            return false;
+        }
+        packs->pending[entry.pack_id]++;
+        return true;
+    }
+
+    // Ends an append(): its row was committed or given up on.
+    static void settle(int user_id, const PackEntry &entry) {
+        auto packs = userPacks(user_id);
+        std::lock_guard<std::mutex> lock(packs->mutex);
+        auto pending = packs->pending.find(entry.pack_id);
+        if (pending != packs->pending.end() && --pending->second <= 0) {
+            packs->pending.erase(pending);
+        }
+    }
+
+    // Part of the caller's transaction, next to the file_hashes and file_index rows.
+    static bool record(int user_id, const std::string &path, const PackEntry &entry) {
+        std::string sql = "INSERT OR REPLACE INTO pack_entries (user_id, path, pack_id, offset, length) "
+                "VALUES (?,?,?,?,?);";
+        DBStatement stmt = DBConnection::local().prepare(sql);
+
+        sqlite3_bind_int(stmt, 1, user_id);
+        sqlite3_bind_text(stmt, 2, path.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(stmt, 3, entry.pack_id);
+        sqlite3_bind_int64(stmt, 4, static_cast<sqlite3_int64>(entry.offset));
+        sqlite3_bind_int64(stmt, 5, static_cast<sqlite3_int64>(entry.length));
+
+        return sqlite3_step(stmt) == SQLITE_DONE;
+    }
+
+    static bool lookup(int user_id, const std::string &path, PackEntry &entry) {
+        std::string sql = "SELECT pack_id, offset, length FROM pack_entries WHERE user_id = ? AND path = ?;";
+        DBStatement stmt = DBConnection::local().prepare(sql);
+
+        sqlite3_bind_int(stmt, 1, user_id);
+        sqlite3_bind_text(stmt, 2, path.c_str(), -1, SQLITE_TRANSIENT);
+
+        if (sqlite3_step(stmt) != SQLITE_ROW) {
+            return false;
+        }
+        entry.pack_id = sqlite3_column_int64(stmt, 0);
+        entry.offset = static_cast<unsigned long long>(sqlite3_column_int64(stmt, 1));
+        entry.length = static_cast<unsigned long long>(sqlite3_column_int64(stmt, 2));
+        return true;
+    }
+
+    static bool contains(int user_id, const std::string &path) {
+        PackEntry entry;
+        return lookup(user_id, path, entry);
+    }
+
+    // Whether a directory still holds packed files (it has nothing on disk to show for them).
+    static bool containsUnder(int user_id, const std::string &dir_path) {
+        std::string sql = "SELECT 1 FROM pack_entries WHERE user_id = ? AND path > ? AND path < ? LIMIT 1;";
+        DBStatement stmt = DBConnection::local().prepare(sql);
+
+        std::string prefix = dir_path + "/";
+        std::string end = dir_path + "0";
+        sqlite3_bind_int(stmt, 1, user_id);
+        sqlite3_bind_text(stmt, 2, prefix.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 3, end.c_str(), -1, SQLITE_TRANSIENT);
+
+        return sqlite3_step(stmt) == SQLITE_ROW;
+    }
+
+    // Part of the caller's transaction; the pack is compacted afterwards (compact()).
+    static bool remove(int user_id, const std::string &path) {
+        std::string sql = "DELETE FROM pack_entries WHERE user_id = ? AND path = ?;";
+        DBStatement stmt = DBConnection::local().prepare(sql);
+
+        sqlite3_bind_int(stmt, 1, user_id);
+        sqlite3_bind_text(stmt, 2, path.c_str(), -1, SQLITE_TRANSIENT);
+
+        return sqlite3_step(stmt) == SQLITE_DONE;
+    }
+
+    // Stored bytes of a packed file, checked against its integrity record, which must exist: it says
+    // how the bytes are encrypted. A damaged primary range is rewritten from the backup pack. A
+    // compaction moving the entry between the lookup and the read is retried once.
+    static bool load(int user_id, const std::filesystem::path &user_dir, const std::string &path,
+                     const IntegrityRecord &record, std::string &data) {
+        if (!record.found) {
+            std::cerr << "No integrity record for packed " << path << '\n';
+            return false;
+        }
+        for (int attempt = 0; attempt < 2; attempt++) {
+            PackEntry entry;
+            if (!lookup(user_id, path, entry)) {
+                return false;
+            }
+
+            data.resize(entry.length);
+            if (!readRange(packPath(user_dir, entry.pack_id, false), entry.offset, data)) {
+                continue;
+            }
+            if (checks(record, data)) {
+                return true;
+            }
+
+            std::cout << "Hash mismatch in pack " << entry.pack_id << " for " << path << ", reading backup\n";
+            if (!readRange(packPath(user_dir, entry.pack_id, true), entry.offset, data) || !checks(record, data)) {
+                std::cerr << "Both copies of packed " << path << " are damaged\n";
+                return false;
+            }
+            rewriteRange(packPath(user_dir, entry.pack_id, false), data, entry.offset);
+            return true;
+        }
+        return false;
+    }
+
+    // Scrubber check of both copies of one entry, each rewritten from the other when it is damaged.
+    // Returns false when neither copy is intact and the entry was not moved or deleted meanwhile.
+    static bool verify(int user_id, const std::filesystem::path &user_dir, const std::string &path,
+                       const PackEntry &entry, bool &primary_repaired, bool &backup_repaired) {
+        primary_repaired = false;
+        backup_repaired = false;
+        IntegrityRecord record = RedundancyManager::getIntegrityRecord(user_id, path);
+
+        std::string primary(entry.length, '\0');
+        std::string backup(entry.length, '\0');
+        bool primary_ok = readRange(packPath(user_dir, entry.pack_id, false), entry.offset, primary) &&
+                          checks(record, primary);
+        bool backup_ok = readRange(packPath(user_dir, entry.pack_id, true), entry.offset, backup) &&
+                         checks(record, backup);
+
+        if (primary_ok && !backup_ok) {
+            backup_repaired = rewriteRange(packPath(user_dir, entry.pack_id, true), primary, entry.offset);
+        } else if (!primary_ok && backup_ok) {
+            primary_repaired = rewriteRange(packPath(user_dir, entry.pack_id, false), backup, entry.offset);
+        } else if (!primary_ok) {
+            PackEntry current;
+            return !lookup(user_id, path, current) || current.pack_id != entry.pack_id ||
+                   current.offset != entry.offset;
+        }
+        return true;
+    }
+
+    // One page of a user's entries in path order, for the scrubber.
+    static std::vector<std::pair<std::string, PackEntry> > entries(int user_id, const std::string &after,
+                                                                   size_t limit) {
+        std::string sql = "SELECT path, pack_id, offset, length FROM pack_entries WHERE user_id = ? AND path > ? "
+                "ORDER BY path LIMIT ?;";
+        DBStatement stmt = DBConnection::local().prepare(sql);
+
+        sqlite3_bind_int(stmt, 1, user_id);
+        sqlite3_bind_text(stmt, 2, after.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(stmt, 3, static_cast<sqlite3_int64>(limit));
+
+        std::vector<std::pair<std::string, PackEntry> > page;
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            PackEntry entry{
+                sqlite3_column_int64(stmt, 1),
+                static_cast<unsigned long long>(sqlite3_column_int64(stmt, 2)),
+                static_cast<unsigned long long>(sqlite3_column_int64(stmt, 3)),
+            };
+            page.emplace_back(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)), entry);
+        }
+        return page;
+    }
+
+    // Reclaims the space of deleted entries in `pack_id`: an empty pack is removed, a mostly dead
+    // one has its live entries moved to the current pack. Entries deleted while this runs leave a
+    // dead copy behind, reclaimed by a later compaction. A pack with unsettled appends is skipped.
+    static void compact(int user_id, const std::filesystem::path &user_dir, long long pack_id) {
+        auto packs = userPacks(user_id);
+        std::lock_guard<std::mutex> lock(packs->mutex);
+        if (packs->pending.count(pack_id) > 0) {
+            return;
+        }
+
+        std::string sql = "SELECT COUNT(*), COALESCE(SUM(length), 0) FROM pack_entries "
+                "WHERE user_id = ? AND pack_id = ?;";
+        unsigned long long count = 0;
+        unsigned long long live = 0;
+        {
+            DBStatement stmt = DBConnection::local().prepare(sql);
+            sqlite3_bind_int(stmt, 1, user_id);
+            sqlite3_bind_int64(stmt, 2, pack_id);
+            if (sqlite3_step(stmt) != SQLITE_ROW) {
+                return;
+            }
+            count = static_cast<unsigned long long>(sqlite3_column_int64(stmt, 0));
+            live = static_cast<unsigned long long>(sqlite3_column_int64(stmt, 1));
+        }
+
+        std::error_code ec;
+        unsigned long long size = std::filesystem::file_size(packPath(user_dir, pack_id, false), ec);
+        if (ec || (count > 0 && live * PACK_COMPACT_RATIO >= size)) {
+            return;
+        }
+        if (pack_id == packs->current) {
+            if (count > 0 && size < PACK_COMPACT_MIN) {
+                return;
+            }
+            rotate(*packs);
+        }
+
+        std::vector<std::pair<std::string, PackEntry> > moved;
+        sql = "SELECT path, offset, length FROM pack_entries WHERE user_id = ? AND pack_id = ?;";
+        {
+            DBStatement stmt = DBConnection::local().prepare(sql);
+            sqlite3_bind_int(stmt, 1, user_id);
+            sqlite3_bind_int64(stmt, 2, pack_id);
+            while (sqlite3_step(stmt) == SQLITE_ROW) {
+                moved.emplace_back(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)),
+                                   PackEntry{pack_id, static_cast<unsigned long long>(sqlite3_column_int64(stmt, 1)),
+                                             static_cast<unsigned long long>(sqlite3_column_int64(stmt, 2))});
+            }
+        }
+
+        // Only intact bytes are carried over: a damaged primary range is taken from the backup.
+        std::vector<PackEntry> targets;
+        for (const auto &entry: moved) {
+            IntegrityRecord record = RedundancyManager::getIntegrityRecord(user_id, entry.first);
+            std::string data(entry.second.length, '\0');
+            if ((!readRange(packPath(user_dir, pack_id, false), entry.second.offset, data) || !checks(record, data)) &&
+                (!readRange(packPath(user_dir, pack_id, true), entry.second.offset, data) || !checks(record, data))) {
+                std::cerr << "Can't compact pack " << pack_id << ": both copies of " << entry.first << " are damaged\n";
+                return;
+            }
+
+            PackEntry target;
+            if (!appendLocked(*packs, user_dir, data, target)) {
+                return;
+            }
+            targets.push_back(target);
+        }
+
+        DBTransaction transaction;
+        sql = "UPDATE pack_entries SET pack_id = ?, offset = ? WHERE user_id = ? AND path = ? AND pack_id = ? "
+                "AND offset = ?;";
+        for (size_t i = 0; i < moved.size(); i++) {
+            DBStatement stmt = DBConnection::local().prepare(sql);
+            sqlite3_bind_int64(stmt, 1, targets[i].pack_id);
+            sqlite3_bind_int64(stmt, 2, static_cast<sqlite3_int64>(targets[i].offset));
+            sqlite3_bind_int(stmt, 3, user_id);
+            sqlite3_bind_text(stmt, 4, moved[i].first.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int64(stmt, 5, pack_id);
+            sqlite3_bind_int64(stmt, 6, static_cast<sqlite3_int64>(moved[i].second.offset));
+            if (sqlite3_step(stmt) != SQLITE_DONE) {
+                return;
+            }
+        }
+        if (!transaction.commit()) {
+            return;
+        }
+
+        std::filesystem::remove(packPath(user_dir, pack_id, false), ec);
+        std::filesystem::remove(packPath(user_dir, pack_id, true), ec);
+        std::cout << "Compacted pack " << pack_id << ": " << moved.size() << " live entries, "
+                << size - live << " bytes reclaimed\n";
+    }
+};
+
+#endif //CPP_PERSONAL_CLOUD_PACK_STORE_H
@@ -1,82 +1,413 @@
 #ifndef CPP_PERSONAL_CLOUD_REDUNDANCY_MANAGER_H
 #define CPP_PERSONAL_CLOUD_REDUNDANCY_MANAGER_H
 
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <filesystem>
 #include <iostream>
 #include <ostream>
 #include <sqlite3.h>
 #include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
 
-#include "picosha2.h"
+#include "db_connection.h"
+#include "sha256_engine.h"
+
+#define HASH_READ_BUFFER (1024 * 1024)
+// Granularity of partial verification and repair; one SHA-256 leaf per block of stored bytes.
+#define INTEGRITY_BLOCK_SIZE (1024 * 1024)
+#define INTEGRITY_BATCH_BLOCKS SHA256_LANES
+
+#define STORAGE_PLAINTEXT 0
+#define STORAGE_AES_CTR_LEGACY 1
+#define STORAGE_AES_CTR_STREAM 2
+
+// Hashes of the stored bytes of one file, computed in a single pass: the leaves of the file's
+// Merkle tree (one SHA-256 per INTEGRITY_BLOCK_SIZE block, concatenated raw digests) and, unless
+// only the leaves are needed to check it, the whole-file SHA-256 kept in file_hashes.hash.
+class FileDigest {
+private:
+    bool with_file_hash;
+    Sha256 file_hasher;
+    Sha256 block_hasher;
+    size_t block_fill = 0;
+    std::string leaves;
+
+public:
+    explicit FileDigest(bool with_file_hash = true) : with_file_hash(with_file_hash) {
+    }
+
+    void update(const void *data, size_t length) {
+        const uint8_t *bytes = static_cast<const uint8_t *>(data);
+        if (with_file_hash) {
+            file_hasher.update(bytes, length);
+        }
+
+        while (length > 0) {
+            size_t take = INTEGRITY_BLOCK_SIZE - block_fill < length ? INTEGRITY_BLOCK_SIZE - block_fill : length;
+            block_hasher.update(bytes, take);
+            block_fill += take;
+            bytes += take;
+            length -= take;
+
+            if (block_fill == INTEGRITY_BLOCK_SIZE) {
+                uint8_t leaf[SHA256_DIGEST];
+                block_hasher.digest(leaf);
+                leaves.append(reinterpret_cast<const char *>(leaf), SHA256_DIGEST);
+                block_hasher.reset();
+                block_fill = 0;
+            }
+        }
+    }
+
+    std::string fileHash() const {
+        return file_hasher.hexDigest();
+    }
+
+    std::string blockHashes() const {
+        std::string all = leaves;
+        if (block_fill > 0) {
+            uint8_t leaf[SHA256_DIGEST];
+            block_hasher.digest(leaf);
+            all.append(reinterpret_cast<const char *>(leaf), SHA256_DIGEST);
+        }
+        return all;
+    }
+};
+
+// Stored hash of a file plus the stat() fingerprint it had when that hash was last confirmed.
+// While the fingerprint is unchanged the file has not been rewritten and need not be rehashed.
+// Without a row (`found` false) the other fields mean nothing; rows from before the encryption
+// column existed got STORAGE_AES_CTR_LEGACY as the column's default.
+struct IntegrityRecord {
+    bool found = false;
+    std::string hash;
+    int encryption = STORAGE_PLAINTEXT;
+    long long verified_size = -1;
+    long long verified_mtime = -1;
+    long long verified_inode = -1;
+    long long verified_at = 0;
+    // Empty for files stored before block hashes existed; they are checked as a whole.
+    std::string block_hashes;
+    // Keystream nonce of a STORAGE_AES_CTR_STREAM file stored on its own or in a pack.
+    std::string nonce;
+
+    static long long mtimeNs(const struct stat &st) {
+        return static_cast<long long>(st.st_mtim.tv_sec) * 1000000000LL + st.st_mtim.tv_nsec;
+    }
+
+    bool isVerified(const struct stat &st, long long max_age_sec) const {
+        return found &&
+               verified_size == static_cast<long long>(st.st_size) &&
+               verified_mtime == mtimeNs(st) &&
+               verified_inode == static_cast<long long>(st.st_ino) &&
+               std::time(nullptr) - verified_at <= max_age_sec;
+    }
+
+    bool matches(const FileDigest &digest) const {
+        if (!block_hashes.empty()) {
+            return digest.blockHashes() == block_hashes;
+        }
+        return digest.fileHash() == hash;
+    }
+};
 
 class RedundancyManager {
 public:
-    static bool initDatabase() {
-        sqlite3 *db;
+    static bool hasColumn(sqlite3 *db, const std::string &table, const std::string &column) {
+        std::string sql = "PRAGMA table_info(" + table + ");";
 
-        int rc = sqlite3_open("./storage/cloud.db", &db);
-        if (rc != SQLITE_OK) {
-            std::cerr << "Can't open database: " << sqlite3_errmsg(db) << '\n';
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
             return false;
         }
 
-        std::string sql =
-                "CREATE TABLE IF NOT EXISTS file_hashes ("
-                "id INTEGER PRIMARY KEY AUTOINCREMENT, "
-                "user_id INTEGER NOT NULL, "
-                "filename TEXT NOT NULL, "
-                "filepath TEXT NOT NULL, "
-                "hash TEXT NOT NULL, "
-                "timestamp TEXT DEFAULT (strftime('%d/%m/%Y', 'now')), "
-                "UNIQUE (user_id, filename)"
-                ");";
+        bool found = false;
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            const unsigned char *name = sqlite3_column_text(stmt, 1);
+            if (name && column == reinterpret_cast<const char *>(name)) {
+                found = true;
+                break;
+            }
+        }
 
-        char *err_msg = nullptr;
-        rc = sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &err_msg);
+        sqlite3_finalize(stmt);
+        return found;
+    }
+
+    // Databases created before a column existed get it added with its default value.
+    static bool addColumnIfMissing(sqlite3 *db, const std::string &table, const std::string &column,
+                                   const std::string &definition) {
+        if (hasColumn(db, table, column)) {
+            return true;
+        }
 
-        if (rc != SQLITE_OK) {
+        std::string sql = "ALTER TABLE " + table + " ADD COLUMN " + column + " " + definition + ";";
+        char *err_msg = nullptr;
+        if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &err_msg) != SQLITE_OK) {
             std::cerr << "SQL error: " << err_msg << '\n';
             sqlite3_free(err_msg);
-            sqlite3_close(db);
             return false;
         }
 
-        sqlite3_close(db);
         return true;
     }
 
+private:
+    static bool readFully(int fd, char *data, size_t length, off_t offset) {
+        size_t filled = 0;
+        while (filled < length) {
+            ssize_t got = pread(fd, data + filled, length - filled, offset + filled);
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                return false;
+            }
+            filled += got;
+        }
+        return true;
+    }
+
+    // Copies the listed blocks from `source_fd` to `target_fd`, each one only after it matched its
+    // leaf, so a damaged source block is never written over the target.
+    static bool patchBlocks(int target_fd, int source_fd, unsigned long long size, const std::string &leaves,
+                            const std::vector<size_t> &blocks) {
+        thread_local std::vector<char> buffer(INTEGRITY_BLOCK_SIZE);
+        bool all_patched = true;
+
+        for (size_t block: blocks) {
+            off_t offset = static_cast<off_t>(block) * INTEGRITY_BLOCK_SIZE;
+            size_t length = size - offset < INTEGRITY_BLOCK_SIZE ? size - offset : INTEGRITY_BLOCK_SIZE;
+
+            uint8_t leaf[SHA256_DIGEST];
+            Sha256 hasher;
+            if (!readFully(source_fd, buffer.data(), length, offset)) {
+                all_patched = false;
+                continue;
+            }
+            hasher.update(buffer.data(), length);
+            hasher.digest(leaf);
+
+            if (std::memcmp(leaf, leaves.data() + block * SHA256_DIGEST, SHA256_DIGEST) != 0 ||
+                pwrite(target_fd, buffer.data(), length, offset) != static_cast<ssize_t>(length)) {
+                std::cerr << "Block " << block << " could not be repaired\n";
+                all_patched = false;
+            }
+        }
+
+        return all_patched;
+    }
+
+    static std::string fileHashesTable(const std::string &name) {
+        return "CREATE TABLE IF NOT EXISTS " + name + " ("
+               "id INTEGER PRIMARY KEY AUTOINCREMENT, "
+               "user_id INTEGER NOT NULL, "
+               "filename TEXT NOT NULL, "
+               "filepath TEXT NOT NULL, "
+               "hash TEXT NOT NULL, "
+               "encryption INTEGER NOT NULL DEFAULT 1, "
+               "verified_size INTEGER, "
+               "verified_mtime INTEGER, "
+               "verified_inode INTEGER, "
+               "verified_at INTEGER, "
+               "block_hashes BLOB, "
+               "merkle_root TEXT, "
+               "nonce BLOB, "
+               "timestamp TEXT DEFAULT (strftime('%d/%m/%Y', 'now')), "
+               "UNIQUE (user_id, filepath)"
+               ");";
+    }
+
+    // Rows used to be unique per file name, so storing /b/x.txt replaced the row of /a/x.txt. The
+    // table is rebuilt once with the key on the full path; SQLite can't change a constraint in place.
+    static bool migrateToPathKey(DBConnection &db) {
+        std::string sql = "SELECT sql FROM sqlite_master WHERE type = 'table' AND name = 'file_hashes';";
+        std::string schema;
+        {
+            DBStatement stmt = db.prepare(sql);
+            if (sqlite3_step(stmt) == SQLITE_ROW) {
+                schema = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+            }
+        }
+        if (schema.find("UNIQUE (user_id, filename)") == std::string::npos) {
+            return true;
+        }
+
+        std::string columns = "id, user_id, filename, filepath, hash, encryption, verified_size, verified_mtime, "
+                "verified_inode, verified_at, block_hashes, merkle_root, nonce, timestamp";
+        DBTransaction transaction;
+        if (!db.exec("DROP TABLE IF EXISTS file_hashes_by_path;") ||
+            !db.exec(fileHashesTable("file_hashes_by_path")) ||
+            !db.exec("INSERT INTO file_hashes_by_path (" + columns + ") SELECT " + columns + " FROM file_hashes;") ||
+            !db.exec("DROP TABLE file_hashes;") ||
+            !db.exec("ALTER TABLE file_hashes_by_path RENAME TO file_hashes;") ||
+            !transaction.commit()) {
+            std::cerr << "Failed to rekey file_hashes on the file path\n";
+            return false;
+        }
+        std::cout << "Rekeyed file_hashes on the file path\n";
+        return true;
+    }
+
+public:
+    static bool initDatabase() {
+        DBConnection &db = DBConnection::local();
+        if (!db.handle()) {
+            return false;
+        }
+
+        if (!db.exec(fileHashesTable("file_hashes"))) {
+            return false;
+        }
+
+        return addColumnIfMissing(db.handle(), "file_hashes", "encryption", "INTEGER NOT NULL DEFAULT 1") &&
+               addColumnIfMissing(db.handle(), "file_hashes", "verified_size", "INTEGER") &&
+               addColumnIfMissing(db.handle(), "file_hashes", "verified_mtime", "INTEGER") &&
+               addColumnIfMissing(db.handle(), "file_hashes", "verified_inode", "INTEGER") &&
+               addColumnIfMissing(db.handle(), "file_hashes", "verified_at", "INTEGER") &&
+               addColumnIfMissing(db.handle(), "file_hashes", "block_hashes", "BLOB") &&
+               addColumnIfMissing(db.handle(), "file_hashes", "merkle_root", "TEXT") &&
+               addColumnIfMissing(db.handle(), "file_hashes", "nonce", "BLOB") &&
+               migrateToPathKey(db);
+    }
+
     static std::string calculateHash(const std::string &file_path) {
-        std::ifstream file(file_path, std::ios::binary);
+        int fd = open(file_path.c_str(), O_RDONLY | O_CLOEXEC);
 
-        if (!file.is_open()) {
+        if (fd < 0) {
             std::cerr << "Can't open file for hashing: " << file_path << '\n';
             return "";
         }
 
-        std::vector<unsigned char> hash(picosha2::k_digest_size);
-        picosha2::hash256(file, hash.begin(), hash.end());
-        file.close();
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 
-        return picosha2::bytes_to_hex_string(hash.begin(), hash.end());
-    }
+        thread_local std::vector<char> buffer(HASH_READ_BUFFER);
+        Sha256 hasher;
 
-    static bool saveFileHash(int user_id, const std::string &full_path, const std::string &hash) {
-        sqlite3 *db;
-        sqlite3_open("./storage/cloud.db", &db);
+        while (true) {
+            ssize_t got = read(fd, buffer.data(), buffer.size());
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got < 0) {
+                std::cerr << "Read failed while hashing: " << file_path << '\n';
+                close(fd);
+                return "";
+            }
+            if (got == 0) {
+                break;
+            }
+            hasher.update(buffer.data(), got);
+        }
 
+        close(fd);
+        return hasher.hexDigest();
+    }
+
+    // The hash was computed over the bytes just written, so the file also counts as verified now.
+    // `nonce` is the one its STORAGE_AES_CTR_STREAM bytes were encrypted with.
+    static bool saveFileHash(int user_id, const std::string &full_path, const std::string &hash,
+                             int encryption = STORAGE_AES_CTR_STREAM, const std::string &block_hashes = "",
+                             const std::string &nonce = "") {
         std::string filename = std::filesystem::path(full_path).filename().string();
-        std::string sql = "INSERT OR REPLACE INTO file_hashes (user_id, filename, filepath, hash) VALUES (?,?,?,?);";
+        std::string sql =
+                "INSERT OR REPLACE INTO file_hashes (user_id, filename, filepath, hash, encryption, "
+                "verified_size, verified_mtime, verified_inode, verified_at, block_hashes, merkle_root, nonce) "
+                "VALUES (?,?,?,?,?,?,?,?,?,?,?,?);";
 
-        sqlite3_stmt *stmt;
-        sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr);
+        DBStatement stmt = DBConnection::local().prepare(sql);
 
         sqlite3_bind_int(stmt, 1, user_id);
         sqlite3_bind_text(stmt, 2, filename.c_str(), -1, SQLITE_TRANSIENT);
         sqlite3_bind_text(stmt, 3, full_path.c_str(), -1, SQLITE_TRANSIENT);
         sqlite3_bind_text(stmt, 4, hash.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(stmt, 5, encryption);
+
+        struct stat st{};
+        if (stat(full_path.c_str(), &st) == 0) {
+            sqlite3_bind_int64(stmt, 6, st.st_size);
+            sqlite3_bind_int64(stmt, 7, IntegrityRecord::mtimeNs(st));
+            sqlite3_bind_int64(stmt, 8, static_cast<sqlite3_int64>(st.st_ino));
+            sqlite3_bind_int64(stmt, 9, std::time(nullptr));
+        }
+
+        std::string root = merkleRoot(block_hashes);
+        if (!block_hashes.empty()) {
+            sqlite3_bind_blob(stmt, 10, block_hashes.data(), static_cast<int>(block_hashes.size()), SQLITE_TRANSIENT);
+            sqlite3_bind_text(stmt, 11, root.c_str(), -1, SQLITE_TRANSIENT);
+        }
+        if (!nonce.empty()) {
+            sqlite3_bind_blob(stmt, 12, nonce.data(), static_cast<int>(nonce.size()), SQLITE_TRANSIENT);
+        }
+
+        int rc = sqlite3_step(stmt);
+        return rc == SQLITE_DONE;
+    }
+
+    // Adds block hashes to a file stored before they existed, once a full check has computed them.
+    static bool saveBlockHashes(int user_id, const std::string &full_path, const std::string &block_hashes) {
+        std::string sql = "UPDATE file_hashes SET block_hashes = ?, merkle_root = ? WHERE user_id = ? AND filepath = ?;";
+
+        DBStatement stmt = DBConnection::local().prepare(sql);
+
+        std::string root = merkleRoot(block_hashes);
+        sqlite3_bind_blob(stmt, 1, block_hashes.data(), static_cast<int>(block_hashes.size()), SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 2, root.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(stmt, 3, user_id);
+        sqlite3_bind_text(stmt, 4, full_path.c_str(), -1, SQLITE_TRANSIENT);
+
+        int rc = sqlite3_step(stmt);
+        return rc == SQLITE_DONE;
+    }
+
+    // Root of the binary hash tree over the leaves (an odd node is carried up unchanged). It is
+    // stored next to the leaves and checked when they are loaded, so a damaged leaf list is not
+    // mistaken for damaged data.
+    static std::string merkleRoot(const std::string &leaves) {
+        if (leaves.empty()) {
+            return "";
+        }
+
+        std::string level = leaves;
+        while (level.size() > SHA256_DIGEST) {
+            std::string next;
+            for (size_t i = 0; i < level.size(); i += 2 * SHA256_DIGEST) {
+                if (i + SHA256_DIGEST == level.size()) {
+                    next.append(level, i, SHA256_DIGEST);
+                    continue;
+                }
+
+                uint8_t parent[SHA256_DIGEST];
+                Sha256 hasher;
+                hasher.update(level.data() + i, 2 * SHA256_DIGEST);
+                hasher.digest(parent);
+                next.append(reinterpret_cast<const char *>(parent), SHA256_DIGEST);
+            }
+            level = std::move(next);
+        }
+
+        return Sha256::toHex(reinterpret_cast<const uint8_t *>(level.data()));
+    }
+
+    static bool markVerified(int user_id, const std::string &full_path, const struct stat &st) {
+        std::string sql = "UPDATE file_hashes SET verified_size = ?, verified_mtime = ?, verified_inode = ?, "
+                "verified_at = ? WHERE user_id = ? AND filepath = ?;";
+
+        DBStatement stmt = DBConnection::local().prepare(sql);
+
+        sqlite3_bind_int64(stmt, 1, st.st_size);
+        sqlite3_bind_int64(stmt, 2, IntegrityRecord::mtimeNs(st));
+        sqlite3_bind_int64(stmt, 3, static_cast<sqlite3_int64>(st.st_ino));
+        sqlite3_bind_int64(stmt, 4, std::time(nullptr));
+        sqlite3_bind_int(stmt, 5, user_id);
+        sqlite3_bind_text(stmt, 6, full_path.c_str(), -1, SQLITE_TRANSIENT);
 
         int rc = sqlite3_step(stmt);
-        sqlite3_finalize(stmt);
-        sqlite3_close(db);
         return rc == SQLITE_DONE;
     }
 
@@ -109,14 +440,138 @@ public:
         }
     }
 
-    static std::string getStoredHash(int user_id, const std::string &full_path) {
-        sqlite3 *db;
-        sqlite3_open("./storage/cloud.db", &db);
+    // The other direction: a damaged or missing backup is rewritten from a verified primary.
+    static bool restoreBackup(const std::string &primary_path, const std::string &backup_path) {
+        try {
+            std::filesystem::create_directories(std::filesystem::path(backup_path).parent_path());
+            std::filesystem::copy_file(primary_path, backup_path,
+                                       std::filesystem::copy_options::overwrite_existing);
+
+            std::cout << "Backup restored from primary: " << backup_path << '\n';
+            return true;
+        } catch (const std::filesystem::filesystem_error &e) {
+            std::cerr << "Backup restore failed: " << e.what() << '\n';
+            return false;
+        }
+    }
+
+    // Rewrites only the blocks of `target_path` whose leaves in `actual` differ from `expected`,
+    // taking them from `source_path`. Falls back to copying the whole file when the block counts
+    // or sizes differ (truncated or grown copy). Returns false if some block stayed damaged.
+    static bool repairBlocks(const std::string &target_path, const std::string &source_path,
+                             const std::string &expected, const std::string &actual) {
+        int source_fd = open(source_path.c_str(), O_RDONLY | O_CLOEXEC);
+        int target_fd = open(target_path.c_str(), O_WRONLY | O_CLOEXEC);
+        struct stat source_stat{}, target_stat{};
+
+        bool same_shape = source_fd >= 0 && target_fd >= 0 && expected.size() == actual.size() &&
+                          fstat(source_fd, &source_stat) == 0 && fstat(target_fd, &target_stat) == 0 &&
+                          source_stat.st_size == target_stat.st_size;
+
+        bool repaired;
+        if (same_shape) {
+            std::vector<size_t> damaged;
+            for (size_t block = 0; block * SHA256_DIGEST < expected.size(); block++) {
+                if (expected.compare(block * SHA256_DIGEST, SHA256_DIGEST, actual, block * SHA256_DIGEST,
+                                     SHA256_DIGEST) != 0) {
+                    damaged.push_back(block);
+                }
+            }
+
+            repaired = patchBlocks(target_fd, source_fd, source_stat.st_size, expected, damaged);
+            std::cout << "Repaired " << damaged.size() << " block(s) of " << target_path << " from " << source_path
+                    << '\n';
+        }
+
+        if (source_fd >= 0) close(source_fd);
+        if (target_fd >= 0) close(target_fd);
 
+        if (!same_shape) {
+            try {
+                std::filesystem::create_directories(std::filesystem::path(target_path).parent_path());
+                std::filesystem::copy_file(source_path, target_path, std::filesystem::copy_options::overwrite_existing);
+                std::cout << "Copied " << source_path << " over " << target_path << '\n';
+                repaired = true;
+            } catch (const std::filesystem::filesystem_error &e) {
+                std::cerr << "Repair failed: " << e.what() << '\n';
+                repaired = false;
+            }
+        }
+
+        return repaired;
+    }
+
+    // Checks only the blocks covering [offset, offset + length) of the primary against their leaves
+    // and patches damaged ones from the backup. Returns false if the range could not be made good.
+    static bool verifyRange(const std::string &primary_path, const std::string &backup_path,
+                            const std::string &leaves, unsigned long long offset, unsigned long long length) {
+        size_t leaf_count = leaves.size() / SHA256_DIGEST;
+        if (length == 0) {
+            return true;
+        }
+
+        int fd = open(primary_path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st{};
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            if (fd >= 0) close(fd);
+            return false;
+        }
+
+        unsigned long long size = st.st_size;
+        size_t first = offset / INTEGRITY_BLOCK_SIZE;
+        size_t last = (offset + length - 1) / INTEGRITY_BLOCK_SIZE;
+        if (last >= leaf_count || (size + INTEGRITY_BLOCK_SIZE - 1) / INTEGRITY_BLOCK_SIZE != leaf_count) {
+            close(fd);
+            return false;
+        }
+
+        thread_local std::vector<char> buffer(INTEGRITY_BLOCK_SIZE * INTEGRITY_BATCH_BLOCKS);
+        std::vector<size_t> damaged;
+
+        // Blocks are hashed in batches so CPUs without SHA-NI can use the multi-buffer kernel.
+        for (size_t batch = first; batch <= last; batch += INTEGRITY_BATCH_BLOCKS) {
+            size_t count = last - batch + 1 < INTEGRITY_BATCH_BLOCKS ? last - batch + 1 : INTEGRITY_BATCH_BLOCKS;
+            Sha256::Input inputs[INTEGRITY_BATCH_BLOCKS];
+            uint8_t digests[INTEGRITY_BATCH_BLOCKS][SHA256_DIGEST];
+
+            for (size_t i = 0; i < count; i++) {
+                off_t block_offset = static_cast<off_t>(batch + i) * INTEGRITY_BLOCK_SIZE;
+                size_t block_length = size - block_offset < INTEGRITY_BLOCK_SIZE ? size - block_offset : INTEGRITY_BLOCK_SIZE;
+                char *block = buffer.data() + i * INTEGRITY_BLOCK_SIZE;
+
+                if (!readFully(fd, block, block_length, block_offset)) {
+                    close(fd);
+                    return false;
+                }
+                inputs[i] = {block, block_length};
+            }
+
+            Sha256::hashMany(inputs, count, digests);
+            for (size_t i = 0; i < count; i++) {
+                if (std::memcmp(digests[i], leaves.data() + (batch + i) * SHA256_DIGEST, SHA256_DIGEST) != 0) {
+                    damaged.push_back(batch + i);
+                }
+            }
+        }
+        close(fd);
+
+        if (damaged.empty()) {
+            return true;
+        }
+
+        std::cout << damaged.size() << " damaged block(s) in " << primary_path << ", patching from backup\n";
+        int target_fd = open(primary_path.c_str(), O_WRONLY | O_CLOEXEC);
+        int source_fd = open(backup_path.c_str(), O_RDONLY | O_CLOEXEC);
+        bool repaired = target_fd >= 0 && source_fd >= 0 && patchBlocks(target_fd, source_fd, size, leaves, damaged);
+        if (target_fd >= 0) close(target_fd);
+        if (source_fd >= 0) close(source_fd);
+        return repaired;
+    }
+
+    static std::string getStoredHash(int user_id, const std::string &full_path) {
         std::string sql = "SELECT hash FROM file_hashes WHERE user_id = ? AND filepath = ?;";
 
-        sqlite3_stmt *stmt;
-        sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr);
+        DBStatement stmt = DBConnection::local().prepare(sql);
 
         sqlite3_bind_int(stmt, 1, user_id);
         sqlite3_bind_text(stmt, 2, full_path.c_str(), -1, SQLITE_TRANSIENT);
@@ -127,10 +582,50 @@ public:
             if (result) hash = std::string(reinterpret_cast<const char *>(result));
         }
 
-        sqlite3_finalize(stmt);
-        sqlite3_close(db);
         return hash;
     }
+
+    static IntegrityRecord getIntegrityRecord(int user_id, const std::string &full_path) {
+        std::string sql = "SELECT hash, encryption, verified_size, verified_mtime, verified_inode, verified_at, "
+                "block_hashes, merkle_root, nonce FROM file_hashes WHERE user_id = ? AND filepath = ?;";
+
+        DBStatement stmt = DBConnection::local().prepare(sql);
+
+        sqlite3_bind_int(stmt, 1, user_id);
+        sqlite3_bind_text(stmt, 2, full_path.c_str(), -1, SQLITE_TRANSIENT);
+
+        IntegrityRecord record;
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            record.found = true;
+            const unsigned char *hash = sqlite3_column_text(stmt, 0);
+            if (hash) record.hash = reinterpret_cast<const char *>(hash);
+            record.encryption = sqlite3_column_int(stmt, 1);
+            if (sqlite3_column_type(stmt, 2) != SQLITE_NULL) {
+                record.verified_size = sqlite3_column_int64(stmt, 2);
+                record.verified_mtime = sqlite3_column_int64(stmt, 3);
+                record.verified_inode = sqlite3_column_int64(stmt, 4);
+                record.verified_at = sqlite3_column_int64(stmt, 5);
+            }
+
+            const void *leaves = sqlite3_column_blob(stmt, 6);
+            int leaves_size = sqlite3_column_bytes(stmt, 6);
+            const unsigned char *root = sqlite3_column_text(stmt, 7);
+            if (leaves && leaves_size % SHA256_DIGEST == 0 && root) {
+                record.block_hashes.assign(static_cast<const char *>(leaves), leaves_size);
+                if (merkleRoot(record.block_hashes) != reinterpret_cast<const char *>(root)) {
+                    std::cerr << "Block hashes of " << full_path << " don't match their root, ignoring them\n";
+                    record.block_hashes.clear();
+                }
+            }
+
+            const void *nonce = sqlite3_column_blob(stmt, 8);
+            if (nonce) {
+                record.nonce.assign(static_cast<const char *>(nonce), sqlite3_column_bytes(stmt, 8));
+            }
+        }
+
+        return record;
+    }
 };
 
 #endif
@@ -0,0 +1,96 @@
+#ifndef CPP_PERSONAL_CLOUD_SERVER_CONFIG_H
+#define CPP_PERSONAL_CLOUD_SERVER_CONFIG_H
+
+#include <cstdlib>
+#include <string>
+
+#define DEFAULT_WORKER_THREADS 16
+#define DEFAULT_WORKER_QUEUE_DEPTH 1024
+#define DEFAULT_USER_QUEUE_DEPTH 64
+#define DEFAULT_ENCRYPT_AT_REST 1
+#define DEFAULT_VERIFY_MAX_AGE_SEC (7 * 24 * 3600)
+#define DEFAULT_SCRUB_ENABLED 1
+#define DEFAULT_SCRUB_RATE (32 * 1024 * 1024)
+#define DEFAULT_SCRUB_INTERVAL_SEC (24 * 3600)
+#define DEFAULT_SCRUB_BUSY_TASKS 1
+#define DEFAULT_PACK_SMALL_FILES 0
+#define DEFAULT_PACK_THRESHOLD (64 * 1024)
+#define DEFAULT_DEDUP 0
+#define DEFAULT_UPLOAD_TTL_SEC (7 * 24 * 3600)
+
+// Tunables read once at startup; every value can be overridden with an environment variable.
+struct ServerConfig {
+    size_t worker_threads = DEFAULT_WORKER_THREADS;
+    size_t worker_queue_depth = DEFAULT_WORKER_QUEUE_DEPTH;
+    size_t user_queue_depth = DEFAULT_USER_QUEUE_DEPTH;
+    // New uploads are stored encrypted; with 0 they are stored as-is and served with sendfile().
+    bool encrypt_at_rest = DEFAULT_ENCRYPT_AT_REST;
+    // A file whose stat() fingerprint still matches its last successful check is served without
+    // rehashing for this long; after that the next download verifies it while streaming.
+    size_t verify_max_age_sec = DEFAULT_VERIFY_MAX_AGE_SEC;
+    // Background scrubber: bytes/sec it may read, pause between full passes, and how many
+    // queued or running client commands make it wait.
+    bool scrub_enabled = DEFAULT_SCRUB_ENABLED;
+    size_t scrub_rate = DEFAULT_SCRUB_RATE;
+    size_t scrub_interval_sec = DEFAULT_SCRUB_INTERVAL_SEC;
+    size_t scrub_busy_tasks = DEFAULT_SCRUB_BUSY_TASKS;
+    // New files up to pack_threshold bytes are appended to per-user pack files (pack_store.h)
+    // instead of getting a file of their own under primary/ and backup/.
+    bool pack_small_files = DEFAULT_PACK_SMALL_FILES;
+    size_t pack_threshold = DEFAULT_PACK_THRESHOLD;
+    // Other new files are cut into content-defined chunks and every chunk is stored once per user
+    // (chunk_store.h), however many files contain it.
+    bool dedup = DEFAULT_DEDUP;
+    // An upload session no chunk has arrived for in this long is dropped with its staging file.
+    size_t upload_ttl_sec = DEFAULT_UPLOAD_TTL_SEC;
+
+    static size_t readSize(const char *name, size_t fallback) {
+        const char *value = std::getenv(name);
+        if (value == nullptr || *value == '\0') {
+            return fallback;
+        }
+
+        char *end = nullptr;
+        unsigned long long parsed = std::strtoull(value, &end, 10);
+        if (end == value || *end != '\0' || parsed == 0) {
+            return fallback;
+        }
+
+        return parsed;
+    }
+
+    static bool readFlag(const char *name, bool fallback) {
+        const char *value = std::getenv(name);
+        if (value == nullptr || *value == '\0') {
+            return fallback;
+        }
+
+        std::string flag = value;
+        return !(flag == "0" || flag == "false" || flag == "no" || flag == "off");
+    }
+
+    static ServerConfig fromEnvironment() {
+        ServerConfig config;
+        config.worker_threads = readSize("CLOUD_WORKER_THREADS", DEFAULT_WORKER_THREADS);
+        config.worker_queue_depth = readSize("CLOUD_QUEUE_DEPTH", DEFAULT_WORKER_QUEUE_DEPTH);
+        config.user_queue_depth = readSize("CLOUD_USER_QUEUE_DEPTH", DEFAULT_USER_QUEUE_DEPTH);
+        config.encrypt_at_rest = readFlag("CLOUD_ENCRYPT_AT_REST", DEFAULT_ENCRYPT_AT_REST);
+        config.verify_max_age_sec = readSize("CLOUD_VERIFY_MAX_AGE", DEFAULT_VERIFY_MAX_AGE_SEC);
+        config.scrub_enabled = readFlag("CLOUD_SCRUB", DEFAULT_SCRUB_ENABLED);
+        config.scrub_rate = readSize("CLOUD_SCRUB_RATE", DEFAULT_SCRUB_RATE);
+        config.scrub_interval_sec = readSize("CLOUD_SCRUB_INTERVAL", DEFAULT_SCRUB_INTERVAL_SEC);
+        config.scrub_busy_tasks = readSize("CLOUD_SCRUB_BUSY_TASKS", DEFAULT_SCRUB_BUSY_TASKS);
+        config.pack_small_files = readFlag("CLOUD_PACK_SMALL_FILES", DEFAULT_PACK_SMALL_FILES);
+        config.pack_threshold = readSize("CLOUD_PACK_THRESHOLD", DEFAULT_PACK_THRESHOLD);
+        config.dedup = readFlag("CLOUD_DEDUP", DEFAULT_DEDUP);
+        config.upload_ttl_sec = readSize("CLOUD_UPLOAD_TTL", DEFAULT_UPLOAD_TTL_SEC);
+        return config;
+    }
+
+    static const ServerConfig &instance() {
+        static const ServerConfig config = fromEnvironment();
+        return config;
+    }
+};
+
+#endif //CPP_PERSONAL_CLOUD_SERVER_CONFIG_H
@@ -0,0 +1,442 @@
+#ifndef CPP_PERSONAL_CLOUD_UPLOAD_MANAGER_H
+#define CPP_PERSONAL_CLOUD_UPLOAD_MANAGER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <ctime>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sqlite3.h>
+#include <string>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "db_manager.h"
+#include "redundancy_manager.h"
+
+#define UPLOAD_CHUNK_SIZE (4ULL * 1024 * 1024)
+#define MAX_UPLOAD_CHUNK (64ULL * 1024 * 1024)
+// Expired upload sessions are looked for at most this often (see sweepExpired).
+#define UPLOAD_SWEEP_INTERVAL_SEC 3600
+
+struct UploadSession {
+    std::string id;
+    int user_id = 0;
+    std::string target_dir;
+    std::string name;
+    unsigned long long size = 0;
+    int encryption = 0;
+    // Keystream nonce of a STORAGE_AES_CTR_STREAM upload; the committed file keeps it.
+    std::string nonce;
+};
+
+// One verified chunk of an upload, with the SHA-256 of its plaintext.
+struct UploadChunk {
+    unsigned long long offset = 0;
+    unsigned long long length = 0;
+    std::string hash;
+};
+
+// Running file and block hashes of the staged (stored-format) bytes of one upload. They cover the
+// contiguous prefix [0, hashed); chunks that arrive out of order are folded in once the gap before
+// them closes. `generation` counts the times a chunk sent again replaced hashed bytes and the
+// digest started over.
+struct UploadDigest {
+    std::mutex mutex;
+    FileDigest hasher;
+    unsigned long long hashed = 0;
+    unsigned long long generation = 0;
+
+    void rewind() {
+        hasher = FileDigest();
+        hashed = 0;
+        generation++;
+    }
+};
+
+// Server-side state of resumable uploads. Chunks are written into a staging file under
+// ./storage/<user>/staging/<upload id>; every verified chunk is recorded here so a client that
+// lost its connection can ask which byte ranges the server already has. A session is touched by
+// every chunk; one left alone for longer than its time to live is swept away with its file.
+class UploadManager {
+private:
+    static std::mutex &digestsMutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    static std::map<std::string, std::shared_ptr<UploadDigest> > &digests() {
+        static std::map<std::string, std::shared_ptr<UploadDigest> > digests;
+        return digests;
+    }
+
+    static std::string generateId() {
+        static const char chars[] = "0123456789abcdef";
+
+        std::random_device rd;
+        std::mt19937_64 gen(rd());
+        std::uniform_int_distribution<> dis(0, 15);
+
+        std::string id;
+        for (int i = 0; i < 32; i++) {
+            id += chars[dis(gen)];
+        }
+        return id;
+    }
+
+    static std::string columnBlob(sqlite3_stmt *stmt, int column) {
+        const void *data = sqlite3_column_blob(stmt, column);
+        return data ? std::string(static_cast<const char *>(data), sqlite3_column_bytes(stmt, column)) : "";
+    }
+
+public:
+    static bool initDatabase() {
+        std::string sql =
+                "CREATE TABLE IF NOT EXISTS upload_sessions ("
+                "id TEXT PRIMARY KEY, "
+                "user_id INTEGER NOT NULL, "
+                "target_dir TEXT NOT NULL, "
+                "name TEXT NOT NULL, "
+                "size INTEGER NOT NULL, "
+                "encryption INTEGER NOT NULL, "
+                "created_at TEXT DEFAULT (strftime('%d/%m/%Y', 'now')), "
+                "touched_at INTEGER, "
+                "nonce BLOB"
+                ");"
+                "CREATE TABLE IF NOT EXISTS upload_chunks ("
+                "upload_id TEXT NOT NULL, "
+                "offset INTEGER NOT NULL, "
+                "length INTEGER NOT NULL, "
+                "hash TEXT NOT NULL, "
+                "PRIMARY KEY (upload_id, offset)"
+                ");";
+
+        // Sessions from before touched_at existed get their time to live from now.
+        DBConnection &db = DBConnection::local();
+        return db.exec(sql) &&
+               RedundancyManager::addColumnIfMissing(db.handle(), "upload_sessions", "touched_at", "INTEGER") &&
+               RedundancyManager::addColumnIfMissing(db.handle(), "upload_sessions", "nonce", "BLOB") &&
+               db.exec("UPDATE upload_sessions SET touched_at = strftime('%s', 'now') WHERE touched_at IS NULL;");
+    }
+
+    static bool touch(const std::string &upload_id) {
+        std::string sql = "UPDATE upload_sessions SET touched_at = strftime('%s', 'now') WHERE id = ?;";
+        DBStatement stmt = DBConnection::local().prepare(sql);
+
+        sqlite3_bind_text(stmt, 1, upload_id.c_str(), -1, SQLITE_TRANSIENT);
+
+        return sqlite3_step(stmt) == SQLITE_DONE;
+    }
+
+    // Returns the unfinished session for the same destination and size, with the encryption and
+    // nonce its staged bytes already use, or starts a new one.
+    static UploadSession beginSession(int user_id, const std::string &target_dir, const std::string &name,
+                                      unsigned long long size, int encryption, const std::string &nonce) {
+        UploadSession session{"", user_id, target_dir, name, size, encryption, nonce};
+
+        std::string sql = "SELECT id, encryption, nonce FROM upload_sessions "
+                "WHERE user_id = ? AND target_dir = ? AND name = ? AND size = ?;";
+        DBStatement stmt = DBConnection::local().prepare(sql);
+
+        sqlite3_bind_int(stmt, 1, user_id);
+        sqlite3_bind_text(stmt, 2, target_dir.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 3, name.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(stmt, 4, static_cast<sqlite3_int64>(size));
+
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            session.id = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+            session.encryption = sqlite3_column_int(stmt, 1);
+            session.nonce = columnBlob(stmt, 2);
+            touch(session.id);
+            return session;
+        }
+
+        session.id = generateId();
+
+        sql = "INSERT INTO upload_sessions (id, user_id, target_dir, name, size, encryption, nonce, touched_at) "
+                "VALUES (?,?,?,?,?,?,?, strftime('%s', 'now'));";
+        DBStatement insert = DBConnection::local().prepare(sql);
+
+        sqlite3_bind_text(insert, 1, session.id.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(insert, 2, user_id);
+        sqlite3_bind_text(insert, 3, target_dir.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(insert, 4, name.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(insert, 5, static_cast<sqlite3_int64>(size));
+        sqlite3_bind_int(insert, 6, encryption);
+        if (!nonce.empty()) {
+            sqlite3_bind_blob(insert, 7, nonce.data(), static_cast<int>(nonce.size()), SQLITE_TRANSIENT);
+        }
+
+        if (sqlite3_step(insert) != SQLITE_DONE) {
+            std::cerr << "Error creating upload session: " << DBConnection::local().error() << '\n';
+            session.id.clear();
+        }
+
+        return session;
+    }
+
+    static bool getSession(const std::string &upload_id, int user_id, UploadSession &session) {
+        std::string sql = "SELECT target_dir, name, size, encryption, nonce FROM upload_sessions "
+                "WHERE id = ? AND user_id = ?;";
+        DBStatement stmt = DBConnection::local().prepare(sql);
+
+        sqlite3_bind_text(stmt, 1, upload_id.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(stmt, 2, user_id);
+
+        bool found = false;
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            session.id = upload_id;
+            session.user_id = user_id;
+            session.target_dir = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+            session.name = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1));
+            session.size = static_cast<unsigned long long>(sqlite3_column_int64(stmt, 2));
+            session.encryption = sqlite3_column_int(stmt, 3);
+            session.nonce = columnBlob(stmt, 4);
+            found = true;
+        }
+
+        return found;
+    }
+
+    static bool recordChunk(const std::string &upload_id, unsigned long long offset, unsigned long long length,
+                            const std::string &hash) {
+        std::string sql = "INSERT OR REPLACE INTO upload_chunks (upload_id, offset, length, hash) VALUES (?,?,?,?);";
+        DBStatement stmt = DBConnection::local().prepare(sql);
+
+        sqlite3_bind_text(stmt, 1, upload_id.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(stmt, 2, static_cast<sqlite3_int64>(offset));
+        sqlite3_bind_int64(stmt, 3, static_cast<sqlite3_int64>(length));
+        sqlite3_bind_text(stmt, 4, hash.c_str(), -1, SQLITE_TRANSIENT);
+
+        int rc = sqlite3_step(stmt);
+        return rc == SQLITE_DONE && touch(upload_id);
+    }
+
+    // Verified chunks in offset order, as recorded (not merged).
+    static std::vector<UploadChunk> getChunks(const std::string &upload_id) {
+        std::string sql = "SELECT offset, length, hash FROM upload_chunks WHERE upload_id = ? ORDER BY offset;";
+        DBStatement stmt = DBConnection::local().prepare(sql);
+
+        sqlite3_bind_text(stmt, 1, upload_id.c_str(), -1, SQLITE_TRANSIENT);
+
+        std::vector<UploadChunk> chunks;
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            chunks.push_back(UploadChunk{
+                static_cast<unsigned long long>(sqlite3_column_int64(stmt, 0)),
+                static_cast<unsigned long long>(sqlite3_column_int64(stmt, 1)),
+                reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2)),
+            });
+        }
+
+        return chunks;
+    }
+
+    // Whether any received chunk covers part of [offset, offset + length).
+    static bool overlapsChunk(const std::string &upload_id, unsigned long long offset, unsigned long long length) {
+        std::string sql = "SELECT 1 FROM upload_chunks WHERE upload_id = ? AND offset < ? AND offset + length > ? "
+                "LIMIT 1;";
+        DBStatement stmt = DBConnection::local().prepare(sql);
+
+        sqlite3_bind_text(stmt, 1, upload_id.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(stmt, 2, static_cast<sqlite3_int64>(offset + length));
+        sqlite3_bind_int64(stmt, 3, static_cast<sqlite3_int64>(offset));
+
+        return sqlite3_step(stmt) == SQLITE_ROW;
+    }
+
+    // Received byte ranges as [offset, length] pairs, sorted and merged.
+    static std::vector<std::pair<unsigned long long, unsigned long long> > getRanges(const std::string &upload_id) {
+        std::string sql = "SELECT offset, length FROM upload_chunks WHERE upload_id = ? ORDER BY offset;";
+        DBStatement stmt = DBConnection::local().prepare(sql);
+
+        sqlite3_bind_text(stmt, 1, upload_id.c_str(), -1, SQLITE_TRANSIENT);
+
+        std::vector<std::pair<unsigned long long, unsigned long long> > ranges;
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            unsigned long long offset = sqlite3_column_int64(stmt, 0);
+            unsigned long long length = sqlite3_column_int64(stmt, 1);
+
+            if (!ranges.empty() && offset <= ranges.back().first + ranges.back().second) {
+                unsigned long long end = std::max(ranges.back().first + ranges.back().second, offset + length);
+                ranges.back().second = end - ranges.back().first;
+            } else {
+                ranges.emplace_back(offset, length);
+            }
+        }
+
+        return ranges;
+    }
+
+    static bool isComplete(const UploadSession &session) {
+        auto ranges = getRanges(session.id);
+        if (session.size == 0) {
+            return true;
+        }
+        return ranges.size() == 1 && ranges[0].first == 0 && ranges[0].second >= session.size;
+    }
+
+    // The digest lives in memory only; after a restart it starts empty and the commit hashes the
+    // whole staging file once.
+    static std::shared_ptr<UploadDigest> getDigest(const std::string &upload_id) {
+        std::lock_guard<std::mutex> lock(digestsMutex());
+
+        auto &digest = digests()[upload_id];
+        if (!digest) {
+            digest = std::make_shared<UploadDigest>();
+        }
+        return digest;
+    }
+
+    static void dropDigest(const std::string &upload_id) {
+        std::lock_guard<std::mutex> lock(digestsMutex());
+        digests().erase(upload_id);
+    }
+
+    // Hashes the staged bytes [digest.hashed, end) from `fd`. The caller holds digest.mutex.
+    static bool extendDigest(UploadDigest &digest, int fd, unsigned long long end) {
+        thread_local std::vector<char> buffer(1024 * 1024);
+
+        while (digest.hashed < end) {
+            size_t to_read = end - digest.hashed < buffer.size() ? end - digest.hashed : buffer.size();
+            ssize_t got = pread(fd, buffer.data(), to_read, static_cast<off_t>(digest.hashed));
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                return false;
+            }
+
+            digest.hasher.update(buffer.data(), got);
+            digest.hashed += got;
+        }
+
+        return true;
+    }
+
+    // End of the received prefix [0, end) of an upload.
+    static unsigned long long contiguousEnd(const std::string &upload_id) {
+        auto ranges = getRanges(upload_id);
+        if (ranges.empty() || ranges[0].first != 0) {
+            return 0;
+        }
+        return ranges[0].second;
+    }
+
+    static bool removeSession(const std::string &upload_id) {
+        bool ok = true;
+        const char *statements[] = {
+            "DELETE FROM upload_chunks WHERE upload_id = ?;",
+            "DELETE FROM upload_sessions WHERE id = ?;",
+        };
+
+        for (const char *sql: statements) {
+            DBStatement stmt = DBConnection::local().prepare(sql);
+            sqlite3_bind_text(stmt, 1, upload_id.c_str(), -1, SQLITE_TRANSIENT);
+            ok = sqlite3_step(stmt) == SQLITE_DONE && ok;
+        }
+
+        // After the rows: a chunk that looked the session up just before finds it gone on its next
+        // lookup instead of bringing the digest back for good.
+        dropDigest(upload_id);
+        return ok;
+    }
+
+    // Ids of `user_id`'s sessions no chunk has arrived for in `ttl_sec` seconds.
+    static std::vector<std::string> expiredSessions(int user_id, unsigned long long ttl_sec) {
+        std::string sql = "SELECT id FROM upload_sessions WHERE user_id = ? AND touched_at < strftime('%s', 'now') - ?;";
+        DBStatement stmt = DBConnection::local().prepare(sql);
+
+        sqlite3_bind_int(stmt, 1, user_id);
+        sqlite3_bind_int64(stmt, 2, static_cast<sqlite3_int64>(ttl_sec));
+
+        std::vector<std::string> ids;
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            ids.emplace_back(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)));
+        }
+        return ids;
+    }
+
+    static bool sessionExists(const std::string &upload_id) {
+        std::string sql = "SELECT 1 FROM upload_sessions WHERE id = ?;";
+        DBStatement stmt = DBConnection::local().prepare(sql);
+
+        sqlite3_bind_text(stmt, 1, upload_id.c_str(), -1, SQLITE_TRANSIENT);
+
+        return sqlite3_step(stmt) == SQLITE_ROW;
+    }
+
+    // Digests whose session is gone, e.g. brought back by a chunk that was being written while its
+    // upload was committed.
+    static void pruneDigests() {
+        std::vector<std::string> ids;
+        {
+            std::lock_guard<std::mutex> lock(digestsMutex());
+            for (const auto &entry: digests()) {
+                ids.push_back(entry.first);
+            }
+        }
+
+        for (const auto &id: ids) {
+            if (!sessionExists(id)) {
+                dropDigest(id);
+            }
+        }
+    }
+
+    // Drops the expired sessions of every user under ./storage with their staging files and
+    // digests, staging files as old that no session refers to, and orphaned digests. Runs at most once per
+    // UPLOAD_SWEEP_INTERVAL_SEC; callers that come in between return right away.
+    static void sweepExpired(unsigned long long ttl_sec) {
+        static std::atomic<long long> last_sweep{0};
+        long long now = std::time(nullptr);
+        long long last = last_sweep.load();
+        if (now - last < UPLOAD_SWEEP_INTERVAL_SEC || !last_sweep.compare_exchange_strong(last, now)) {
+            return;
+        }
+
+        size_t removed = 0;
+        std::error_code ec;
+        for (const auto &user_dir: std::filesystem::directory_iterator("./storage", ec)) {
+            std::filesystem::path staging_dir = user_dir.path() / "staging";
+            if (!user_dir.is_directory() || !std::filesystem::is_directory(staging_dir)) {
+                continue;
+            }
+
+            int user_id = DBManager::get_user_id(user_dir.path().filename().string());
+            if (user_id <= 0) {
+                continue;
+            }
+
+            for (const auto &id: expiredSessions(user_id, ttl_sec)) {
+                std::filesystem::remove(staging_dir / id, ec);
+                if (removeSession(id)) {
+                    removed++;
+                }
+            }
+
+            auto cutoff = std::filesystem::file_time_type::clock::now() - std::chrono::seconds(ttl_sec);
+            for (const auto &staged: std::filesystem::directory_iterator(staging_dir, ec)) {
+                if (staged.is_regular_file(ec) && staged.last_write_time(ec) < cutoff &&
+                    !sessionExists(staged.path().filename().string())) {
+                    std::filesystem::remove(staged.path(), ec);
+                    removed++;
+                }
+            }
+        }
+
+        pruneDigests();
+
+        if (removed > 0) {
+            std::cout << "Removed " << removed << " expired uploads\n";
+        }
+    }
+};
+
+#endif //CPP_PERSONAL_CLOUD_UPLOAD_MANAGER_H
@@ -6,58 +6,90 @@
 #include <filesystem>
 #include <iostream>
 
+#include "db_manager.h"
+#include "encryption_manager.h"
+#include "metadata_index.h"
+
+// Everything a command needs to know about the logged-in user, resolved once at login: commands
+// read the id, key schedule and storage directories from here and never go back to the database
+// for them.
 class UserSession {
 private:
     std::string username;
     int userid;
-    std::string password_hash;
+    CipherKey cipher_key;
     bool authenticated;
     std::filesystem::path user_directory;
+    std::filesystem::path primary_directory;
+    std::filesystem::path backup_directory;
+    std::filesystem::path staging_directory;
+    std::string scheduling_key;
 
 public:
-    UserSession() : authenticated(false) {
+    UserSession() : userid(0), authenticated(false) {
     }
 
     bool isAuthenticated() const {
         return authenticated;
     }
 
-    std::string getUsername() const {
+    const std::string &getUsername() const {
         return username;
     }
 
-    std::filesystem::path getUserDirectory() const {
+    const std::filesystem::path &getUserDirectory() const {
         return user_directory;
     }
 
-    std::string getPasswordHash() const {
-        return password_hash;
+    const std::filesystem::path &getPrimaryDirectory() const {
+        return primary_directory;
+    }
+
+    const std::filesystem::path &getBackupDirectory() const {
+        return backup_directory;
+    }
+
+    const std::filesystem::path &getStagingDirectory() const {
+        return staging_directory;
+    }
+
+    const CipherKey &getCipherKey() const {
+        return cipher_key;
     }
 
     int getUserId() const {
         return userid;
     }
 
+    // WorkerPool queue key shared by all connections of this user.
+    const std::string &getSchedulingKey() const {
+        return scheduling_key;
+    }
+
     bool login(const std::string &user, const std::string &password) {
-        username = user;
-        if (DBManager::try_login(username, password)) {
+        std::string key_hash;
+        if (DBManager::try_login(user, password, userid, key_hash)) {
+            username = user;
             authenticated = true;
 
-            userid = DBManager::get_user_id(username);
-            password_hash = DBManager::get_user_hash(userid);
+            cipher_key = EncryptionManager::deriveKey(key_hash);
+            scheduling_key = "user:" + username;
 
             user_directory = std::filesystem::path("./storage") / username;
-            std::filesystem::path primary = user_directory / "primary";
-            std::filesystem::path backup = user_directory / "backup";
+            primary_directory = user_directory / "primary";
+            backup_directory = user_directory / "backup";
+            staging_directory = user_directory / "staging";
 
             try {
-                std::filesystem::create_directories(primary);
-                std::filesystem::create_directories(backup);
+                std::filesystem::create_directories(primary_directory);
+                std::filesystem::create_directories(backup_directory);
+                std::filesystem::create_directories(staging_directory);
                 std::cout << "Created directories for user: " << username << '\n';
+                MetadataIndex::ensureIndexed(userid, primary_directory);
                 return true;
             } catch (const std::exception &e) {
                 std::cerr << "Failed to create user directories: " << e.what() << '\n';
-                authenticated = false;
+                logout();
                 return false;
             }
         } else {
@@ -67,8 +99,14 @@ public:
 
     void logout() {
         username.clear();
+        userid = 0;
+        cipher_key.reset();
         authenticated = false;
         user_directory.clear();
+        primary_directory.clear();
+        backup_directory.clear();
+        staging_directory.clear();
+        scheduling_key.clear();
     }
 };
 
@@ -0,0 +1,208 @@
+#ifndef CPP_PERSONAL_CLOUD_WORKER_POOL_H
+#define CPP_PERSONAL_CLOUD_WORKER_POOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Fixed set of threads that run the blocking part of client commands (disk I/O, transfers).
+//
+// Every task is queued under a key (the user it runs for) and the keys are served with deficit
+// round-robin, so a user with a burst of queued uploads gets one turn per round like everybody
+// else. Bulk tasks (transfers) cost a full quantum and may only occupy part of the pool; the
+// remaining threads are kept for light metadata commands so LIST/CREATEDIR don't wait behind
+// multi-GB transfers. Queues are bounded globally and per key; a full queue rejects the task.
+class WorkerPool {
+private:
+    static constexpr long QUANTUM = 4;
+    static constexpr long LIGHT_COST = 1;
+    static constexpr long BULK_COST = QUANTUM;
+
+    struct Task {
+        std::function<void()> run;
+        bool bulk;
+        long cost;
+    };
+
+    struct Flow {
+        std::deque<Task> tasks;
+        long deficit = 0;
+        bool new_turn = true;
+    };
+
+    std::vector<std::thread> threads;
+    std::unordered_map<std::string, Flow> flows;
+    std::deque<std::string> active;
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    size_t max_queue;
+    size_t max_user_queue;
+    size_t max_bulk;
+    size_t queued = 0;
+    size_t running = 0;
+    size_t bulk_running = 0;
+    bool stopping = false;
+
+    void rotate() {
+        active.push_back(std::move(active.front()));
+        active.pop_front();
+    }
+
+    bool pickTask(Task &picked) {
+        size_t scanned = 0;
+
+        while (scanned < active.size()) {
+            Flow &flow = flows[active.front()];
+            Task &head = flow.tasks.front();
+
+            if (head.bulk && bulk_running >= max_bulk) {
+                flow.new_turn = true;
+                rotate();
+                scanned++;
+                continue;
+            }
+
+            if (flow.new_turn) {
+                flow.deficit += QUANTUM;
+                flow.new_turn = false;
+            }
+
+            if (flow.deficit < head.cost) {
+                flow.new_turn = true;
+                rotate();
+                scanned++;
+                continue;
+            }
+
+            flow.deficit -= head.cost;
+            picked = std::move(head);
+            flow.tasks.pop_front();
+            queued--;
+
+            if (flow.tasks.empty()) {
+                flows.erase(active.front());
+                active.pop_front();
+            } else if (flow.deficit < flow.tasks.front().cost) {
+                flow.new_turn = true;
+                rotate();
+            }
+
+            return true;
+        }
+
+        return false;
+    }
+
+    void workerLoop() {
+        while (true) {
+            Task task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this, &task] { return stopping || pickTask(task); });
+
+                if (!task.run) {
+                    return;
+                }
+
+                running++;
+                if (task.bulk) {
+                    bulk_running++;
+                }
+            }
+
+            try {
+                task.run();
+            } catch (const std::exception &e) {
+                std::cerr << "Worker task failed: " << e.what() << '\n';
+            } catch (...) {
+                std::cerr << "Worker task failed with unknown error\n";
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                running--;
+                if (task.bulk) {
+                    bulk_running--;
+                }
+            }
+            if (task.bulk) {
+                cv.notify_all();
+            }
+        }
+    }
+
+public:
+    WorkerPool(size_t thread_count, size_t max_queue, size_t max_user_queue)
+        : max_queue(max_queue), max_user_queue(max_user_queue) {
+        if (thread_count == 0) {
+            thread_count = 1;
+        }
+
+        size_t reserved_light = thread_count / 4;
+        if (reserved_light == 0 && thread_count > 1) {
+            reserved_light = 1;
+        }
+        max_bulk = thread_count - reserved_light;
+
+        for (size_t i = 0; i < thread_count; i++) {
+            threads.emplace_back(&WorkerPool::workerLoop, this);
+        }
+    }
+
+    WorkerPool(const WorkerPool &) = delete;
+
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+
+        for (auto &thread: threads) {
+            if (thread.joinable()) {
+                thread.join();
+            }
+        }
+    }
+
+    // Client commands queued or running; background work backs off while this is high.
+    size_t load() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return queued + running;
+    }
+
+    bool submit(const std::string &key, bool bulk, std::function<void()> run) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopping || queued >= max_queue) {
+                return false;
+            }
+
+            auto found = flows.find(key);
+            if (found != flows.end() && found->second.tasks.size() >= max_user_queue) {
+                return false;
+            }
+
+            Flow &flow = flows[key];
+            if (flow.tasks.empty()) {
+                active.push_back(key);
+            }
+
+            flow.tasks.push_back(Task{std::move(run), bulk, bulk ? BULK_COST : LIGHT_COST});
+            queued++;
+        }
+        cv.notify_one();
+        return true;
+    }
+};
+
+#endif //CPP_PERSONAL_CLOUD_WORKER_POOL_H
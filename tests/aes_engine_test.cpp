@@ -0,0 +1,180 @@
+// AES-CTR kernels of AesEngine against tiny-AES (include/aes.c): every kernel the CPU can run must
+// produce the same keystream for any key, IV, byte offset and length, and CipherStream must stay
+// in step across seek() and segment boundaries.
+//
+// Exits non-zero on the first failure.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "aes.h"
+}
+
+#include "aes_engine.h"
+#include "encryption_manager.h"
+
+#define TEST_ROUNDS 2000
+#define TEST_MAX_OFFSET 300
+#define TEST_MAX_LENGTH 1200
+
+static int failures = 0;
+
+static void check(bool condition, const std::string &what) {
+    if (!condition) {
+        std::cerr << "FAILED: " << what << '\n';
+        failures++;
+    }
+}
+
+static std::mt19937 rng(20240917);
+
+static void fill(uint8_t *data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        data[i] = static_cast<uint8_t>(rng());
+    }
+}
+
+// tiny-AES over the whole buffer from the start of the IV's stream.
+static std::vector<uint8_t> reference(const uint8_t key[16], const uint8_t iv[16], std::vector<uint8_t> data) {
+    AES_ctx ctx;
+    AES_init_ctx_iv(&ctx, key, iv);
+    AES_CTR_xcrypt_buffer(&ctx, data.data(), data.size());
+    return data;
+}
+
+// Random IVs; every third one has a low half about to wrap, so the carry into the high half is hit.
+static void randomIv(uint8_t iv[16], int round) {
+    fill(iv, 16);
+    if (round % 3 == 0) {
+        std::memset(iv + 8, 0xff, 8);
+        iv[15] = static_cast<uint8_t>(0xff - rng() % 64);
+    }
+}
+
+static void testKeySchedule() {
+    for (int round = 0; round < 100; round++) {
+        uint8_t key[16];
+        uint8_t iv[16] = {0};
+        fill(key, sizeof(key));
+
+        AES_ctx ctx;
+        AES_init_ctx_iv(&ctx, key, iv);
+        AesEngine::Schedule schedule;
+        AesEngine::expandKey(key, schedule);
+        check(std::memcmp(schedule.round_keys, ctx.RoundKey, sizeof(schedule.round_keys)) == 0, "key schedule");
+    }
+}
+
+// A slice starting at any byte offset, unaligned lengths included, and buffers long enough for the
+// 8- and 16-block loops of the hardware kernels.
+static void testKernel(const char *name, AesEngine::Kernel run) {
+    for (int round = 0; round < TEST_ROUNDS; round++) {
+        uint8_t key[16];
+        uint8_t iv[16];
+        fill(key, sizeof(key));
+        randomIv(iv, round);
+
+        size_t offset = rng() % TEST_MAX_OFFSET;
+        size_t length = round % 50 == 0 ? 64 * 1024 + rng() % 100 : rng() % TEST_MAX_LENGTH;
+        std::vector<uint8_t> data(offset + length);
+        fill(data.data(), data.size());
+        std::vector<uint8_t> expected = reference(key, iv, data);
+
+        AesEngine::Schedule schedule;
+        AesEngine::expandKey(key, schedule);
+        std::vector<uint8_t> slice(data.begin() + offset, data.end());
+        AesEngine::ctrXcrypt(run, schedule, iv, offset, slice.data(), slice.size());
+
+        check(std::memcmp(slice.data(), expected.data() + offset, length) == 0,
+              std::string(name) + " at offset " + std::to_string(offset) + ", length " + std::to_string(length));
+    }
+}
+
+// The buffer is encrypted in random pieces, each after a seek() to where it starts, in random
+// order; pieces mostly start and end inside a block.
+static void testSeek() {
+    for (int round = 0; round < 200; round++) {
+        uint8_t key[16];
+        uint8_t iv[16];
+        fill(key, sizeof(key));
+        randomIv(iv, round);
+
+        std::vector<uint8_t> data(rng() % 5000 + 1);
+        fill(data.data(), data.size());
+        std::vector<uint8_t> expected = reference(key, iv, data);
+
+        std::vector<std::pair<size_t, size_t> > pieces;
+        for (size_t start = 0; start < data.size();) {
+            size_t length = rng() % 100 + 1;
+            length = length < data.size() - start ? length : data.size() - start;
+            pieces.emplace_back(start, length);
+            start += length;
+        }
+        std::shuffle(pieces.begin(), pieces.end(), rng);
+
+        auto schedule = std::make_shared<AesEngine::Schedule>();
+        AesEngine::expandKey(key, *schedule);
+        CipherStream cipher(schedule, iv);
+        for (const auto &piece: pieces) {
+            cipher.seek(piece.first);
+            cipher.xcrypt(data.data() + piece.first, piece.second);
+            check(cipher.tell() == piece.first + piece.second, "tell() after a piece");
+        }
+
+        check(data == expected, "seek over " + std::to_string(pieces.size()) + " pieces");
+    }
+}
+
+// Legacy objects restart the keystream every LEGACY_CIPHER_SEGMENT bytes.
+static void testSegments() {
+    uint8_t key[16];
+    uint8_t iv[16];
+    fill(key, sizeof(key));
+    fill(iv, sizeof(iv));
+
+    std::vector<uint8_t> data(3 * LEGACY_CIPHER_SEGMENT + 1234);
+    fill(data.data(), data.size());
+    std::vector<uint8_t> expected = data;
+    for (size_t start = 0; start < expected.size(); start += LEGACY_CIPHER_SEGMENT) {
+        size_t length = expected.size() - start < LEGACY_CIPHER_SEGMENT ? expected.size() - start
+                                                                          : LEGACY_CIPHER_SEGMENT;
+        std::vector<uint8_t> segment(expected.begin() + start, expected.begin() + start + length);
+        segment = reference(key, iv, segment);
+        std::memcpy(expected.data() + start, segment.data(), length);
+    }
+
+    auto schedule = std::make_shared<AesEngine::Schedule>();
+    AesEngine::expandKey(key, *schedule);
+    CipherStream cipher(schedule, iv, LEGACY_CIPHER_SEGMENT);
+    size_t offset = LEGACY_CIPHER_SEGMENT - 5;
+    cipher.seek(offset);
+    cipher.xcrypt(data.data() + offset, data.size() - offset);
+    cipher.seek(0);
+    cipher.xcrypt(data.data(), offset);
+
+    check(data == expected, "segmented stream across segment boundaries");
+}
+
+int main() {
+    testKeySchedule();
+    for (const auto &kernel: AesEngine::availableKernels()) {
+        std::cout << "Checking the " << kernel.first << " kernel\n";
+        testKernel(kernel.first, kernel.second);
+    }
+    testSeek();
+    testSegments();
+
+    if (failures > 0) {
+        std::cerr << failures << " checks failed\n";
+        return 1;
+    }
+    std::cout << "aes_engine_test passed\n";
+    return 0;
+}
@@ -0,0 +1,257 @@
+// Reference counting in ChunkStore: two files with a common prefix share its chunks, each chunk
+// counts the recipes that use it, and dropping a file (or aborting an upload) removes only the
+// chunks nothing else refers to. Encrypted and plaintext writers store the same content under the
+// same id for one key, and read back the same plaintext.
+//
+// Runs in a scratch directory (its own ./storage/cloud.db); exits non-zero on the first failure.
+
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "chunk_store.h"
+
+#define TEST_USER 1
+#define TEST_OTHER_USER 2
+#define TEST_KEY "00112233445566778899aabbccddeeff00112233445566778899aabbccddeeff"
+#define TEST_OTHER_KEY "ffeeddccbbaa99887766554433221100ffeeddccbbaa99887766554433221100"
+
+static int failures = 0;
+
+static void check(bool condition, const std::string &what) {
+    if (!condition) {
+        std::cerr << "FAILED: " << what << '\n';
+        failures++;
+    }
+}
+
+static std::mt19937 rng(20240917);
+
+static std::string randomBytes(size_t length) {
+    std::string data(length, '\0');
+    for (char &c: data) {
+        c = static_cast<char>(rng());
+    }
+    return data;
+}
+
+static std::filesystem::path userDir(int user_id) {
+    return std::filesystem::path("storage") / std::to_string(user_id);
+}
+
+static std::filesystem::path chunkFile(int user_id, const std::string &id, bool backup) {
+    return userDir(user_id) / "chunks" / (backup ? "backup" : "primary") / id.substr(0, 2) / id;
+}
+
+static std::string readFile(const std::filesystem::path &path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+static long long chunkRefs(int user_id, const std::string &id) {
+    DBStatement stmt = DBConnection::local().prepare("SELECT refs FROM chunks WHERE user_id = ? AND hash = ?;");
+    sqlite3_bind_int(stmt, 1, user_id);
+    sqlite3_bind_text(stmt, 2, id.c_str(), -1, SQLITE_TRANSIENT);
+    return sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : 0;
+}
+
+static bool bothCopies(int user_id, const std::string &id) {
+    return std::filesystem::exists(chunkFile(user_id, id, false)) &&
+           std::filesystem::exists(chunkFile(user_id, id, true));
+}
+
+static bool neitherCopy(int user_id, const std::string &id) {
+    return !std::filesystem::exists(chunkFile(user_id, id, false)) &&
+           !std::filesystem::exists(chunkFile(user_id, id, true));
+}
+
+// Stores `data` as the chunked file `path`, the way a POST does.
+static std::vector<ChunkRef> storeFile(int user_id, const CipherKey &key, bool encrypt, const std::string &path,
+                                       const std::string &data) {
+    ChunkWriter writer(user_id, userDir(user_id), key, encrypt);
+    bool written = writer.feed(data.data(), data.size()) && writer.finish();
+    check(written && writer.size() == data.size(), "write " + path);
+    check(writer.fileHash() == Sha256::hashHex(data.data(), data.size()), "file hash of " + path);
+
+    DBTransaction transaction;
+    check(ChunkStore::record(user_id, path, writer.recipe()) && transaction.commit(), "record " + path);
+    return writer.recipe();
+}
+
+static std::string loadFile(int user_id, const CipherKey &key, const std::string &path) {
+    std::vector<ChunkRef> recipe;
+    if (!ChunkStore::recipe(user_id, path, recipe)) {
+        return "";
+    }
+    ChunkReader reader(user_id, userDir(user_id), key, recipe);
+    std::string data;
+    bool read = reader.read(0, reader.size(), [&data](const char *piece, size_t length) {
+        data.append(piece, length);
+        return true;
+    });
+    return read ? data : "";
+}
+
+// Drops a file the way DELETE does: recipe and references in one transaction, then the files.
+static std::vector<std::string> dropFile(int user_id, const std::string &path) {
+    std::vector<std::string> unreferenced;
+    auto lock = ChunkStore::lock(user_id);
+    DBTransaction transaction;
+    check(ChunkStore::dropFile(user_id, path, unreferenced) && transaction.commit(), "drop " + path);
+    ChunkStore::removeChunkFiles(userDir(user_id), unreferenced);
+    return unreferenced;
+}
+
+// a.bin and b.bin start with the same 3 MB, so the chunks cut before it ends are stored once and
+// counted twice; dropping a.bin removes its own chunks and leaves the shared ones to b.bin.
+static void testSharedChunks(const CipherKey &key) {
+    std::string common = randomBytes(3 * 1024 * 1024);
+    std::string a = common + randomBytes(2 * 1024 * 1024);
+    std::string b = common + randomBytes(2 * 1024 * 1024);
+
+    std::vector<ChunkRef> recipe_a = storeFile(TEST_USER, key, true, "/a.bin", a);
+    std::vector<ChunkRef> recipe_b = storeFile(TEST_USER, key, true, "/b.bin", b);
+
+    std::set<std::string> ids_a;
+    std::set<std::string> ids_b;
+    for (const auto &chunk: recipe_a) {
+        ids_a.insert(chunk.hash);
+    }
+    for (const auto &chunk: recipe_b) {
+        ids_b.insert(chunk.hash);
+    }
+
+    std::set<std::string> shared;
+    for (const auto &id: ids_a) {
+        if (ids_b.count(id)) {
+            shared.insert(id);
+        }
+    }
+    check(!shared.empty() && shared.size() < ids_a.size(), "the common prefix is shared, the rest is not");
+    for (const auto &id: ids_a) {
+        check(chunkRefs(TEST_USER, id) == (shared.count(id) ? 2 : 1), "one reference per recipe");
+        check(bothCopies(TEST_USER, id), "primary and backup copies stored");
+    }
+
+    check(ChunkStore::contains(TEST_USER, "/a.bin") && ChunkStore::containsUnder(TEST_USER, ""), "recipes found");
+    check(loadFile(TEST_USER, key, "/a.bin") == a && loadFile(TEST_USER, key, "/b.bin") == b, "files read back");
+
+    std::vector<std::string> removed = dropFile(TEST_USER, "/a.bin");
+    check(removed.size() == ids_a.size() - shared.size(), "only a.bin's own chunks unreferenced");
+    for (const auto &id: ids_a) {
+        if (shared.count(id)) {
+            check(chunkRefs(TEST_USER, id) == 1 && bothCopies(TEST_USER, id), "shared chunk kept for b.bin");
+        } else {
+            check(chunkRefs(TEST_USER, id) == 0 && neitherCopy(TEST_USER, id), "a.bin's own chunk removed");
+        }
+    }
+    check(!ChunkStore::contains(TEST_USER, "/a.bin"), "a.bin's recipe gone");
+    check(loadFile(TEST_USER, key, "/b.bin") == b, "b.bin still reads back");
+
+    removed = dropFile(TEST_USER, "/b.bin");
+    check(removed.size() == ids_b.size(), "every chunk of the last file unreferenced");
+    check(ChunkStore::chunks(TEST_USER, "", 1000).empty(), "no chunks left");
+    for (const auto &id: ids_b) {
+        check(neitherCopy(TEST_USER, id), "chunk files of the last file removed");
+    }
+}
+
+// An upload that fails gives its references back: chunks it stored go, chunks a recorded file
+// also uses stay with one reference.
+static void testAbortReleases(const CipherKey &key) {
+    std::string kept = randomBytes(2 * 1024 * 1024);
+    std::vector<ChunkRef> recipe_kept = storeFile(TEST_USER, key, true, "/kept.bin", kept);
+
+    ChunkWriter writer(TEST_USER, userDir(TEST_USER), key, true);
+    std::string data = kept + randomBytes(2 * 1024 * 1024);
+    check(writer.feed(data.data(), data.size()) && writer.finish(), "write the aborted upload");
+    std::vector<ChunkRef> recipe_aborted = writer.recipe();
+    writer.abort();
+    check(writer.recipe().empty(), "abort forgets the recipe");
+
+    std::set<std::string> ids_kept;
+    for (const auto &chunk: recipe_kept) {
+        ids_kept.insert(chunk.hash);
+    }
+    for (const auto &chunk: recipe_aborted) {
+        if (ids_kept.count(chunk.hash)) {
+            check(chunkRefs(TEST_USER, chunk.hash) == 1 && bothCopies(TEST_USER, chunk.hash),
+                  "chunk of a recorded file kept");
+        } else {
+            check(chunkRefs(TEST_USER, chunk.hash) == 0 && neitherCopy(TEST_USER, chunk.hash),
+                  "chunk only the aborted upload used removed");
+        }
+    }
+    check(loadFile(TEST_USER, key, "/kept.bin") == kept, "recorded file still reads back");
+    dropFile(TEST_USER, "/kept.bin");
+}
+
+// The id depends on the key and the content only; what lands on disk depends on the writer.
+static void testEncryptedAndPlaintext(const CipherKey &key, const CipherKey &other_key) {
+    std::string data = randomBytes(512 * 1024);
+    std::string content_hash = Sha256::hashHex(data.data(), data.size());
+
+    std::vector<ChunkRef> plain = storeFile(TEST_OTHER_USER, key, false, "/plain.bin", data);
+    std::vector<ChunkRef> sealed = storeFile(TEST_USER, key, true, "/sealed.bin", data);
+    check(plain.size() == 1 && sealed.size() == 1, "one chunk each");
+    if (plain.size() != 1 || sealed.size() != 1) {
+        return;
+    }
+
+    check(plain[0].hash == sealed[0].hash && plain[0].hash == ChunkStore::chunkId(key, content_hash),
+          "same id for the same key and content");
+    check(ChunkStore::chunkId(other_key, content_hash) != plain[0].hash, "another key gives another id");
+    check(plain[0].hash != content_hash, "the id is not the content hash");
+
+    check(readFile(chunkFile(TEST_OTHER_USER, plain[0].hash, false)) == data, "plaintext chunk stored as is");
+    std::string stored = readFile(chunkFile(TEST_USER, sealed[0].hash, false));
+    check(stored.size() == data.size() && stored != data, "encrypted chunk stored encrypted");
+
+    check(loadFile(TEST_OTHER_USER, key, "/plain.bin") == data, "plaintext chunk reads back");
+    check(loadFile(TEST_USER, key, "/sealed.bin") == data, "encrypted chunk reads back");
+
+    // The primary copy is damaged; the backup serves the read and repairs it.
+    {
+        std::ofstream damaged(chunkFile(TEST_USER, sealed[0].hash, false), std::ios::binary | std::ios::in);
+        damaged.put('x');
+    }
+    check(loadFile(TEST_USER, key, "/sealed.bin") == data, "read from the backup copy");
+    check(readFile(chunkFile(TEST_USER, sealed[0].hash, false)) == stored, "primary copy repaired");
+
+    dropFile(TEST_USER, "/sealed.bin");
+    check(bothCopies(TEST_OTHER_USER, plain[0].hash) && chunkRefs(TEST_OTHER_USER, plain[0].hash) == 1,
+          "another user's copy of the same id untouched");
+    dropFile(TEST_OTHER_USER, "/plain.bin");
+}
+
+int main() {
+    std::filesystem::path scratch = std::filesystem::temp_directory_path() / "chunk_store_test";
+    std::filesystem::remove_all(scratch);
+    std::filesystem::create_directories(scratch / "storage");
+    std::filesystem::current_path(scratch);
+
+    if (!ChunkStore::initDatabase()) {
+        std::cerr << "Failed to create the test database\n";
+        return 1;
+    }
+
+    CipherKey key = EncryptionManager::deriveKey(TEST_KEY);
+    CipherKey other_key = EncryptionManager::deriveKey(TEST_OTHER_KEY);
+
+    testSharedChunks(key);
+    testAbortReleases(key);
+    testEncryptedAndPlaintext(key, other_key);
+
+    if (failures > 0) {
+        std::cerr << failures << " checks failed\n";
+        return 1;
+    }
+    std::cout << "chunk_store_test passed\n";
+    return 0;
+}
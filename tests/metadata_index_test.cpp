@@ -0,0 +1,126 @@
+// The change journal behind LIST_SINCE in MetadataIndex: changes come back in version order, a
+// client too far behind (or from another database) is told to reload, and pruning keeps the last
+// JOURNAL_RETAIN entries of one user without touching anyone else's.
+//
+// Runs in a scratch directory (its own ./storage/cloud.db); exits non-zero on the first failure.
+
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+#include "metadata_index.h"
+
+#define TEST_USER 1
+#define TEST_OTHER_USER 2
+
+static int failures = 0;
+
+static void check(bool condition, const std::string &what) {
+    if (!condition) {
+        std::cerr << "FAILED: " << what << '\n';
+        failures++;
+    }
+}
+
+static struct stat fileStat(long long size) {
+    struct stat st{};
+    st.st_size = size;
+    return st;
+}
+
+static unsigned long long journalRows(int user_id, unsigned long long &oldest) {
+    DBStatement stmt = DBConnection::local().prepare(
+        "SELECT COUNT(*), MIN(version) FROM file_journal WHERE user_id = ?;");
+    sqlite3_bind_int(stmt, 1, user_id);
+    if (sqlite3_step(stmt) != SQLITE_ROW) {
+        return 0;
+    }
+    oldest = static_cast<unsigned long long>(sqlite3_column_int64(stmt, 1));
+    return static_cast<unsigned long long>(sqlite3_column_int64(stmt, 0));
+}
+
+// A file in a new directory journals the directory first; a delete follows the puts.
+static void testChangesInOrder() {
+    {
+        DBTransaction transaction;
+        check(MetadataIndex::putFile(TEST_OTHER_USER, "/docs/a.txt", fileStat(10), "h") &&
+              MetadataIndex::remove(TEST_OTHER_USER, "/docs/a.txt") && transaction.commit(), "other user's changes");
+    }
+
+    std::vector<CloudChange> changes;
+    unsigned long long version = 0;
+    check(MetadataIndex::changesSince(TEST_OTHER_USER, 0, changes, version), "changes since 0");
+    check(version == 3 && changes.size() == 3, "three changes");
+    if (changes.size() == 3) {
+        check(changes[0].op == "put" && changes[0].path == "/docs" && changes[0].is_dir, "directory first");
+        check(changes[1].op == "put" && changes[1].path == "/docs/a.txt" && changes[1].size == 10, "then the file");
+        check(changes[2].op == "delete" && changes[2].version == 3, "then the delete");
+    }
+
+    changes.clear();
+    check(MetadataIndex::changesSince(TEST_OTHER_USER, version, changes, version) && changes.empty(),
+          "nothing new at the current version");
+    check(!MetadataIndex::changesSince(TEST_OTHER_USER, version + 1, changes, version),
+          "a version from the future means another database");
+}
+
+// Enough changes to prune twice; the client limits apply at JOURNAL_MAX_CHANGES.
+static void testPruning() {
+    unsigned long long total = JOURNAL_RETAIN + 2 * JOURNAL_PRUNE_EVERY + 17;
+    {
+        DBTransaction transaction;
+        bool stored = true;
+        for (unsigned long long i = 0; stored && i < total; i++) {
+            stored = MetadataIndex::putFile(TEST_USER, "/f" + std::to_string(i % 100), fileStat(i), "");
+        }
+        check(stored && transaction.commit(), "store " + std::to_string(total) + " changes");
+    }
+
+    unsigned long long version = MetadataIndex::currentVersion(TEST_USER);
+    check(version == total, "one version per change");
+
+    unsigned long long last_prune = version - version % JOURNAL_PRUNE_EVERY;
+    unsigned long long oldest = 0;
+    unsigned long long rows = journalRows(TEST_USER, oldest);
+    check(oldest == last_prune - JOURNAL_RETAIN + 1, "entries before the retained window pruned");
+    check(rows == version - oldest + 1, "retained entries kept whole");
+
+    std::vector<CloudChange> changes;
+    unsigned long long reached = 0;
+    check(MetadataIndex::changesSince(TEST_USER, version - JOURNAL_MAX_CHANGES, changes, reached) &&
+          changes.size() == JOURNAL_MAX_CHANGES && reached == version, "a client at the limit gets every change");
+
+    changes.clear();
+    check(!MetadataIndex::changesSince(TEST_USER, version - JOURNAL_MAX_CHANGES - 1, changes, reached),
+          "a client past the limit reloads");
+    check(!MetadataIndex::changesSince(TEST_USER, 1, changes, reached), "a client before the pruned entries reloads");
+
+    changes.clear();
+    check(MetadataIndex::changesSince(TEST_OTHER_USER, 0, changes, reached) && changes.size() == 3,
+          "other user's journal untouched by pruning");
+}
+
+int main() {
+    std::filesystem::path scratch = std::filesystem::temp_directory_path() / "metadata_index_test";
+    std::filesystem::remove_all(scratch);
+    std::filesystem::create_directories(scratch / "storage");
+    std::filesystem::current_path(scratch);
+
+    if (!MetadataIndex::initDatabase()) {
+        std::cerr << "Failed to create the test database\n";
+        return 1;
+    }
+
+    testChangesInOrder();
+    testPruning();
+
+    if (failures > 0) {
+        std::cerr << failures << " checks failed\n";
+        return 1;
+    }
+    std::cout << "metadata_index_test passed\n";
+    return 0;
+}
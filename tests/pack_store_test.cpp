@@ -0,0 +1,145 @@
+// Appends racing compaction in PackStore: the bytes of an append whose row is not committed yet
+// must survive a compaction of its pack, and every committed entry must still load afterwards.
+//
+// Runs in a scratch directory (its own ./storage/cloud.db); exits non-zero on the first failure.
+
+#include <atomic>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "pack_store.h"
+
+#define TEST_USER 1
+#define TEST_THREADS 4
+#define TEST_FILES_PER_THREAD 200
+
+static std::atomic<int> failures{0};
+
+static void check(bool condition, const std::string &what) {
+    if (!condition) {
+        std::cerr << "FAILED: " << what << '\n';
+        failures++;
+    }
+}
+
+static bool recordEntry(const std::string &path, const PackEntry &entry) {
+    DBTransaction transaction;
+    return PackStore::record(TEST_USER, path, entry) && transaction.commit();
+}
+
+static bool removeEntry(const std::string &path) {
+    DBTransaction transaction;
+    return PackStore::remove(TEST_USER, path) && transaction.commit();
+}
+
+// The entries are plaintext and carry no hash, so load() only finds and reads them.
+static bool loads(const std::filesystem::path &user_dir, const std::string &path, const std::string &expected) {
+    IntegrityRecord record;
+    record.found = true;
+    std::string data;
+    return PackStore::load(TEST_USER, user_dir, path, record, data) && data == expected;
+}
+
+// The only live entry of the current pack is deleted while another append to it is in flight.
+static void testPendingAppendSurvivesCompaction(const std::filesystem::path &user_dir) {
+    PackEntry first;
+    check(PackStore::append(TEST_USER, user_dir, std::string(4096, 'a'), first), "append first");
+    check(recordEntry("first", first), "record first");
+    PackStore::settle(TEST_USER, first);
+
+    PackEntry second;
+    std::string second_data(2 * 1024 * 1024, 'b');
+    check(PackStore::append(TEST_USER, user_dir, second_data, second), "append second");
+    check(second.pack_id == first.pack_id, "both appends go to one pack");
+
+    check(removeEntry("first"), "remove first");
+    PackStore::compact(TEST_USER, user_dir, first.pack_id);
+
+    check(recordEntry("second", second), "record second");
+    PackStore::settle(TEST_USER, second);
+    check(loads(user_dir, "second", second_data), "second still loads after compaction");
+
+    check(removeEntry("second"), "remove second");
+    PackStore::compact(TEST_USER, user_dir, second.pack_id);
+}
+
+// Writers append, yield and commit while a deleter drops three entries in four and compacts.
+static void testConcurrentAppendAndCompaction(const std::filesystem::path &user_dir) {
+    std::atomic<int> done{0};
+    std::vector<std::thread> writers;
+
+    for (int t = 0; t < TEST_THREADS; t++) {
+        writers.emplace_back([&user_dir, &done, t]() {
+            for (int i = 0; i < TEST_FILES_PER_THREAD; i++) {
+                std::string path = "w" + std::to_string(t) + "/" + std::to_string(i);
+                std::string data(1000 + i * 97 % 50000, static_cast<char>('a' + (t + i) % 26));
+                PackEntry entry;
+                if (!PackStore::append(TEST_USER, user_dir, data, entry)) {
+                    check(false, "append " + path);
+                    continue;
+                }
+                std::this_thread::yield();
+                check(recordEntry(path, entry), "record " + path);
+                PackStore::settle(TEST_USER, entry);
+            }
+            done++;
+        });
+    }
+
+    std::thread deleter([&user_dir, &done]() {
+        while (done < TEST_THREADS) {
+            for (int t = 0; t < TEST_THREADS; t++) {
+                for (int i = 0; i < TEST_FILES_PER_THREAD; i++) {
+                    if (i % 4 == 3) {
+                        continue;
+                    }
+                    std::string path = "w" + std::to_string(t) + "/" + std::to_string(i);
+                    PackEntry entry;
+                    if (PackStore::lookup(TEST_USER, path, entry) && removeEntry(path)) {
+                        PackStore::compact(TEST_USER, user_dir, entry.pack_id);
+                    }
+                }
+            }
+        }
+    });
+
+    for (auto &writer: writers) {
+        writer.join();
+    }
+    deleter.join();
+
+    for (int t = 0; t < TEST_THREADS; t++) {
+        for (int i = 3; i < TEST_FILES_PER_THREAD; i += 4) {
+            std::string path = "w" + std::to_string(t) + "/" + std::to_string(i);
+            std::string data(1000 + i * 97 % 50000, static_cast<char>('a' + (t + i) % 26));
+            check(loads(user_dir, path, data), "load " + path);
+        }
+    }
+}
+
+int main() {
+    std::filesystem::path scratch = std::filesystem::temp_directory_path() / "pack_store_test";
+    std::filesystem::remove_all(scratch);
+    std::filesystem::create_directories(scratch / "storage");
+    std::filesystem::current_path(scratch);
+
+    if (!RedundancyManager::initDatabase() || !PackStore::initDatabase()) {
+        std::cerr << "Failed to create the test database\n";
+        return 1;
+    }
+
+    std::filesystem::path user_dir = scratch / "storage" / "user";
+    testPendingAppendSurvivesCompaction(user_dir);
+    testConcurrentAppendAndCompaction(user_dir);
+
+    if (failures > 0) {
+        std::cerr << failures << " checks failed\n";
+        return 1;
+    }
+    std::cout << "pack_store_test passed\n";
+    return 0;
+}
@@ -0,0 +1,113 @@
+// SHA-256 kernels of Sha256 against picosha2: every compression kernel the CPU can run, and the
+// AVX2 8-lane batch path, must give picosha2's digest for any message length and any split of
+// the message over update() calls.
+//
+// Exits non-zero on the first failure.
+
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <picosha2.h>
+
+#include "sha256_engine.h"
+
+#define TEST_ROUNDS 300
+#define TEST_MAX_LENGTH (100 * 1024)
+
+static int failures = 0;
+
+static void check(bool condition, const std::string &what) {
+    if (!condition) {
+        std::cerr << "FAILED: " << what << '\n';
+        failures++;
+    }
+}
+
+static std::mt19937 rng(20240917);
+
+static std::string randomBytes(size_t length) {
+    std::string data(length, '\0');
+    for (char &c: data) {
+        c = static_cast<char>(rng());
+    }
+    return data;
+}
+
+static std::string reference(const std::string &data) {
+    return picosha2::hash256_hex_string(data);
+}
+
+// Every length up to a few blocks (padding into one or two tail blocks), then long messages fed in
+// random pieces so updates start and end inside blocks.
+static void testKernel(const char *name, Sha256::Kernel compress) {
+    for (size_t length = 0; length <= 4 * SHA256_BLOCK + 1; length++) {
+        std::string data = randomBytes(length);
+        Sha256 hasher(compress);
+        hasher.update(data.data(), data.size());
+        check(hasher.hexDigest() == reference(data), std::string(name) + ", length " + std::to_string(length));
+    }
+
+    for (int round = 0; round < TEST_ROUNDS; round++) {
+        std::string data = randomBytes(rng() % TEST_MAX_LENGTH);
+        Sha256 hasher(compress);
+        for (size_t done = 0; done < data.size();) {
+            size_t piece = round % 2 == 0 ? rng() % 200 + 1 : rng() % 20000 + 1;
+            piece = piece < data.size() - done ? piece : data.size() - done;
+            hasher.update(data.data() + done, piece);
+            done += piece;
+        }
+        check(hasher.hexDigest() == reference(data),
+              std::string(name) + ", " + std::to_string(data.size()) + " bytes in pieces");
+    }
+}
+
+// Batches of every size up to three groups of eight, with messages of different lengths so lanes
+// finish at different blocks, through the AVX2 lanes and through hashMany().
+static void testBatches() {
+    bool lanes = true;
+    for (size_t count = 1; count <= 3 * SHA256_LANES; count++) {
+        std::vector<std::string> messages;
+        std::vector<Sha256::Input> inputs;
+        for (size_t i = 0; i < count; i++) {
+            size_t length = i % 4 == 0 ? rng() % (4 * SHA256_BLOCK) : rng() % (64 * 1024);
+            messages.push_back(randomBytes(length));
+        }
+        for (const auto &message: messages) {
+            inputs.push_back(Sha256::Input{message.data(), message.size()});
+        }
+
+        uint8_t digests[3 * SHA256_LANES][SHA256_DIGEST];
+        lanes = Sha256::hashManyLanes(inputs.data(), count, digests);
+        for (size_t i = 0; lanes && i < count; i++) {
+            check(Sha256::toHex(digests[i]) == reference(messages[i]),
+                  "lane " + std::to_string(i) + " of a batch of " + std::to_string(count));
+        }
+
+        uint8_t many[3 * SHA256_LANES][SHA256_DIGEST];
+        Sha256::hashMany(inputs.data(), count, many);
+        for (size_t i = 0; i < count; i++) {
+            check(Sha256::toHex(many[i]) == reference(messages[i]),
+                  "hashMany " + std::to_string(i) + " of a batch of " + std::to_string(count));
+        }
+    }
+
+    std::cout << (lanes ? "Checked the AVX2 x8 lanes\n" : "No AVX2, lanes not checked\n");
+}
+
+int main() {
+    for (const auto &kernel: Sha256::availableKernels()) {
+        std::cout << "Checking the " << kernel.first << " kernel\n";
+        testKernel(kernel.first, kernel.second);
+    }
+    testBatches();
+
+    if (failures > 0) {
+        std::cerr << failures << " checks failed\n";
+        return 1;
+    }
+    std::cout << "sha256_engine_test passed\n";
+    return 0;
+}
@@ -0,0 +1,163 @@
+// Resuming an upload in UploadManager: a second POST_BEGIN for the same destination must find the
+// unfinished session with the nonce its staged bytes were encrypted with, the received ranges must
+// say exactly which bytes are still missing, and the digest must cover only the staged prefix.
+// Expired sessions are found and removed with their digests.
+//
+// Runs in a scratch directory (its own ./storage/cloud.db); exits non-zero on the first failure.
+
+#include <cstdlib>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "upload_manager.h"
+
+#define TEST_USER 1
+#define TEST_CHUNK 1000
+
+static int failures = 0;
+
+static void check(bool condition, const std::string &what) {
+    if (!condition) {
+        std::cerr << "FAILED: " << what << '\n';
+        failures++;
+    }
+}
+
+static std::string chunkData(int index) {
+    return std::string(TEST_CHUNK, static_cast<char>('a' + index));
+}
+
+// The same destination and size resume the first session and keep its nonce; another size is a
+// new upload.
+static void testBeginResumesSession() {
+    UploadSession first = UploadManager::beginSession(TEST_USER, "/", "a.bin", 3 * TEST_CHUNK,
+                                                      STORAGE_AES_CTR_STREAM, "nonce-01");
+    check(!first.id.empty(), "first session created");
+
+    UploadSession again = UploadManager::beginSession(TEST_USER, "/", "a.bin", 3 * TEST_CHUNK,
+                                                      STORAGE_AES_CTR_STREAM, "nonce-02");
+    check(again.id == first.id, "same destination resumes the session");
+    check(again.nonce == "nonce-01", "resumed session keeps its nonce");
+
+    UploadSession stored;
+    check(UploadManager::getSession(first.id, TEST_USER, stored), "session found by id");
+    check(stored.nonce == "nonce-01" && stored.encryption == STORAGE_AES_CTR_STREAM, "session row");
+    check(!UploadManager::getSession(first.id, TEST_USER + 1, stored), "session hidden from other users");
+
+    UploadSession other = UploadManager::beginSession(TEST_USER, "/", "a.bin", 4 * TEST_CHUNK,
+                                                      STORAGE_AES_CTR_STREAM, "nonce-03");
+    check(other.id != first.id, "other size starts a new session");
+    UploadManager::removeSession(other.id);
+}
+
+// Chunks 0 and 2 of 3 arrived before the connection broke; only chunk 1 is missing.
+static void testRangesAfterInterruption() {
+    UploadSession upload = UploadManager::beginSession(TEST_USER, "/", "a.bin", 3 * TEST_CHUNK,
+                                                       STORAGE_AES_CTR_STREAM, "nonce-01");
+    check(UploadManager::recordChunk(upload.id, 0, TEST_CHUNK, "h0"), "record chunk 0");
+    check(UploadManager::recordChunk(upload.id, 2 * TEST_CHUNK, TEST_CHUNK, "h2"), "record chunk 2");
+
+    auto ranges = UploadManager::getRanges(upload.id);
+    check(ranges.size() == 2 && ranges[0] == std::make_pair(0ULL, 1ULL * TEST_CHUNK) &&
+          ranges[1] == std::make_pair(2ULL * TEST_CHUNK, 1ULL * TEST_CHUNK), "ranges with a gap");
+    check(UploadManager::contiguousEnd(upload.id) == TEST_CHUNK, "prefix ends at the gap");
+    check(!UploadManager::isComplete(upload), "incomplete with a gap");
+
+    check(UploadManager::overlapsChunk(upload.id, TEST_CHUNK - 1, 2), "overlap across a chunk's end");
+    check(!UploadManager::overlapsChunk(upload.id, TEST_CHUNK, TEST_CHUNK), "the gap overlaps nothing");
+
+    check(UploadManager::recordChunk(upload.id, TEST_CHUNK, TEST_CHUNK, "h1"), "record chunk 1");
+    ranges = UploadManager::getRanges(upload.id);
+    check(ranges.size() == 1 && ranges[0] == std::make_pair(0ULL, 3ULL * TEST_CHUNK), "ranges merged");
+    check(UploadManager::isComplete(upload), "complete once the gap is filled");
+
+    check(UploadManager::recordChunk(upload.id, 0, TEST_CHUNK, "h0-changed"), "chunk 0 sent again");
+    auto chunks = UploadManager::getChunks(upload.id);
+    check(chunks.size() == 3 && chunks[0].hash == "h0-changed" && chunks[1].hash == "h1" && chunks[2].hash == "h2",
+          "chunk sent again replaces its hash");
+}
+
+// The digest only ever covers the contiguous staged prefix, and starts over after a rewind.
+static void testDigestCoversPrefix(const std::filesystem::path &scratch) {
+    UploadSession upload = UploadManager::beginSession(TEST_USER, "/", "a.bin", 3 * TEST_CHUNK,
+                                                       STORAGE_AES_CTR_STREAM, "nonce-01");
+    std::filesystem::path staging_file = scratch / "staged";
+    {
+        std::ofstream staged(staging_file, std::ios::binary);
+        staged << chunkData(0) << chunkData(1) << chunkData(2);
+    }
+
+    int fd = open(staging_file.c_str(), O_RDONLY | O_CLOEXEC);
+    check(fd >= 0, "open staging file");
+
+    auto digest = UploadManager::getDigest(upload.id);
+    check(UploadManager::getDigest(upload.id) == digest, "one digest per upload");
+    check(UploadManager::extendDigest(*digest, fd, 2 * TEST_CHUNK), "extend over two chunks");
+    check(digest->hashed == 2 * TEST_CHUNK, "hashed prefix");
+
+    unsigned long long generation = digest->generation;
+    digest->rewind();
+    check(digest->hashed == 0 && digest->generation == generation + 1, "rewind starts over");
+
+    check(UploadManager::extendDigest(*digest, fd, 3 * TEST_CHUNK), "extend over the whole file");
+    FileDigest expected;
+    std::string whole = chunkData(0) + chunkData(1) + chunkData(2);
+    expected.update(whole.data(), whole.size());
+    check(digest->hasher.fileHash() == expected.fileHash(), "digest of the staged file");
+    close(fd);
+}
+
+// A session no chunk touched for longer than its time to live is found, and its removal takes the
+// rows and the digest with it.
+static void testExpiredSession() {
+    UploadSession upload = UploadManager::beginSession(TEST_USER, "/", "a.bin", 3 * TEST_CHUNK,
+                                                       STORAGE_AES_CTR_STREAM, "nonce-01");
+    check(UploadManager::expiredSessions(TEST_USER, 3600).empty(), "fresh session is not expired");
+
+    DBConnection &db = DBConnection::local();
+    check(db.exec("UPDATE upload_sessions SET touched_at = strftime('%s', 'now') - 7200;"), "age the session");
+    auto expired = UploadManager::expiredSessions(TEST_USER, 3600);
+    check(expired.size() == 1 && expired[0] == upload.id, "old session is expired");
+
+    auto digest = UploadManager::getDigest(upload.id);
+    check(UploadManager::removeSession(upload.id), "remove session");
+    check(!UploadManager::sessionExists(upload.id), "session row gone");
+    check(UploadManager::getChunks(upload.id).empty(), "chunk rows gone");
+    check(UploadManager::getDigest(upload.id) != digest, "digest dropped with the session");
+
+    // A chunk still being written when its session went away brings the digest back.
+    auto orphan = UploadManager::getDigest(upload.id);
+    UploadManager::pruneDigests();
+    check(UploadManager::getDigest(upload.id) != orphan, "orphaned digest pruned");
+    UploadManager::pruneDigests();
+}
+
+int main() {
+    std::filesystem::path scratch = std::filesystem::temp_directory_path() / "upload_manager_test";
+    std::filesystem::remove_all(scratch);
+    std::filesystem::create_directories(scratch / "storage");
+    std::filesystem::current_path(scratch);
+
+    if (!RedundancyManager::initDatabase() || !UploadManager::initDatabase()) {
+        std::cerr << "Failed to create the test database\n";
+        return 1;
+    }
+
+    testBeginResumesSession();
+    testRangesAfterInterruption();
+    testDigestCoversPrefix(scratch);
+    testExpiredSession();
+
+    if (failures > 0) {
+        std::cerr << failures << " checks failed\n";
+        return 1;
+    }
+    std::cout << "upload_manager_test passed\n";
+    return 0;
+}